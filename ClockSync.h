@@ -0,0 +1,188 @@
+// A common timebase for the master, relays and slaves
+// Author: James Walker jwwalker a+ mtu d0+ edu
+//
+// The master's CLOCK_REALTIME is the reference. Every SYNC_INTERVAL a slave
+// sends the master "SYNC~t1" with its own clock reading; the master answers
+// "SYNCR~t1~t2~t3" with the times, by its clock, the request reached its
+// socket and the answer left, and the slave notes t4 when that reaches its
+// socket. As in NTP, the master's clock is then ahead of the slave's by
+// ((t2 - t1) + (t3 - t4)) / 2, give or take half the round trip
+// (t4 - t1) - (t3 - t2), which doesn't count the time the master sat on the
+// request. Exchanges that were held up somewhere are skewed, so the estimate
+// comes from a straight line fitted through the quickest recent ones, whose
+// slope is how fast the two crystals drift apart. A relay keeps its own
+// estimate against the node upstream and answers the slaves behind it in the
+// reference time, so every tile ends up on the master's clock.
+
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+// Clock synchronization variables **CUSTOMIZABLE**
+const double SYNC_INTERVAL = 0.5;        // Seconds between a slave's exchanges with the master, once it has a few.
+const int SYNC_SAMPLES = 32;             // Recent exchanges the estimate is fitted to; with SYNC_INTERVAL this is
+                                         // about 16 seconds, long enough to see the drift.
+const double SYNC_DELAY_SLACK = 50e-6;   // An exchange whose round trip is more than this many seconds slower than
+                                         // the quickest recent one is left out of the fit.
+const double SYNC_MIN_SPAN = 4.0;        // Seconds the fitted exchanges must span before the drift is estimated.
+
+const int SYNC_STARTUP = 4;              // exchanges sent back to back at startup, so a tile syncs in well under a second
+const double SYNC_STARTUP_INTERVAL = 0.05;
+
+// Slaves send requests to the address the datagrams come from, as they do
+// NACKs; the answer comes back to the socket that asked.
+#define SYNC_REQUEST "SYNC"
+#define SYNC_REPLY "SYNCR"
+
+typedef struct syncSample {
+  long long local;      // local time halfway through the exchange, ns
+  long long offset;     // reference minus local, ns
+  long long delay;      // round trip, not counting the time the other end held it, ns
+} syncSample;
+
+typedef struct clockSync {
+  syncSample samples[SYNC_SAMPLES];
+  int numSamples;
+  int next;             // where the next sample goes
+  bool synced;          // there is an estimate
+  long long base;       // local time the estimate is centred on, ns
+  double offset;        // reference minus local at base, ns
+  double drift;         // change in offset per ns of local time
+  long long delay;      // quickest round trip among the samples, ns
+  double lastRequest;   // monotonic seconds
+  unsigned long requests, replies, stale;
+} clockSync;
+
+inline long long localClockNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// When a message reached the socket, from its SO_TIMESTAMPNS control message,
+// or fallback if it has none.
+inline long long arrivalTimeNs(struct msghdr *msg, long long fallback) {
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+      return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+  }
+  return fallback;
+}
+
+inline double syncMonotonic() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+inline void initClockSync(clockSync &c) {
+  c.numSamples = c.next = 0;
+  c.synced = false;
+  c.base = 0;
+  c.offset = c.drift = 0;
+  c.delay = 0;
+  c.lastRequest = -1e9;
+  c.requests = c.replies = c.stale = 0;
+}
+
+// A clock that is the reference, or shares its host's clock with it.
+inline void referenceClock(clockSync &c) {
+  initClockSync(c);
+  c.synced = true;
+}
+
+// The reference time at local time localNs.
+inline long long syncedNs(const clockSync &c, long long localNs) {
+  return localNs + (long long)(c.offset + c.drift * (localNs - c.base));
+}
+
+inline long long syncedNowNs(const clockSync &c) {
+  return syncedNs(c, localClockNs());
+}
+
+// Whether it's time for another exchange; if so, counts it as sent.
+inline bool syncDue(clockSync &c) {
+  double now = syncMonotonic();
+  double interval = c.requests < SYNC_STARTUP ? SYNC_STARTUP_INTERVAL : SYNC_INTERVAL;
+  if (now - c.lastRequest < interval) return false;
+  c.lastRequest = now;
+  c.requests++;
+  return true;
+}
+
+inline int writeSyncRequest(char *buf, size_t size, long long t1) {
+  return snprintf(buf, size, SYNC_REQUEST "~%lld", t1);
+}
+
+inline bool parseSyncRequest(const char *buf, long long &t1) {
+  return sscanf(buf, SYNC_REQUEST "~%lld", &t1) == 1;
+}
+
+inline int writeSyncReply(char *buf, size_t size, long long t1, long long t2, long long t3) {
+  return snprintf(buf, size, SYNC_REPLY "~%lld~%lld~%lld", t1, t2, t3);
+}
+
+inline bool parseSyncReply(const char *buf, long long &t1, long long &t2, long long &t3) {
+  return sscanf(buf, SYNC_REPLY "~%lld~%lld~%lld", &t1, &t2, &t3) == 3;
+}
+
+// Fit the estimate to the quickest recent exchanges: a straight line once
+// they span SYNC_MIN_SPAN, their mean until then.
+inline void fitClockSync(clockSync &c) {
+  long long quickest = c.samples[0].delay;
+  for (int i = 1; i < c.numSamples; i++) {
+    if (c.samples[i].delay < quickest) quickest = c.samples[i].delay;
+  }
+  long long limit = quickest + (long long)(SYNC_DELAY_SLACK * 1e9);
+  long long base = c.samples[(c.next + SYNC_SAMPLES - 1) % SYNC_SAMPLES].local;  // the newest
+  double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0, lo = 0, hi = 0;
+  for (int i = 0; i < c.numSamples; i++) {
+    const syncSample &s = c.samples[i];
+    if (s.delay > limit) continue;
+    double x = (s.local - base) / 1e9;  // seconds, to keep the sums well conditioned
+    double y = s.offset;
+    n++;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+    if (n == 1 || x < lo) lo = x;
+    if (n == 1 || x > hi) hi = x;
+  }
+  double meanX = sx / n, meanY = sy / n;
+  double slope = c.drift * 1e9;  // ns of offset per second
+  double varX = sxx / n - meanX * meanX;
+  if (hi - lo >= SYNC_MIN_SPAN && varX > 0) slope = (sxy / n - meanX * meanY) / varX;
+  c.base = base;
+  c.offset = meanY - slope * meanX;
+  c.drift = slope / 1e9;
+  c.delay = quickest;
+  c.synced = true;
+}
+
+// Take an answer: t1 and t4 by the local clock, t2 and t3 by the reference.
+// Answers to requests from more than SYNC_SAMPLES intervals ago are ignored.
+inline void addSyncReply(clockSync &c, long long t1, long long t2, long long t3, long long t4) {
+  long long delay = (t4 - t1) - (t3 - t2);
+  if (t4 < t1 || delay < 0 || t4 - t1 > (long long)(SYNC_INTERVAL * SYNC_SAMPLES * 1e9)) {
+    c.stale++;
+    return;
+  }
+  syncSample &s = c.samples[c.next];
+  s.local = t1 + (t4 - t1) / 2;
+  s.offset = ((t2 - t1) + (t3 - t4)) / 2;
+  s.delay = delay;
+  c.next = (c.next + 1) % SYNC_SAMPLES;
+  if (c.numSamples < SYNC_SAMPLES) c.numSamples++;
+  c.replies++;
+  fitClockSync(c);
+}
+
+#endif
@@ -0,0 +1,146 @@
+// Threshold gestures on tracked segments, for the master
+// Author: James Walker jwwalker a+ mtu d0+ edu
+//
+// A gesture fires when one axis of a segment's position crosses its enter
+// threshold and stays on that side of its exit threshold for the hold time.
+// It can't fire again until the segment has gone back past the exit
+// threshold and the refractory time has passed, except for erase, which
+// fires again every refractory seconds for as long as it is held, so the
+// eraser keeps working as it moves. Times are in seconds from
+// the Vicon frame clock, so the debounce doesn't depend on how fast the
+// master loops.
+
+#ifndef GESTURE_RECOGNIZER_H
+#define GESTURE_RECOGNIZER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+enum gestureAction {
+  GESTURE_DRAW,         // toggle drawing on and off
+  GESTURE_CLEAR,        // erase every stroke
+  GESTURE_UNDO,         // erase the most recent stroke
+  GESTURE_PALETTE,      // move on to the next stroke palette
+  GESTURE_ERASE,        // erase strokes around the segment
+  GESTURE_LAYER,        // draw on the next layer
+  GESTURE_SOLO,         // toggle between every layer and only the active one
+  NUM_GESTURE_ACTIONS
+};
+
+static const char *gestureActionNames[NUM_GESTURE_ACTIONS] = { "draw", "clear", "undo", "palette", "erase", "layer", "solo" };
+
+typedef struct gestureRule {
+  gestureAction action;
+  std::string segment;
+  int axis;             // 0, 1, 2 for Vicon x, y, z
+  bool above;           // fires above enter (else below)
+  double enter, exit;   // millimetres; exit is the hysteresis edge
+  double hold;          // seconds past enter before firing
+  double refractory;    // seconds after firing before it can fire again
+  bool repeat;          // keeps firing while held
+} gestureRule;
+
+enum gesturePhase { GESTURE_IDLE, GESTURE_ARMED, GESTURE_FIRED };
+
+typedef struct gestureState {
+  gesturePhase phase;
+  double since;         // when it was armed
+  double lastFired;
+} gestureState;
+
+inline void resetGesture(gestureState &state) {
+  state.phase = GESTURE_IDLE;
+  state.since = 0;
+  state.lastFired = -1e9;
+}
+
+// Feed the segment's position (Vicon millimetres) at time. Returns true on
+// the frame the gesture fires. A segment that isn't visible disarms the
+// gesture but doesn't release it.
+inline bool updateGesture(const gestureRule &rule, gestureState &state, const double position[3], bool visible, double time) {
+  double value = position[rule.axis];
+  bool pastEnter = rule.above ? value > rule.enter : value < rule.enter;
+  bool pastExit = rule.above ? value > rule.exit : value < rule.exit;
+  switch (state.phase) {
+    case GESTURE_IDLE:
+      if (visible && pastEnter && time - state.lastFired >= rule.refractory) {
+        state.phase = GESTURE_ARMED;
+        state.since = time;
+      }
+      break;
+    case GESTURE_ARMED:
+      if (!visible || !pastExit) {
+        state.phase = GESTURE_IDLE;
+      } else if (time - state.since >= rule.hold) {
+        state.phase = GESTURE_FIRED;
+        state.lastFired = time;
+        return true;
+      }
+      break;
+    case GESTURE_FIRED:
+      if (visible && !pastExit) state.phase = GESTURE_IDLE;
+      else if (rule.repeat && visible && time - state.lastFired >= rule.refractory) {
+        state.lastFired = time;
+        return true;
+      }
+      break;
+  }
+  // a zero hold fires on the frame it arms
+  if (state.phase == GESTURE_ARMED && rule.hold <= 0) {
+    state.phase = GESTURE_FIRED;
+    state.lastFired = time;
+    return true;
+  }
+  return false;
+}
+
+// Parse "action segment axis above|below enter exit hold refractory", e.g.
+// "draw Flag z above 2000 1900 0.05 1.0".
+inline bool parseGestureRule(const char *line, gestureRule &rule) {
+  char action[32], segment[128], axis[8], side[8];
+  if (sscanf(line, "%31s %127s %7s %7s %lf %lf %lf %lf", action, segment, axis, side,
+             &rule.enter, &rule.exit, &rule.hold, &rule.refractory) != 8) return false;
+  int a = 0;
+  while (a < NUM_GESTURE_ACTIONS && strcmp(action, gestureActionNames[a]) != 0) a++;
+  if (a == NUM_GESTURE_ACTIONS) return false;
+  rule.action = (gestureAction)a;
+  rule.repeat = rule.action == GESTURE_ERASE;
+  rule.segment = segment;
+  if (axis[1] != '\0' || axis[0] < 'x' || axis[0] > 'z') return false;
+  rule.axis = axis[0] - 'x';
+  if (strcmp(side, "above") == 0) rule.above = true;
+  else if (strcmp(side, "below") == 0) rule.above = false;
+  else return false;
+  // the exit edge must sit on the near side of enter
+  if (rule.above ? rule.exit > rule.enter : rule.exit < rule.enter) return false;
+  return true;
+}
+
+// Read one rule per line; blank lines and lines starting with '#' are
+// skipped. Returns false, having printed the offending line, on a bad rule.
+inline bool loadGestures(const char *filename, std::vector<gestureRule> &rules) {
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    printf("Unable to open %s\n", filename);
+    return false;
+  }
+  std::string line;
+  int lineNumber = 0;
+  while (getline(file, line)) {
+    lineNumber++;
+    size_t start = line.find_first_not_of(" \t\r");
+    if (start == std::string::npos || line[start] == '#') continue;
+    gestureRule rule;
+    if (!parseGestureRule(line.c_str() + start, rule)) {
+      printf("%s:%d: bad gesture \"%s\"\n", filename, lineNumber, line.c_str());
+      return false;
+    }
+    rules.push_back(rule);
+  }
+  return true;
+}
+
+#endif
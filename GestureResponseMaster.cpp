@@ -1,4 +1,12 @@
 #include "Client.h"
+#include "Protocol.h"
+#include "Retransmit.h"
+#include "ShmRing.h"
+#include "Relay.h"
+#include "ClockSync.h"
+#include "LineParser.h"
+#include "MotionFilter.h"
+#include "GestureRecognizer.h"
 
 #include <GL/glut.h>
 
@@ -15,11 +23,14 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <errno.h>
 #include <pthread.h>
 
 #define SEND_IP "10.2.255.255"  // broadcast address for IVS network (update if needed)
 #define BUFLEN 512
 #define PORT 25885
+#define SEND_BATCH 64  // datagrams handed to the kernel per sendmmsg() call
+#define RELAY_REPORT_INTERVAL 10  // seconds between a relay's latency reports
 
 #include "../boost_1_53_0/boost/format.hpp"
 #include "../boost_1_53_0/boost/lexical_cast.hpp"
@@ -170,11 +181,10 @@ void viconExit()
 
 	// TODO: Disconnect seems to cause a hang. -Scott Kuhl
     // Disconnect and dispose
-    int t = clock();
+    double t = retransmitClock();  // wall time; clock() counts CPU time, which a hang doesn't use
     std::cout << " Disconnecting..." << std::endl;
     MyClient.Disconnect();
-    int dt = clock() - t;
-    double secs = (double) (dt)/(double)CLOCKS_PER_SEC;
+    double secs = retransmitClock() - t;
     std::cout << " Disconnect time = " << secs << " secs" << std::endl;
 }
 
@@ -284,10 +294,17 @@ bool simulation = true;
 vector<string> trackNames;
 
 vector<string> objectsToTrack;
+vector<motionFilter> motionFilters;  // one per tracked object
+vector<double> occlusionNotices;     // when each object's last occlusion notice went out, or -1
 string dataToSend;
 bool drawingOn = false;
 string flagObject;
-int switchDrawingCtr = 0;
+vector<gestureRule> gestures;
+vector<gestureState> gestureStates;
+unsigned int controlEvent = 0;
+int palette = 0;
+int activeLayer = 0;
+bool soloLayer = false;
 
 int totalCtr = 0;
 // Artist performance variable **CUSTOMIZABLE**
@@ -300,12 +317,143 @@ const int UPDATE_COUNTER = 120;  // A new line will be recorded
                                  // The higher this value, the nicer the lines will look, but the more quickly
                                  // the buffer will fill up. Tweak this value to find a
                                  // good balance.
+const float ERASE_RADIUS = 0.1f; // How close (scene units, roughly metres) to the erase gesture's segment a stroke
+                                 // has to pass to be rubbed out.
 
 void error(const char *msg) {
   perror(msg);
   exit(1);
 }
 
+unsigned int sendSeq = 0;
+unsigned int sendRun = 1;  // this run of the master, so slaves can tell it from the last
+resendHistory history;  // recent datagrams, for slaves that missed them
+
+// Outgoing datagrams are queued and handed to the kernel SEND_BATCH at a time
+// with sendmmsg(), so a Vicon frame's worth of objects costs one syscall.
+char batchBufs[SEND_BATCH][BUFLEN];
+struct mmsghdr batchMsgs[SEND_BATCH];
+struct iovec batchIovecs[SEND_BATCH];
+int batchCount = 0;
+
+// With an address of "shm:/name" the datagrams go into a shared-memory ring
+// instead, for slaves on this machine.
+bool useShm = false;
+shmRing ring;
+unsigned long long shmPending = 0;
+
+// Send everything queued so far. Returns the number of datagrams sent, or -1.
+int flushPayloads() {
+  if (useShm) {
+    int sent = batchCount;
+    for (int i = 0; i < batchCount; i++) shmPublish(ring, shmPending, batchBufs[i], batchIovecs[i].iov_len);
+    shmWake(ring, shmPending);
+    batchCount = 0;
+    return sent;
+  }
+  int sent = 0;
+  while (sent < batchCount) {
+    int n = sendmmsg(s, batchMsgs + sent, batchCount - sent, 0);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      batchCount = 0;
+      return -1;
+    }
+    sent += n;
+  }
+  batchCount = 0;
+  return sent;
+}
+
+// Queue a datagram, header and all, for sending.
+int queuePacket(const char *packet, size_t len) {
+  if (batchCount == SEND_BATCH && flushPayloads() == -1) return -1;
+  memcpy(batchBufs[batchCount], packet, len);
+  batchIovecs[batchCount].iov_base = batchBufs[batchCount];
+  batchIovecs[batchCount].iov_len = len;
+  memset(&batchMsgs[batchCount], 0, sizeof(batchMsgs[batchCount]));
+  batchMsgs[batchCount].msg_hdr.msg_name = &si_other;
+  batchMsgs[batchCount].msg_hdr.msg_namelen = slen;
+  batchMsgs[batchCount].msg_hdr.msg_iov = &batchIovecs[batchCount];
+  batchMsgs[batchCount].msg_hdr.msg_iovlen = 1;
+  batchCount++;
+  return 0;
+}
+
+// Stamp the payload with the next sequence number and the time, keep a copy
+// for resending and queue it for sending.
+int queuePayload(const char *data, size_t len) {
+  char packet[BUFLEN];
+  sendSeq = nextSeq(sendSeq);
+  int headerLen = writeSeqHeader(packet, BUFLEN, sendSeq, sendRun, localClockNs());
+  if (headerLen + len > BUFLEN) len = BUFLEN - headerLen;
+  memcpy(packet + headerLen, data, len);
+  rememberPacket(history, sendSeq, packet, headerLen + len);
+  return queuePacket(packet, headerLen + len);
+}
+
+// Answer a slave's clock sync request straight away. arrivedNs is when it
+// reached our socket, by our clock, which is the reference.
+void answerSync(long long t1, long long arrivedNs, const struct sockaddr_in &slave) {
+  char reply[96];
+  int len = writeSyncReply(reply, sizeof(reply), t1, arrivedNs, localClockNs());
+  sendto(s, reply, len, 0, (struct sockaddr*)&slave, sizeof(slave));
+}
+
+// Answer whatever the slaves have asked for since the last call: resend the
+// datagrams they NACKed, to every slave at once, and answer clock sync
+// requests. Returns the number of datagrams resent, or -1.
+int serveSlaves() {
+  char request[64];
+  char control[CMSG_SPACE(sizeof(struct timespec))];
+  struct sockaddr_in slave;
+  struct iovec iov;
+  struct msghdr msg;
+  int resent = 0;
+  while (true) {
+    iov.iov_base = request;
+    iov.iov_len = sizeof(request) - 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &slave;
+    msg.msg_namelen = sizeof(slave);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(s, &msg, MSG_DONTWAIT);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return -1;
+    }
+    request[n] = '\0';
+    long long t1;
+    if (parseSyncRequest(request, t1)) {
+      answerSync(t1, arrivalTimeNs(&msg, localClockNs()), slave);
+      continue;
+    }
+    unsigned int first;
+    int count;
+    if (!parseNack(request, first, count)) continue;
+    history.nacks++;
+    double now = retransmitClock();
+    if (count > RESEND_HISTORY) count = RESEND_HISTORY;
+    for (unsigned int seq = first; count > 0; seq = nextSeq(seq), count--) {
+      const sentPacket *p = packetToResend(history, seq, now);
+      if (p == NULL) continue;
+      if (queuePacket(p->data, p->len) == -1) return -1;
+      resent++;
+    }
+  }
+  if (flushPayloads() == -1) return -1;
+  return resent;
+}
+
+int sendPayload(const char *data, size_t len) {
+  if (queuePayload(data, len) == -1) return -1;
+  return flushPayloads();
+}
+
 void closeProgram() {
   exit(0);
 }
@@ -327,6 +475,120 @@ void keyboard(unsigned char key, int x, int y) {
   else if (key == ' ') recording = !recording;
 }
 
+// Append "~qx~qy~qz~qw" for a Vicon (x, y, z, w) rotation. Positions go out
+// with x negated, which mirrors the scene, so the rotation is mirrored to
+// match: the axis' y and z flip along with the angle. Four decimals keep the
+// orientation to about 0.01 degrees in a fraction of lexical_cast's digits.
+void appendQuaternion(string &out, const double rotation[4]) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "~%.4f~%.4f~%.4f~%.4f", rotation[0], -rotation[1], -rotation[2], rotation[3]);
+  out.append(buf);
+}
+
+// Log a live line to the output file and queue it for the slaves.
+void queueLine(string &line) {
+  outputFile << line << "\n";
+  line.append("\n");
+  if (queuePayload(line.c_str(), line.length()) == -1) {
+    perror ("ERROR sendmmsg()");
+  }
+}
+
+// Vicon millimetres to the slaves' scene coordinates.
+void viconToScene(const double translation[3], float position[3]) {
+  position[0] = (float)translation[0] / -1000.0f;
+  position[1] = (float)translation[1] / 1000.0f * 1.5f;
+  position[2] = (float)translation[2] / 1000.0f * 3.5f - 2.0f;
+}
+
+// Queue a control message ahead of this frame's samples, CONTROL_REPEATS
+// times, and log it once.
+void queueControl(const char *command, const float *values, int numValues) {
+  char buf[128];
+  controlEvent++;
+  int len = snprintf(buf, sizeof(buf), "%s~%u", command, controlEvent);
+  for (int v = 0; v < numValues; v++) len += snprintf(buf + len, sizeof(buf) - len, "~%g", values[v]);
+  outputFile << buf << "\n";
+  for (int r = 0; r < CONTROL_REPEATS; r++) {
+    if (queuePayload(buf, strlen(buf)) == -1) perror ("ERROR sendmmsg()");
+  }
+}
+
+void queueControl(const char *command, float value) {
+  queueControl(command, &value, 1);
+}
+
+void queueControl(const char *command) {
+  queueControl(command, NULL, 0);
+}
+
+// Act on a gesture that fired with its segment at translation.
+void fireGesture(const gestureRule &rule, const double translation[3]) {
+  switch (rule.action) {
+    case GESTURE_DRAW:
+      drawingOn = !drawingOn;
+      // start each stroke from the hand, not from where it was last seen
+      for (int i = 0; i < motionFilters.size(); i++) resetMotionFilter(motionFilters[i]);
+      if (drawingOn) printf("Drawing has switched from OFF to ON\n");
+      else printf("Drawing has switched from ON to OFF\n");
+      queueControl(CONTROL_DRAW, drawingOn ? 1 : 0);
+      break;
+    case GESTURE_CLEAR:
+      printf("Clearing the canvas\n");
+      queueControl(CONTROL_CLEAR);
+      break;
+    case GESTURE_UNDO:
+      printf("Undoing the last stroke\n");
+      queueControl(CONTROL_UNDO);
+      break;
+    case GESTURE_PALETTE:
+      palette = (palette + 1) % NUM_PALETTES;
+      printf("Switched to palette %d\n", palette);
+      queueControl(CONTROL_PALETTE, palette);
+      break;
+    case GESTURE_ERASE: {
+      float values[4];
+      viconToScene(translation, values);
+      values[3] = ERASE_RADIUS;
+      queueControl(CONTROL_ERASE, values, 4);
+      break;
+    }
+    case GESTURE_LAYER:
+      activeLayer = (activeLayer + 1) % NUM_LAYERS;
+      printf("Drawing on layer %d\n", activeLayer);
+      queueControl(CONTROL_LAYER, activeLayer);
+      if (soloLayer) queueControl(CONTROL_SHOW, 1 << activeLayer);
+      break;
+    case GESTURE_SOLO:
+      soloLayer = !soloLayer;
+      if (soloLayer) printf("Showing only layer %d\n", activeLayer);
+      else printf("Showing every layer\n");
+      queueControl(CONTROL_SHOW, soloLayer ? 1 << activeLayer : (1 << NUM_LAYERS) - 1);
+      break;
+    default:
+      break;
+  }
+}
+
+// The current Vicon frame's time, from its number, so dropped frames still
+// count towards the filters' and gestures' dt.
+double viconFrameTime() {
+  Output_GetFrameRate frameRate = MyClient.GetFrameRate();
+  double frameHz = (frameRate.Result == Result::Success && frameRate.FrameRateHz > 0) ? frameRate.FrameRateHz : dataHertz;
+  return MyClient.GetFrameNumber().FrameNumber / frameHz;
+}
+
+// Run every gesture rule on the current Vicon frame, firing those that trigger.
+void runGestures(double frameTime) {
+  for (int g = 0; g < gestures.size(); g++) {
+    Output_GetSegmentGlobalTranslation gestureTranslate = MyClient.GetSegmentGlobalTranslation(gestures[g].segment, gestures[g].segment);
+    bool visible = gestureTranslate.Result == Result::Success && !gestureTranslate.Occluded;
+    if (updateGesture(gestures[g], gestureStates[g], gestureTranslate.Translation, visible, frameTime)) {
+      fireGesture(gestures[g], gestureTranslate.Translation);
+    }
+  }
+}
+
 int gargc;
 char** gargv;
 
@@ -337,9 +599,7 @@ void sender() {
     if (inputFile.is_open()) {
       while (inputFile.good()) {
         getline(inputFile, line);
-        sprintf(buf, "%s", line.c_str());
-        if (sendto(s, buf, BUFLEN, 0, (struct sockaddr*)&si_other,
-          slen) == -1) error("ERROR sendto()");
+        if (sendPayload(line.c_str(), line.length()) == -1) error("ERROR sendto()");
         usleep(1000);
       }
     } else {
@@ -357,12 +617,7 @@ void sender() {
       totalCtr++;
       if (MyClient.GetFrame().Result != Result::Success )
         printf("WARNING: Inside display() and there is no data from Vicon...\n");
-      if (switchDrawingCtr > 0) switchDrawingCtr--;
-      Output_GetSegmentGlobalTranslation flagTranslate = MyClient.GetSegmentGlobalTranslation(flagObject, flagObject);
-      if (flagTranslate.Translation[2] > 2.0 && switchDrawingCtr <= 0) {
-        switchDrawingCtr = 360;
-        drawingOn = !drawingOn;
-      }
+      runGestures(viconFrameTime());
       if (drawingOn && totalCtr % UPDATE_COUNTER == 0) {
         for (int i = 0; i < objectsToTrack.size(); i++) {
           dataToSend.clear();
@@ -382,7 +637,7 @@ void sender() {
 //          dataToSend.append(formatters[i].str());
           outputFile << dataToSend << "\n";
           dataToSend.append("\n");
-          if (sendto(s, dataToSend.c_str(), dataToSend.length(), 0, (struct sockaddr*)&si_other, slen) == -1) {
+          if (sendPayload(dataToSend.c_str(), dataToSend.length()) == -1) {
             perror ("ERROR sendto()");
           }
 //printf("I sent %s\n", dataToSend.c_str());
@@ -392,17 +647,59 @@ void sender() {
   } // end live tracking w/ Vicon
 }
 
+// Pass an upstream master's stream on to our own group until killed,
+// reporting how much latency the hop adds.
+int runRelay(const char *listen, const char *groupAddr, int groupPort) {
+  relayNode relay;
+  if (!openRelay(relay, listen, groupAddr, groupPort)) error("ERROR setting up the relay");
+  if (!relayRealtime()) printf("WARNING: no real-time scheduling; a busy machine may hold datagrams up\n");
+  printf("Relaying %s to %s:%d\n", listen, groupAddr, groupPort);
+  double lastReport = retransmitClock();
+  while (true) {
+    if (relayPackets(relay) == -1) perror("ERROR relaying");
+    if (retransmitClock() - lastReport < RELAY_REPORT_INTERVAL) continue;
+    const latencyHistogram &h = relay.latency;
+    printf("Relayed %lu datagrams (%lu duplicates dropped); added latency p50 %.0f us, p99 %.0f us, max %.0f us, "
+      "%lu over 1 ms; resent %lu for %lu NACKs, passed %lu upstream\n",
+      relay.forwarded, relay.duplicates, latencyPercentile(h, 0.5) * 1e6, latencyPercentile(h, 0.99) * 1e6,
+      h.max * 1e6, h.overBudget, relay.history.resent, relay.history.nacks, relay.passedUp);
+    const clockSync &c = relay.clock;
+    if (c.synced) {
+      printf("Clock %+.0f us from upstream, drifting %+.2f ppm, round trip %.0f us\n",
+        c.offset / 1e3, c.drift * 1e6, c.delay / 1e3);
+    }
+    fflush(stdout);
+    memset(&relay.latency, 0, sizeof(relay.latency));
+    lastReport = retransmitClock();
+  }
+  return 0;
+}
+
 int main(int argc, char** argv) {
   if (argc < 2) {
     printf("USAGE:\n");
     printf("Playback mode:    GestureResponseMaster input_filename ip_address port\n");
-    printf("Live tracking:    GestureResponseMaster FALSE ip_address port output_filename flag_object objects_to_track\n");
+    printf("Live tracking:    GestureResponseMaster FALSE ip_address port output_filename flag_object objects_to_track [--gestures=file]\n");
+    printf("  Without --gestures, raising flag_object above 2 m toggles drawing; see gestures.txt for more.\n");
+    printf("  An ip_address of shm:/name publishes into shared memory for slaves on this machine (run them\n");
+    printf("  with --shm=/name); port is then ignored.\n");
+    printf("Relay:            GestureResponseMaster RELAY ip_address port [group:]listen_port\n");
+    printf("  A relay passes on what it hears on listen_port (joining the multicast group, if given) to\n");
+    printf("  ip_address:port, keeping its sequence numbers, and answers its own slaves' NACKs.\n");
     return 1;
   }
 
   gargc = argc;
   gargv = argv;
 
+  if (strcmp(argv[1], "RELAY") == 0) {
+    if (argc < 5) {
+      printf("Relay mode needs ip_address port listen_port\n");
+      return 1;
+    }
+    return runRelay(argv[4], argv[2], atoi(argv[3]));
+  }
+
   ipAddress = string(argv[2]);
   port = atoi(argv[3]);
 
@@ -410,14 +707,23 @@ int main(int argc, char** argv) {
   slen=sizeof(si_other);
   if ((s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) error("ERROR socket - audio");
   setsockopt(s, SOL_SOCKET, SO_BROADCAST, &so_broadcast, sizeof(so_broadcast));
+  int one = 1;
+  setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));  // when clock sync requests arrive
   memset((char *) &si_other, 0, sizeof(si_other));
   si_other.sin_family = AF_INET;
   si_other.sin_port = htons(port);
-  if (inet_aton(ipAddress.c_str(), &si_other.sin_addr) == 0) {
+  if (ipAddress.compare(0, strlen(SHM_PREFIX), SHM_PREFIX) == 0) {
+    if (!createShmRing(ring, ipAddress.c_str() + strlen(SHM_PREFIX))) error("ERROR shm_open");
+    useShm = true;
+  } else if (inet_aton(ipAddress.c_str(), &si_other.sin_addr) == 0) {
     fprintf(stderr, "inet_aton() failed\n");
     exit(1);
   }
 
+  initResendHistory(history);
+  sendRun = time(NULL) % RUN_WRAP;
+  if (sendRun == 0) sendRun = 1;
+
   atexit(exitCallback);
   viconInit(); // Vicon initialization
 
@@ -444,64 +750,121 @@ int main(int argc, char** argv) {
 
   if (simulation) { // read from data dump
     string line;
+    parsedLine parsed;
+    int samples = 0;
+    int frames = 0;
     ifstream inputFile(gargv[1]);
     if (inputFile.is_open()) {
       while (inputFile.good()) {
         getline(inputFile, line);
-        sprintf(buf, "%s", line.c_str());
-        if (sendto(s, buf, BUFLEN, 0, (struct sockaddr*)&si_other,
-          slen) == -1) error("ERROR sendto()");
-        usleep(1000);
+        if (line.empty()) continue;
+        bool frameEnd = !parseLine(line.c_str(), line.length(), parsed); // timing lines mark frame boundaries
+        if (frameEnd) frames++;
+        else samples++;
+        if (queuePayload(line.c_str(), line.length()) == -1) error("ERROR sendmmsg()");
+        if (frameEnd || batchCount == SEND_BATCH) {
+          int sent = flushPayloads();
+          if (sent == -1) error("ERROR sendmmsg()");
+          usleep(1000 * sent); // keep the old pace of one line per millisecond
+          if (serveSlaves() == -1) perror("ERROR serving slaves");
+        }
+      }
+      if (flushPayloads() == -1) error("ERROR sendmmsg()");
+      // stay long enough for the slaves to chase the last gaps
+      for (double end = retransmitClock() + NACK_GIVE_UP; retransmitClock() < end; usleep(1000)) {
+        if (serveSlaves() == -1) perror("ERROR serving slaves");
       }
     } else {
       printf("Unable to open file\n");
       exit(1);
     }
     inputFile.close();
+    printf("Played back %d samples in %d frames; resent %lu datagrams for %lu NACKs (%lu suppressed, %lu too old)\n",
+      samples, frames, history.resent, history.nacks, history.suppressed, history.expired);
   } else { // live tracking w/ Vicon
     outputFile.open(gargv[4]);
     flagObject = gargv[5];
-    for (int i = 6; i < gargc; i++) objectsToTrack.push_back(string(gargv[i]));
+    const char *gestureFile = NULL;
+    for (int i = 6; i < gargc; i++) {
+      if (strncmp(gargv[i], "--gestures=", 11) == 0) gestureFile = gargv[i] + 11;
+      else objectsToTrack.push_back(string(gargv[i]));
+    }
+    if (gestureFile) {
+      if (!loadGestures(gestureFile, gestures)) exit(1);
+    } else { // the original toggle: raise the flag object above 2 m
+      gestureRule toggle;
+      toggle.action = GESTURE_DRAW;
+      toggle.segment = flagObject;
+      toggle.axis = 2;
+      toggle.above = true;
+      toggle.enter = 2000.0;
+      toggle.exit = 1900.0;
+      toggle.hold = 0.05;
+      toggle.refractory = 1.0;
+      toggle.repeat = false;
+      gestures.push_back(toggle);
+    }
+    gestureStates.resize(gestures.size());
+    for (int g = 0; g < gestureStates.size(); g++) resetGesture(gestureStates[g]);
+    motionFilters.resize(objectsToTrack.size());
+    for (int i = 0; i < motionFilters.size(); i++) resetMotionFilter(motionFilters[i]);
+    occlusionNotices.assign(objectsToTrack.size(), -1);
     //vector<format> formatters;
     //for (int i = 0; i < objectsToTrack.size(); i++) formatters.push_back(format("%1%~%2%~%3%~%4%"));
     while (true) {
       if (MyClient.GetFrame().Result != Result::Success )
         printf("WARNING: Inside display() and there is no data from Vicon...\n");
-      if (switchDrawingCtr > 0) switchDrawingCtr--;
-      Output_GetSegmentGlobalTranslation flagTranslate = MyClient.GetSegmentGlobalTranslation(flagObject, flagObject);
-      if (flagTranslate.Translation[2] > 2000.0 && switchDrawingCtr <= 0) {
-        switchDrawingCtr = 360;
-        drawingOn = !drawingOn;
-        if (drawingOn) printf("Drawing has switched from OFF to ON\n");
-        else printf("Drawing has switched from ON to OFF\n");
-      }
+      if (serveSlaves() == -1) perror("ERROR serving slaves");
+      double frameTime = viconFrameTime();
+      runGestures(frameTime);  // first, so their control messages lead this frame's samples
       if (drawingOn) {
         for (int i = 0; i < objectsToTrack.size(); i++) {
           dataToSend.clear();
           Output_GetSegmentGlobalTranslation globalTranslate = MyClient.GetSegmentGlobalTranslation(objectsToTrack[i], objectsToTrack[i]);
-          Output_GetSegmentGlobalRotationEulerXYZ globalRotation = MyClient.GetSegmentGlobalRotationEulerXYZ(objectsToTrack[i], objectsToTrack[i]);
+          Output_GetSegmentGlobalRotationQuaternion globalRotation = MyClient.GetSegmentGlobalRotationQuaternion(objectsToTrack[i], objectsToTrack[i]);
+          bool visible = globalTranslate.Result == Result::Success && !globalTranslate.Occluded;
+          float position[3];
+          if (visible) {
+            viconToScene(globalTranslate.Translation, position);
+            filterPosition(motionFilters[i], position, frameTime, position);
+            occlusionNotices[i] = -1;
+          } else if (motionFilters[i].primed && frameTime - motionFilters[i].lastTime <= OCCLUSION_BRIDGE) {
+            predictPosition(motionFilters[i], frameTime, position);
+          } else {
+            // gone too long to bridge: end the stroke, and start the next one
+            // from wherever the object reappears
+            resetMotionFilter(motionFilters[i]);
+            if (occlusionNotices[i] >= 0 && frameTime - occlusionNotices[i] < OCCLUSION_RESEND) continue;
+            occlusionNotices[i] = frameTime;
+            dataToSend = objectsToTrack[i];
+            dataToSend.append("~" OCCLUDED_FIELD);
+            queueLine(dataToSend);
+            continue;
+          }
+          if (!resamplePosition(motionFilters[i], position, RESAMPLE_DISTANCE)) continue;
           dataToSend = objectsToTrack[i];
           dataToSend.append("~");
-          dataToSend.append(boost::lexical_cast<string>((float)globalTranslate.Translation[0] / -1000.0f));
+          dataToSend.append(boost::lexical_cast<string>(position[0]));
           dataToSend.append("~");
-          dataToSend.append(boost::lexical_cast<string>((float)globalTranslate.Translation[1] / 1000.0f * 1.5f));
+          dataToSend.append(boost::lexical_cast<string>(position[1]));
           dataToSend.append("~");
-          dataToSend.append(boost::lexical_cast<string>((float)globalTranslate.Translation[2] / 1000.0f * 3.5f - 2.0f));
+          dataToSend.append(boost::lexical_cast<string>(position[2]));
+          if (visible && globalRotation.Result == Result::Success && !globalRotation.Occluded) {
+            appendQuaternion(dataToSend, globalRotation.Rotation);
+          }
 //          formatters[i] % objectsToTrack[i];
 //          formatters[i] % (globalTranslate.Translation[0] / 1000);
 //          formatters[i] % (globalTranslate.Translation[1] / 1000);
 //          formatters[i] % (globalTranslate.Translation[2] / 1000);
 //          dataToSend.append(formatters[i].str());
-          outputFile << dataToSend << "\n";
-          dataToSend.append("\n");
-          if (sendto(s, dataToSend.c_str(), dataToSend.length(), 0, (struct sockaddr*)&si_other, slen) == -1) {
-            perror ("ERROR sendto()");
-          }
+          queueLine(dataToSend);
 //printf("I sent %s\n", dataToSend.c_str());
         } // end for loop thru objectsToTrack
+        if (flushPayloads() == -1) perror ("ERROR sendmmsg()");
       } else { // end ifDrawingOn
+        if (flushPayloads() == -1) perror ("ERROR sendmmsg()");  // any control messages
         dataToSend = "DUMMYDATA\n";
-        if (sendto(s, dataToSend.c_str(), dataToSend.length(), 0, (struct sockaddr*)&si_other, slen) == -1) {
+        if (sendPayload(dataToSend.c_str(), dataToSend.length()) == -1) {
           perror ("ERROR sendto()");
         }
         usleep(10000);
@@ -7,6 +7,7 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <unistd.h>
@@ -17,127 +18,113 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <zlib.h>
 #include "../boost_1_53_0/boost/lexical_cast.hpp"
 
+#include "Protocol.h"
+#include "Retransmit.h"
+#include "ShmRing.h"
+#include "ClockSync.h"
+#include "Profiler.h"
+#include "SceneState.h"
+#include "SceneRenderer.h"
+#include "Offscreen.h"
+
 #define BUFLEN 512
 #define NPACK 10
+#define RECV_BATCH 64  // datagrams drained per recvmmsg() call
 #define PORT 25884
+#define NACK_TICK_MS 5  // longest the receiver waits before checking for gaps to chase
+#define INGEST_BACKLOG 1024  // datagrams staged while the scene is locked before the receiver waits for it
 
 using namespace std;
 
-const GLdouble SCREEN_WIDTH = (1920*3);  
-const GLdouble SCREEN_HEIGHT = 1080;
-const float screenAspectRatio = SCREEN_WIDTH/SCREEN_HEIGHT;
-
-//ofstream outputFile;
-bool simulation;
-
-typedef struct trackable {
-  float x;
-  float y;
-  float z;
-} trackable;
-
-typedef struct myline {
-  float x1, x2;
-  float y1, y2;
-  float z1, z2;
-  float r, g, b;
-} myline;
-
-int bufferHead = -1;
-const int bufferSeconds = 5;
-const int dataHertz = 100;
-//const int bufferSize = bufferSeconds * dataHertz;
-const int bufferSize = 20;
-int numTrackedObjects;
-
-const bool SIMULATION = true;
-vector<string> trackNames;
-map<string, vector<trackable> > trackHistory; 
-vector<float> averageDistances;
-
-map<string, vector<trackable> > afterImages;
-//vector<particle> particles; -- disabled; I think these would just get in the way for drawing purposes.
-
-pthread_t simulatorThread;
-
-// Artist performance variables **CUSTOMIZABLE**
-const bool LIMIT_BUFFER = true;  // Do we limit the size of our lines buffer?
-                                 // If yes: Avoid the problem of the computer running out of memory,
-                                 //         but once the limit is reached, old lines will disappear as
-                                 //         new ones are drawn.
-                                 // If no: The number of lines that can be drawn is "theoretically" unlimited,
-                                 //        but of course once the available memory fills up, the program will
-                                 //        crash. For this reason, it is recommended to leave LIMIT_BUFFER at "true".
-
-const int ART_BUFFER_SIZE = 200000; // How many lines can be held in memory at one time.
-                                 // Make the number too small, and old lines will start to disappear quickly.
-                                 // Make the number too big, and the system's performance will degrade.
-                                 // Tweak this value to try to achieve an effective balance.
-                                 // Here is the equation for how quickly lines will start to disappear based on
-                                 // this value:
-                                 //
-                                 // X = ART_BUFFER_SIZE / (Vicon update rate / (UPDATE_COUNTER/2) * <number of tracked objects>)
-                                 //
-                                 // where X = number of seconds before the buffer fills up.
-                                 // If ART_BUFFER_SIZE = 200,000; Vicon update = 100Hz; UPDATE_COUNTER = 40;
-                                 // and you are tracking 4 objects, then it will be 10,000 seconds, or just short of 167
-                                 // minutes, before the buffer fills.
-
-const double COLOR_CHANGE = 0.0003f; // The program is configured so that the color of drawn lines changes over time.
-                                 // This number controls how quickly the line color changes. The rate of change is
-                                 // expressed by the following equation:
-                                 //
-                                 // X = 1 / COLOR_CHANGE / 60
-                                 //
-                                 // where X is the number of seconds until the color has completely changed, and the
-                                 // pattern repeats. If COLOR_CHANGE = .0003, the color goes through one complete
-                                 // cycle about once per minute.
-
-const float LINE_THICKNESS = 5.0f; // Line thickness varies on user's distance from the screen, but this variable
-                                   // controls the "base" thickness of the lines. Higher value = fatter lines.
-                                   // Adjust to suit your aesthetic taste.
-
-// Artist performance variables **NOT CUSTOMIZABLE--DON'T ALTER THESE**
-map<string, vector<myline> > lines;
-int lineBufferHead = -1;
-map<string, myline> currentLine;
-bool drawingOn = true;
-double lineRed = 1.0;
-double lineGreen = 0.5;
-double lineBlue = 0.0;
-double lineRedDir = -1.0;
-double lineGreenDir = 1.0;
-double lineBlueDir = 1.0;
-
 // DGR vars
 int s, milliseconds;
 struct timespec req;
 pthread_t receiverThread;
 struct sockaddr_in si_me, si_other;
 int slen;
-
-double ortho_left;
-double ortho_right;
-double ortho_bottom;
-double ortho_top;
+int rcvbufSize = 0;              // 0 = leave SO_RCVBUF at the system default
+unsigned int kernelDrops = 0;    // datagrams the kernel dropped on our socket (SO_RXQ_OVFL)
+unsigned long receivedPackets = 0;
+unsigned long receiveBatches = 0;
+reorderWindow reorder;           // datagrams held back behind a gap until it's filled
+
+// Datagrams received but not yet applied, because the scene was locked. They
+// carry the time they reached the socket, so the lag until they're applied
+// can be profiled.
+typedef struct stagedPacket {
+  unsigned int seq;
+  unsigned long long arrivedNs;  // CLOCK_REALTIME, as the kernel stamps them
+  long long sentStamp;           // the master's send stamp, or -1
+  size_t len;
+  char data[BUFLEN + 1];
+} stagedPacket;
+stagedPacket staged[INGEST_BACKLOG];
+int numStaged = 0;
+unsigned long long arrivalNs = 0;   // when the datagram being handled arrived
+unsigned long coalescedSamples = 0; // samples that only extended their strokes
+bool retransmit = true;          // ask the master for missing datagrams
+struct sockaddr_in masterAddr;   // where the last datagram came from, for NACKs
+bool haveMaster = false;
+clockSync masterClock;           // the master's clock, estimated from our exchanges with it
+long long swapPeriodNs = 0;      // swap on these boundaries of the master's clock; 0 = as soon as drawn
+long long predictLeadNs = -1;    // from building a frame to its being on screen, for prediction; -1 = don't predict
+bool timedSamples = true;         // time samples by sampleTime(); off for recordings, which keep their own frame clock
+bool useShm = false;             // read the master's shared-memory ring instead of the socket
+shmRing ring;
+unsigned long shmOverruns = 0;   // datagrams the master overwrote before we read them
+bool profileOverlay = false;
+
+SceneState *scene;
+sceneFrame frame;
+strokePoolStats poolTelemetry;  // copied out with the frame, for the profile
+pthread_mutex_t stateMutex = PTHREAD_MUTEX_INITIALIZER; // guards the scene against the network and snapshot threads
+unsigned int lastSeq = 0;    // sequence number of the last packet applied
+
+vector<tileView> tiles;       // the frustums we draw, side by side in one window
+vector<tileCommands> tileCmds;
+ribbonCache ribbons;
+lodCache lod;
+int windowWidth, windowHeight;
 
 bool receivedPacket = false;
 int framesPassed = 0;
 
-vector<string> &split(const string &s, char delim, vector<string> &elems) {
-  stringstream ss(s);
-  string item;
-  while (getline(ss, item, delim)) {
-    elems.push_back(item);
-  }
-  return elems;
-}
-
-vector<string> split(const string &s, char delim) {
-  vector<string> elems;
-  return split(s, delim, elems);
+// Late-joiner snapshot vars
+pthread_t snapshotThread;
+int snapshotPort = SNAPSHOT_PORT;
+string snapshotSource;       // host[:port] of a peer slave to catch up from; empty = start fresh
+bool loadingSnapshot = false;
+vector<string> pendingPackets; // live packets held back while a snapshot is loading
+vector<double> pendingTimes;   // and when their samples were taken
+
+// Optional "--name=value" arguments following the positional ones
+const char *optionValue(int argc, char** argv, const char *name) {
+  size_t len = strlen(name);
+  for (int i = 7; i < argc; i++) {
+    if (strncmp(argv[i], name, len) == 0 && argv[i][len] == '=') return argv[i] + len + 1;
+  }
+  return NULL;
+}
+
+unsigned long long realtimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+double nowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
 }
 
 void error(const char *msg) {
@@ -150,248 +137,476 @@ void closeProgram() {
   exit(0);
 }
 
-float absFloat(float f) {
-  if (f >= 0) return f;
-  else return -f;
+// When a datagram's samples were taken, in seconds on the master's clock:
+// when the master sent it if it says, else when it got here.
+double sampleTime(const stagedPacket &p) {
+  long long arrived = syncedNs(masterClock, p.arrivedNs);
+  if (p.sentStamp < 0 || !masterClock.synced) return arrived / 1e9;
+  return arrived / 1e9 - stampAgeUs(p.sentStamp, arrived) / 1e6;
 }
 
-float computeAverage(vector<float> values) {
-  float avg = 0.0f;
-  for (int i = 0; i < values.size(); i++) {
-    avg += values[i];
+// Apply the backlog in one go, only the newest sample of each object
+// updating its head and trail, or, while a snapshot is being fetched, hold
+// it back so it can be replayed on top of the snapshot. Without wait, leaves
+// the backlog to grow if the scene is locked. Returns false if it did.
+bool flushStaged(bool wait) {
+  static const char *payloads[INGEST_BACKLOG];
+  static size_t lens[INGEST_BACKLOG];
+  static double times[INGEST_BACKLOG];
+  if (numStaged == 0) return true;
+  if (wait) pthread_mutex_lock(&stateMutex);
+  else if (pthread_mutex_trylock(&stateMutex) != 0) return false;
+  for (int i = 0; i < numStaged; i++) {
+    if (loadingSnapshot) {
+      pendingPackets.push_back(string(staged[i].data, staged[i].len));
+      pendingTimes.push_back(timedSamples ? sampleTime(staged[i]) : -1);
+      continue;
+    }
+    unsigned int seq;
+    payloads[i] = readSeqHeader(staged[i].data, seq);
+    lens[i] = staged[i].len - (payloads[i] - staged[i].data);
+    if (seq != 0) lastSeq = seq;
+    times[i] = sampleTime(staged[i]);
+  }
+  if (!loadingSnapshot) {
+    coalescedSamples += scene->applyPackets(payloads, lens, numStaged, timedSamples ? times : NULL);
+  }
+  pthread_mutex_unlock(&stateMutex);
+  if (profilingEnabled) {
+    unsigned long long now = realtimeNs();
+    for (int i = 0; i < numStaged; i++) {
+      if (now > staged[i].arrivedNs) profileRecord(PROFILE_LAG, now - staged[i].arrivedNs);
+      if (staged[i].sentStamp < 0 || !masterClock.synced) continue;
+      long long transit = stampAgeUs(staged[i].sentStamp, syncedNs(masterClock, staged[i].arrivedNs));
+      if (transit >= 0) profileRecord(PROFILE_TRANSIT, transit * 1000);
+    }
   }
-  avg /= values.size();
-  return avg;
+  numStaged = 0;
+  return true;
 }
 
-float compute3dDistance(trackable t1, trackable t2) {
-  float xd = t1.x - t2.x;
-  float yd = t1.y - t2.y;
-  float zd = t1.z - t2.z;
-  return sqrt(xd*xd + yd*yd + zd*zd);
+// Queue a datagram, header and all, to be applied with the rest of the
+// backlog. If the backlog is full, apply it first.
+void stagePacket(void *context, unsigned int seq, const char *buf, size_t len) {
+  if (numStaged == INGEST_BACKLOG) flushStaged(true);
+  stagedPacket &p = staged[numStaged++];
+  if (len > BUFLEN) len = BUFLEN;
+  readSeqHeader(buf, seq, p.sentStamp);
+  p.seq = seq;
+  p.arrivedNs = arrivalNs;
+  p.len = len;
+  memcpy(p.data, buf, len);
+  p.data[len] = '\0';
 }
 
-float computeAverageDistance(vector<trackable> t) {
-  vector<float> distances;
-  for (int i = 0; i < t.size() - 1; i++) {
-    for (int j = i + 1; j < t.size(); j++) {
-      distances.push_back(compute3dDistance(t[i], t[j]));
-    }
+// Pass a datagram on in sequence order, holding it back if any before it are
+// missing. Datagrams without a sequence number go straight through.
+void handlePacket(const char *buf, size_t len) {
+  unsigned int seq, run;
+  long long stamp;
+  readSeqHeader(buf, seq, run, stamp);
+  if (seq == 0 || !retransmit) stagePacket(NULL, seq, buf, len);
+  else acceptPacket(reorder, seq, run, buf, len, retransmitClock(), stagePacket, NULL);
+}
+
+// Skip gaps that have been open too long and ask the master for the missing
+// datagrams that are due.
+void serviceRetransmit() {
+  if (!retransmit) return;
+  nackRange ranges[NACK_MAX_RANGES];
+  int n = serviceWindow(reorder, retransmitClock(), ranges, NACK_MAX_RANGES, stagePacket, NULL);
+  for (int i = 0; i < n && haveMaster; i++) {
+    char nack[64];
+    int len = writeNack(nack, sizeof(nack), ranges[i].first, ranges[i].count);
+    if (sendto(s, nack, len, 0, (struct sockaddr*)&masterAddr, sizeof(masterAddr)) == -1) perror("WARNING: NACK");
   }
-  return computeAverage(distances);
 }
 
-const int numAfterImages = 24;
+long long masterNowNs() {
+  return syncedNowNs(masterClock);
+}
 
-void addAfterImage(string key, trackable addMe) {
-  if (afterImages[key].size() < numAfterImages) {
-    afterImages[key].push_back(addMe);
-  } else {
-    afterImages[key].erase(afterImages[key].end()-1);
-    afterImages[key].insert(afterImages[key].begin(), addMe);
-  } /* */
+// Ask the master, or the relay we hear it through, for the time when an
+// exchange is due.
+void serviceClockSync() {
+  if (!haveMaster || !syncDue(masterClock)) return;
+  char request[64];
+  int len = writeSyncRequest(request, sizeof(request), localClockNs());
+  if (sendto(s, request, len, 0, (struct sockaddr*)&masterAddr, sizeof(masterAddr)) == -1) perror("WARNING: clock sync");
 }
 
-trackable calculateVelocity(string key) {
-  trackable retData;
-  retData.x = 0;
-  retData.y = 0;
-  retData.z = 0;
-  float xVel = 0;
-  float yVel = 0;
-  float zVel = 0;
-  if (bufferHead >= 6) {
-    for (int t = bufferHead; t > bufferHead - 5; t--) {
-      xVel += trackHistory[key][t].x - trackHistory[key][t-1].x;
-      yVel += trackHistory[key][t].y - trackHistory[key][t-1].y;
-      zVel += trackHistory[key][t].z - trackHistory[key][t-1].z;
-    }
-    retData.x = xVel / 5.0f;
-    retData.y = yVel / 5.0f;
-    retData.z = zVel / 5.0f;
+// Drain the socket RECV_BATCH datagrams per recvmmsg() call and apply them
+// under a single lock. While a frame is being built the lock is busy, so
+// rather than wait, and let datagrams pile up in the kernel, the receiver
+// keeps draining the socket and applies the whole backlog once it's free.
+// The kernel attaches its running count of datagrams dropped for lack of
+// buffer space (SO_RXQ_OVFL) and the time each one arrived to each message.
+// The socket times out every NACK_TICK_MS so that gaps are chased, and the
+// backlog applied, even when nothing is arriving.
+void receiver() {
+  static char bufs[RECV_BATCH][BUFLEN + 1];
+  static char controls[RECV_BATCH][CMSG_SPACE(sizeof(unsigned int)) + CMSG_SPACE(sizeof(struct timespec))];
+  static struct sockaddr_in senders[RECV_BATCH];
+  struct mmsghdr msgs[RECV_BATCH];
+  struct iovec iovecs[RECV_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < RECV_BATCH; i++) {
+    iovecs[i].iov_base = bufs[i];
+    iovecs[i].iov_len = BUFLEN;
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = controls[i];
+    msgs[i].msg_hdr.msg_name = &senders[i];
   }
-  return retData;
+  unsigned int reportedDrops = 0;
+  double lastDropReport = 0;
+  while (true) {
+    for (int i = 0; i < RECV_BATCH; i++) {
+      msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+      msgs[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+    }
+    int n = recvmmsg(s, msgs, RECV_BATCH, MSG_WAITFORONE, NULL);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        serviceRetransmit();
+        serviceClockSync();
+        flushStaged(true);
+        continue;
+      }
+      if (errno == EINTR) continue;
+      error("ERROR recvmmsg()");
+    }
+    receivedPacket = true;
+    framesPassed = 0;
+    PROFILE_SCOPE(PROFILE_RECEIVE);
+    unsigned long long received = realtimeNs();
+    for (int i = 0; i < n; i++) {
+      arrivalNs = received;
+      for (struct cmsghdr *c = CMSG_FIRSTHDR(&msgs[i].msg_hdr); c != NULL; c = CMSG_NXTHDR(&msgs[i].msg_hdr, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+          memcpy(&kernelDrops, CMSG_DATA(c), sizeof(kernelDrops));
+        } else if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+          struct timespec ts;
+          memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+          arrivalNs = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+      }
+      bufs[i][msgs[i].msg_len] = '\0';
+      long long t1, t2, t3;
+      // data datagrams start with their sequence number, so one byte tells a
+      // clock sync reply apart without scanning every datagram
+      if (bufs[i][0] == SYNC_REPLY[0] && parseSyncReply(bufs[i], t1, t2, t3)) addSyncReply(masterClock, t1, t2, t3, arrivalNs);
+      else handlePacket(bufs[i], msgs[i].msg_len);
+    }
+    masterAddr = senders[n - 1];
+    haveMaster = true;
+    serviceRetransmit();
+    serviceClockSync();
+    // wait for the lock only once the backlog couldn't take another batch
+    flushStaged(numStaged + RECV_BATCH > INGEST_BACKLOG);
+    receiveBatches++;
+    receivedPackets += n;
+    if (kernelDrops != reportedDrops && nowMs() - lastDropReport > 1000) {
+      printf("WARNING: kernel dropped %u packets so far (socket buffer full)\n", kernelDrops);
+      reportedDrops = kernelDrops;
+      lastDropReport = nowMs();
+    }
+  } // end receive loop
 }
 
-float calculateAverageVelocity() {
-  trackable retData;
-  retData.x = 0.0f;
-  retData.y = 0.0f;
-  retData.z = 0.0f;
-  for (int i = 0; i < trackNames.size(); i++) {
-    trackable runningAvg = calculateVelocity(trackNames[i]);
-    retData.x += absFloat(runningAvg.x);
-    retData.y += absFloat(runningAvg.y);
-    retData.z += absFloat(runningAvg.z);
+// The same, reading from a master on this machine through its shared-memory
+// ring: each datagram is copied straight out of the ring, and the receiver
+// only makes a syscall to sleep once it has caught up. The ring stamps each
+// datagram with when it was published, which stands in for the kernel's
+// arrival time.
+void shmReceiver() {
+  static char bufs[RECV_BATCH][BUFLEN + 1];
+  int lens[RECV_BATCH];
+  unsigned long long stamps[RECV_BATCH];
+  unsigned long long cursor = shmCursor(ring);
+  unsigned long reportedOverruns = 0;
+  double lastOverrunReport = 0;
+  while (true) {
+    int n = 0;
+    while (n < RECV_BATCH && (lens[n] = shmRead(ring, cursor, bufs[n], BUFLEN, stamps[n], shmOverruns)) >= 0) n++;
+    if (n == 0) {
+      flushStaged(true);
+      shmWait(ring, cursor, NACK_TICK_MS);
+      continue;
+    }
+    receivedPacket = true;
+    framesPassed = 0;
+    PROFILE_SCOPE(PROFILE_RECEIVE);
+    for (int i = 0; i < n; i++) {
+      arrivalNs = stamps[i];
+      bufs[i][lens[i]] = '\0';
+      handlePacket(bufs[i], lens[i]);
+    }
+    flushStaged(numStaged + RECV_BATCH > INGEST_BACKLOG);
+    receiveBatches++;
+    receivedPackets += n;
+    if (shmOverruns != reportedOverruns && nowMs() - lastOverrunReport > 1000) {
+      printf("WARNING: fell behind the master and missed %lu packets so far\n", shmOverruns);
+      reportedOverruns = shmOverruns;
+      lastOverrunReport = nowMs();
+    }
   }
-  retData.x /= (float)numTrackedObjects;
-  retData.y /= (float)numTrackedObjects;
-  retData.z /= (float)numTrackedObjects;
-  return ((retData.x + retData.y + retData.z) / 3.0f);
 }
 
-int getTmpBufferHead(string effName) {
-  int tmpBufferHead = bufferHead - 1;
-  if (tmpBufferHead < 0) {
-    if (trackHistory[effName].size() == bufferSize) tmpBufferHead = bufferSize - 1;
-    else tmpBufferHead = 0;
-  }
-  return tmpBufferHead;
+// ***SNAPSHOTS***
+// A running slave serves its whole stroke buffer over TCP so that a tile that
+// was restarted mid-performance can catch up with its neighbours instead of
+// starting from an empty canvas. The payload is zlib-compressed; the header
+// carries the sequence number of the last packet it reflects. Sizes in the
+// header are checked against the largest snapshot a full stroke pool makes
+// before anything is allocated for them, and every socket gives up after
+// SNAPSHOT_TIMEOUT_MS, so a bad or stalled peer costs a late joiner an empty
+// canvas rather than its memory or its start-up.
+
+// a full pool with every line packed and its stroke id, four times over for
+// a peer configured with a bigger pool, plus room for the chunks' base times,
+// the objects' names and state
+const size_t SNAPSHOT_MAX_RAW =
+  (size_t)(STROKE_POOL_MB * 1048576 / SEGMENT_BYTES) * (sizeof(packedLine) + sizeof(unsigned int)) * 4 + 1048576;
+
+void setSocketTimeouts(int fd) {
+  struct timeval timeout;
+  timeout.tv_sec = SNAPSHOT_TIMEOUT_MS / 1000;
+  timeout.tv_usec = (SNAPSHOT_TIMEOUT_MS % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 }
 
-trackable getColors(string effName) {
-  trackable color;
-  color.x = color.y = color.z = 1.0f;
-  int tmpBufferHead = getTmpBufferHead(effName);
-  if (averageDistances.size() > 0) {
-    color.x = averageDistances[tmpBufferHead] / 2.0f;
-    color.z = 1.0f - averageDistances[tmpBufferHead] / 2.0f;
-    if (color.x > color.z) color.y = color.x - color.z;
-    else color.y = color.z - color.x;
-    if (color.x > 1.0f) color.x = 1.0f;
-    if (color.z < 0.0f) color.z = 0.0f;
-    if (color.y > 1.0f) color.y = 1.0f;
+bool readFully(int fd, void *data, size_t len) {
+  char *p = (char*)data;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
   }
-  return color;
+  return true;
 }
 
-float cubeRotationA = 0.0f;
-float cubeRotationB = 0.0f;
-float cubeRotationC = 0.0f;
-float cubeColorR = 0.3f;
-float cubeColorG = 0.6f;
-float cubeColorB = 0.9f;
-
-int executionCtr = 0;
-int totalCtr = 0;
-
-void averageDistanceHelper() {
-            executionCtr++;
-            if (trackNames.size() == numTrackedObjects) {
-              vector<trackable> points;
-              for (int i = 0; i < trackNames.size(); i++) {
-                points.push_back(trackHistory[trackNames[i]][bufferHead]);
-              }
-              if (averageDistances.size() < bufferSize) {
-                averageDistances.push_back(computeAverageDistance(points));
-              } else {
-                averageDistances[bufferHead] = computeAverageDistance(points);
-              }
-            }
-            bufferHead++;
+bool writeFully(int fd, const void *data, size_t len) {
+  const char *p = (const char*)data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
 }
 
-void receiver() {
-  char buf[BUFLEN];
-  vector<string> splitLine;
+void snapshotServer() {
+  int ls = socket(AF_INET, SOCK_STREAM, 0);
+  if (ls == -1) error("ERROR snapshot socket");
+  int reuse = 1;
+  setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in addr;
+  memset((char *) &addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(snapshotPort);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(ls, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(ls, 4) == -1) {
+    perror("WARNING: snapshot server disabled");
+    close(ls);
+    return;
+  }
   while (true) {
-    if (recvfrom(s, buf, BUFLEN, 0, (struct sockaddr*)&si_other,
-      &slen) == -1) error("ERROR recvfrom()");
-    receivedPacket = true;
-    framesPassed = 0;
-    string itrmdt(buf);
-    splitLine = split(itrmdt, '~');
-    if (splitLine.size() == 4) {  // valid input line
-      trackable newTrackData;
-      newTrackData.x = atof(splitLine[1].c_str());
-      newTrackData.y = atof(splitLine[2].c_str());
-      newTrackData.z = atof(splitLine[3].c_str());
-      if (trackHistory.count(splitLine[0]) == 0) {
-        trackNames.push_back(splitLine[0]);
-        myline newcline;
-        newcline.x1 = newcline.x2 = newTrackData.x;
-        newcline.y1 = newcline.y2 = newTrackData.y;
-        newcline.z1 = newcline.z2 = newTrackData.z;
-        currentLine[splitLine[0]] = newcline;
-      }
-      if (bufferHead >= bufferSize) bufferHead = 0;
-      if (trackHistory[splitLine[0]].size() < bufferSize) {
-        trackHistory[splitLine[0]].push_back(newTrackData);
-      } else {
-        trackHistory[splitLine[0]][bufferHead] = newTrackData;
+    int cs = accept(ls, NULL, NULL);
+    if (cs == -1) continue;
+    setSocketTimeouts(cs);
+    char request[sizeof(SNAPSHOT_REQUEST) - 1];
+    if (readFully(cs, request, sizeof(request)) &&
+        memcmp(request, SNAPSHOT_REQUEST, sizeof(request)) == 0) {
+      double start = nowMs();
+      string raw;
+      snapshotHeader header;
+      pthread_mutex_lock(&stateMutex);
+      header.seq = lastSeq;
+      scene->encodeSnapshot(raw);
+      pthread_mutex_unlock(&stateMutex);
+      uLongf compressedSize = compressBound(raw.size());
+      vector<Bytef> compressed(compressedSize);
+      compress2(&compressed[0], &compressedSize, (const Bytef*)raw.data(), raw.size(), Z_BEST_SPEED);
+      memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+      header.version = SNAPSHOT_VERSION;
+      header.rawSize = raw.size();
+      header.compressedSize = compressedSize;
+      if (writeFully(cs, &header, sizeof(header)) && writeFully(cs, &compressed[0], compressedSize)) {
+        printf("Served snapshot at seq %u: %u bytes (%lu compressed) in %.1f ms\n",
+          header.seq, header.rawSize, (unsigned long)compressedSize, nowMs() - start);
       }
-      if (executionCtr % 3 == 0) addAfterImage(splitLine[0], newTrackData);
-      
-
-      // add particles
-      /*if (executionCtr % 50 == 0) {
-        trackable velocityData = calculateVelocity(splitLine[0]);
-        trackable color = getColors(splitLine[0]);
-        if (velocityData.x != 0 && velocityData.y != 0 && velocityData.z != 0) {
-          particle newParticle;
-          newParticle.x = newTrackData.x;
-          newParticle.y = newTrackData.y;
-          newParticle.z = newTrackData.z;
-          newParticle.x_vel = velocityData.x;
-          newParticle.y_vel = velocityData.y;
-          newParticle.z_vel = velocityData.z;
-          newParticle.colorR = color.x;
-          newParticle.colorG = color.y;
-          newParticle.colorB = color.z;
-          newParticle.colorA = 1.0f;
-          particles.push_back(newParticle);
-        }
-      } */
-
-      // ADD LINE RECORDING FOR ARTIST VERSION
-      if (drawingOn /*&& totalCtr % UPDATE_COUNTER == 0*/ &&
-         (newTrackData.x != 0 || newTrackData.y != 0 || newTrackData.z != 0))
-      {
-
-        currentLine[splitLine[0]].r = lineRed;
-        currentLine[splitLine[0]].g = lineGreen;
-        currentLine[splitLine[0]].b = lineBlue;
-
-        currentLine[splitLine[0]].x1 = currentLine[splitLine[0]].x2;
-        currentLine[splitLine[0]].y1 = currentLine[splitLine[0]].y2;
-        currentLine[splitLine[0]].z1 = currentLine[splitLine[0]].z2;
-
-        currentLine[splitLine[0]].x2 = newTrackData.x;
-        currentLine[splitLine[0]].y2 = newTrackData.y;
-        currentLine[splitLine[0]].z2 = newTrackData.z;
-
-        myline newLine;
-        newLine.x1 = currentLine[splitLine[0]].x1; newLine.x2 = currentLine[splitLine[0]].x2;
-        newLine.y1 = currentLine[splitLine[0]].y1; newLine.y2 = currentLine[splitLine[0]].y2;
-        newLine.z1 = currentLine[splitLine[0]].z1; newLine.z2 = currentLine[splitLine[0]].z2;
-        newLine.r = currentLine[splitLine[0]].r;
-        newLine.g = currentLine[splitLine[0]].g;
-        newLine.b = currentLine[splitLine[0]].b;
-
-        lineBufferHead++;
-        if (lineBufferHead >= ART_BUFFER_SIZE) lineBufferHead = 0;
-        if (lines[splitLine[0]].size() < ART_BUFFER_SIZE) lines[splitLine[0]].push_back(newLine);
-        else lines[splitLine[0]][lineBufferHead] = newLine;
-      }
-      // END LINE RECORDING FOR ARTIST VERSION
-
-      if (!simulation) {  // counting for live tracking
-        totalCtr++;
-        if (trackNames.size() > 0) {
-          if (totalCtr % trackNames.size() == 0) {
-            averageDistanceHelper();
-          }
-        }
-      }
-
-    // end check for valid input line
-    } else if (simulation) { // counting for data dump reading
-      totalCtr++;
-      averageDistanceHelper();
-      // compute average proximity
+    }
+    close(cs);
+  }
+}
 
-// DEBUG CODE
-//if (logger) {
-//  outputFile << "trackNames.size() is " << boost::lexical_cast<string>(trackNames.size()) << "\n";
-//  outputFile << "numTrackedObjects is " << boost::lexical_cast<string>(numTrackedObjects) << "\n";
-//}
-// END DEBUG CODE
+int connectTo(const string &source, int defaultPort) {
+  string host = source;
+  string port = boost::lexical_cast<string>(defaultPort);
+  size_t colon = source.find(':');
+  if (colon != string::npos) {
+    host = source.substr(0, colon);
+    port = source.substr(colon + 1);
+  }
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return -1;
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd != -1) {
+    // connect without blocking, so an unreachable peer times out like a
+    // stalled one instead of after the kernel's minutes of retries
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    bool connected = connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+    if (!connected && errno == EINPROGRESS) {
+      struct pollfd pending = { fd, POLLOUT, 0 };
+      int err = 0;
+      socklen_t errLen = sizeof(err);
+      connected = poll(&pending, 1, SNAPSHOT_TIMEOUT_MS) == 1 &&
+                  getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) == 0 && err == 0;
+    }
+    if (connected) {
+      fcntl(fd, F_SETFL, flags);
+      setSocketTimeouts(fd);
+    } else {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  return fd;
+}
 
+// Fetch a snapshot from a peer, install it, then replay whatever arrived on
+// the live stream in the meantime that the snapshot does not already reflect.
+void snapshotLoader() {
+  double start = nowMs();
+  int fd = connectTo(snapshotSource, SNAPSHOT_PORT);
+  snapshotHeader header;
+  string raw;
+  bool ok = false;
+  if (fd == -1) {
+    printf("WARNING: can't reach snapshot source %s\n", snapshotSource.c_str());
+  } else if (!writeFully(fd, SNAPSHOT_REQUEST, sizeof(SNAPSHOT_REQUEST) - 1) ||
+             !readFully(fd, &header, sizeof(header)) ||
+             memcmp(header.magic, SNAPSHOT_MAGIC, 4) != 0 || header.version != SNAPSHOT_VERSION) {
+    printf("WARNING: no snapshot header from %s\n", snapshotSource.c_str());
+  } else if (header.rawSize > SNAPSHOT_MAX_RAW || header.compressedSize == 0 ||
+             header.compressedSize > compressBound(header.rawSize)) {
+    printf("WARNING: snapshot from %s claims %u bytes (%u compressed), more than a stroke pool holds\n",
+      snapshotSource.c_str(), header.rawSize, header.compressedSize);
+  } else {
+    vector<Bytef> compressed(header.compressedSize);
+    if (readFully(fd, &compressed[0], header.compressedSize)) {
+      double received = nowMs();
+      raw.resize(header.rawSize);
+      uLongf rawSize = header.rawSize;
+      ok = uncompress((Bytef*)&raw[0], &rawSize, &compressed[0], header.compressedSize) == Z_OK &&
+           rawSize == header.rawSize;
+      if (ok) printf("Snapshot at seq %u: %u bytes (%u compressed), transfer %.1f ms, inflate %.1f ms\n",
+        header.seq, header.rawSize, header.compressedSize, received - start, nowMs() - received);
     }
-  } // end receive loop
+  }
+  if (fd != -1) close(fd);
+
+  pthread_mutex_lock(&stateMutex);
+  if (ok) ok = scene->decodeSnapshot(raw);
+  if (ok) lastSeq = header.seq;
+  else printf("WARNING: no usable snapshot, starting with an empty canvas\n");
+  int replayed = 0;
+  for (int i = 0; i < pendingPackets.size(); i++) {
+    unsigned int seq;
+    const char *payload = readSeqHeader(pendingPackets[i].c_str(), seq);
+    if (ok && seq != 0 && !seqAfter(seq, header.seq)) continue;
+    scene->applyPacket(payload, pendingPackets[i].size() - (payload - pendingPackets[i].c_str()), pendingTimes[i]);
+    if (seq != 0) lastSeq = seq;
+    replayed++;
+  }
+  pendingPackets.clear();
+  pendingTimes.clear();
+  loadingSnapshot = false;
+  pthread_mutex_unlock(&stateMutex);
+  printf("Caught up in %.1f ms (%d live packets replayed)\n", nowMs() - start, replayed);
+}
+
+// end of snapshots ///////////////////////////////////////////////////////////
+
+// Build and draw one frame of every tile. The frame's strokes point into the
+// scene, so the lock is held until each tile's lines have been copied into
+// its commands and the changed ribbon segments and level-of-detail chunks
+// staged, but not while they're uploaded and drawn.
+void renderScene() {
+  PROFILE_SCOPE(PROFILE_FRAME);
+  // predict to when this frame will be on screen: the swap boundary it's
+  // held for, if any, plus the display's own lag
+  double displayTime = -1;
+  if (predictLeadNs >= 0) {
+    long long now = masterNowNs();
+    long long swap = swapPeriodNs > 0 && masterClock.synced ? now + swapPeriodNs - now % swapPeriodNs : now;
+    displayTime = (swap + predictLeadNs) / 1e9;
+  }
+  pthread_mutex_lock(&stateMutex);
+  scene->buildFrame(frame, displayTime);
+  stageRibbons(frame, ribbons);
+  stageLod(frame, lod);
+  buildAllTileCommands(frame, lod, tiles, tileCmds);
+  if (profilingEnabled) scene->poolStats(poolTelemetry);
+  pthread_mutex_unlock(&stateMutex);
+  uploadRibbons(ribbons);
+  drawTiles(frame, tiles, tileCmds, ribbons);
 }
 
-string effName;
+// Publish the network counters and export the profile if it's due.
+void profileFrame() {
+  if (!profilingEnabled) return;
+  profileGauge("packets", receivedPackets);
+  profileGauge("recv_batches", receiveBatches);
+  profileGauge("kernel_drops", kernelDrops);
+  if (useShm) profileGauge("shm_overruns", shmOverruns);
+  profileGauge("clock_synced", masterClock.synced);
+  profileGauge("clock_offset_us", masterClock.offset / 1e3);
+  profileGauge("clock_drift_ppm", masterClock.drift * 1e6);
+  profileGauge("clock_rtt_us", masterClock.delay / 1e3);
+  profileGauge("coalesced", coalescedSamples);
+  profileGauge("missed", reorder.missed);
+  profileGauge("recovered", reorder.recovered);
+  profileGauge("lost", reorder.lost);
+  profileGauge("nacks", reorder.nacks);
+  profileGauge("recovery_ms_max", reorder.recoveryMax * 1e3);
+  if (reorder.recovered > 0) profileGauge("recovery_ms_mean", reorder.recoveryTotal / reorder.recovered * 1e3);
+  profileGauge("pool_used", poolTelemetry.used);
+  profileGauge("pool_live", poolTelemetry.live);
+  profileGauge("pool_capacity", poolTelemetry.capacity);
+  profileGauge("pool_used_mb", poolTelemetry.usedMB);
+  profileGauge("pool_evicted", poolTelemetry.evicted);
+  profileGauge("lod_built", lod.built);
+  profileTick();
+}
+
+// Last exported profile as text in the top left corner (GLUT windows only).
+void drawProfileOverlay() {
+  const vector<string> &text = profileSummary();
+  glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  glOrtho(0, SCREEN_WIDTH, 0, SCREEN_HEIGHT, -1, 1);
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  glDisable(GL_DEPTH_TEST);
+  glBlendFunc(GL_ONE, GL_ZERO);
+  glColor3f(1.0f, 1.0f, 1.0f);
+  for (int i = 0; i < text.size(); i++) {
+    glRasterPos2f(10, SCREEN_HEIGHT - 20 - 15 * i);
+    for (int c = 0; c < text[i].size(); c++) glutBitmapCharacter(GLUT_BITMAP_8_BY_13, text[i][c]);
+  }
+  glBlendFunc(GL_SRC_COLOR, GL_DST_COLOR);
+}
 
 void display() {
 
@@ -409,186 +624,233 @@ void display() {
     }
   }
 
-  // color changing
-  lineRed += COLOR_CHANGE * lineRedDir;
-  lineGreen += COLOR_CHANGE * lineGreenDir;
-  lineBlue += COLOR_CHANGE * lineBlueDir;
-  if (lineRed <= 0) lineRedDir = 1.0;
-  else if (lineRed >= 1) lineRedDir = -1.0;
-  if (lineGreen <= 0) lineGreenDir = 1.0;
-  else if (lineGreen >= 1) lineGreenDir = -1.0;
-  if (lineBlue <= 0) lineBlueDir = 1.0;
-  else if (lineBlue >= 1) lineBlueDir = -1.0;
-
-  // display
-
-//  glEnable(GL_LIGHTING) ;
-//  glEnable(GL_LIGHT0);
-  glEnable(GL_COLOR_MATERIAL);
-  glEnable(GL_NORMALIZE);
-  glEnable(GL_DEPTH_TEST);
-
-  glClearColor(0, 0, 0, 0);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glFrustum(ortho_left, ortho_right, ortho_bottom, ortho_top, 0.1, 5000);
-//  gluPerspective(45, screenAspectRatio, .1, 5000);
-
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
-  gluLookAt(0,4,1,
-            0,0,1,
-            0,0,1);
-
-  glTranslatef(0.0f, 3.5f, 0.0f);
-
-  // draw huge wireframe cubes that spin in response to user movement
-  // disabled; doesn't seem useful for a drawing application.
-  /*glBlendFunc(GL_ONE, GL_ZERO);
-  glLineWidth(5.0f);
-  float avgVel = calculateAverageVelocity();
-  cubeRotationA += (avgVel * 3);
-  cubeRotationB += (avgVel * 5);
-  cubeRotationC += (avgVel * 7);
-  cubeColorR += 0.01f;
-  cubeColorG += 0.03f;
-  cubeColorB += 0.05f;
-  if (cubeColorR > 1.0f) cubeColorR = 0.0f;
-  if (cubeColorG > 1.0f) cubeColorG = 0.0f;
-  if (cubeColorB > 1.0f) cubeColorB = 0.0f;
-  glColor4f(cubeColorR, cubeColorG, cubeColorB, 1.0f);
-  glPushMatrix();
-  glRotatef(cubeRotationA, 0.0f, 0.0f, 1.0f);
-  glutWireSphere(6.0, 8, 8);
-  glPopMatrix();
-  glColor4f(cubeColorB, cubeColorR, cubeColorG, 1.0f);
-  glPushMatrix();
-  glRotatef(cubeRotationB, 0.0f, 1.0f, 0.0f);
-  glutWireSphere(6.0, 8, 8);
-  glPopMatrix();
-  glColor4f(cubeColorG, cubeColorB, cubeColorR, 1.0f);
-  glPushMatrix();
-  glRotatef(cubeRotationC, 1.0f, 0.0f, 0.0f);
-  glutWireSphere(6.0, 8, 8);
-  glPopMatrix();
-  glLineWidth(1.0f); */
-  glBlendFunc(GL_SRC_COLOR, GL_DST_COLOR);
-
-  for (int i = 0; i < trackNames.size(); i++) {
-    glPushMatrix();
-
-    // basic display
-    effName = trackNames[i];
-
-    int tmpBufferHead = getTmpBufferHead(effName);
-    trackable color = getColors(effName);
-
-    if (trackHistory[effName][tmpBufferHead].z != 0) {
-      glTranslatef(trackHistory[effName][tmpBufferHead].x,
-        trackHistory[effName][tmpBufferHead].y,
-        trackHistory[effName][tmpBufferHead].z);
-      glColor3f(color.x, color.y, color.z);
-      glutSolidSphere(0.1, 12, 12);
-      glPopMatrix();
-    }
-    // display afterimages (trail)
-    float runningSize = 0.1f;
-    float runningAlpha = 1.0f;
-    if (afterImages[effName].size() == numAfterImages) {
-      for (int a = 0; a < numAfterImages; a++) {
-        if (afterImages[effName][a].z != 0) {
-          glPushMatrix();
-          glTranslatef(afterImages[effName][a].x,
-            afterImages[effName][a].y,
-            afterImages[effName][a].z);
-          glColor4f(color.x, color.y, color.z, runningAlpha);
-          glutSolidSphere(runningSize, 8, 8);
-          glPopMatrix();
-          runningSize -= 0.005f;
-          runningAlpha -= 0.05f;
-        }
-      }
-    }
-  } // end loop thru trackNames
-
-  // draw lines
-  for (int t = 0; t < trackNames.size(); t++) {
-    effName = trackNames[t];
-    for (int i = 0; i < lines[effName].size(); i++) {
-      myline cline = lines[effName][i];
-      float lineWidth = (cline.y1 + 2) * LINE_THICKNESS * 1.5f;
-      glLineWidth(lineWidth);
-      glColor3f(cline.r, cline.g, cline.b);
-      glBegin(GL_LINES);
-      glVertex3f(cline.x1, cline.y1, cline.z1);
-      glVertex3f(cline.x2, cline.y2, cline.z2);
-      glEnd();
-    } // end loop thru lines
+  renderScene();
+  profileFrame();
+  if (profileOverlay) drawProfileOverlay();
+
+  // swap on the same boundaries of the master's clock as every other tile;
+  // without genlock the displays' own refreshes still differ by up to a frame
+  if (swapPeriodNs > 0 && masterClock.synced) {
+    long long wait = swapPeriodNs - syncedNowNs(masterClock) % swapPeriodNs;
+    struct timespec ts;
+    ts.tv_sec = wait / 1000000000LL;
+    ts.tv_nsec = wait % 1000000000LL;
+    nanosleep(&ts, NULL);
   }
-
-  // display particles
-  /*for (int i = particles.size() - 1; i >= 0; i--) {
-    particles[i].colorA -= 0.0025f;
-    if (particles[i].colorA <= 0) particles.erase(particles.begin() + i);
-    else {
-      particles[i].x += particles[i].x_vel;
-      particles[i].y += particles[i].y_vel;
-      particles[i].z += particles[i].z_vel;
-      glPushMatrix();
-      glTranslatef(particles[i].x, particles[i].y, particles[i].z);
-      glColor4f(particles[i].colorR, particles[i].colorG,
-        particles[i].colorB, particles[i].colorA);
-      glutSolidCube(0.07);
-      glPopMatrix();
-    }
-  } */
-
   glutSwapBuffers();
   glutPostRedisplay();
 }
 
+// ***HEADLESS***
+// Renders a recorded session into an EGL pbuffer at the tile resolution
+// instead of a window, so the render path can be profiled on machines
+// without the wall's X displays (software Mesa is fine). The recording is
+// fed through the same ingest path as the network, a fixed number of lines
+// per frame, and frame times and peak resident memory are reported at the
+// end.
+
+int runHeadless(const char *recording, int linesPerFrame, const char *dumpFile) {
+  offscreenContext ctx = createOffscreenContext(windowWidth, windowHeight);
+  printf("Headless: %s, %s, %dx%d\n", glGetString(GL_RENDERER), glGetString(GL_VERSION),
+    windowWidth, windowHeight);
+  initGL();
+
+  ifstream inputFile(recording);
+  if (!inputFile.is_open()) {
+    printf("Unable to open %s\n", recording);
+    return 1;
+  }
+  string line;
+  vector<double> frameTimes;
+  int totalLines = 0;
+  while (inputFile.good()) {
+    for (int i = 0; i < linesPerFrame && getline(inputFile, line); i++) {
+      arrivalNs = realtimeNs();
+      handlePacket(line.c_str(), line.length());
+      flushStaged(true);
+      totalLines++;
+    }
+    double start = nowMs();
+    renderScene();
+    glFinish();
+    frameTimes.push_back(nowMs() - start);
+    profileFrame();
+  }
+  if (frameTimes.empty()) return 1;
+
+  vector<double> sorted(frameTimes);
+  sort(sorted.begin(), sorted.end());
+  double total = 0;
+  for (int i = 0; i < sorted.size(); i++) total += sorted[i];
+  size_t strokes = scene->strokeCount();
+  strokePoolStats pool;
+  scene->poolStats(pool);
+  struct rusage usage;  // peak resident memory, to weigh one --tiles slave against one per tile
+  getrusage(RUSAGE_SELF, &usage);
+  printf("{\"frames\":%d,\"tiles\":%d,\"lines\":%d,\"strokes\":%lu,\"mean_ms\":%.3f,\"p50_ms\":%.3f,"
+         "\"p95_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"last_ms\":%.3f,"
+         "\"pool_live\":%d,\"pool_used_mb\":%.2f,\"pool_budget_mb\":%.2f,\"pool_evicted\":%llu,"
+         "\"peak_rss_mb\":%.1f}\n",
+    (int)sorted.size(), (int)tiles.size(), totalLines, (unsigned long)strokes, total / sorted.size(),
+    sorted[sorted.size() / 2], sorted[sorted.size() * 95 / 100], sorted[sorted.size() * 99 / 100],
+    sorted.back(), frameTimes.back(), pool.live, pool.usedMB, pool.budgetMB, pool.evicted,
+    usage.ru_maxrss / 1024.0);
+  if (dumpFile) writePPM(dumpFile, windowWidth, windowHeight);
+
+  destroyOffscreenContext(ctx);
+  return 0;
+}
+
+// end of headless ////////////////////////////////////////////////////////////
+
 int main(int argc, char** argv) {
   if (argc < 7) {
-    printf("USAGE: GestureResponseSlave left right bottom top num_tracked_objects simulation\n");
+    printf("USAGE: GestureResponseSlave left right bottom top num_tracked_objects simulation [options]\n");
+    printf("  --snapshot-from=host[:port]  catch up from a running slave's stroke buffer\n");
+    printf("  --snapshot-port=port         port to serve our stroke buffer on (0 = don't serve)\n");
+    printf("  --rcvbuf=bytes               UDP receive buffer size (default: system default)\n");
+    printf("  --group=address              join a multicast group, as a relay may send to one\n");
+    printf("  --nack=0                     don't ask the master to resend missing datagrams\n");
+    printf("  --shm=/name                  read from a master on this machine, started with shm:/name\n");
+    printf("  --swap-hz=n                  swap buffers n times a second, in step with the master's clock\n");
+    printf("  --predict=ms                 draw heads and stroke tips where they'll be when the frame is seen,\n");
+    printf("                               ms after it is swapped in (not in headless mode)\n");
+    printf("  --pool-mb=n                  memory for strokes; the oldest go once it fills (default %g)\n", STROKE_POOL_MB);
+    printf("  --hugepages=1                put the stroke pool on huge pages (see vm.nr_hugepages)\n");
+    printf("  --lod=0                      draw every line in full, however small it looks\n");
+    printf("  --fade=seconds               fade lines out over this long after they're drawn (default: never)\n");
+    printf("  --headless=recording         render a recording offscreen and report frame times\n");
+    printf("  --lines-per-frame=n          recording lines fed per headless frame (default 16)\n");
+    printf("  --dump=file.ppm              save the last headless frame\n");
+    printf("  --profile=file|udp:host:port export per-stage timings as JSON lines\n");
+    printf("  --profile-interval=ms        how often to export them (default 1000)\n");
+    printf("  --profile-overlay=1          also draw them on screen\n");
+    printf("  --tiles=l,r,b,t/l,r,b,t/...  draw several tiles side by side from one scene,\n");
+    printf("                               instead of the left right bottom top arguments\n");
     return 1;
   }
 
-  ortho_left = atof(argv[1]); //-5.0;
-  ortho_right = atof(argv[2]); //0.0;
-  ortho_bottom = atof(argv[3]); //-5.0;
-  ortho_top = atof(argv[4]); //5.0;
-  numTrackedObjects = atoi(argv[5]);
-  simulation = (strcmp(argv[6], "FALSE") != 0);
+  tileView tile;
+  tile.left = atof(argv[1]); //-5.0;
+  tile.right = atof(argv[2]); //0.0;
+  tile.bottom = atof(argv[3]); //-5.0;
+  tile.top = atof(argv[4]); //5.0;
+  tile.x = tile.y = 0;
+  tile.width = SCREEN_WIDTH;
+  tile.height = SCREEN_HEIGHT;
+  if (optionValue(argc, argv, "--tiles")) {
+    if (!parseTiles(optionValue(argc, argv, "--tiles"), SCREEN_WIDTH, SCREEN_HEIGHT, tiles)) {
+      printf("Bad --tiles; expected l,r,b,t/l,r,b,t/...\n");
+      return 1;
+    }
+  } else {
+    tiles.push_back(tile);
+  }
+  windowWidth = tiles.size() * SCREEN_WIDTH;
+  windowHeight = SCREEN_HEIGHT;
+  int numTrackedObjects = atoi(argv[5]);
+  bool simulation = (strcmp(argv[6], "FALSE") != 0);
+  scene = new SceneState(numTrackedObjects, simulation);
+  bool hugePages = optionValue(argc, argv, "--hugepages") != NULL && atoi(optionValue(argc, argv, "--hugepages")) != 0;
+  if (optionValue(argc, argv, "--pool-mb") || hugePages) {
+    double megabytes = optionValue(argc, argv, "--pool-mb") ? atof(optionValue(argc, argv, "--pool-mb")) : STROKE_POOL_MB;
+    scene->setPoolBudget(megabytes, hugePages);
+    if (hugePages && !scene->pool.onHugePages()) printf("WARNING: no huge pages to spare, asked for transparent ones instead\n");
+  }
   //if (!simulation) outputFile.open(argv[6]);
+  if (optionValue(argc, argv, "--lod")) lod.disabled = atoi(optionValue(argc, argv, "--lod")) == 0;
+  if (optionValue(argc, argv, "--fade")) lineStyle.fadeSeconds = atof(optionValue(argc, argv, "--fade"));
+  if (optionValue(argc, argv, "--snapshot-from")) snapshotSource = optionValue(argc, argv, "--snapshot-from");
+  if (optionValue(argc, argv, "--snapshot-port")) snapshotPort = atoi(optionValue(argc, argv, "--snapshot-port"));
+  if (optionValue(argc, argv, "--rcvbuf")) rcvbufSize = atoi(optionValue(argc, argv, "--rcvbuf"));
+  if (optionValue(argc, argv, "--nack")) retransmit = atoi(optionValue(argc, argv, "--nack")) != 0;
+  // the ring loses nothing unless we fall a whole ring behind, and by then
+  // the master has forgotten what we missed
+  if (optionValue(argc, argv, "--shm")) {
+    useShm = true;
+    retransmit = false;
+  }
+  // on the master's machine its clock is ours
+  if (useShm) referenceClock(masterClock);
+  else initClockSync(masterClock);
+  if (optionValue(argc, argv, "--swap-hz")) swapPeriodNs = (long long)(1e9 / atof(optionValue(argc, argv, "--swap-hz")));
+  if (optionValue(argc, argv, "--predict")) predictLeadNs = (long long)(atof(optionValue(argc, argv, "--predict")) * 1e6);
+  initReorderWindow(reorder, getpid() ^ (unsigned int)nowMs());
+  if (optionValue(argc, argv, "--profile")) {
+    int interval = 1000;
+    if (optionValue(argc, argv, "--profile-interval")) interval = atoi(optionValue(argc, argv, "--profile-interval"));
+    if (!profileInit(optionValue(argc, argv, "--profile"), interval)) perror("WARNING: profiling disabled");
+    profileSetClock(masterNowNs);
+  }
+  profileOverlay = optionValue(argc, argv, "--profile-overlay") != NULL && profilingEnabled;
+
+  if (optionValue(argc, argv, "--headless")) {
+    // recordings are fed faster than they were captured
+    predictLeadNs = -1;
+    timedSamples = false;
+    int linesPerFrame = 16;  // ~1 line/ms from the master at 60 frames/s
+    if (optionValue(argc, argv, "--lines-per-frame")) linesPerFrame = atoi(optionValue(argc, argv, "--lines-per-frame"));
+    return runHeadless(optionValue(argc, argv, "--headless"), linesPerFrame, optionValue(argc, argv, "--dump"));
+  }
 
   glutInit(&argc, argv);
   glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
-  glutInitWindowSize(SCREEN_WIDTH, SCREEN_HEIGHT);
+  glutInitWindowSize(windowWidth, windowHeight);
   glutInitWindowPosition(0, 0);
   glutCreateWindow("Gesture Responder Slave Node");
-  glShadeModel(GL_SMOOTH);
-  glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_COLOR, GL_DST_COLOR);
+  initGL();
   glutDisplayFunc(display);
 
-  // socket stuff
-  slen=sizeof(si_other);
-  if ((s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) error("ERROR socket");
-  memset((char *) &si_me, 0, sizeof(si_me));
-  si_me.sin_family = AF_INET;
-  si_me.sin_port = htons(PORT);
-  si_me.sin_addr.s_addr = htonl(INADDR_ANY);
-  if (bind(s, (struct sockaddr*)&si_me, sizeof(si_me)) == -1) error("ERROR bind");
+  // socket stuff, or the master's ring
+  if (useShm) {
+    if (!openShmRing(ring, optionValue(argc, argv, "--shm"))) error("ERROR opening the master's ring (is it running?)");
+  } else {
+    slen=sizeof(si_other);
+    if ((s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) error("ERROR socket");
+    memset((char *) &si_me, 0, sizeof(si_me));
+    si_me.sin_family = AF_INET;
+    si_me.sin_port = htons(PORT);
+    si_me.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(s, (struct sockaddr*)&si_me, sizeof(si_me)) == -1) error("ERROR bind");
+    if (rcvbufSize > 0 &&
+        setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbufSize, sizeof(rcvbufSize)) == -1 &&
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbufSize, sizeof(rcvbufSize)) == -1) {
+      perror("WARNING: can't set SO_RCVBUF");
+    }
+    if (optionValue(argc, argv, "--group")) {
+      struct ip_mreq join;
+      if (inet_aton(optionValue(argc, argv, "--group"), &join.imr_multiaddr) == 0) error("ERROR bad --group");
+      join.imr_interface.s_addr = htonl(INADDR_ANY);
+      if (setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &join, sizeof(join)) == -1) error("ERROR joining the group");
+    }
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    struct timeval tick;
+    tick.tv_sec = 0;
+    tick.tv_usec = NACK_TICK_MS * 1000;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof(tick));
+    int actualRcvbuf = 0;
+    socklen_t optlen = sizeof(actualRcvbuf);
+    getsockopt(s, SOL_SOCKET, SO_RCVBUF, &actualRcvbuf, &optlen);
+    printf("Receive buffer is %d bytes\n", actualRcvbuf);
+  }
 
   // listen for updates
-  if (pthread_create(&receiverThread, NULL, receiver, NULL) != 0) {
+  loadingSnapshot = !snapshotSource.empty();
+  if (pthread_create(&receiverThread, NULL, useShm ? shmReceiver : receiver, NULL) != 0) {
     perror("Can't start thread, terminating");
     return 1;
   }
 
+  // catch up with the rest of the wall before the first frame, then let
+  // later restarts catch up from us
+  if (loadingSnapshot) snapshotLoader();
+  if (snapshotPort != 0 && pthread_create(&snapshotThread, NULL, snapshotServer, NULL) != 0) {
+    perror("Can't start snapshot thread, terminating");
+    return 1;
+  }
+
   glutMainLoop();
 
   return 0;
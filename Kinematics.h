@@ -0,0 +1,171 @@
+// Per-object motion history and derivatives for the slave's scene
+// Author: James Walker jwwalker a+ mtu d0+ edu
+//
+// Each tracked object keeps a ring of its last KINEMATIC_HISTORY samples with
+// the times they were taken, so nothing assumes the samples are evenly
+// spaced or that every object reports every frame. Once a frame,
+// updateKinematics() works out every object's velocity, acceleration and jerk
+// at its newest sample from divided differences over the real time deltas.
+// The rings and the results are laid out an array per quantity with an
+// entry per object, so the update runs as a few straight loops over all
+// objects at once that the compiler can vectorize, and the colouring, line
+// width and prediction code read an object's motion by its index rather than
+// by looking its name up.
+
+#ifndef KINEMATICS_H
+#define KINEMATICS_H
+
+#include <math.h>
+#include <vector>
+
+const int KINEMATIC_HISTORY = 8;   // samples kept per object; a power of two
+
+typedef struct kinematics {
+  int numObjects;
+  // rings, KINEMATIC_HISTORY entries per object
+  std::vector<double> times;       // seconds
+  std::vector<float> positions[3];
+  std::vector<int> count;          // samples in each ring, up to KINEMATIC_HISTORY
+  std::vector<int> newest;         // slot of each ring's newest sample
+  // at each object's newest sample, from the last updateKinematics()
+  std::vector<float> velocity[3];  // scene units per second; zero until there are two samples
+  std::vector<float> acceleration[3];  // zero until there are three
+  std::vector<float> jerk[3];      // zero until there are four
+  std::vector<float> speed;
+  // scratch for the update: the newest four samples of every object, an
+  // array per sample back
+  std::vector<float> gaps[3];      // time from each sample to the one before it
+  std::vector<float> recent[4][3];
+  std::vector<float> depth[2];     // 1 where an object has a third, fourth sample
+} kinematics;
+
+inline void initKinematics(kinematics &k) {
+  k.numObjects = 0;
+}
+
+// Make room for another object; returns its index.
+inline int addKinematicObject(kinematics &k) {
+  int o = k.numObjects++;
+  k.times.resize(k.numObjects * KINEMATIC_HISTORY, 0);
+  for (int a = 0; a < 3; a++) {
+    k.positions[a].resize(k.numObjects * KINEMATIC_HISTORY, 0);
+    k.velocity[a].resize(k.numObjects, 0);
+    k.acceleration[a].resize(k.numObjects, 0);
+    k.jerk[a].resize(k.numObjects, 0);
+  }
+  k.count.resize(k.numObjects, 0);
+  k.newest.resize(k.numObjects, 0);
+  k.speed.resize(k.numObjects, 0);
+  for (int g = 0; g < 3; g++) k.gaps[g].resize(k.numObjects);
+  for (int s = 0; s < 4; s++) {
+    for (int a = 0; a < 3; a++) k.recent[s][a].resize(k.numObjects);
+  }
+  for (int d = 0; d < 2; d++) k.depth[d].resize(k.numObjects);
+  return o;
+}
+
+// Forget an object's history, so its motion isn't worked out across a gap.
+inline void resetKinematics(kinematics &k, int o) {
+  k.count[o] = 0;
+}
+
+// Note a sample of object o taken at time seconds. One at the same time as
+// the newest replaces it; one before it is ignored.
+inline void recordKinematics(kinematics &k, int o, const float position[3], double time) {
+  int slot = k.newest[o];
+  double *times = &k.times[o * KINEMATIC_HISTORY];
+  if (k.count[o] > 0 && time < times[slot]) return;
+  if (k.count[o] == 0 || time > times[slot]) {
+    slot = (slot + 1) & (KINEMATIC_HISTORY - 1);
+    if (k.count[o] < KINEMATIC_HISTORY) k.count[o]++;
+    k.newest[o] = slot;
+  }
+  times[slot] = time;
+  for (int a = 0; a < 3; a++) k.positions[a][o * KINEMATIC_HISTORY + slot] = position[a];
+}
+
+inline bool hasKinematics(const kinematics &k, int o) {
+  return k.count[o] > 0;
+}
+
+inline double newestTime(const kinematics &k, int o) {
+  return k.times[o * KINEMATIC_HISTORY + k.newest[o]];
+}
+
+inline void newestPosition(const kinematics &k, int o, float out[3]) {
+  for (int a = 0; a < 3; a++) out[a] = k.positions[a][o * KINEMATIC_HISTORY + k.newest[o]];
+}
+
+// Speed from object o's newest sample to one at position taken at time, or
+// -1 if there is no newest sample or it isn't older.
+inline float speedTo(const kinematics &k, int o, const float position[3], double time) {
+  if (k.count[o] == 0) return -1;
+  double gap = time - newestTime(k, o);
+  if (gap <= 0) return -1;
+  float last[3];
+  newestPosition(k, o, last);
+  float dx = position[0] - last[0], dy = position[1] - last[1], dz = position[2] - last[2];
+  return (float)(sqrt(dx * dx + dy * dy + dz * dz) / gap);
+}
+
+// Object o's samples oldest first, up to max of them, into times and
+// positions; returns how many.
+inline int kinematicHistory(const kinematics &k, int o, int max, double *times, float (*positions)[3]) {
+  int n = k.count[o] < max ? k.count[o] : max;
+  for (int i = 0; i < n; i++) {
+    int slot = (k.newest[o] - (n - 1 - i)) & (KINEMATIC_HISTORY - 1);
+    times[i] = k.times[o * KINEMATIC_HISTORY + slot];
+    for (int a = 0; a < 3; a++) positions[i][a] = k.positions[a][o * KINEMATIC_HISTORY + slot];
+  }
+  return n;
+}
+
+// Every object's derivatives at its newest sample. With p0 the newest sample
+// and h1..h3 the gaps back from it, the velocity is that of the parabola
+// through the newest three samples, the acceleration twice their second
+// divided difference and the jerk six times the third of the newest four;
+// each is zero until there are enough samples to define it.
+inline void updateKinematics(kinematics &k) {
+  int n = k.numObjects;
+  // gather the newest four samples of each object; missing ones repeat the
+  // oldest a second earlier, which keeps the differences finite, and are
+  // masked out below
+  for (int o = 0; o < n; o++) {
+    int c = k.count[o];
+    int slots[4];
+    for (int s = 0; s < 4; s++) slots[s] = (k.newest[o] - (s < c ? s : (c > 0 ? c - 1 : 0))) & (KINEMATIC_HISTORY - 1);
+    const double *times = &k.times[o * KINEMATIC_HISTORY];
+    for (int s = 0; s < 3; s++) {
+      k.gaps[s][o] = s + 1 < c ? (float)(times[slots[s]] - times[slots[s + 1]]) : 1.0f;
+    }
+    for (int s = 0; s < 4; s++) {
+      for (int a = 0; a < 3; a++) k.recent[s][a][o] = k.positions[a][o * KINEMATIC_HISTORY + slots[s]];
+    }
+    k.depth[0][o] = c >= 3;
+    k.depth[1][o] = c >= 4;
+  }
+  const float *h1 = &k.gaps[0][0], *h2 = &k.gaps[1][0], *h3 = &k.gaps[2][0];
+  const float *m3 = &k.depth[0][0], *m4 = &k.depth[1][0];
+  float *speed = &k.speed[0];
+  for (int o = 0; o < n; o++) speed[o] = 0;
+  for (int a = 0; a < 3; a++) {
+    const float *p0 = &k.recent[0][a][0], *p1 = &k.recent[1][a][0];
+    const float *p2 = &k.recent[2][a][0], *p3 = &k.recent[3][a][0];
+    float *v = &k.velocity[a][0], *acc = &k.acceleration[a][0], *j = &k.jerk[a][0];
+    for (int o = 0; o < n; o++) {
+      float d01 = (p0[o] - p1[o]) / h1[o];
+      float d12 = (p1[o] - p2[o]) / h2[o];
+      float d23 = (p2[o] - p3[o]) / h3[o];
+      float dd012 = m3[o] * (d01 - d12) / (h1[o] + h2[o]);
+      float dd123 = (d12 - d23) / (h2[o] + h3[o]);
+      float ddd = m4[o] * (dd012 - dd123) / (h1[o] + h2[o] + h3[o]);
+      v[o] = d01 + dd012 * h1[o];
+      acc[o] = 2 * dd012;
+      j[o] = 6 * ddd;
+      speed[o] += v[o] * v[o];
+    }
+  }
+  for (int o = 0; o < n; o++) speed[o] = sqrtf(speed[o]);
+}
+
+#endif
@@ -0,0 +1,160 @@
+// Allocation-free parser for the "Name~x~y~z" text protocol and recordings
+// Author: James Walker jwwalker a+ mtu d0+ edu
+
+#ifndef LINE_PARSER_H
+#define LINE_PARSER_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define FIELD_DELIM '~'
+#define MAX_LINE_FIELDS 8
+
+// A parsed line points into the caller's buffer; nothing is copied.
+typedef struct parsedLine {
+  const char *name;
+  int nameLen;
+  int numValues;                        // number of fields after the name
+  float values[MAX_LINE_FIELDS - 1];
+} parsedLine;
+
+// Record the offsets of every delimiter in p[0..len), stopping early at a NUL.
+// Returns the number of delimiters found (which may exceed maxPositions; only
+// the first maxPositions offsets are stored) and sets end to where the line
+// stops. Scans 16 bytes at a time where SSE2 is available.
+inline int scanDelimiters(const char *p, size_t len, int *positions, int maxPositions, size_t &end) {
+  int n = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i delim = _mm_set1_epi8(FIELD_DELIM);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(p + i));
+    unsigned int delimMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, delim));
+    unsigned int zeroMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+    if (zeroMask) delimMask &= (1u << __builtin_ctz(zeroMask)) - 1;
+    while (delimMask) {
+      if (n < maxPositions) positions[n] = i + __builtin_ctz(delimMask);
+      n++;
+      delimMask &= delimMask - 1;
+    }
+    if (zeroMask) {
+      end = i + __builtin_ctz(zeroMask);
+      return n;
+    }
+  }
+#endif
+  for (; i < len && p[i] != '\0'; i++) {
+    if (p[i] == FIELD_DELIM) {
+      if (n < maxPositions) positions[n] = i;
+      n++;
+    }
+  }
+  end = i;
+  return n;
+}
+
+// Parse a decimal float from [begin, end) with atof() semantics: leading
+// whitespace is skipped, trailing garbage is ignored and 0 is returned if
+// there is no number. Mantissas of up to 15 significant digits are exact in
+// a double and are scaled by an exact power of ten, so the single rounding
+// gives the same double strtod() would, and hence the same float as the old
+// (float)atof(). Anything else (more digits, large exponents, inf, nan)
+// falls back to strtod().
+inline float parseFloat(const char *begin, const char *end) {
+  static const double powersOf10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const char *p = begin;
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+  unsigned long long mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool sawDigit = false;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    sawDigit = true;
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      if (mantissa) digits++;
+    } else {
+      exponent++;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      sawDigit = true;
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        if (mantissa) digits++;
+        exponent--;
+      }
+    }
+  }
+  if (!sawDigit) {
+    if (p < end && (*p | 0x20) >= 'a' && (*p | 0x20) <= 'z') goto slowPath; // inf, nan
+    return 0.0f;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char *e = p + 1;
+    bool negativeExp = false;
+    if (e < end && (*e == '-' || *e == '+')) {
+      negativeExp = (*e == '-');
+      e++;
+    }
+    if (e < end && *e >= '0' && *e <= '9') {
+      int value = 0;
+      for (; e < end && *e >= '0' && *e <= '9'; e++) {
+        if (value < 10000) value = value * 10 + (*e - '0');
+      }
+      exponent += negativeExp ? -value : value;
+    }
+  }
+  if (exponent < -22 || exponent > 22 || digits > 15) goto slowPath;
+  {
+    double value = (double)mantissa;
+    if (exponent < 0) value /= powersOf10[-exponent];
+    else value *= powersOf10[exponent];
+    return negative ? -(float)value : (float)value;
+  }
+
+slowPath:
+  char copy[64];
+  size_t len = end - begin;
+  if (len > sizeof(copy) - 1) len = sizeof(copy) - 1;
+  memcpy(copy, begin, len);
+  copy[len] = '\0';
+  return (float)strtod(copy, NULL);
+}
+
+// Parse a "Name~v1~v2~...~vn" line of at most len bytes (or up to a NUL).
+// Field counting matches the old split(): a trailing empty field is not a
+// field. Returns false for lines without any delimiter (frame markers,
+// DUMMYDATA, blank lines) or with more than MAX_LINE_FIELDS fields.
+inline bool parseLine(const char *line, size_t len, parsedLine &out) {
+  int positions[MAX_LINE_FIELDS + 1];
+  size_t end;
+  int numDelims = scanDelimiters(line, len, positions, MAX_LINE_FIELDS + 1, end);
+  if (numDelims > MAX_LINE_FIELDS) return false;
+  if (numDelims > 0 && (size_t)positions[numDelims - 1] + 1 == end) numDelims--; // "a~b~" is two fields
+  if (numDelims == 0 || numDelims >= MAX_LINE_FIELDS) return false;
+  out.name = line;
+  out.nameLen = positions[0];
+  out.numValues = numDelims;
+  for (int f = 0; f < numDelims; f++) {
+    const char *fieldEnd = line + (f + 1 < numDelims ? positions[f + 1] : end);
+    out.values[f] = parseFloat(line + positions[f] + 1, fieldEnd);
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,98 @@
+// Smoothing and resampling of tracked positions before the master sends them
+// Author: James Walker jwwalker a+ mtu d0+ edu
+//
+// Each tracked object gets a One-Euro filter (Casiez, Roussel and Vogel,
+// CHI 2012): a low-pass filter whose cutoff rises with speed, so a still hand
+// loses its jitter while a fast one isn't dragged behind. The smoothed point
+// is only sent once it has moved RESAMPLE_DISTANCE from the last one sent,
+// which keeps a resting hand from filling the stroke buffer with noise.
+// Brief occlusions are bridged by carrying the filtered motion forward.
+
+#ifndef MOTION_FILTER_H
+#define MOTION_FILTER_H
+
+#include <math.h>
+
+// Motion filter variables **CUSTOMIZABLE**
+const float FILTER_MIN_CUTOFF = 1.0f;  // Cutoff frequency (Hz) for a still hand. Lower = steadier lines when
+                                       // moving slowly, but more lag.
+const float FILTER_BETA = 10.0f;       // How quickly the cutoff rises with speed (Hz per scene unit/second).
+                                       // Raise it if fast strokes lag behind the hand; lower it if they jitter.
+const float FILTER_DERIV_CUTOFF = 4.0f; // Cutoff (Hz) for the speed estimate itself; rarely needs changing.
+const float RESAMPLE_DISTANCE = 0.005f; // A new point is sent once the hand has moved this far (scene units)
+                                       // from the last one. 0 sends every frame.
+const float OCCLUSION_BRIDGE = 0.1f;   // Occlusions up to this long (seconds) are bridged with predicted positions,
+                                       // so a marker flickering out doesn't break the stroke. Longer ones end it.
+const float PREDICTION_DECAY = 0.05f;  // Time constant (seconds) with which a lost object's predicted speed dies
+                                       // away; hands rarely keep going in a straight line for long.
+
+typedef struct motionFilter {
+  bool primed;          // false until the first sample
+  double lastTime;      // seconds
+  float value[3];       // smoothed position
+  float deriv[3];       // smoothed velocity
+  bool sent;            // false until the first point is sent
+  float lastSent[3];
+} motionFilter;
+
+inline void resetMotionFilter(motionFilter &f) {
+  f.primed = false;
+  f.sent = false;
+}
+
+// Weight of the new sample in an exponential average with the given cutoff.
+inline float smoothingFactor(float dt, float cutoff) {
+  float tau = 1.0f / (2.0f * (float)M_PI * cutoff);
+  return 1.0f / (1.0f + tau / dt);
+}
+
+// Smooth raw (x, y, z) taken at time seconds into out. A sample at or before
+// the previous one's time (a repeated Vicon frame) leaves the filter as is.
+inline void filterPosition(motionFilter &f, const float raw[3], double time, float out[3]) {
+  if (!f.primed) {
+    for (int k = 0; k < 3; k++) {
+      f.value[k] = raw[k];
+      f.deriv[k] = 0;
+    }
+    f.primed = true;
+    f.lastTime = time;
+  } else if (time > f.lastTime) {
+    float dt = time - f.lastTime;
+    f.lastTime = time;
+    float derivAlpha = smoothingFactor(dt, FILTER_DERIV_CUTOFF);
+    float speed = 0;
+    for (int k = 0; k < 3; k++) {
+      float rawDeriv = (raw[k] - f.value[k]) / dt;
+      f.deriv[k] += derivAlpha * (rawDeriv - f.deriv[k]);
+      speed += f.deriv[k] * f.deriv[k];
+    }
+    float alpha = smoothingFactor(dt, FILTER_MIN_CUTOFF + FILTER_BETA * sqrtf(speed));
+    for (int k = 0; k < 3; k++) f.value[k] += alpha * (raw[k] - f.value[k]);
+  }
+  for (int k = 0; k < 3; k++) out[k] = f.value[k];
+}
+
+// Where the smoothed motion puts the object at time, by dead reckoning from
+// the last sample with a speed that decays by PREDICTION_DECAY. Only
+// meaningful once the filter is primed.
+inline void predictPosition(const motionFilter &f, double time, float out[3]) {
+  float dt = time - f.lastTime;
+  float reach = PREDICTION_DECAY * (1.0f - expf(-dt / PREDICTION_DECAY));
+  for (int k = 0; k < 3; k++) out[k] = f.value[k] + f.deriv[k] * reach;
+}
+
+// True if point should be sent: the first one, or once it is more than
+// distance from the last point sent, which it then becomes.
+inline bool resamplePosition(motionFilter &f, const float point[3], float distance) {
+  if (f.sent) {
+    float dx = point[0] - f.lastSent[0];
+    float dy = point[1] - f.lastSent[1];
+    float dz = point[2] - f.lastSent[2];
+    if (dx*dx + dy*dy + dz*dz <= distance * distance) return false;
+  }
+  for (int k = 0; k < 3; k++) f.lastSent[k] = point[k];
+  f.sent = true;
+  return true;
+}
+
+#endif
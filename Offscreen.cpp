@@ -0,0 +1,66 @@
+// Offscreen (EGL pbuffer) GL contexts for headless rendering and benchmarks
+// Author: James Walker jwwalker a+ mtu d0+ edu
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+
+#include <stdio.h>
+#include <vector>
+
+#include "Offscreen.h"
+
+using namespace std;
+
+void error(const char *msg);
+
+offscreenContext createOffscreenContext(int width, int height) {
+  offscreenContext ctx;
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  ctx.display = EGL_NO_DISPLAY;
+  if (getPlatformDisplay) ctx.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if (ctx.display == EGL_NO_DISPLAY) ctx.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  EGLint major, minor;
+  if (!eglInitialize(ctx.display, &major, &minor)) error("ERROR eglInitialize");
+  EGLint configAttribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint numConfigs;
+  if (!eglChooseConfig(ctx.display, configAttribs, &config, 1, &numConfigs) || numConfigs < 1) {
+    error("ERROR eglChooseConfig");
+  }
+  EGLint pbufferAttribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+  ctx.surface = eglCreatePbufferSurface(ctx.display, config, pbufferAttribs);
+  eglBindAPI(EGL_OPENGL_API);
+  ctx.context = eglCreateContext(ctx.display, config, EGL_NO_CONTEXT, NULL);
+  if (ctx.surface == EGL_NO_SURFACE || ctx.context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(ctx.display, ctx.surface, ctx.surface, ctx.context)) error("ERROR creating offscreen context");
+  return ctx;
+}
+
+void destroyOffscreenContext(offscreenContext &ctx) {
+  eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(ctx.display, ctx.context);
+  eglDestroySurface(ctx.display, ctx.surface);
+  eglTerminate(ctx.display);
+}
+
+void writePPM(const char *filename, int width, int height) {
+  vector<unsigned char> pixels(width * height * 3);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    perror("WARNING: can't write frame dump");
+    return;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  for (int row = height - 1; row >= 0; row--) fwrite(&pixels[row * width * 3], 1, width * 3, f);
+  fclose(f);
+}
@@ -0,0 +1,24 @@
+// Offscreen (EGL pbuffer) GL contexts for headless rendering and benchmarks
+// Author: James Walker jwwalker a+ mtu d0+ edu
+
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <EGL/egl.h>
+
+typedef struct offscreenContext {
+  EGLDisplay display;
+  EGLSurface surface;
+  EGLContext context;
+} offscreenContext;
+
+// Create a width x height desktop-GL pbuffer context and make it current.
+// Mesa's surfaceless platform is preferred, so no X server is needed.
+// Exits via error() if no context can be made.
+offscreenContext createOffscreenContext(int width, int height);
+void destroyOffscreenContext(offscreenContext &ctx);
+
+// Save the current read buffer as a binary PPM, top row first.
+void writePPM(const char *filename, int width, int height);
+
+#endif
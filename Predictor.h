@@ -0,0 +1,112 @@
+// Short-horizon prediction of tracked positions on the slave
+// Author: James Walker jwwalker a+ mtu d0+ edu
+//
+// A head sphere is drawn where the object's last sample put it, and by the
+// time the frame reaches the screen that sample is a network hop, a wait for
+// the next frame and the frame itself old. The predictor fits a quadratic in
+// time through the object's recent samples and carries the newest sample
+// forward at the fitted velocity (plus, if asked, the fitted acceleration)
+// to the time the frame will be seen. How far it may carry it is clamped:
+// the horizon and the step are capped, the step shrinks as the fit gets
+// worse at explaining the samples, and an object that has stopped reporting
+// (a resampling master sends nothing while a hand rests) is left where it
+// is. bench/PredictBench measures the error against a recording.
+
+#ifndef PREDICTOR_H
+#define PREDICTOR_H
+
+#include <math.h>
+
+#include "Kinematics.h"
+
+// Prediction variables **CUSTOMIZABLE**
+const int PREDICT_SAMPLES = 6;            // Recent samples the motion is fitted to, up to KINEMATIC_HISTORY. More is
+                                          // steadier but slower to notice a change of direction.
+const double PREDICT_WINDOW = 0.08;       // Samples older than this (seconds) than the newest are left out of the fit.
+const double PREDICT_MAX_HORIZON = 0.05;  // Furthest ahead (seconds) a position is carried. Hands change direction
+                                          // too often for a longer guess to beat the last sample.
+const double PREDICT_STALE = 0.03;        // An object whose newest sample is older than this (seconds) when the
+                                          // frame is built is drawn where it is; it has probably stopped.
+const float PREDICT_MAX_STEP = 0.1f;      // Furthest (scene units) a position is carried from its newest sample.
+const float PREDICT_NOISE = 0.01f;        // Fit residual (scene units, RMS) at which the step is halved; jittery or
+                                          // erratic motion is extrapolated less far.
+const float PREDICT_ACCELERATION = 0.0f;  // Weight of the fitted acceleration: 0 extrapolates at constant velocity,
+                                          // 1 at constant acceleration. On the recorded performances the
+                                          // acceleration of a hand changes too fast for it to help.
+
+// Where object o will be at time, from its history in kin. Returns false,
+// leaving out at the newest sample, if there is nothing to go on or the
+// object has gone quiet.
+inline bool predictMotion(const kinematics &kin, int o, double time, float out[3]) {
+  if (!hasKinematics(kin, o)) return false;
+  double times[PREDICT_SAMPLES];
+  float positions[PREDICT_SAMPLES][3];
+  int count = kinematicHistory(kin, o, PREDICT_SAMPLES, times, positions);
+  double t0 = times[count - 1];
+  for (int k = 0; k < 3; k++) out[k] = positions[count - 1][k];
+  double h = time - t0;
+  if (count < 2 || h <= 0 || h > PREDICT_STALE + PREDICT_MAX_HORIZON) return false;
+  if (h > PREDICT_MAX_HORIZON) h = PREDICT_MAX_HORIZON;
+
+  // least squares x(t) = c0 + c1 t + c2 t^2 with t relative to the newest
+  double s[5] = { 0, 0, 0, 0, 0 };  // sums of t^0 .. t^4
+  double r[3][3];                   // per axis, sums of x t^0 .. x t^2
+  for (int k = 0; k < 3; k++) r[k][0] = r[k][1] = r[k][2] = 0;
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    double t = times[i] - t0;
+    if (t < -PREDICT_WINDOW) continue;
+    double power = 1;
+    for (int e = 0; e < 5; e++, power *= t) s[e] += power;
+    for (int k = 0; k < 3; k++) {
+      double x = positions[i][k] - out[k];
+      r[k][0] += x;
+      r[k][1] += x * t;
+      r[k][2] += x * t * t;
+    }
+    n++;
+  }
+  if (n < 2) return false;
+  double velocity[3], acceleration[3] = { 0, 0, 0 };
+  double det = s[0] * (s[2] * s[4] - s[3] * s[3]) - s[1] * (s[1] * s[4] - s[3] * s[2]) + s[2] * (s[1] * s[3] - s[2] * s[2]);
+  bool quadratic = n >= 4 && fabs(det) > 1e-30;
+  double residual = 0;
+  for (int k = 0; k < 3; k++) {
+    double c[3];
+    if (quadratic) {  // Cramer's rule on the normal equations
+      c[0] = (r[k][0] * (s[2] * s[4] - s[3] * s[3]) - s[1] * (r[k][1] * s[4] - s[3] * r[k][2]) +
+              s[2] * (r[k][1] * s[3] - s[2] * r[k][2])) / det;
+      c[1] = (s[0] * (r[k][1] * s[4] - r[k][2] * s[3]) - r[k][0] * (s[1] * s[4] - s[3] * s[2]) +
+              s[2] * (s[1] * r[k][2] - r[k][1] * s[2])) / det;
+      c[2] = (s[0] * (s[2] * r[k][2] - s[3] * r[k][1]) - s[1] * (s[1] * r[k][2] - s[2] * r[k][1]) +
+              r[k][0] * (s[1] * s[3] - s[2] * s[2])) / det;
+    } else {  // a straight line
+      double d = s[0] * s[2] - s[1] * s[1];
+      if (fabs(d) < 1e-30) return false;
+      c[0] = (r[k][0] * s[2] - s[1] * r[k][1]) / d;
+      c[1] = (s[0] * r[k][1] - s[1] * r[k][0]) / d;
+      c[2] = 0;
+    }
+    velocity[k] = c[1];
+    acceleration[k] = 2 * c[2];
+    for (int i = 0; i < count; i++) {
+      double t = times[i] - t0;
+      if (t < -PREDICT_WINDOW) continue;
+      double e = positions[i][k] - out[k] - (c[0] + c[1] * t + c[2] * t * t);
+      residual += e * e;
+    }
+  }
+  residual = sqrt(residual / n);
+  double confidence = PREDICT_NOISE * PREDICT_NOISE / (PREDICT_NOISE * PREDICT_NOISE + residual * residual);
+  double step[3], length = 0;
+  for (int k = 0; k < 3; k++) {
+    step[k] = confidence * (velocity[k] * h + 0.5 * PREDICT_ACCELERATION * acceleration[k] * h * h);
+    length += step[k] * step[k];
+  }
+  length = sqrt(length);
+  double scale = length > PREDICT_MAX_STEP ? PREDICT_MAX_STEP / length : 1;
+  for (int k = 0; k < 3; k++) out[k] += step[k] * scale;
+  return true;
+}
+
+#endif
@@ -0,0 +1,169 @@
+// Hot-path profiling for the slave
+// Author: James Walker jwwalker a+ mtu d0+ edu
+
+#include "Profiler.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <algorithm>
+
+using namespace std;
+
+// Quarter-octave buckets from 1/16 us up to ~65 ms; percentiles are reported
+// as the bucket's upper edge, so they are within ~19% of the true value.
+#define BUCKETS_PER_OCTAVE 4
+#define NUM_BUCKETS 80
+#define MIN_BUCKET_US (1.0 / 16.0)
+
+typedef struct stageHistogram {
+  unsigned int buckets[NUM_BUCKETS];
+  unsigned long long totalNs;
+  unsigned long long maxNs;
+} stageHistogram;
+
+static const char *stageNames[NUM_PROFILE_STAGES] = {
+  "receive", "parse", "record", "avgdist", "spheres", "lines", "tiles", "ribbons", "lod", "frame", "lag", "transit"
+};
+
+bool profilingEnabled = false;
+
+static stageHistogram histograms[NUM_PROFILE_STAGES];
+static vector<pair<string, double> > gauges;
+static vector<string> summary;
+static FILE *exportFile = NULL;
+static int exportSocket = -1;
+static struct sockaddr_storage exportAddr;
+static socklen_t exportAddrLen = 0;
+static unsigned long long intervalNs = 1000000000ULL;
+static unsigned long long lastExport = 0;
+static long long (*exportClock)() = NULL;
+
+// Recorded from both the network and render threads, hence the atomics.
+void profileRecord(profileStage stage, unsigned long long ns) {
+  stageHistogram &h = histograms[stage];
+  double us = ns / 1000.0;
+  int bucket = 0;
+  if (us > MIN_BUCKET_US) bucket = (int)(log2(us / MIN_BUCKET_US) * BUCKETS_PER_OCTAVE);
+  if (bucket >= NUM_BUCKETS) bucket = NUM_BUCKETS - 1;
+  __sync_fetch_and_add(&h.buckets[bucket], 1);
+  __sync_fetch_and_add(&h.totalNs, ns);
+  unsigned long long seen = h.maxNs;
+  while (ns > seen && !__sync_bool_compare_and_swap(&h.maxNs, seen, ns)) seen = h.maxNs;
+}
+
+static double bucketUpperUs(int bucket) {
+  return MIN_BUCKET_US * pow(2.0, (bucket + 1) / (double)BUCKETS_PER_OCTAVE);
+}
+
+static double percentileUs(const stageHistogram &h, unsigned long long count, double fraction) {
+  unsigned long long target = (unsigned long long)ceil(count * fraction);
+  unsigned long long seen = 0;
+  for (int b = 0; b < NUM_BUCKETS; b++) {
+    seen += h.buckets[b];
+    if (seen >= target) return bucketUpperUs(b);
+  }
+  return bucketUpperUs(NUM_BUCKETS - 1);
+}
+
+bool profileInit(const char *destination, int intervalMs) {
+  if (strncmp(destination, "udp:", 4) == 0) {
+    string hostPort(destination + 4);
+    size_t colon = hostPort.rfind(':');
+    if (colon == string::npos) return false;
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(hostPort.substr(0, colon).c_str(), hostPort.substr(colon + 1).c_str(), &hints, &res) != 0) {
+      return false;
+    }
+    exportSocket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    memcpy(&exportAddr, res->ai_addr, res->ai_addrlen);
+    exportAddrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+    if (exportSocket == -1) return false;
+  } else {
+    exportFile = fopen(destination, "a");
+    if (exportFile == NULL) return false;
+  }
+  if (intervalMs > 0) intervalNs = intervalMs * 1000000ULL;
+  lastExport = profileNowNs();
+  profilingEnabled = true;
+  return true;
+}
+
+void profileSetClock(long long (*nowNs)()) {
+  exportClock = nowNs;
+}
+
+void profileGauge(const char *name, double value) {
+  for (int i = 0; i < gauges.size(); i++) {
+    if (gauges[i].first == name) {
+      gauges[i].second = value;
+      return;
+    }
+  }
+  gauges.push_back(make_pair(string(name), value));
+}
+
+void profileTick() {
+  if (!profilingEnabled) return;
+  unsigned long long now = profileNowNs();
+  if (now - lastExport < intervalNs) return;
+
+  char hostname[64] = "";
+  gethostname(hostname, sizeof(hostname) - 1);
+  string json;
+  char field[256];
+  struct timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  long long timeNs = exportClock ? exportClock() : wall.tv_sec * 1000000000LL + wall.tv_nsec;
+  snprintf(field, sizeof(field), "{\"host\":\"%s\",\"time_ms\":%.3f,\"interval_ms\":%.1f,\"stages\":{",
+    hostname, timeNs / 1e6, (now - lastExport) / 1e6);
+  json = field;
+  summary.clear();
+  for (int s = 0; s < NUM_PROFILE_STAGES; s++) {
+    // snapshot and reset; samples racing with this land in the next interval
+    stageHistogram h;
+    for (int b = 0; b < NUM_BUCKETS; b++) h.buckets[b] = __sync_lock_test_and_set(&histograms[s].buckets[b], 0);
+    h.totalNs = __sync_lock_test_and_set(&histograms[s].totalNs, 0);
+    h.maxNs = __sync_lock_test_and_set(&histograms[s].maxNs, 0);
+    unsigned long long count = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) count += h.buckets[b];
+    double meanUs = count ? h.totalNs / 1000.0 / count : 0;
+    double maxUs = h.maxNs / 1000.0;
+    double p50 = count ? min(percentileUs(h, count, 0.5), maxUs) : 0;
+    double p99 = count ? min(percentileUs(h, count, 0.99), maxUs) : 0;
+    snprintf(field, sizeof(field), "%s\"%s\":{\"count\":%llu,\"mean_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}",
+      s ? "," : "", stageNames[s], (unsigned long long)count, meanUs, p50, p99, maxUs);
+    json += field;
+    snprintf(field, sizeof(field), "%-8s %8llu  mean %9.1f us  p99 %9.1f us  max %9.1f us",
+      stageNames[s], (unsigned long long)count, meanUs, p99, maxUs);
+    summary.push_back(field);
+  }
+  json += "}";
+  for (int i = 0; i < gauges.size(); i++) {
+    snprintf(field, sizeof(field), ",\"%s\":%.6g", gauges[i].first.c_str(), gauges[i].second);
+    json += field;
+    snprintf(field, sizeof(field), "%-16s %.6g", gauges[i].first.c_str(), gauges[i].second);
+    summary.push_back(field);
+  }
+  json += "}\n";
+
+  if (exportFile) {
+    fputs(json.c_str(), exportFile);
+    fflush(exportFile);
+  } else if (exportSocket != -1) {
+    sendto(exportSocket, json.data(), json.size(), 0, (struct sockaddr*)&exportAddr, exportAddrLen);
+  }
+  lastExport = now;
+}
+
+const vector<string> &profileSummary() {
+  return summary;
+}
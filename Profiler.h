@@ -0,0 +1,76 @@
+// Hot-path profiling for the slave
+// Author: James Walker jwwalker a+ mtu d0+ edu
+//
+// Wrap a stage in PROFILE_SCOPE(stage) to time it. Samples go into a rolling
+// log-scale histogram per stage that is exported as one JSON line per interval
+// to a file or a UDP stats port, and can be drawn as a text overlay. When
+// profiling is off a scope costs one predictable branch and no clock reads.
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <time.h>
+#include <string>
+#include <vector>
+
+enum profileStage {
+  PROFILE_RECEIVE,     // handling one recvmmsg() batch, including lock wait
+  PROFILE_PARSE,       // parsing one packet
+  PROFILE_RECORD,      // line recording for one sample
+  PROFILE_AVGDIST,     // average-distance colouring, once per tracking frame
+  PROFILE_SPHERES,     // head spheres and trails
+  PROFILE_LINES,       // line submission for one tile
+  PROFILE_TILES,       // building every tile's line commands
+  PROFILE_RIBBONS,     // staging or uploading the ribbon segments that changed
+  PROFILE_LOD,         // tracking changed chunks and rebuilding their coarse levels
+  PROFILE_FRAME,       // all of renderScene()
+  PROFILE_LAG,         // from a datagram reaching the slave's socket to it being applied
+  PROFILE_TRANSIT,     // from the master sending a datagram to it reaching the slave's socket
+  NUM_PROFILE_STAGES
+};
+
+extern bool profilingEnabled;
+
+inline unsigned long long profileNowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void profileRecord(profileStage stage, unsigned long long ns);
+
+class ProfileScope {
+public:
+  ProfileScope(profileStage stage) : stage(stage), start(profilingEnabled ? profileNowNs() : 0) {}
+  ~ProfileScope() {
+    if (start) profileRecord(stage, profileNowNs() - start);
+  }
+private:
+  profileStage stage;
+  unsigned long long start;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(stage) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(stage)
+
+// destination is a filename or "udp:host:port". Returns false if it can't be
+// opened, in which case profiling stays off.
+bool profileInit(const char *destination, int intervalMs);
+
+// Where each export's time_ms comes from, in nanoseconds; by default this
+// machine's CLOCK_REALTIME. The slave passes the master's clock, so exports
+// from every tile line up.
+void profileSetClock(long long (*nowNs)());
+
+// Named values (packet counts, drops, ...) reported alongside the timings.
+void profileGauge(const char *name, double value);
+
+// Call once per frame; exports and resets the histograms when the interval
+// has elapsed.
+void profileTick();
+
+// Text for the on-screen overlay, refreshed at each export.
+const std::vector<std::string> &profileSummary();
+
+#endif
@@ -0,0 +1,161 @@
+// Wire protocol shared by GestureResponseMaster and GestureResponseSlave
+// Author: James Walker jwwalker a+ mtu d0+ edu
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Every datagram the master sends is prefixed with "<seq>|", where seq is a
+// 32-bit counter that starts at 1 and skips 0 when it wraps. Slaves use it to
+// line a state snapshot up with the live stream. Datagrams without the prefix
+// (older masters, hand-made test input) are accepted and reported as seq 0.
+#define SEQ_DELIM '|'
+
+// The master also stamps each datagram with the time it was first sent, as
+// "<seq>@<stamp>|", the stamp being microseconds on the master's clock
+// modulo SEND_STAMP_WRAP. A slave whose clock is synchronized with the
+// master's can tell from it how long the datagram took to reach it, across
+// relays and resends alike.
+#define STAMP_DELIM '@'
+const long long SEND_STAMP_WRAP = 1000000000LL;  // about 16 minutes
+
+// And with the run it belongs to, as "<seq>#<run>@<stamp>|", the run being
+// the second the master started modulo RUN_WRAP (never 0). A restarted master
+// counts from seq 1 again; the run tells a slave its datagrams are new ones
+// rather than repeats of the old run's, however few of those it had seen.
+#define RUN_DELIM '#'
+const unsigned int RUN_WRAP = 1 << 20;  // about 12 days
+
+// true if run a started after run b, allowing for wrap-around; 0 is no run
+inline bool runAfter(unsigned int a, unsigned int b) {
+  unsigned int d = (a - b) & (RUN_WRAP - 1);
+  return d != 0 && d < RUN_WRAP / 2;
+}
+
+// An object the cameras have lost is sent as "Name~occluded" in place of its
+// position: once when it goes and then every OCCLUSION_RESEND seconds, in
+// case a datagram is dropped. Slaves end its stroke there, so the next
+// position starts a new one. Recordings from before this marker use
+// "Name~0~0~0", which slaves treat the same way.
+#define OCCLUDED_FIELD "occluded"
+#define OCCLUSION_RESEND 0.25
+
+// Gestures reach the slaves as control messages, "!COMMAND~event" or
+// "!COMMAND~event~value", queued ahead of the frame's samples. event counts
+// up from 1 in each master run; every message goes out CONTROL_REPEATS times
+// in a row to ride out a dropped datagram, and slaves act on the first copy.
+#define CONTROL_PREFIX '!'
+#define CONTROL_REPEATS 3
+#define CONTROL_DRAW "!DRAW"        // value 1 to start drawing, 0 to stop
+#define CONTROL_CLEAR "!CLEAR"
+#define CONTROL_UNDO "!UNDO"
+#define CONTROL_PALETTE "!PALETTE"  // value is the palette to draw with
+#define CONTROL_ERASE "!ERASE"      // values are the scene x, y, z and radius
+#define CONTROL_LAYER "!LAYER"      // value is the layer new strokes go on
+#define CONTROL_SHOW "!SHOW"        // value is a bit mask of the layers to draw
+#define NUM_PALETTES 4
+#define NUM_LAYERS 4
+
+#define SNAPSHOT_PORT 25886  // TCP port a slave serves its stroke buffer on
+#define SNAPSHOT_MAGIC "GRSS"
+#define SNAPSHOT_VERSION 7
+#define SNAPSHOT_REQUEST "SNAPSHOT\n"
+#define SNAPSHOT_TIMEOUT_MS 5000  // a peer that stalls this long connecting, sending or receiving is given up on
+
+typedef struct snapshotHeader {
+  char magic[4];
+  unsigned int version;
+  unsigned int seq;             // last sequence number reflected in the snapshot
+  unsigned int rawSize;         // size of the payload once inflated
+  unsigned int compressedSize;  // size of the zlib stream that follows
+} snapshotHeader;
+
+inline unsigned int nextSeq(unsigned int seq) {
+  seq++;
+  if (seq == 0) seq = 1;
+  return seq;
+}
+
+inline unsigned int prevSeq(unsigned int seq) {
+  seq--;
+  if (seq == 0) seq--;
+  return seq;
+}
+
+// The sequence number n before seq, allowing for the skipped 0.
+inline unsigned int seqBefore(unsigned int seq, unsigned int n) {
+  unsigned int s = seq - n;
+  if (s == 0 || s > seq) s--;
+  return s;
+}
+
+// true if a comes after b, allowing for wrap-around
+inline bool seqAfter(unsigned int a, unsigned int b) {
+  return (int)(a - b) > 0;
+}
+
+inline int writeSeqHeader(char *buf, size_t size, unsigned int seq) {
+  return snprintf(buf, size, "%u%c", seq, SEQ_DELIM);
+}
+
+// The same with the master's run and a send stamp, from its clock in
+// nanoseconds.
+inline int writeSeqHeader(char *buf, size_t size, unsigned int seq, unsigned int run, long long sentNs) {
+  return snprintf(buf, size, "%u%c%u%c%lld%c", seq, RUN_DELIM, run, STAMP_DELIM, sentNs / 1000 % SEND_STAMP_WRAP,
+                  SEQ_DELIM);
+}
+
+// Returns a pointer to the payload following the header, or buf itself if the
+// datagram has no header. run is 0 and stamp -1 if the datagram doesn't carry
+// them.
+inline const char *readSeqHeader(const char *buf, unsigned int &seq, unsigned int &run, long long &stamp) {
+  const char *p = buf;
+  unsigned int value = 0;
+  seq = run = 0;
+  stamp = -1;
+  while (*p >= '0' && *p <= '9') {
+    value = value * 10 + (*p - '0');
+    p++;
+  }
+  if (p == buf) return buf;
+  unsigned int runValue = 0;
+  if (*p == RUN_DELIM) {
+    for (p++; *p >= '0' && *p <= '9'; p++) runValue = runValue * 10 + (*p - '0');
+  }
+  long long sent = -1;
+  if (*p == STAMP_DELIM) {
+    sent = 0;
+    for (p++; *p >= '0' && *p <= '9'; p++) sent = sent * 10 + (*p - '0');
+  }
+  if (*p == SEQ_DELIM) {
+    seq = value;
+    run = runValue;
+    stamp = sent;
+    return p + 1;
+  }
+  return buf;
+}
+
+inline const char *readSeqHeader(const char *buf, unsigned int &seq, long long &stamp) {
+  unsigned int run;
+  return readSeqHeader(buf, seq, run, stamp);
+}
+
+inline const char *readSeqHeader(const char *buf, unsigned int &seq) {
+  unsigned int run;
+  long long stamp;
+  return readSeqHeader(buf, seq, run, stamp);
+}
+
+// Microseconds from a send stamp to nowNs on the master's clock; negative
+// if the clocks disagree about which came first.
+inline long long stampAgeUs(long long stamp, long long nowNs) {
+  long long age = (nowNs / 1000 - stamp) % SEND_STAMP_WRAP;
+  if (age < 0) age += SEND_STAMP_WRAP;
+  if (age > SEND_STAMP_WRAP / 2) age -= SEND_STAMP_WRAP;
+  return age;
+}
+
+#endif
@@ -0,0 +1,364 @@
+// Relay nodes: a master that passes another master's stream on
+// Author: James Walker jwwalker a+ mtu d0+ edu
+//
+// A relay listens where a slave would, and sends every datagram it hears on
+// to its own broadcast or multicast group, byte for byte, so the sequence
+// numbers and the recording's timing lines reach the slaves behind it
+// unchanged. It forwards each datagram as soon as it arrives, in whatever
+// order, and leaves the reordering to the slaves. Those slaves NACK the relay
+// as they would a master: it resends what it still has and passes the NACK
+// on upstream for what it never heard, so each hop only recovers its own
+// losses. The time from a datagram reaching the relay's socket to its send
+// returning is the latency the hop adds. The relay also keeps its clock in
+// step with the node upstream and answers its slaves' clock sync requests in
+// the master's time.
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "Protocol.h"
+#include "Retransmit.h"
+#include "ClockSync.h"
+
+// Relay variables **CUSTOMIZABLE**
+const int RELAY_TICK_MS = 5;              // Longest the relay waits on the upstream socket before checking for NACKs.
+const double RELAY_DUPLICATE_WINDOW = 0.5;  // Seconds during which a datagram heard again (an upstream resend
+                                            // another node asked for) isn't passed on a second time.
+
+const int RELAY_BATCH = 64;               // datagrams per recvmmsg()/sendmmsg() call
+const int RELAY_PACKET = RESEND_PACKET;   // largest datagram, as BUFLEN in the master and slave
+const int LATENCY_BUCKETS = 500;          // 10 us each, so up to 5 ms; anything slower is counted in the last
+
+typedef struct latencyHistogram {
+  unsigned long buckets[LATENCY_BUCKETS];
+  unsigned long count;
+  unsigned long overBudget;     // took a millisecond or more
+  double total, max;            // seconds
+} latencyHistogram;
+
+typedef struct relayNode {
+  int upstream;                 // where the stream arrives; NACKs we can't serve go back out of it
+  struct sockaddr_in source;    // who the stream comes from
+  bool haveSource;
+  int downstream;               // what we send on, and hear our slaves' NACKs on
+  struct sockaddr_in group;
+  resendHistory history;        // everything passed on, for our own slaves
+  std::vector<double> heardAt;  // when each datagram in the history arrived, indexed the same way
+  unsigned int run;             // the master's run the history is from, or 0
+  unsigned long forwarded;
+  unsigned long duplicates;     // heard again and not passed on
+  unsigned long passedUp;       // NACK ranges sent upstream
+  clockSync clock;              // against the node upstream, so ultimately the master
+  latencyHistogram latency;
+} relayNode;
+
+inline void recordLatency(latencyHistogram &h, double seconds) {
+  int bucket = (int)(seconds * 1e5);
+  if (bucket < 0) bucket = 0;
+  if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+  h.buckets[bucket]++;
+  h.count++;
+  h.total += seconds;
+  if (seconds > h.max) h.max = seconds;
+  if (seconds >= 0.001) h.overBudget++;
+}
+
+// The latency below which the given fraction of datagrams fell, to the
+// nearest bucket, in seconds.
+inline double latencyPercentile(const latencyHistogram &h, double fraction) {
+  unsigned long target = (unsigned long)(h.count * fraction);
+  unsigned long seen = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += h.buckets[b];
+    if (seen > target) return (b + 1) * 1e-5;
+  }
+  return h.max;
+}
+
+// Listen on "[group:]port", joining the multicast group if there is one, and
+// send on to groupAddr:groupPort, which may be a broadcast or multicast
+// address. Returns false, with errno set, if a socket can't be set up.
+inline bool openRelay(relayNode &r, const char *listen, const char *groupAddr, int groupPort) {
+  memset(&r.latency, 0, sizeof(r.latency));
+  r.forwarded = r.duplicates = r.passedUp = 0;
+  r.haveSource = false;
+  initResendHistory(r.history);
+  r.heardAt.assign(RESEND_HISTORY, 0);
+  r.run = 0;
+  initClockSync(r.clock);
+
+  char listenGroup[64] = "";
+  int listenPort;
+  const char *colon = strrchr(listen, ':');
+  if (colon != NULL) {
+    snprintf(listenGroup, sizeof(listenGroup), "%.*s", (int)(colon - listen), listen);
+    listenPort = atoi(colon + 1);
+  } else {
+    listenPort = atoi(listen);
+  }
+
+  if ((r.upstream = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) return false;
+  int one = 1;
+  setsockopt(r.upstream, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in me;
+  memset(&me, 0, sizeof(me));
+  me.sin_family = AF_INET;
+  me.sin_port = htons(listenPort);
+  me.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(r.upstream, (struct sockaddr*)&me, sizeof(me)) == -1) return false;
+  if (listenGroup[0] != '\0') {
+    struct ip_mreq join;
+    if (inet_aton(listenGroup, &join.imr_multiaddr) == 0) {
+      errno = EINVAL;
+      return false;
+    }
+    join.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(r.upstream, IPPROTO_IP, IP_ADD_MEMBERSHIP, &join, sizeof(join)) == -1) return false;
+  }
+  setsockopt(r.upstream, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+  struct timeval tick;
+  tick.tv_sec = 0;
+  tick.tv_usec = RELAY_TICK_MS * 1000;
+  setsockopt(r.upstream, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof(tick));
+
+  if ((r.downstream = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) return false;
+  setsockopt(r.downstream, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+  memset(&r.group, 0, sizeof(r.group));
+  r.group.sin_family = AF_INET;
+  r.group.sin_port = htons(groupPort);
+  if (inet_aton(groupAddr, &r.group.sin_addr) == 0) {
+    errno = EINVAL;
+    return false;
+  }
+  if (IN_MULTICAST(ntohl(r.group.sin_addr.s_addr))) {
+    unsigned char ttl = 1;  // one hop; a further relay takes it from there
+    setsockopt(r.downstream, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+  } else {
+    setsockopt(r.downstream, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+  }
+  return true;
+}
+
+// Run the calling thread ahead of ordinary work, so that a datagram isn't
+// held up behind whatever else shares the relay's cores. Returns false
+// without the privilege (CAP_SYS_NICE or an rtprio limit).
+inline bool relayRealtime() {
+  struct sched_param param;
+  param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+  return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+}
+
+inline void closeRelay(relayNode &r) {
+  close(r.upstream);
+  close(r.downstream);
+}
+
+inline double realtimeSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Send count datagrams to the group in as few calls as the kernel allows.
+inline bool sendToGroup(relayNode &r, struct mmsghdr *msgs, int count) {
+  for (int sent = 0; sent < count; ) {
+    int n = sendmmsg(r.downstream, msgs + sent, count - sent, 0);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// Resend what our slaves have asked for, ask upstream for what we never
+// had, and answer clock sync requests once we're synced ourselves. Returns
+// false on a socket error.
+inline bool serveRelaySlaves(relayNode &r) {
+  char request[64];
+  char control[CMSG_SPACE(sizeof(struct timespec))];
+  struct sockaddr_in slave;
+  struct iovec iov;
+  struct msghdr msg;
+  while (true) {
+    iov.iov_base = request;
+    iov.iov_len = sizeof(request) - 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &slave;
+    msg.msg_namelen = sizeof(slave);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(r.downstream, &msg, MSG_DONTWAIT);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      return false;
+    }
+    request[n] = '\0';
+    long long t1;
+    if (parseSyncRequest(request, t1)) {
+      if (!r.clock.synced) continue;  // the slave will ask again
+      char reply[96];
+      long long arrived = syncedNs(r.clock, arrivalTimeNs(&msg, localClockNs()));
+      int len = writeSyncReply(reply, sizeof(reply), t1, arrived, syncedNowNs(r.clock));
+      sendto(r.downstream, reply, len, 0, (struct sockaddr*)&slave, sizeof(slave));
+      continue;
+    }
+    unsigned int first;
+    int count;
+    if (!parseNack(request, first, count)) continue;
+    r.history.nacks++;
+    double now = retransmitClock();
+    if (count > RESEND_HISTORY) count = RESEND_HISTORY;
+    struct mmsghdr msgs[RELAY_BATCH];
+    struct iovec iovecs[RELAY_BATCH];
+    int queued = 0;
+    unsigned int missingFirst = 0;
+    int missingCount = 0;
+    for (unsigned int seq = first; count > 0; seq = nextSeq(seq), count--) {
+      bool had = r.history.packets[seq % RESEND_HISTORY].seq == seq;
+      const sentPacket *p = packetToResend(r.history, seq, now);
+      if (p != NULL) {
+        memset(&msgs[queued], 0, sizeof(msgs[queued]));
+        iovecs[queued].iov_base = (void*)p->data;
+        iovecs[queued].iov_len = p->len;
+        msgs[queued].msg_hdr.msg_iov = &iovecs[queued];
+        msgs[queued].msg_hdr.msg_iovlen = 1;
+        msgs[queued].msg_hdr.msg_name = &r.group;
+        msgs[queued].msg_hdr.msg_namelen = sizeof(r.group);
+        if (++queued == RELAY_BATCH) {
+          if (!sendToGroup(r, msgs, queued)) return false;
+          queued = 0;
+        }
+      }
+      if (!had) {
+        if (missingCount == 0) missingFirst = seq;
+        missingCount++;
+      }
+      if (missingCount > 0 && (had || count == 1)) {
+        // we never heard these either
+        if (r.haveSource) {
+          char nack[64];
+          int len = writeNack(nack, sizeof(nack), missingFirst, missingCount);
+          sendto(r.upstream, nack, len, 0, (struct sockaddr*)&r.source, sizeof(r.source));
+          r.passedUp++;
+        }
+        missingCount = 0;
+      }
+    }
+    if (queued > 0 && !sendToGroup(r, msgs, queued)) return false;
+  }
+}
+
+// Wait up to RELAY_TICK_MS for datagrams from upstream and pass on what
+// arrives, then serve our slaves' requests. Returns the number of datagrams
+// passed on, or -1 on a socket error.
+inline int relayPackets(relayNode &r) {
+  char bufs[RELAY_BATCH][RELAY_PACKET + 1];
+  char controls[RELAY_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+  struct sockaddr_in senders[RELAY_BATCH];
+  struct mmsghdr msgs[RELAY_BATCH];
+  struct iovec iovecs[RELAY_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < RELAY_BATCH; i++) {
+    iovecs[i].iov_base = bufs[i];
+    iovecs[i].iov_len = RELAY_PACKET;
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = controls[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    msgs[i].msg_hdr.msg_name = &senders[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+  }
+  int n = recvmmsg(r.upstream, msgs, RELAY_BATCH, MSG_WAITFORONE, NULL);
+  if (n == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+    n = 0;
+  }
+
+  // pass on everything new at once, with the same buffers
+  struct mmsghdr out[RELAY_BATCH];
+  struct iovec outIovecs[RELAY_BATCH];
+  double arrived[RELAY_BATCH];
+  int numOut = 0;
+  double now = retransmitClock();
+  for (int i = 0; i < n; i++) {
+    unsigned int seq;
+    bufs[i][msgs[i].msg_len] = '\0';
+    long long arrivedNs = arrivalTimeNs(&msgs[i].msg_hdr, -1);
+    long long t1, t2, t3;
+    if (bufs[i][0] == SYNC_REPLY[0] && parseSyncReply(bufs[i], t1, t2, t3)) {
+      // the answer to our own clock sync request, not for passing on
+      addSyncReply(r.clock, t1, t2, t3, arrivedNs >= 0 ? arrivedNs : localClockNs());
+      continue;
+    }
+    unsigned int run;
+    long long stamp;
+    readSeqHeader(bufs[i], seq, run, stamp);
+    if (run != 0 && r.run != 0 && run != r.run) {
+      if (!runAfter(run, r.run)) {  // a straggler from before the master restarted
+        r.duplicates++;
+        continue;
+      }
+      // the master has restarted, so what we kept is of no use to our slaves
+      initResendHistory(r.history);
+      r.heardAt.assign(RESEND_HISTORY, 0);
+    }
+    if (run != 0) r.run = run;
+    if (seq != 0) {
+      const sentPacket &p = r.history.packets[seq % RESEND_HISTORY];
+      if (p.seq == seq && now - r.heardAt[seq % RESEND_HISTORY] < RELAY_DUPLICATE_WINDOW) {
+        r.duplicates++;
+        continue;
+      }
+      rememberPacket(r.history, seq, bufs[i], msgs[i].msg_len);
+      r.heardAt[seq % RESEND_HISTORY] = now;
+    }
+    arrived[numOut] = arrivedNs >= 0 ? arrivedNs / 1e9 : -1;
+    memset(&out[numOut], 0, sizeof(out[numOut]));
+    outIovecs[numOut].iov_base = bufs[i];
+    outIovecs[numOut].iov_len = msgs[i].msg_len;
+    out[numOut].msg_hdr.msg_iov = &outIovecs[numOut];
+    out[numOut].msg_hdr.msg_iovlen = 1;
+    out[numOut].msg_hdr.msg_name = &r.group;
+    out[numOut].msg_hdr.msg_namelen = sizeof(r.group);
+    numOut++;
+  }
+  if (n > 0) {
+    r.source = senders[n - 1];
+    r.haveSource = true;
+  }
+  if (numOut > 0) {
+    if (!sendToGroup(r, out, numOut)) return -1;
+    double sent = realtimeSeconds();
+    for (int i = 0; i < numOut; i++) {
+      if (arrived[i] >= 0) recordLatency(r.latency, sent - arrived[i]);
+    }
+    r.forwarded += numOut;
+  }
+  if (r.haveSource && syncDue(r.clock)) {
+    char request[64];
+    int len = writeSyncRequest(request, sizeof(request), localClockNs());
+    sendto(r.upstream, request, len, 0, (struct sockaddr*)&r.source, sizeof(r.source));
+  }
+  if (!serveRelaySlaves(r)) return -1;
+  return numOut;
+}
+
+#endif
@@ -0,0 +1,292 @@
+// Recovery of dropped datagrams, for the master and the slaves
+// Author: James Walker jwwalker a+ mtu d0+ edu
+//
+// Strokes are permanent, so a datagram one tile misses leaves a hole that its
+// neighbours don't have. The master keeps the last RESEND_HISTORY datagrams it
+// sent. A slave that sees a gap in the sequence numbers holds back what
+// follows it and, after a short random delay, asks the master for the missing
+// range with a NACK. The master sends each missing datagram again, exactly as
+// it was, to the whole wall, but no more than once per RESEND_HOLDOFF however
+// many tiles ask; a tile that sees the resend before its own delay is up
+// never asks. A gap still open after NACK_GIVE_UP seconds is skipped, so one
+// datagram lost for good can't hold a tile up. Datagrams from a newer run of
+// the master start the window again; ones from an older run are dropped.
+
+#ifndef RETRANSMIT_H
+#define RETRANSMIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "Protocol.h"
+
+// Retransmission variables **CUSTOMIZABLE**
+const int RESEND_HISTORY = 4096;     // Datagrams the master keeps for resending, about 4 seconds of a live
+                                     // performance. A NACK for anything older goes unanswered.
+const double RESEND_HOLDOFF = 0.02;  // Seconds after resending a datagram during which the master ignores further
+                                     // NACKs for it, so the tiles that asked at the same time get one resend.
+const int REORDER_WINDOW = 1024;     // Datagrams a slave can hold back behind a gap. A gap further back than this
+                                     // is skipped at once. Must be a power of two.
+const double NACK_DELAY = 0.004;     // A slave waits a random time up to this long (seconds) before asking for a
+                                     // missing datagram, so that if every tile missed it, one asks and the rest
+                                     // see the resend. Should be a few times the network's round trip.
+const double NACK_RETRY = 0.03;      // Seconds between NACKs for a datagram that still hasn't come.
+const double NACK_GIVE_UP = 0.25;    // Seconds after which a missing datagram is skipped. The tile draws nothing
+                                     // newer than the gap for this long, so keep it short.
+
+const int RESEND_PACKET = 512;       // largest datagram kept, as BUFLEN in the master and slave
+const int NACK_MAX_RANGES = 16;      // ranges a slave asks for in one service
+
+// Slaves send NACKs as "NACK~first~count" to the address the datagrams came
+// from.
+#define NACK_COMMAND "NACK"
+
+inline double retransmitClock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// How many sequence numbers after b a comes, allowing for the skipped 0.
+inline int seqDistance(unsigned int a, unsigned int b) {
+  int d = (int)(a - b);
+  if (d > 0 && a < b) d--;
+  else if (d < 0 && a > b) d++;
+  return d;
+}
+
+inline int writeNack(char *buf, size_t size, unsigned int first, int count) {
+  return snprintf(buf, size, NACK_COMMAND "~%u~%d", first, count);
+}
+
+inline bool parseNack(const char *buf, unsigned int &first, int &count) {
+  return sscanf(buf, NACK_COMMAND "~%u~%d", &first, &count) == 2 && first != 0 && count > 0;
+}
+
+// ***MASTER***
+
+typedef struct sentPacket {
+  unsigned int seq;     // 0 while the slot is empty
+  int len;
+  double resent;        // when it was last resent, or -1
+  char data[RESEND_PACKET];
+} sentPacket;
+
+typedef struct resendHistory {
+  std::vector<sentPacket> packets;  // indexed by seq % RESEND_HISTORY
+  unsigned long nacks;              // NACKs received
+  unsigned long resent;             // datagrams resent
+  unsigned long suppressed;         // asked for again within the holdoff
+  unsigned long expired;            // asked for after they'd left the history
+  unsigned long resentBytes;
+} resendHistory;
+
+inline void initResendHistory(resendHistory &h) {
+  h.packets.assign(RESEND_HISTORY, sentPacket());
+  for (int i = 0; i < RESEND_HISTORY; i++) h.packets[i].seq = 0;
+  h.nacks = h.resent = h.suppressed = h.expired = h.resentBytes = 0;
+}
+
+// Keep a copy of a datagram as it was sent, header and all.
+inline void rememberPacket(resendHistory &h, unsigned int seq, const char *data, int len) {
+  sentPacket &p = h.packets[seq % RESEND_HISTORY];
+  if (len > RESEND_PACKET) len = RESEND_PACKET;
+  p.seq = seq;
+  p.len = len;
+  p.resent = -1;
+  memcpy(p.data, data, len);
+}
+
+// The datagram to send again for seq, or NULL if it has gone or was resent
+// within the holdoff. Marks it resent.
+inline const sentPacket *packetToResend(resendHistory &h, unsigned int seq, double now) {
+  sentPacket &p = h.packets[seq % RESEND_HISTORY];
+  if (p.seq != seq) {
+    h.expired++;
+    return NULL;
+  }
+  if (p.resent >= 0 && now - p.resent < RESEND_HOLDOFF) {
+    h.suppressed++;
+    return NULL;
+  }
+  p.resent = now;
+  h.resent++;
+  h.resentBytes += p.len;
+  return &p;
+}
+
+// ***SLAVE***
+
+typedef struct heldPacket {
+  unsigned int seq;
+  int len;              // -1 while it's missing
+  double missedAt;      // when the gap was seen
+  double nackAt;        // when to ask for it next
+  char data[RESEND_PACKET + 1];
+} heldPacket;
+
+typedef struct nackRange {
+  unsigned int first;
+  int count;
+} nackRange;
+
+// Called with each datagram, header and all, in sequence order.
+typedef void (*packetSink)(void *context, unsigned int seq, const char *data, size_t len);
+
+typedef struct reorderWindow {
+  std::vector<heldPacket> slots;    // indexed by seq % REORDER_WINDOW
+  bool started;
+  unsigned int delivered;           // last seq handed on
+  unsigned int highest;             // newest seq seen
+  unsigned int run;                 // the master's run, or 0 until a datagram says
+  unsigned int seed;                // for the NACK delays, different on every tile
+  unsigned long missed;             // datagrams found missing
+  unsigned long recovered;          // of those, ones that came later
+  unsigned long lost;               // and ones skipped
+  unsigned long duplicates;         // including stragglers from an older run
+  unsigned long restarts;           // newer runs of the master seen
+  unsigned long nacks;              // NACKs sent
+  double recoveryTotal, recoveryMax;  // seconds from seeing a gap to filling it
+} reorderWindow;
+
+inline void initReorderWindow(reorderWindow &w, unsigned int seed) {
+  w.slots.assign(REORDER_WINDOW, heldPacket());
+  w.started = false;
+  w.delivered = w.highest = 0;
+  w.run = 0;
+  w.seed = seed;
+  w.missed = w.recovered = w.lost = w.duplicates = w.restarts = w.nacks = 0;
+  w.recoveryTotal = w.recoveryMax = 0;
+}
+
+// Hand on everything up to and including last, skipping what's still missing.
+inline void skipTo(reorderWindow &w, unsigned int last, packetSink sink, void *context) {
+  while (seqAfter(last, w.delivered)) {
+    w.delivered = nextSeq(w.delivered);
+    heldPacket &p = w.slots[w.delivered % REORDER_WINDOW];
+    if (seqAfter(w.delivered, w.highest)) w.missed++;  // never even seen to be missing
+    if (p.seq == w.delivered && p.len >= 0) sink(context, p.seq, p.data, p.len);
+    else w.lost++;
+  }
+  if (seqAfter(w.delivered, w.highest)) w.highest = w.delivered;
+}
+
+// Hand on the held datagrams that now follow on from the last one delivered.
+inline void deliverHeld(reorderWindow &w, packetSink sink, void *context) {
+  while (seqAfter(w.highest, w.delivered)) {
+    heldPacket &p = w.slots[nextSeq(w.delivered) % REORDER_WINDOW];
+    if (p.len < 0) break;
+    w.delivered = p.seq;
+    sink(context, p.seq, p.data, p.len);
+  }
+}
+
+// Hand on what the master's last run left held, then start again at seq.
+inline void restartWindow(reorderWindow &w, unsigned int seq, packetSink sink, void *context) {
+  skipTo(w, w.highest, sink, context);
+  w.delivered = w.highest = prevSeq(seq);
+}
+
+// Take a datagram with sequence number seq from the master's run (0 if it
+// doesn't say), passing it and any it was holding up to sink in order.
+// Returns false for a duplicate.
+inline bool acceptPacket(reorderWindow &w, unsigned int seq, unsigned int run, const char *data, size_t len,
+                         double now, packetSink sink, void *context) {
+  if (!w.started) {
+    w.started = true;
+    w.delivered = w.highest = prevSeq(seq);
+  }
+  if (run != 0 && w.run != 0 && run != w.run) {
+    if (!runAfter(run, w.run)) {
+      w.duplicates++;
+      return false;
+    }
+    restartWindow(w, seq, sink, context);
+    w.restarts++;
+  }
+  if (run != 0) w.run = run;
+  int ahead = seqDistance(seq, w.delivered);
+  if (ahead <= -REORDER_WINDOW) {
+    // far behind, from a master that doesn't say its run: it must have
+    // restarted, so start again from here
+    restartWindow(w, seq, sink, context);
+    w.restarts++;
+    ahead = 1;
+  } else if (ahead <= 0) {
+    w.duplicates++;
+    return false;
+  }
+  if (ahead == 1 && w.highest == w.delivered) {
+    // the usual case: nothing held, nothing missing
+    w.delivered = w.highest = seq;
+    sink(context, seq, data, len);
+    return true;
+  }
+  if (ahead >= REORDER_WINDOW) skipTo(w, seqBefore(seq, REORDER_WINDOW - 1), sink, context);
+  heldPacket &p = w.slots[seq % REORDER_WINDOW];
+  if (seqAfter(seq, w.highest)) {
+    // everything between the newest so far and this one is missing
+    for (unsigned int s = nextSeq(w.highest); s != seq; s = nextSeq(s)) {
+      heldPacket &gap = w.slots[s % REORDER_WINDOW];
+      gap.seq = s;
+      gap.len = -1;
+      gap.missedAt = now;
+      gap.nackAt = now + NACK_DELAY * rand_r(&w.seed) / RAND_MAX;
+      w.missed++;
+    }
+    w.highest = seq;
+  } else if (p.seq != seq || p.len >= 0) {
+    w.duplicates++;
+    return false;
+  } else {
+    double latency = now - p.missedAt;
+    w.recovered++;
+    w.recoveryTotal += latency;
+    if (latency > w.recoveryMax) w.recoveryMax = latency;
+  }
+  if (len > RESEND_PACKET) len = RESEND_PACKET;
+  p.seq = seq;
+  p.len = len;
+  memcpy(p.data, data, len);
+  p.data[len] = '\0';
+  deliverHeld(w, sink, context);
+  return true;
+}
+
+// Skip the gaps that have been open too long, and fill ranges with the
+// missing datagrams that are due to be asked for. Returns the number of
+// ranges, at most maxRanges.
+inline int serviceWindow(reorderWindow &w, double now, nackRange *ranges, int maxRanges,
+                         packetSink sink, void *context) {
+  while (seqAfter(w.highest, w.delivered)) {
+    heldPacket &front = w.slots[nextSeq(w.delivered) % REORDER_WINDOW];
+    if (front.len >= 0 || now - front.missedAt < NACK_GIVE_UP) break;
+    skipTo(w, front.seq, sink, context);
+    deliverHeld(w, sink, context);
+  }
+  int numRanges = 0;
+  unsigned int rangeEnd = 0;
+  for (unsigned int s = w.delivered; s != w.highest; ) {
+    s = nextSeq(s);
+    heldPacket &p = w.slots[s % REORDER_WINDOW];
+    if (p.len >= 0 || p.nackAt > now) continue;
+    if (numRanges > 0 && nextSeq(rangeEnd) == s) {
+      ranges[numRanges - 1].count++;
+    } else if (numRanges < maxRanges) {
+      ranges[numRanges].first = s;
+      ranges[numRanges].count = 1;
+      numRanges++;
+    } else {
+      break;
+    }
+    rangeEnd = s;
+    p.nackAt = now + NACK_RETRY;
+  }
+  w.nacks += numRanges;
+  return numRanges;
+}
+
+#endif
@@ -0,0 +1,1228 @@
+// GL drawing of a SceneState frame
+// Author: James Walker jwwalker a+ mtu d0+ edu
+
+#define GL_GLEXT_PROTOTYPES  // vertex buffer objects (GL 1.5), shaders (2.0), geometry shaders (3.2), instanced arrays (3.3)
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "SceneRenderer.h"
+#include "Profiler.h"
+
+// Camera shared by every tile; each tile only changes the frustum.
+static const double cameraEye[3] = { 0, 4, 1 };
+static const double cameraCenter[3] = { 0, 0, 1 };
+static const double cameraUp[3] = { 0, 0, 1 };
+static const float sceneOffset[3] = { 0.0f, 3.5f, 0.0f };
+static const double nearPlane = 0.1;
+static const double farPlane = 5000;
+
+strokeStyle lineStyle = {
+  LINE_THICKNESS, STROKE_SPEED_WIDTH, STROKE_MIN_WIDTH, STROKE_MAX_WIDTH, STROKE_SPEED_GLOW, STROKE_FADE_SECONDS
+};
+
+static void buildStrokeShaders();
+
+void initGL() {
+  glShadeModel(GL_SMOOTH);
+  glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_COLOR, GL_DST_COLOR);
+  buildStrokeShaders();
+}
+
+float cubeRotationA = 0.0f;
+float cubeRotationB = 0.0f;
+float cubeRotationC = 0.0f;
+float cubeColorR = 0.3f;
+float cubeColorG = 0.6f;
+float cubeColorB = 0.9f;
+
+GLUquadric *sphereQuadric = NULL;
+
+// Same tessellation as glutSolidSphere(), but through GLU so that it also
+// works in headless mode where GLUT is never initialised.
+void drawSphere(double radius, int slices, int stacks) {
+  if (sphereQuadric == NULL) sphereQuadric = gluNewQuadric();
+  gluSphere(sphereQuadric, radius, slices, stacks);
+}
+
+// A line's width in pixels: the thickness scaled by how high it is, as the
+// wall has always drawn it, and by how fast the hand was moving. The
+// shader works it out the same way.
+static inline float lineWidth(float y1, float speed) {
+  float factor = 1 + lineStyle.speedWidth * speed;
+  if (factor < lineStyle.minWidth) factor = lineStyle.minWidth;
+  if (factor > lineStyle.maxWidth) factor = lineStyle.maxWidth;
+  float width = (y1 + 2) * lineStyle.thickness * 1.5f * factor;
+  return width < 1 ? 1 : width;
+}
+
+// The widest a line starting this high can be, whatever its speed.
+static inline float widestLineAt(float y) {
+  float width = (y + 2) * lineStyle.thickness * 1.5f * lineStyle.maxWidth;
+  return width < 1 ? 1 : width;
+}
+
+// ***TILES***
+// Command building only reads the frame and writes its own tileCommands, so
+// tiles are built in parallel; only the GL submission is serial.
+
+// The rows of projection * modelview as drawTile() sets them up, so lines
+// can be culled without a GL context.
+static void tileMatrix(const tileView &tile, double m[4][4]) {
+  double f[3], s[3], u[3];
+  for (int i = 0; i < 3; i++) f[i] = cameraCenter[i] - cameraEye[i];
+  double len = sqrt(f[0]*f[0] + f[1]*f[1] + f[2]*f[2]);
+  for (int i = 0; i < 3; i++) f[i] /= len;
+  s[0] = f[1]*cameraUp[2] - f[2]*cameraUp[1];
+  s[1] = f[2]*cameraUp[0] - f[0]*cameraUp[2];
+  s[2] = f[0]*cameraUp[1] - f[1]*cameraUp[0];
+  len = sqrt(s[0]*s[0] + s[1]*s[1] + s[2]*s[2]);
+  for (int i = 0; i < 3; i++) s[i] /= len;
+  u[0] = s[1]*f[2] - s[2]*f[1];
+  u[1] = s[2]*f[0] - s[0]*f[2];
+  u[2] = s[0]*f[1] - s[1]*f[0];
+
+  // gluLookAt() followed by glTranslatef(sceneOffset)
+  double view[4][4] = {
+    { s[0], s[1], s[2], 0 },
+    { u[0], u[1], u[2], 0 },
+    { -f[0], -f[1], -f[2], 0 },
+    { 0, 0, 0, 1 }
+  };
+  for (int r = 0; r < 3; r++) {
+    double t = 0;
+    for (int i = 0; i < 3; i++) t += view[r][i] * (sceneOffset[i] - cameraEye[i]);
+    view[r][3] = t;
+  }
+
+  double l = tile.left, r = tile.right, b = tile.bottom, t = tile.top;
+  double n = nearPlane, fr = farPlane;
+  double projection[4][4] = {
+    { 2*n/(r-l), 0, (r+l)/(r-l), 0 },
+    { 0, 2*n/(t-b), (t+b)/(t-b), 0 },
+    { 0, 0, -(fr+n)/(fr-n), -2*fr*n/(fr-n) },
+    { 0, 0, -1, 0 }
+  };
+  for (int row = 0; row < 4; row++) {
+    for (int col = 0; col < 4; col++) {
+      m[row][col] = 0;
+      for (int k = 0; k < 4; k++) m[row][col] += projection[row][k] * view[k][col];
+    }
+  }
+}
+
+static inline void toClip(const double m[4][4], float x, float y, float z, double clip[4]) {
+  for (int r = 0; r < 4; r++) clip[r] = m[r][0]*x + m[r][1]*y + m[r][2]*z + m[r][3];
+}
+
+// How far out, as a multiple of w, the sides of the frustum are pushed so
+// that a line this wide is never dropped while an implementation might
+// still rasterize part of it: half its width plus a pixel.
+static inline double lineMargin(float lineWidth, int pixels) {
+  return 1 + (lineWidth / 2 + 1) * 2 / pixels;
+}
+
+// True if the box is entirely outside one side of the tile's frustum, with
+// the x and y sides pushed out by the margins.
+static bool boxOffTile(const double m[4][4], const float lo[3], const float hi[3], double marginX, double marginY) {
+  double margins[3] = { marginX, marginY, 1 };
+  int outside[6] = { 0, 0, 0, 0, 0, 0 };
+  for (int corner = 0; corner < 8; corner++) {
+    double c[4];
+    toClip(m, corner & 1 ? hi[0] : lo[0], corner & 2 ? hi[1] : lo[1], corner & 4 ? hi[2] : lo[2], c);
+    for (int k = 0; k < 3; k++) {
+      if (c[k] > c[3] * margins[k]) outside[k * 2]++;
+      if (c[k] < -c[3] * margins[k]) outside[k * 2 + 1]++;
+    }
+  }
+  for (int side = 0; side < 6; side++) {
+    if (outside[side] == 8) return true;
+  }
+  return false;
+}
+
+// shift moves the line's time from its chunk's base onto the frame's.
+static void addLine(const double m[4][4], const tileView &tile, const packedLine &cline, int shift, tileCommands &commands) {
+  float y1 = unpackCoordinate(cline.y1, 1);
+  float width = lineWidth(y1, cline.speed * PACKED_SPEED_STEP);
+
+  // Skip lines that are entirely outside one side of the frustum.
+  double a[4], b[4];
+  toClip(m, unpackCoordinate(cline.x1, 0), y1, unpackCoordinate(cline.z1, 2), a);
+  toClip(m, unpackCoordinate(cline.x2, 0), unpackCoordinate(cline.y2, 1), unpackCoordinate(cline.z2, 2), b);
+  double marginX = lineMargin(width, tile.width);
+  double marginY = lineMargin(width, tile.height);
+  if ((a[0] > a[3] * marginX && b[0] > b[3] * marginX) ||
+      (a[0] < -a[3] * marginX && b[0] < -b[3] * marginX) ||
+      (a[1] > a[3] * marginY && b[1] > b[3] * marginY) ||
+      (a[1] < -a[3] * marginY && b[1] < -b[3] * marginY) ||
+      (a[2] > a[3] && b[2] > b[3]) ||
+      (a[2] < -a[3] && b[2] < -b[3])) {
+    commands.culled++;
+    return;
+  }
+  commands.lines.push_back(cline);
+  commands.lines.back().time = shiftTime(cline.time, shift);
+}
+
+// The coarsest level whose tolerance looks no bigger than LOD_PIXELS at the
+// box's nearest corner; 0 for the lines themselves.
+static int lodLevel(const double m[4][4], const tileView &tile, const float lo[3], const float hi[3]) {
+  double nearest = farPlane;
+  for (int corner = 0; corner < 8; corner++) {
+    double c[4];
+    toClip(m, corner & 1 ? hi[0] : lo[0], corner & 2 ? hi[1] : lo[1], corner & 4 ? hi[2] : lo[2], c);
+    if (c[3] < nearest) nearest = c[3];  // w is the distance in front of the eye
+  }
+  if (nearest <= nearPlane) return 0;
+  // pixels per metre at that distance, along whichever axis has more
+  double perX = nearPlane * tile.width / (tile.right - tile.left);
+  double perY = nearPlane * tile.height / (tile.top - tile.bottom);
+  double pixels = (perX > perY ? perX : perY) / nearest;
+  int level = 0;
+  while (level < LOD_LEVELS && LOD_TOLERANCE[level] * pixels <= LOD_PIXELS) level++;
+  return level;
+}
+
+// Ribbons are drawn from their chunk's vertex buffer, so they are only
+// culled a chunk at a time; a chunk far enough away draws its coarse copy.
+static void addRibbons(const double m[4][4], const tileView &tile, const lodCache &lod, int c, int shift, tileCommands &commands) {
+  const lodChunk &chunk = lod.chunks[c];
+  if (chunk.ribbonLo[0] > chunk.ribbonHi[0]) return;  // no ribbons
+  if (boxOffTile(m, chunk.ribbonLo, chunk.ribbonHi, 1, 1)) return;
+  int level = chunk.built && !lod.disabled ? lodLevel(m, tile, chunk.ribbonLo, chunk.ribbonHi) : 0;
+  if (level == 0) {
+    commands.ribbonChunks.push_back(c);
+    return;
+  }
+  const vector<packedLine> &coarse = chunk.ribbonLevels[level - 1];
+  for (int i = 0; i < coarse.size(); i++) {
+    commands.ribbons.push_back(coarse[i]);
+    commands.ribbons.back().time = shiftTime(coarse[i].time, shift);
+  }
+}
+
+void buildTileCommands(const sceneFrame &frame, const lodCache &lod, const tileView &tile, tileCommands &commands) {
+  double m[4][4];
+  tileMatrix(tile, m);
+  commands.lines.clear();
+  commands.culled = 0;
+  commands.ribbonChunks.clear();
+  commands.ribbons.clear();
+  const strokeArena &segments = *frame.segments;
+  int size = segments.size();
+  for (int first = 0; first < size; first += LOD_CHUNK) {
+    int end = first + LOD_CHUNK;
+    if (end > size) end = size;
+    int c = first / LOD_CHUNK;
+    int shift = timeShift(frame.chunkTimes[c], frame.timeBase);
+    if (c >= lod.chunks.size()) {  // not staged yet: draw its ribbons in full and its lines one by one
+      commands.ribbonChunks.push_back(c);
+    } else {
+      const lodChunk &chunk = lod.chunks[c];
+      addRibbons(m, tile, lod, c, shift, commands);
+      if (chunk.lo[0] > chunk.hi[0]) continue;  // nothing but ribbons and erased lines
+      float widest = widestLineAt(chunk.hi[1]);
+      if (boxOffTile(m, chunk.lo, chunk.hi, lineMargin(widest, tile.width), lineMargin(widest, tile.height))) {
+        commands.culled += end - first;
+        continue;
+      }
+      int level = chunk.built && !lod.disabled ? lodLevel(m, tile, chunk.lo, chunk.hi) : 0;
+      if (level > 0) {
+        const vector<packedLine> &coarse = chunk.levels[level - 1];
+        for (int i = 0; i < coarse.size(); i++) addLine(m, tile, coarse[i], shift, commands);
+        continue;
+      }
+    }
+    for (int i = first; i < end; i++) {
+      const packedLine &cline = segments[i];
+      if (isRibbon(cline) || !isDrawn(cline, frame.visibleLayers)) continue;
+      addLine(m, tile, cline, shift, commands);
+    }
+  }
+  for (int i = 0; i < frame.tips.size(); i++) {
+    if (isDrawn(frame.tips[i], frame.visibleLayers)) addLine(m, tile, packLine(frame.tips[i], frame.timeBase), 0, commands);
+  }
+}
+
+// The build threads are started with the first frame and then wait for the
+// next one, so a frame costs each of them a wake-up rather than a thread
+// start, and the worker array is only ever allocated once.
+typedef struct tileWorker {
+  pthread_t thread;
+  int first;   // this worker builds tiles first, first + stride, ...
+} tileWorker;
+
+typedef struct tileJob {
+  const sceneFrame *frame;
+  const lodCache *lod;
+  const vector<tileView> *tiles;
+  vector<tileCommands> *commands;
+  int stride;
+} tileJob;
+
+static vector<tileWorker> tileWorkers;  // [0] stands for the calling thread
+static int numTileWorkers = 0;          // started, counting the calling thread
+static tileJob tileFrame;
+static unsigned long tileFrameNumber = 0;  // bumped to wake the workers
+static int tileWorkersBusy = 0;
+static pthread_mutex_t tileMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tileWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tileDone = PTHREAD_COND_INITIALIZER;
+
+static void buildTileShare(int first) {
+  const tileJob &job = tileFrame;
+  for (int i = first; i < job.tiles->size(); i += job.stride) {
+    buildTileCommands(*job.frame, *job.lod, (*job.tiles)[i], (*job.commands)[i]);
+  }
+}
+
+static void *tileWorkerMain(void *arg) {
+  tileWorker *worker = (tileWorker*)arg;
+  unsigned long built = 0;
+  pthread_mutex_lock(&tileMutex);
+  while (true) {
+    while (tileFrameNumber == built) pthread_cond_wait(&tileWake, &tileMutex);
+    built = tileFrameNumber;
+    pthread_mutex_unlock(&tileMutex);
+    if (worker->first < tileFrame.stride) buildTileShare(worker->first);
+    pthread_mutex_lock(&tileMutex);
+    if (--tileWorkersBusy == 0) pthread_cond_signal(&tileDone);
+  }
+  return NULL;
+}
+
+// One worker per core, the calling thread being the first; fewer if threads
+// can't be had.
+static void startTileWorkers() {
+  int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) cores = 1;
+  tileWorkers.resize(cores);
+  tileWorkers[0].first = 0;
+  for (numTileWorkers = 1; numTileWorkers < cores; numTileWorkers++) {
+    tileWorker &worker = tileWorkers[numTileWorkers];
+    worker.first = numTileWorkers;
+    if (pthread_create(&worker.thread, NULL, tileWorkerMain, &worker) != 0) break;
+  }
+}
+
+void buildAllTileCommands(const sceneFrame &frame, const lodCache &lod, const vector<tileView> &tiles,
+                          vector<tileCommands> &commands) {
+  PROFILE_SCOPE(PROFILE_TILES);
+  commands.resize(tiles.size());
+  if (numTileWorkers == 0) startTileWorkers();
+  tileFrame.frame = &frame;
+  tileFrame.lod = &lod;
+  tileFrame.tiles = &tiles;
+  tileFrame.commands = &commands;
+  tileFrame.stride = numTileWorkers < (int)tiles.size() ? numTileWorkers : (int)tiles.size();
+  if (tileFrame.stride < 1) tileFrame.stride = 1;
+  bool shared = tileFrame.stride > 1;
+  if (shared) {
+    pthread_mutex_lock(&tileMutex);
+    tileWorkersBusy = numTileWorkers - 1;
+    tileFrameNumber++;
+    pthread_cond_broadcast(&tileWake);
+    pthread_mutex_unlock(&tileMutex);
+  }
+  // the calling thread takes the first share itself
+  buildTileShare(0);
+  if (shared) {
+    pthread_mutex_lock(&tileMutex);
+    while (tileWorkersBusy > 0) pthread_cond_wait(&tileDone, &tileMutex);
+    pthread_mutex_unlock(&tileMutex);
+  }
+}
+
+// end of tiles ///////////////////////////////////////////////////////////////
+
+// ***LEVEL OF DETAIL***
+// Once a chunk of the pool has stopped changing, coarser copies of its plain
+// lines and of its ribbons are built, so that a tile far from a densely
+// drawn area draws a few hundred merged lines there instead of thousands of
+// overlapping ones.
+
+// Most points one coarse line may stand for, which also bounds how far its
+// width and colour can drift from the lines it replaces.
+static const int LOD_MAX_MERGE = 32;
+
+// A line or ribbon while its chunk's levels are built, unpacked and without
+// what only the scene needs.
+typedef struct lodSegment {
+  float x1, y1, z1;
+  float x2, y2, z2;
+  float sx1, sy1, sz1;
+  float sx2, sy2, sz2;
+  float r, g, b;
+  float time, speed;
+} lodSegment;
+
+static inline lodSegment flatten(const myline &cline) {
+  lodSegment segment = {
+    cline.x1, cline.y1, cline.z1, cline.x2, cline.y2, cline.z2,
+    cline.sx1, cline.sy1, cline.sz1, cline.sx2, cline.sy2, cline.sz2,
+    cline.r, cline.g, cline.b, cline.time, cline.speed
+  };
+  return segment;
+}
+
+static inline packedLine packSegment(const lodSegment &segment, float timeBase) {
+  myline cline = {
+    segment.x1, segment.x2, segment.y1, segment.y2, segment.z1, segment.z2, segment.r, segment.g, segment.b,
+    segment.sx1, segment.sx2, segment.sy1, segment.sy2, segment.sz1, segment.sz2, segment.time, segment.speed, 1, 0
+  };
+  return packLine(cline, timeBase);
+}
+
+static bool byStroke(const myline *a, const myline *b) {
+  return a->stroke != b->stroke ? a->stroke < b->stroke : a < b;
+}
+
+// A point merged away, with the brush direction there if it is a ribbon's.
+typedef struct lodJoint {
+  trackable point;
+  trackable side;
+} lodJoint;
+
+// Whether the joint stays within tolerance of the line replacing it, and
+// for a ribbon, both of the brush's ends within tolerance of the edges.
+static bool nearChord(const myline &chord, const lodJoint &joint, float tolerance) {
+  float limit = tolerance * tolerance;
+  if (segmentDistance2(chord, joint.point) > limit) return false;
+  if (joint.side.x == 0 && joint.side.y == 0 && joint.side.z == 0) return true;
+  for (int edge = -1; edge <= 1; edge += 2) {
+    myline along = chord;
+    along.x1 += edge * chord.sx1; along.y1 += edge * chord.sy1; along.z1 += edge * chord.sz1;
+    along.x2 += edge * chord.sx2; along.y2 += edge * chord.sy2; along.z2 += edge * chord.sz2;
+    trackable p = { joint.point.x + edge * joint.side.x, joint.point.y + edge * joint.side.y,
+                    joint.point.z + edge * joint.side.z };
+    if (segmentDistance2(along, p) > limit) return false;
+  }
+  return true;
+}
+
+// Merge runs of a stroke's lines, in drawing order, into one line for as
+// long as every point merged away stays within tolerance of it. A merged
+// ribbon keeps the brush direction of its first and last ends.
+static void simplifyLines(const vector<const myline*> &lines, float tolerance, vector<lodSegment> &out) {
+  out.clear();
+  vector<lodJoint> merged;   // points dropped from out.back()
+  for (int i = 0; i < lines.size(); i++) {
+    const myline &cline = *lines[i];
+    if (i > 0 && lines[i - 1]->stroke == cline.stroke && merged.size() < LOD_MAX_MERGE) {
+      lodSegment &last = out.back();
+      if (last.x2 == cline.x1 && last.y2 == cline.y1 && last.z2 == cline.z1) {
+        myline chord = cline;
+        chord.x1 = last.x1; chord.y1 = last.y1; chord.z1 = last.z1;
+        chord.sx1 = last.sx1; chord.sy1 = last.sy1; chord.sz1 = last.sz1;
+        lodJoint joint = { { cline.x1, cline.y1, cline.z1 }, { cline.sx1, cline.sy1, cline.sz1 } };
+        bool keeps = nearChord(chord, joint, tolerance);
+        for (int p = 0; p < merged.size() && keeps; p++) keeps = nearChord(chord, merged[p], tolerance);
+        if (keeps) {
+          merged.push_back(joint);
+          last.x2 = cline.x2; last.y2 = cline.y2; last.z2 = cline.z2;
+          last.sx2 = cline.sx2; last.sy2 = cline.sy2; last.sz2 = cline.sz2;
+          continue;
+        }
+      }
+    }
+    out.push_back(flatten(cline));
+    merged.clear();
+  }
+}
+
+static inline long long cellKey(float x, float y, float z, float cell) {
+  long long cx = (long long)floorf(x / cell), cy = (long long)floorf(y / cell), cz = (long long)floorf(z / cell);
+  return ((cx & 0x1fffff) << 42) | ((cy & 0x1fffff) << 21) | (cz & 0x1fffff);
+}
+
+static inline float cellCentre(float v, float cell) {
+  return (floorf(v / cell) + 0.5f) * cell;
+}
+
+// Snap line ends to the centres of their cells and keep the first line
+// between each pair of cells. Lines within one cell vanish, but their
+// neighbours still meet at its centre.
+static void clusterLines(vector<lodSegment> &lines, float cell) {
+  // sort (cell pair, index) so each pair's first line comes first, then
+  // compact in drawing order
+  vector<pair<pair<long long, long long>, int> > keys;
+  keys.reserve(lines.size());
+  for (int i = 0; i < lines.size(); i++) {
+    const lodSegment &cline = lines[i];
+    long long a = cellKey(cline.x1, cline.y1, cline.z1, cell);
+    long long b = cellKey(cline.x2, cline.y2, cline.z2, cell);
+    if (a != b) keys.push_back(make_pair(a < b ? make_pair(a, b) : make_pair(b, a), i));
+  }
+  sort(keys.begin(), keys.end());
+  vector<bool> keep(lines.size(), false);
+  for (int k = 0; k < keys.size(); k++) {
+    if (k == 0 || keys[k].first != keys[k - 1].first) keep[keys[k].second] = true;
+  }
+  int kept = 0;
+  for (int i = 0; i < lines.size(); i++) {
+    if (!keep[i]) continue;
+    lodSegment cline = lines[i];
+    cline.x1 = cellCentre(cline.x1, cell); cline.y1 = cellCentre(cline.y1, cell); cline.z1 = cellCentre(cline.z1, cell);
+    cline.x2 = cellCentre(cline.x2, cell); cline.y2 = cellCentre(cline.y2, cell); cline.z2 = cellCentre(cline.z2, cell);
+    lines[kept++] = cline;
+  }
+  lines.resize(kept);
+}
+
+static inline void emptyBounds(lodChunk &chunk) {
+  for (int k = 0; k < 3; k++) {
+    chunk.lo[k] = chunk.ribbonLo[k] = FLT_MAX;
+    chunk.hi[k] = chunk.ribbonHi[k] = -FLT_MAX;
+  }
+}
+
+static inline void growBox(float lo[3], float hi[3], float x, float y, float z) {
+  float p[3] = { x, y, z };
+  for (int k = 0; k < 3; k++) {
+    if (p[k] < lo[k]) lo[k] = p[k];
+    if (p[k] > hi[k]) hi[k] = p[k];
+  }
+}
+
+// A line grows the chunk's bounds by its ends, a ribbon its ribbon bounds
+// by the corners of its quad.
+static inline void growBounds(lodChunk &chunk, const myline &cline) {
+  if (!isRibbon(cline)) {
+    growBox(chunk.lo, chunk.hi, cline.x1, cline.y1, cline.z1);
+    growBox(chunk.lo, chunk.hi, cline.x2, cline.y2, cline.z2);
+    return;
+  }
+  for (int edge = -1; edge <= 1; edge += 2) {
+    growBox(chunk.ribbonLo, chunk.ribbonHi, cline.x1 + edge * cline.sx1, cline.y1 + edge * cline.sy1,
+            cline.z1 + edge * cline.sz1);
+    growBox(chunk.ribbonLo, chunk.ribbonHi, cline.x2 + edge * cline.sx2, cline.y2 + edge * cline.sy2,
+            cline.z2 + edge * cline.sz2);
+  }
+}
+
+static void buildLodLevels(const sceneFrame &frame, int c, int count, lodChunk &chunk) {
+  emptyBounds(chunk);
+  const packedLine *segments = &(*frame.segments)[c * LOD_CHUNK];
+  float timeBase = frame.chunkTimes[c];
+  vector<myline> unpacked;
+  unpacked.reserve(count);
+  for (int i = 0; i < count; i++) {
+    if (!isDrawn(segments[i], frame.visibleLayers)) continue;
+    unpacked.push_back(unpackLine(segments[i], timeBase));
+    myline &cline = unpacked.back();
+    cline.stroke = frame.links[c * LOD_CHUNK + i].record + 1;  // only to group by, so any per-stroke key will do
+    growBounds(chunk, cline);
+    if (!isRibbon(cline)) {  // a brush direction at one end only doesn't make a ribbon
+      cline.sx1 = cline.sy1 = cline.sz1 = 0;
+      cline.sx2 = cline.sy2 = cline.sz2 = 0;
+    }
+  }
+  // the pool interleaves every object's lines; follow one stroke at a time
+  vector<const myline*> lines, ribbons;
+  for (int i = 0; i < unpacked.size(); i++) (isRibbon(unpacked[i]) ? ribbons : lines).push_back(&unpacked[i]);
+  sort(lines.begin(), lines.end(), byStroke);
+  sort(ribbons.begin(), ribbons.end(), byStroke);
+  vector<lodSegment> simplified;
+  for (int level = 0; level < LOD_LEVELS; level++) {
+    simplifyLines(lines, LOD_TOLERANCE[level], simplified);
+    clusterLines(simplified, LOD_TOLERANCE[level]);
+    vector<packedLine> &packed = chunk.levels[level];
+    packed.resize(simplified.size());
+    for (int i = 0; i < simplified.size(); i++) packed[i] = packSegment(simplified[i], timeBase);
+
+    simplifyLines(ribbons, LOD_TOLERANCE[level], simplified);
+    vector<packedLine> &packedRibbons = chunk.ribbonLevels[level];
+    packedRibbons.resize(simplified.size());
+    for (int i = 0; i < simplified.size(); i++) packedRibbons[i] = packSegment(simplified[i], timeBase);
+  }
+  chunk.built = true;
+}
+
+void stageLod(const sceneFrame &frame, lodCache &lod) {
+  PROFILE_SCOPE(PROFILE_LOD);
+  const strokeArena &segments = *frame.segments;
+  int size = segments.size();
+  int numChunks = (size + LOD_CHUNK - 1) / LOD_CHUNK;
+  lod.frame++;
+  if (lod.chunks.size() > numChunks) lod.chunks.resize(numChunks);  // cleared
+  while (lod.chunks.size() < numChunks) {
+    lod.chunks.push_back(lodChunk());
+    emptyBounds(lod.chunks.back());
+    lod.chunks.back().built = false;
+    lod.chunks.back().changed = lod.frame;
+  }
+
+  for (int u = 0; u < frame.updates.size(); u++) {
+    const strokeUpdate &update = frame.updates[u];
+    int end = update.first + update.count;
+    if (end > size) end = size;
+    for (int slot = update.first; slot < end; slot++) {
+      lodChunk &chunk = lod.chunks[slot / LOD_CHUNK];
+      chunk.built = false;
+      chunk.changed = lod.frame;
+      if (isDrawn(segments[slot], frame.visibleLayers)) growBounds(chunk, unpackLine(segments[slot]));
+    }
+  }
+
+  if (lod.disabled) return;
+  int builds = 0;
+  for (int c = 0; c < lod.chunks.size() && builds < LOD_BUILDS_PER_FRAME; c++) {
+    lodChunk &chunk = lod.chunks[c];
+    if (chunk.built || lod.frame - chunk.changed < LOD_AGE) continue;
+    int count = size - c * LOD_CHUNK;
+    if (count > LOD_CHUNK) count = LOD_CHUNK;
+    buildLodLevels(frame, c, count, chunk);
+    builds++;
+    lod.built++;
+  }
+}
+
+// end of level of detail /////////////////////////////////////////////////////
+
+// ***STROKE SHADERS***
+// Lines are drawn as quads extruded across the screen in the vertex shader,
+// one instance per line from the tile's commands, so a tile's lines go in a
+// single draw call whatever their widths. Their width, brightness and fade
+// are worked out there from the style uniforms and what each line recorded,
+// which is also applied to the ribbons' colours.
+
+typedef struct strokeShader {
+  GLuint program;           // 0 if it couldn't be built
+  GLint viewport, now, thickness, speedWidth, minWidth, maxWidth, speedGlow, fadeSeconds;  // uniforms
+  GLint stageMin, stageStep, speedStep, sideStep, timeStep;
+  GLint corner, from, to, side1, side2, color, speed, time;  // attributes; the lines have corners, the ribbons sides
+} strokeShader;
+
+static strokeShader lineShader, ribbonShader;
+
+// corner is (0 at from or 1 at to, -1 or 1 across the line): a triangle strip
+static const float lineCorners[8] = { 0, -1, 0, 1, 1, -1, 1, 1 };
+
+// The attributes are a packedLine's fields as they are, so the shaders undo
+// packLine() themselves.
+static const char *strokeShadeSource =
+  "#version 120\n"
+  "uniform float now, speedGlow, fadeSeconds;\n"
+  "uniform vec3 stageMin, stageStep;\n"
+  "uniform float speedStep, timeStep;\n"
+  "vec3 stagePoint(vec3 steps) {\n"
+  "  return stageMin + steps * stageStep;\n"
+  "}\n"
+  "vec3 strokeShade(vec3 color, float time, float speed) {\n"
+  "  float fade = fadeSeconds > 0.0 ? clamp(1.0 - (now - time * timeStep) / fadeSeconds, 0.0, 1.0) : 1.0;\n"
+  "  return min(color * (1.0 + speedGlow * speed), 1.0) * fade;\n"
+  "}\n";
+
+// The width is lineWidth()'s; the ends are pushed apart in pixels, then back
+// into clip space, so a line is as wide near the camera as far from it.
+static const char *lineVertexSource =
+  "attribute vec2 corner;\n"
+  "attribute vec3 from, to;\n"
+  "attribute vec3 color;\n"
+  "attribute float speed, time;\n"
+  "uniform vec2 viewport;\n"
+  "uniform float thickness, speedWidth, minWidth, maxWidth;\n"
+  "varying vec3 shade;\n"
+  "void main() {\n"
+  "  vec3 start = stagePoint(from);\n"
+  "  float moving = speed * speedStep;\n"
+  "  float factor = clamp(1.0 + speedWidth * moving, minWidth, maxWidth);\n"
+  "  float width = max((start.y + 2.0) * thickness * 1.5 * factor, 1.0);\n"
+  "  vec4 a = gl_ModelViewProjectionMatrix * vec4(start, 1.0);\n"
+  "  vec4 b = gl_ModelViewProjectionMatrix * vec4(stagePoint(to), 1.0);\n"
+  "  vec2 along = (b.xy / max(b.w, 1e-4) - a.xy / max(a.w, 1e-4)) * viewport;\n"
+  "  along = dot(along, along) > 1e-12 ? normalize(along) : vec2(1.0, 0.0);\n"
+  "  vec4 p = corner.x < 0.5 ? a : b;\n"
+  "  p.xy += vec2(-along.y, along.x) * corner.y * width / viewport * p.w;\n"
+  "  gl_Position = p;\n"
+  "  shade = strokeShade(color, time, moving);\n"
+  "}\n";
+
+// A ribbon segment is drawn as a point that the geometry shader turns into
+// ribbonCorners()'s quad, each end pushed out either way along its side, so
+// each segment's packed line is read once rather than once per corner.
+static const char *ribbonVertexSource =
+  "attribute vec3 from, to, side1, side2;\n"
+  "attribute vec3 color;\n"
+  "attribute float speed, time;\n"
+  "uniform float sideStep;\n"
+  "varying vec3 start, end, startSide, endSide, ribbonShade;\n"
+  "void main() {\n"
+  "  start = stagePoint(from);\n"
+  "  end = stagePoint(to);\n"
+  "  startSide = side1 * sideStep;\n"
+  "  endSide = side2 * sideStep;\n"
+  "  ribbonShade = strokeShade(color, time, speed * speedStep);\n"
+  "  gl_Position = vec4(start, 1.0);\n"
+  "}\n";
+
+static const char *ribbonGeometrySource =
+  "#version 150 compatibility\n"
+  "layout(points) in;\n"
+  "layout(triangle_strip, max_vertices = 4) out;\n"
+  "in vec3 start[], end[], startSide[], endSide[], ribbonShade[];\n"
+  "out vec3 shade;\n"
+  "void emitCorner(vec3 p) {\n"
+  "  gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 1.0);\n"
+  "  shade = ribbonShade[0];\n"
+  "  EmitVertex();\n"
+  "}\n"
+  "void main() {\n"
+  "  if (startSide[0] == vec3(0.0)) return;  // nothing to extrude; see stageRibbons()\n"
+  "  emitCorner(start[0] - startSide[0]);\n"
+  "  emitCorner(start[0] + startSide[0]);\n"
+  "  emitCorner(end[0] - endSide[0]);\n"
+  "  emitCorner(end[0] + endSide[0]);\n"
+  "  EndPrimitive();\n"
+  "}\n";
+
+static const char *strokeFragmentSource =
+  "#version 120\n"
+  "varying vec3 shade;\n"
+  "void main() {\n"
+  "  gl_FragColor = vec4(shade, 1.0);\n"
+  "}\n";
+
+static GLuint compileShader(GLenum type, const char *const *sources, int count) {
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, count, sources, NULL);
+  glCompileShader(shader);
+  GLint ok;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    printf("WARNING: stroke shader didn't compile: %s\n", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+// firstAttribute is bound to 0, which has to be an array that advances with
+// each vertex.
+static void buildStrokeShader(strokeShader &shader, const char *vertexBody, const char *geometrySource,
+                              const char *firstAttribute) {
+  shader.program = 0;
+  const char *vertexSources[2] = { strokeShadeSource, vertexBody };
+  GLuint vertex = compileShader(GL_VERTEX_SHADER, vertexSources, 2);
+  GLuint geometry = geometrySource ? compileShader(GL_GEOMETRY_SHADER, &geometrySource, 1) : 0;
+  GLuint fragment = compileShader(GL_FRAGMENT_SHADER, &strokeFragmentSource, 1);
+  if (vertex != 0 && fragment != 0 && (geometry != 0 || geometrySource == NULL)) {
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex);
+    if (geometry != 0) glAttachShader(program, geometry);
+    glAttachShader(program, fragment);
+    glBindAttribLocation(program, 0, firstAttribute);
+    glLinkProgram(program);
+    GLint ok;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (ok) {
+      shader.program = program;
+    } else {
+      char log[1024];
+      glGetProgramInfoLog(program, sizeof(log), NULL, log);
+      printf("WARNING: stroke shader didn't link: %s\n", log);
+      glDeleteProgram(program);
+    }
+  }
+  if (vertex != 0) glDeleteShader(vertex);
+  if (geometry != 0) glDeleteShader(geometry);
+  if (fragment != 0) glDeleteShader(fragment);
+  if (shader.program == 0) return;
+  GLuint p = shader.program;
+  shader.viewport = glGetUniformLocation(p, "viewport");
+  shader.now = glGetUniformLocation(p, "now");
+  shader.thickness = glGetUniformLocation(p, "thickness");
+  shader.speedWidth = glGetUniformLocation(p, "speedWidth");
+  shader.minWidth = glGetUniformLocation(p, "minWidth");
+  shader.maxWidth = glGetUniformLocation(p, "maxWidth");
+  shader.speedGlow = glGetUniformLocation(p, "speedGlow");
+  shader.fadeSeconds = glGetUniformLocation(p, "fadeSeconds");
+  shader.stageMin = glGetUniformLocation(p, "stageMin");
+  shader.stageStep = glGetUniformLocation(p, "stageStep");
+  shader.speedStep = glGetUniformLocation(p, "speedStep");
+  shader.sideStep = glGetUniformLocation(p, "sideStep");
+  shader.timeStep = glGetUniformLocation(p, "timeStep");
+  shader.corner = glGetAttribLocation(p, "corner");
+  shader.from = glGetAttribLocation(p, "from");
+  shader.to = glGetAttribLocation(p, "to");
+  shader.side1 = glGetAttribLocation(p, "side1");
+  shader.side2 = glGetAttribLocation(p, "side2");
+  shader.color = glGetAttribLocation(p, "color");
+  shader.speed = glGetAttribLocation(p, "speed");
+  shader.time = glGetAttribLocation(p, "time");
+}
+
+static void buildStrokeShaders() {
+  lineShader.program = ribbonShader.program = 0;
+  const char *version = (const char*)glGetString(GL_VERSION);
+  int major = 0, minor = 0;
+  if (version == NULL || sscanf(version, "%d.%d", &major, &minor) != 2 || major * 10 + minor < 33) {
+    printf("WARNING: GL %s has no instanced arrays; drawing fixed-function lines\n", version ? version : "?");
+    return;
+  }
+  // an instanced draw needs its per-vertex corners at 0
+  buildStrokeShader(lineShader, lineVertexSource, NULL, "corner");
+  buildStrokeShader(ribbonShader, ribbonVertexSource, ribbonGeometrySource, "from");
+  if (lineShader.program == 0) printf("WARNING: drawing fixed-function lines\n");
+}
+
+// Bind the program and load the style; nothing about the lines themselves
+// is uploaded to restyle them. The lines' times count from timeBase.
+static void useStrokeShader(const strokeShader &shader, const sceneFrame &frame, const tileView &tile,
+                            float timeBase) {
+  glUseProgram(shader.program);
+  glUniform2f(shader.viewport, tile.width, tile.height);
+  glUniform1f(shader.now, frame.strokeClock - timeBase);
+  glUniform1f(shader.thickness, lineStyle.thickness);
+  glUniform1f(shader.speedWidth, lineStyle.speedWidth);
+  glUniform1f(shader.minWidth, lineStyle.minWidth);
+  glUniform1f(shader.maxWidth, lineStyle.maxWidth);
+  glUniform1f(shader.speedGlow, lineStyle.speedGlow);
+  glUniform1f(shader.fadeSeconds, lineStyle.fadeSeconds);
+  glUniform3f(shader.stageMin, STAGE_MIN[0], STAGE_MIN[1], STAGE_MIN[2]);
+  glUniform3f(shader.stageStep, stageStep(0), stageStep(1), stageStep(2));
+  glUniform1f(shader.speedStep, PACKED_SPEED_STEP);
+  glUniform1f(shader.sideStep, PACKED_SIDE_STEP);
+  glUniform1f(shader.timeStep, PACKED_TIME_STEP);
+}
+
+// Point the shader's attributes at packed lines starting at base: client
+// memory, or an offset into the bound buffer. With a divisor of 1 each
+// instance reads a line, with 0 each vertex does.
+static const int NUM_PACKED_ATTRIBUTES = 7;
+
+static void bindPackedLines(const strokeShader &shader, const char *base, GLuint divisor) {
+  const GLint locations[NUM_PACKED_ATTRIBUTES] = {
+    shader.from, shader.to, shader.side1, shader.side2, shader.color, shader.speed, shader.time
+  };
+  const GLint sizes[NUM_PACKED_ATTRIBUTES] = { 3, 3, 3, 3, 3, 1, 1 };
+  const GLenum types[NUM_PACKED_ATTRIBUTES] = {
+    GL_UNSIGNED_SHORT, GL_UNSIGNED_SHORT, GL_BYTE, GL_BYTE, GL_UNSIGNED_BYTE, GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT
+  };
+  const size_t offsets[NUM_PACKED_ATTRIBUTES] = {
+    offsetof(packedLine, x1), offsetof(packedLine, x2), offsetof(packedLine, sx1), offsetof(packedLine, sx2),
+    offsetof(packedLine, r), offsetof(packedLine, speed), offsetof(packedLine, time)
+  };
+  for (int a = 0; a < NUM_PACKED_ATTRIBUTES; a++) {
+    if (locations[a] < 0) continue;
+    glEnableVertexAttribArray(locations[a]);
+    // only the colour is normalized; the rest are whole steps
+    glVertexAttribPointer(locations[a], sizes[a], types[a], locations[a] == shader.color, sizeof(packedLine),
+                          base + offsets[a]);
+    glVertexAttribDivisor(locations[a], divisor);
+  }
+}
+
+static void unbindPackedLines(const strokeShader &shader) {
+  const GLint locations[NUM_PACKED_ATTRIBUTES] = {
+    shader.from, shader.to, shader.side1, shader.side2, shader.color, shader.speed, shader.time
+  };
+  for (int a = 0; a < NUM_PACKED_ATTRIBUTES; a++) {
+    if (locations[a] < 0) continue;
+    glVertexAttribDivisor(locations[a], 0);
+    glDisableVertexAttribArray(locations[a]);
+  }
+}
+
+// strokeShade() on the CPU, for the fixed-function lines.
+static void shadeLine(const myline &cline, float now, float rgb[3]) {
+  float fade = 1;
+  if (lineStyle.fadeSeconds > 0) {
+    fade = 1 - (now - cline.time) / lineStyle.fadeSeconds;
+    if (fade < 0) fade = 0;
+    else if (fade > 1) fade = 1;
+  }
+  float glow = 1 + lineStyle.speedGlow * cline.speed;
+  float color[3] = { cline.r, cline.g, cline.b };
+  for (int k = 0; k < 3; k++) rgb[k] = (color[k] * glow < 1 ? color[k] * glow : 1) * fade;
+}
+
+// Without the shader, aliased GL lines at the nearest whole width, changing
+// the width only between lines that round differently.
+static void drawFixedLines(const sceneFrame &frame, const tileCommands &commands) {
+  float current = 0;
+  for (int i = 0; i < commands.lines.size(); i++) {
+    myline cline = unpackLine(commands.lines[i]);
+    float width = floorf(lineWidth(cline.y1, cline.speed) + 0.5f);
+    if (width != current) {
+      if (current != 0) glEnd();
+      glLineWidth(width);
+      glBegin(GL_LINES);
+      current = width;
+    }
+    float rgb[3];
+    shadeLine(cline, frame.strokeClock - frame.timeBase, rgb);
+    glColor3fv(rgb);
+    glVertex3f(cline.x1, cline.y1, cline.z1);
+    glVertex3f(cline.x2, cline.y2, cline.z2);
+  }
+  if (current != 0) glEnd();
+}
+
+static void drawLines(const sceneFrame &frame, const tileView &tile, const tileCommands &commands) {
+  if (lineShader.program == 0) {
+    drawFixedLines(frame, commands);
+    return;
+  }
+  if (commands.lines.empty()) return;
+  useStrokeShader(lineShader, frame, tile, frame.timeBase);
+  glEnableVertexAttribArray(lineShader.corner);
+  glVertexAttribPointer(lineShader.corner, 2, GL_FLOAT, GL_FALSE, 0, lineCorners);
+  bindPackedLines(lineShader, (const char*)&commands.lines[0], 1);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, commands.lines.size());
+  unbindPackedLines(lineShader);
+  glDisableVertexAttribArray(lineShader.corner);
+  glUseProgram(0);
+}
+
+// end of stroke shaders //////////////////////////////////////////////////////
+
+// ***RIBBONS***
+// Oriented strokes are kept on the GPU in fixed-size chunks so that each
+// frame only uploads the slots that changed, however long the strokes get.
+// With the stroke shaders a chunk holds the packed lines and the shader
+// extrudes the quads; without, they are extruded on the CPU, four segments
+// at a time. Which chunks a tile draws, and which it swaps for their coarse
+// levels, is decided with its lines in buildTileCommands().
+
+static void ribbonCorners(const myline &cline, float *out) {
+  float sx1 = 0, sy1 = 0, sz1 = 0, sx2 = 0, sy2 = 0, sz2 = 0;
+  if (isRibbon(cline)) {
+    sx1 = cline.sx1; sy1 = cline.sy1; sz1 = cline.sz1;
+    sx2 = cline.sx2; sy2 = cline.sy2; sz2 = cline.sz2;
+  }
+  out[0] = cline.x1 + sx1; out[1] = cline.y1 + sy1; out[2] = cline.z1 + sz1;
+  out[3] = cline.x1 - sx1; out[4] = cline.y1 - sy1; out[5] = cline.z1 - sz1;
+  out[6] = cline.x2 - sx2; out[7] = cline.y2 - sy2; out[8] = cline.z2 - sz2;
+  out[9] = cline.x2 + sx2; out[10] = cline.y2 + sy2; out[11] = cline.z2 + sz2;
+}
+
+void buildRibbonVertices(const packedLine *segments, int count, float *positions, float *colors) {
+  int i = 0;
+#ifdef __SSE2__
+  // one segment per lane, then three 4x4 transposes back to 12 floats each
+  const __m128 zero = _mm_setzero_ps();
+  for (; i + 4 <= count; i += 4) {
+    myline l[4];
+    for (int j = 0; j < 4; j++) l[j] = unpackLine(segments[i + j]);
+#define RIBBON_LANES(field) _mm_setr_ps(l[0].field, l[1].field, l[2].field, l[3].field)
+    __m128 x1 = RIBBON_LANES(x1), y1 = RIBBON_LANES(y1), z1 = RIBBON_LANES(z1);
+    __m128 x2 = RIBBON_LANES(x2), y2 = RIBBON_LANES(y2), z2 = RIBBON_LANES(z2);
+    __m128 sx1 = RIBBON_LANES(sx1), sy1 = RIBBON_LANES(sy1), sz1 = RIBBON_LANES(sz1);
+    __m128 sx2 = RIBBON_LANES(sx2), sy2 = RIBBON_LANES(sy2), sz2 = RIBBON_LANES(sz2);
+#undef RIBBON_LANES
+    __m128 has1 = _mm_or_ps(_mm_or_ps(_mm_cmpneq_ps(sx1, zero), _mm_cmpneq_ps(sy1, zero)), _mm_cmpneq_ps(sz1, zero));
+    __m128 has2 = _mm_or_ps(_mm_or_ps(_mm_cmpneq_ps(sx2, zero), _mm_cmpneq_ps(sy2, zero)), _mm_cmpneq_ps(sz2, zero));
+    __m128 ribbon = _mm_and_ps(has1, has2);
+    sx1 = _mm_and_ps(sx1, ribbon); sy1 = _mm_and_ps(sy1, ribbon); sz1 = _mm_and_ps(sz1, ribbon);
+    sx2 = _mm_and_ps(sx2, ribbon); sy2 = _mm_and_ps(sy2, ribbon); sz2 = _mm_and_ps(sz2, ribbon);
+
+    __m128 a0 = _mm_add_ps(x1, sx1), a1 = _mm_add_ps(y1, sy1), a2 = _mm_add_ps(z1, sz1), a3 = _mm_sub_ps(x1, sx1);
+    __m128 b0 = _mm_sub_ps(y1, sy1), b1 = _mm_sub_ps(z1, sz1), b2 = _mm_sub_ps(x2, sx2), b3 = _mm_sub_ps(y2, sy2);
+    __m128 c0 = _mm_sub_ps(z2, sz2), c1 = _mm_add_ps(x2, sx2), c2 = _mm_add_ps(y2, sy2), c3 = _mm_add_ps(z2, sz2);
+    _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+    _MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    float *out = positions + i * 12;
+    _mm_storeu_ps(out, a0); _mm_storeu_ps(out + 4, b0); _mm_storeu_ps(out + 8, c0);
+    _mm_storeu_ps(out + 12, a1); _mm_storeu_ps(out + 16, b1); _mm_storeu_ps(out + 20, c1);
+    _mm_storeu_ps(out + 24, a2); _mm_storeu_ps(out + 28, b2); _mm_storeu_ps(out + 32, c2);
+    _mm_storeu_ps(out + 36, a3); _mm_storeu_ps(out + 40, b3); _mm_storeu_ps(out + 44, c3);
+  }
+#endif
+  for (; i < count; i++) ribbonCorners(unpackLine(segments[i]), positions + i * 12);
+
+  for (i = 0; i < count; i++) {
+    float *out = colors + i * 12;
+    for (int v = 0; v < 4; v++) {
+      out[v * 3] = segments[i].r / 255.0f;
+      out[v * 3 + 1] = segments[i].g / 255.0f;
+      out[v * 3 + 2] = segments[i].b / 255.0f;
+    }
+  }
+}
+
+void stageRibbons(const sceneFrame &frame, ribbonCache &cache) {
+  PROFILE_SCOPE(PROFILE_RIBBONS);
+  if (frame.updates.empty()) return;
+  const strokeArena &segments = *frame.segments;
+  vector<ribbonChunk> &chunks = cache.chunks;
+  int size = segments.size();
+  int numChunks = (size + RIBBON_CHUNK - 1) / RIBBON_CHUNK;
+  while (chunks.size() < numChunks) {
+    ribbonChunk chunk;
+    chunk.buffer = 0;
+    chunk.segments = 0;
+    chunks.push_back(chunk);
+  }
+  for (int c = 0; c < chunks.size(); c++) {
+    int used = size - c * RIBBON_CHUNK;
+    if (used > RIBBON_CHUNK) used = RIBBON_CHUNK;
+    if (used < 0) used = 0;
+    chunks[c].segments = used;
+  }
+
+  for (int u = 0; u < frame.updates.size(); u++) {
+    const strokeUpdate &update = frame.updates[u];
+    // split at chunk boundaries so that each upload goes to one buffer
+    int slot = update.first;
+    int end = update.first + update.count;
+    if (end > size) end = size;
+    while (slot < end) {
+      int c = slot / RIBBON_CHUNK;
+      int count = (c + 1) * RIBBON_CHUNK;
+      if (count > end) count = end;
+      count -= slot;
+      if (cache.numPending == cache.pending.size()) cache.pending.push_back(ribbonUpload());
+      ribbonUpload &upload = cache.pending[cache.numPending++];
+      upload.chunk = c;
+      upload.offset = slot - c * RIBBON_CHUNK;
+      upload.count = count;
+      upload.lines.assign(&segments[slot], &segments[slot] + count);
+      for (int i = 0; i < count; i++) {
+        packedLine &cline = upload.lines[i];
+        if (!isRibbon(cline) || !isDrawn(cline, frame.visibleLayers)) {  // collapse ribbons on hidden layers too
+          cline.sx1 = cline.sy1 = cline.sz1 = 0;
+          cline.sx2 = cline.sy2 = cline.sz2 = 0;
+        }
+      }
+      slot += count;
+    }
+  }
+}
+
+void uploadRibbons(ribbonCache &cache) {
+  PROFILE_SCOPE(PROFILE_RIBBONS);
+  bool packed = ribbonShader.program != 0;
+  for (int u = 0; u < cache.numPending; u++) {
+    const ribbonUpload &upload = cache.pending[u];
+    ribbonChunk &chunk = cache.chunks[upload.chunk];
+    if (chunk.buffer == 0) {
+      glGenBuffers(1, &chunk.buffer);
+      glBindBuffer(GL_ARRAY_BUFFER, chunk.buffer);
+      size_t perSegment = packed ? sizeof(packedLine) : 24 * sizeof(float);
+      glBufferData(GL_ARRAY_BUFFER, RIBBON_CHUNK * perSegment, NULL, GL_DYNAMIC_DRAW);
+    } else {
+      glBindBuffer(GL_ARRAY_BUFFER, chunk.buffer);
+    }
+    if (packed) {
+      size_t bytes = upload.count * sizeof(packedLine);
+      glBufferSubData(GL_ARRAY_BUFFER, upload.offset * sizeof(packedLine), bytes, &upload.lines[0]);
+      cache.uploadedBytes += bytes;
+      continue;
+    }
+    cache.positions.resize(upload.count * 12);
+    cache.colors.resize(upload.count * 12);
+    buildRibbonVertices(&upload.lines[0], upload.count, &cache.positions[0], &cache.colors[0]);
+    size_t bytes = upload.count * 12 * sizeof(float);
+    glBufferSubData(GL_ARRAY_BUFFER, upload.offset * 12 * sizeof(float), bytes, &cache.positions[0]);
+    glBufferSubData(GL_ARRAY_BUFFER, (RIBBON_CHUNK + upload.offset) * 12 * sizeof(float), bytes, &cache.colors[0]);
+    cache.uploadedBytes += 2 * bytes;
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  cache.numPending = 0;
+}
+
+void freeRibbons(ribbonCache &cache) {
+  for (int c = 0; c < cache.chunks.size(); c++) {
+    if (cache.chunks[c].buffer != 0) glDeleteBuffers(1, &cache.chunks[c].buffer);
+  }
+  cache.chunks.clear();
+  cache.numPending = 0;
+}
+
+// The tile's full chunks straight from their buffers, then its coarse
+// ribbons in one draw from the commands.
+static void drawRibbons(const sceneFrame &frame, const ribbonCache &ribbons, const tileView &tile,
+                        const tileCommands &commands) {
+  bool shaded = ribbonShader.program != 0;
+  if (shaded) {
+    useStrokeShader(ribbonShader, frame, tile, frame.timeBase);
+  } else {
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+  }
+  for (int i = 0; i < commands.ribbonChunks.size(); i++) {
+    int c = commands.ribbonChunks[i];
+    if (c >= ribbons.chunks.size()) continue;  // not uploaded yet
+    const ribbonChunk &chunk = ribbons.chunks[c];
+    if (chunk.buffer == 0 || chunk.segments == 0) continue;
+    glBindBuffer(GL_ARRAY_BUFFER, chunk.buffer);
+    if (shaded) {
+      // the buffer's times count from its pool chunk's base
+      float base = c < frame.chunkTimes.size() ? frame.chunkTimes[c] : frame.timeBase;
+      glUniform1f(ribbonShader.now, frame.strokeClock - base);
+      bindPackedLines(ribbonShader, (const char*)0, 0);
+      glDrawArrays(GL_POINTS, 0, chunk.segments);
+    } else {
+      glVertexPointer(3, GL_FLOAT, 0, (const GLvoid*)0);
+      glColorPointer(3, GL_FLOAT, 0, (const GLvoid*)(RIBBON_CHUNK * 12 * sizeof(float)));
+      glDrawArrays(GL_QUADS, 0, chunk.segments * 4);
+    }
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  if (shaded) {
+    if (!commands.ribbons.empty()) {
+      glUniform1f(ribbonShader.now, frame.strokeClock - frame.timeBase);
+      bindPackedLines(ribbonShader, (const char*)&commands.ribbons[0], 0);
+      glDrawArrays(GL_POINTS, 0, commands.ribbons.size());
+    }
+    unbindPackedLines(ribbonShader);
+    glUseProgram(0);
+  } else {
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBegin(GL_QUADS);
+    for (int i = 0; i < commands.ribbons.size(); i++) {
+      myline cline = unpackLine(commands.ribbons[i]);
+      float corners[12];
+      ribbonCorners(cline, corners);
+      glColor3f(cline.r, cline.g, cline.b);
+      for (int v = 0; v < 12; v += 3) glVertex3fv(corners + v);
+    }
+    glEnd();
+  }
+}
+
+// end of ribbons /////////////////////////////////////////////////////////////
+
+void clearFrame() {
+  glClearColor(0, 0, 0, 0);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void drawTile(const sceneFrame &frame, const tileView &tile, const tileCommands &commands, const ribbonCache &ribbons) {
+  glViewport(tile.x, tile.y, tile.width, tile.height);
+
+//  glEnable(GL_LIGHTING) ;
+//  glEnable(GL_LIGHT0);
+  glEnable(GL_COLOR_MATERIAL);
+  glEnable(GL_NORMALIZE);
+  glEnable(GL_DEPTH_TEST);
+
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  glFrustum(tile.left, tile.right, tile.bottom, tile.top, nearPlane, farPlane);
+//  gluPerspective(45, screenAspectRatio, .1, 5000);
+
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  gluLookAt(cameraEye[0], cameraEye[1], cameraEye[2],
+            cameraCenter[0], cameraCenter[1], cameraCenter[2],
+            cameraUp[0], cameraUp[1], cameraUp[2]);
+
+  glTranslatef(sceneOffset[0], sceneOffset[1], sceneOffset[2]);
+
+  // draw huge wireframe cubes that spin in response to user movement
+  // disabled; doesn't seem useful for a drawing application.
+  /*glBlendFunc(GL_ONE, GL_ZERO);
+  glLineWidth(5.0f);
+  float avgVel = calculateAverageVelocity();
+  cubeRotationA += (avgVel * 3);
+  cubeRotationB += (avgVel * 5);
+  cubeRotationC += (avgVel * 7);
+  cubeColorR += 0.01f;
+  cubeColorG += 0.03f;
+  cubeColorB += 0.05f;
+  if (cubeColorR > 1.0f) cubeColorR = 0.0f;
+  if (cubeColorG > 1.0f) cubeColorG = 0.0f;
+  if (cubeColorB > 1.0f) cubeColorB = 0.0f;
+  glColor4f(cubeColorR, cubeColorG, cubeColorB, 1.0f);
+  glPushMatrix();
+  glRotatef(cubeRotationA, 0.0f, 0.0f, 1.0f);
+  glutWireSphere(6.0, 8, 8);
+  glPopMatrix();
+  glColor4f(cubeColorB, cubeColorR, cubeColorG, 1.0f);
+  glPushMatrix();
+  glRotatef(cubeRotationB, 0.0f, 1.0f, 0.0f);
+  glutWireSphere(6.0, 8, 8);
+  glPopMatrix();
+  glColor4f(cubeColorG, cubeColorB, cubeColorR, 1.0f);
+  glPushMatrix();
+  glRotatef(cubeRotationC, 1.0f, 0.0f, 0.0f);
+  glutWireSphere(6.0, 8, 8);
+  glPopMatrix();
+  glLineWidth(1.0f); */
+  glBlendFunc(GL_SRC_COLOR, GL_DST_COLOR);
+
+  {
+  PROFILE_SCOPE(PROFILE_SPHERES);
+  for (int i = 0; i < frame.spheres.size(); i++) {
+    const frameSphere &sphere = frame.spheres[i];
+    glPushMatrix();
+    glTranslatef(sphere.position.x, sphere.position.y, sphere.position.z);
+    glColor4f(sphere.r, sphere.g, sphere.b, sphere.a);
+    drawSphere(sphere.radius, sphere.detail, sphere.detail);
+    glPopMatrix();
+  }
+  }
+
+  // draw lines
+  if (!commands.lines.empty()) {
+    PROFILE_SCOPE(PROFILE_LINES);
+    drawLines(frame, tile, commands);
+  }
+
+  if (!commands.ribbonChunks.empty() || !commands.ribbons.empty()) {
+    PROFILE_SCOPE(PROFILE_LINES);
+    drawRibbons(frame, ribbons, tile, commands);
+  }
+
+  // display particles
+  /*for (int i = particles.size() - 1; i >= 0; i--) {
+    particles[i].colorA -= 0.0025f;
+    if (particles[i].colorA <= 0) particles.erase(particles.begin() + i);
+    else {
+      particles[i].x += particles[i].x_vel;
+      particles[i].y += particles[i].y_vel;
+      particles[i].z += particles[i].z_vel;
+      glPushMatrix();
+      glTranslatef(particles[i].x, particles[i].y, particles[i].z);
+      glColor4f(particles[i].colorR, particles[i].colorG,
+        particles[i].colorB, particles[i].colorA);
+      glutSolidCube(0.07);
+      glPopMatrix();
+    }
+  } */
+
+
+}
+
+void drawTiles(const sceneFrame &frame, const vector<tileView> &tiles, const vector<tileCommands> &commands,
+               const ribbonCache &ribbons) {
+  clearFrame();
+  for (int i = 0; i < tiles.size(); i++) drawTile(frame, tiles[i], commands[i], ribbons);
+}
+
+// Tiles are "left,right,bottom,top" frustums separated by '/', laid out left
+// to right in one width x height viewport each.
+bool parseTiles(const char *spec, int width, int height, vector<tileView> &tiles) {
+  const char *p = spec;
+  while (*p) {
+    tileView tile;
+    int consumed = 0;
+    if (sscanf(p, "%lf,%lf,%lf,%lf%n", &tile.left, &tile.right, &tile.bottom, &tile.top, &consumed) != 4) return false;
+    tile.x = tiles.size() * width;
+    tile.y = 0;
+    tile.width = width;
+    tile.height = height;
+    tiles.push_back(tile);
+    p += consumed;
+    if (*p == '/') p++;
+    else if (*p) return false;
+  }
+  return !tiles.empty();
+}
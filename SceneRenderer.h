@@ -0,0 +1,175 @@
+// GL drawing of a SceneState frame, shared by the GLUT window, headless
+// mode and the benchmarks
+// Author: James Walker jwwalker a+ mtu d0+ edu
+
+#ifndef SCENE_RENDERER_H
+#define SCENE_RENDERER_H
+
+#include <GL/gl.h>
+#include <map>
+
+#include "SceneState.h"
+
+const GLdouble SCREEN_WIDTH = (1920*3);
+const GLdouble SCREEN_HEIGHT = 1080;
+const float screenAspectRatio = SCREEN_WIDTH/SCREEN_HEIGHT;
+
+// One slice of the wall: the frustum the slave takes on its command line,
+// and where it goes in the window.
+typedef struct tileView {
+  double left, right, bottom, top;
+  int x, y, width, height;
+} tileView;
+
+// Stroke style variables **CUSTOMIZABLE**
+// Plain lines are drawn by a shader from what was recorded with each line:
+// its ends, its colour, when it was drawn and how fast the hand was moving.
+// Changing lineStyle (below) restyles the whole canvas on the next frame
+// without touching the lines.
+const float STROKE_SPEED_WIDTH = -0.4f; // Change in a line's width per metre a second the hand was moving, as a
+                                        // fraction of LINE_THICKNESS's width. Negative thins fast strokes, as a
+                                        // brush does; 0 draws every line at the width its height gives it.
+const float STROKE_MIN_WIDTH = 0.3f;    // Bounds on that change, as fractions of the width the height gives.
+const float STROKE_MAX_WIDTH = 1.0f;
+const float STROKE_SPEED_GLOW = 0.15f;  // How much brighter a line is per metre a second, as a fraction of its
+                                        // colour; the colour cycle still picks the hue.
+const float STROKE_FADE_SECONDS = 0;    // Lines fade to nothing over this many seconds after they are drawn, so
+                                        // the canvas only holds the recent performance. 0 keeps them until the
+                                        // stroke pool reuses their slots (the slave's --fade overrides it).
+
+typedef struct strokeStyle {
+  float thickness;          // LINE_THICKNESS
+  float speedWidth, minWidth, maxWidth;
+  float speedGlow;
+  float fadeSeconds;        // 0 = never fade
+} strokeStyle;
+
+extern strokeStyle lineStyle;
+
+// A tile's lines in draw order, with only the lines that can touch the
+// tile. Each is drawn as one instance of a quad the shader extrudes, straight
+// from the packed line. Ribbons are culled and simplified a chunk at a time:
+// a chunk near enough to need every segment is drawn from its vertex buffer,
+// the rest from their coarse copies, all in one draw.
+typedef struct tileCommands {
+  vector<packedLine> lines;
+  size_t culled;            // slots skipped as off-tile, line by line or a chunk at a time
+  vector<int> ribbonChunks; // ribbon chunks to draw in full
+  vector<packedLine> ribbons;  // coarse ribbons standing in for the other chunks on the tile
+} tileCommands;
+
+const int RIBBON_CHUNK = POOL_CHUNK;  // pool slots per ribbon vertex buffer
+
+// A run of pool slots within one chunk, copied while the scene is locked
+// and uploaded once it is released. Slots with nothing to extrude (plain
+// lines, erased lines, ribbons on hidden layers) have their sides zeroed.
+typedef struct ribbonUpload {
+  int chunk;
+  int offset;               // first slot within the chunk
+  int count;
+  vector<packedLine> lines;
+} ribbonUpload;
+
+// One vertex buffer of RIBBON_CHUNK segments. With the stroke shaders it
+// holds the packed lines themselves, each drawn as one instance of a quad;
+// without, all the quads' corner positions, then all their colours. Which
+// tiles draw it is up to the matching lodChunk's ribbon bounds.
+typedef struct ribbonChunk {
+  GLuint buffer;            // 0 until the first upload
+  int segments;             // slots in use
+} ribbonChunk;
+
+// The GPU copy of the pool's ribbons, kept in step with the scene by
+// uploading only the slots each frame marks as changed.
+typedef struct ribbonCache {
+  vector<ribbonChunk> chunks;
+  vector<ribbonUpload> pending;
+  int numPending;
+  size_t uploadedBytes;     // running total, for the benchmarks
+  vector<float> positions;  // scratch for the fixed-function upload
+  vector<float> colors;
+} ribbonCache;
+
+// Level-of-detail variables **CUSTOMIZABLE**
+const int LOD_LEVELS = 2;           // Coarser copies kept of each chunk of lines and ribbons, besides the lines
+                                    // themselves.
+const float LOD_TOLERANCE[LOD_LEVELS] = { 0.001f, 0.004f };
+                                    // About how far, in metres, each level may move a line or a ribbon's edge.
+                                    // Each level merges nearly straight runs of a stroke, then snaps plain line
+                                    // ends to cells this size, keeping one line per pair of cells, so overdrawn
+                                    // areas thin out. Ribbons are only merged; snapping would twist them.
+const float LOD_PIXELS = 0.75f;     // A chunk is drawn at the coarsest level whose tolerance looks no bigger than
+                                    // this many pixels in a tile, judged at the chunk's nearest corner. Raise it
+                                    // for speed at the cost of visibly simplified strokes; 0 turns LOD off.
+const int LOD_AGE = 60;             // Frames a chunk must go unchanged before its levels are built, so that the
+                                    // chunk being drawn into isn't rebuilt every frame.
+const int LOD_BUILDS_PER_FRAME = 1; // Chunks whose levels may be built in one frame; building holds the scene lock.
+
+const int LOD_CHUNK = RIBBON_CHUNK; // pool slots per level-of-detail chunk
+
+// One chunk of the pool. The bounds cover every drawn line written to it,
+// and the ribbon bounds every drawn ribbon's quad; both only grow until the
+// levels are rebuilt, and are empty (lo > hi) while there is nothing of the
+// kind to draw. A chunk that changes is drawn in full until it has aged again.
+typedef struct lodChunk {
+  float lo[3], hi[3];
+  float ribbonLo[3], ribbonHi[3];
+  int changed;              // frame of the last change
+  bool built;               // the levels match the chunk
+  vector<packedLine> levels[LOD_LEVELS];
+  vector<packedLine> ribbonLevels[LOD_LEVELS];
+} lodChunk;
+
+typedef struct lodCache {
+  vector<lodChunk> chunks;
+  int frame;
+  bool disabled;            // draw every chunk in full; the bounds still cull
+  int built;                // chunks built so far, for the benchmarks
+} lodCache;
+
+// Set up blending and build the stroke shaders. Without GLSL and instanced
+// arrays (GL 3.3) lines are drawn with the fixed-function pipeline instead,
+// a glLineWidth() per change of width.
+void initGL();
+void drawSphere(double radius, int slices, int stacks);
+
+// Note the frame's changed chunks and build the levels of one that has aged.
+// Needs no GL context; call it with the scene locked, straight after
+// buildFrame().
+void stageLod(const sceneFrame &frame, lodCache &lod);
+
+// Build one tile's commands, each chunk at the level that suits the tile.
+// Needs no GL context, and only reads the frame and the levels.
+void buildTileCommands(const sceneFrame &frame, const lodCache &lod, const tileView &tile, tileCommands &commands);
+// Build every tile's commands, spread over one thread per core; the threads
+// are started on the first call and kept waiting between frames.
+void buildAllTileCommands(const sceneFrame &frame, const lodCache &lod, const vector<tileView> &tiles,
+                          vector<tileCommands> &commands);
+
+// Quad corners (x1 + side1, x1 - side1, x2 - side2, x2 + side2) and colours
+// for count segments, for drawing without the stroke shaders. Segments that
+// aren't ribbons collapse to zero area, leaving them to the line path. Uses
+// SSE2 where available.
+void buildRibbonVertices(const packedLine *segments, int count, float *positions, float *colors);
+
+// Copy the frame's changed slots. Needs no GL context; call it with the
+// scene locked, straight after buildFrame().
+void stageRibbons(const sceneFrame &frame, ribbonCache &cache);
+// Copy the staged slots, or without the stroke shaders the quads built from
+// them, into their chunks' buffers.
+void uploadRibbons(ribbonCache &cache);
+void freeRibbons(ribbonCache &cache);
+
+// Clear the drawable, then draw each tile into its viewport. Uses the
+// frame's spheres but not its strokes, so the scene may change once the
+// commands are built and the ribbons staged.
+void clearFrame();
+void drawTile(const sceneFrame &frame, const tileView &tile, const tileCommands &commands, const ribbonCache &ribbons);
+void drawTiles(const sceneFrame &frame, const vector<tileView> &tiles, const vector<tileCommands> &commands,
+               const ribbonCache &ribbons);
+
+// Parse "l,r,b,t/l,r,b,t/..." into tiles laid out left to right, each
+// width x height. Returns false on a malformed spec.
+bool parseTiles(const char *spec, int width, int height, vector<tileView> &tiles);
+
+#endif
@@ -0,0 +1,1021 @@
+// Scene state for GestureResponseSlave
+// Author: James Walker jwwalker a+ mtu d0+ edu
+
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "SceneState.h"
+#include "LineParser.h"
+#include "Profiler.h"
+#include "Protocol.h"
+
+// Each palette is an order in which to deal the colour cycle out to red,
+// green and blue; the first leaves it as it is.
+static const int paletteChannels[NUM_PALETTES][3] = { {0, 1, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0} };
+
+// Past this many separate changed ranges in the pool, a frame uploads the
+// span covering them all instead.
+const int MAX_DIRTY_RANGES = 64;
+
+// Buckets the erasing grid's cells hash into; a power of two.
+const int GRID_BUCKETS = 65536;
+
+const size_t HUGE_PAGE = 2 * 1048576;
+
+// What each packet of a backlog is, for applyPackets(); the old ones have
+// been superseded by a newer one later in the backlog.
+enum packetKind { PACKET_CONTROL, PACKET_OCCLUSION, PACKET_SAMPLE, PACKET_OLD_SAMPLE, PACKET_MARKER, PACKET_OLD_MARKER };
+
+void error(const char *msg);
+
+float absFloat(float f) {
+  if (f >= 0) return f;
+  else return -f;
+}
+
+float computeAverage(vector<float> values) {
+  float avg = 0.0f;
+  for (int i = 0; i < values.size(); i++) {
+    avg += values[i];
+  }
+  avg /= values.size();
+  return avg;
+}
+
+float compute3dDistance(trackable t1, trackable t2) {
+  float xd = t1.x - t2.x;
+  float yd = t1.y - t2.y;
+  float zd = t1.z - t2.z;
+  return sqrt(xd*xd + yd*yd + zd*zd);
+}
+
+float computeAverageDistance(const vector<trackable> &t) {
+  float total = 0.0f;
+  int pairs = 0;
+  for (int i = 0; i < t.size() - 1; i++) {
+    for (int j = i + 1; j < t.size(); j++) {
+      total += compute3dDistance(t[i], t[j]);
+      pairs++;
+    }
+  }
+  return total / pairs;
+}
+
+SceneState::SceneState(int numTrackedObjects, bool simulation)
+  : numTrackedObjects(numTrackedObjects), simulation(simulation),
+    clockStart(-1), strokeClock(0), untimedClock(0), averageDistance(0), distanceMeasured(false), executionCtr(0), totalCtr(0), lastControlEvent(0),
+    nextStroke(1), activeLayer(0), visibleLayers((1u << NUM_LAYERS) - 1),
+    drawingOn(true), palette(0),
+    lineRed(1.0), lineGreen(0.5), lineBlue(0.0),
+    lineRedDir(-1.0), lineGreenDir(1.0), lineBlueDir(1.0) {
+  dirtyLines.reserve(MAX_DIRTY_RANGES);
+  initKinematics(motion);
+  setPoolBudget(STROKE_POOL_MB);
+}
+
+// ***STROKE ARENA***
+
+strokeArena::strokeArena() : lines(NULL), used(0), mappedBytes(0), huge(false) {
+}
+
+strokeArena::~strokeArena() {
+  release();
+}
+
+void strokeArena::release() {
+  if (lines != NULL) munmap(lines, mappedBytes);
+  lines = NULL;
+  used = 0;
+  mappedBytes = 0;
+  huge = false;
+}
+
+void strokeArena::reserve(int capacity, bool hugePages) {
+  release();
+  int chunks = (capacity + POOL_CHUNK - 1) / POOL_CHUNK;
+  size_t bytes = (size_t)chunks * POOL_CHUNK * sizeof(packedLine);
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (hugePages) {
+    mappedBytes = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    p = mmap(NULL, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    huge = p != MAP_FAILED;
+  }
+#endif
+  if (p == MAP_FAILED) {
+    mappedBytes = bytes;
+    p = mmap(NULL, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) error("ERROR mapping the stroke pool");
+#ifdef MADV_HUGEPAGE
+    if (hugePages) madvise(p, mappedBytes, MADV_HUGEPAGE);
+#endif
+    // fault every page in now rather than one at a time as lines arrive
+    for (size_t offset = 0; offset < mappedBytes; offset += 4096) ((volatile char*)p)[offset] = 0;
+  }
+  lines = (packedLine*)p;
+}
+
+// end of stroke arena ////////////////////////////////////////////////////////
+
+void SceneState::addAfterImage(const string &key, trackable addMe) {
+  if (afterImages[key].size() < numAfterImages) {
+    afterImages[key].push_back(addMe);
+  } else {
+    afterImages[key].erase(afterImages[key].end()-1);
+    afterImages[key].insert(afterImages[key].begin(), addMe);
+  } /* */
+}
+
+trackable SceneState::getColors() {
+  trackable color;
+  color.x = color.y = color.z = 1.0f;
+  if (distanceMeasured) {
+    color.x = averageDistance / 2.0f;
+    color.z = 1.0f - averageDistance / 2.0f;
+    if (color.x > color.z) color.y = color.x - color.z;
+    else color.y = color.z - color.x;
+    if (color.x > 1.0f) color.x = 1.0f;
+    if (color.z < 0.0f) color.z = 0.0f;
+    if (color.y > 1.0f) color.y = 1.0f;
+  }
+  return color;
+}
+
+void SceneState::averageDistanceHelper() {
+            PROFILE_SCOPE(PROFILE_AVGDIST);
+            executionCtr++;
+            if (trackNames.size() == numTrackedObjects) {
+              vector<trackable> &points = distancePoints;
+              points.clear();
+              // a resampling master skips objects that haven't moved, so
+              // each is wherever its newest sample put it
+              for (int i = 0; i < trackNames.size(); i++) {
+                float position[3];
+                newestPosition(motion, i, position);
+                trackable point = { position[0], position[1], position[2] };
+                points.push_back(point);
+              }
+              averageDistance = computeAverageDistance(points);
+              distanceMeasured = true;
+            }
+}
+
+// The wand's local x axis rotated into the scene, scaled to half the ribbon
+// width; the ribbon is extruded that far either side of the stroke.
+trackable brushSide(const orientation &q) {
+  trackable side;
+  float half = RIBBON_WIDTH * 0.5f;
+  side.x = (1.0f - 2.0f * (q.y * q.y + q.z * q.z)) * half;
+  side.y = 2.0f * (q.x * q.y + q.w * q.z) * half;
+  side.z = 2.0f * (q.x * q.z - q.w * q.y) * half;
+  return side;
+}
+
+void SceneState::markDirty(int first, int count) {
+  vector<strokeUpdate> &ranges = dirtyLines;
+  // drawing dirties one slot after another, so usually this just grows the
+  // last range
+  if (!ranges.empty()) {
+    strokeUpdate &range = ranges.back();
+    int last = range.first + range.count;
+    if (first <= last && first + count >= range.first) {
+      if (first + count > last) last = first + count;
+      if (first < range.first) range.first = first;
+      range.count = last - range.first;
+      return;
+    }
+  }
+  if (ranges.size() >= MAX_DIRTY_RANGES) {
+    strokeUpdate &span = ranges[0];
+    int last = first + count;
+    for (int r = 0; r < ranges.size(); r++) {
+      if (ranges[r].first + ranges[r].count > last) last = ranges[r].first + ranges[r].count;
+      if (ranges[r].first < first) first = ranges[r].first;
+    }
+    span.first = first;
+    span.count = last - first;
+    ranges.resize(1);
+    return;
+  }
+  strokeUpdate update;
+  update.first = first;
+  update.count = count;
+  ranges.push_back(update);
+}
+
+// ***STROKE INDEX***
+
+static inline int gridCoord(float v) {
+  return (int)floorf(v / GRID_CELL);
+}
+
+// Cells hash into a fixed number of buckets. Cells that share one are
+// searched together, which costs an eraser a few extra distance checks but
+// never misses a segment.
+static inline int gridBucket(int cx, int cy, int cz) {
+  unsigned int h = (unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u ^ (unsigned int)cz * 83492791u;
+  return h & (GRID_BUCKETS - 1);
+}
+
+static inline int gridBucket(float x, float y, float z) {
+  return gridBucket(gridCoord(x), gridCoord(y), gridCoord(z));
+}
+
+// Take an entry from the free list and make it the newest live stroke. A
+// full table makes room by erasing its oldest stroke.
+int SceneState::startStroke(unsigned int id, int layer, int object) {
+  if (freeRecord == -1) {
+    int evicted = records[oldestRecord].live;
+    eraseStroke(oldestRecord);
+    poolEvicted += evicted;
+  }
+  int r = freeRecord;
+  strokeRecord &record = records[r];
+  freeRecord = record.older;
+  record.id = id;
+  record.layer = layer;
+  record.object = object;
+  record.live = 0;
+  record.last = -1;
+  record.older = newestRecord;
+  record.newer = -1;
+  if (newestRecord != -1) records[newestRecord].newer = r;
+  else oldestRecord = r;
+  newestRecord = r;
+  numStrokes++;
+  return r;
+}
+
+void SceneState::endStroke(int r) {
+  strokeRecord &record = records[r];
+  if (record.older != -1) records[record.older].newer = record.newer;
+  else oldestRecord = record.newer;
+  if (record.newer != -1) records[record.newer].older = record.older;
+  else newestRecord = record.older;
+  record.id = 0;
+  record.older = freeRecord;
+  freeRecord = r;
+  numStrokes--;
+}
+
+// Erase every live segment of a stroke, newest first. The chain stops at
+// the first slot the pool has given to another stroke: slots are reused
+// oldest first, so the stroke's older ones have gone too.
+void SceneState::eraseStroke(int r) {
+  unsigned int id = records[r].id;
+  int slot = records[r].last;
+  for (int steps = 0; slot != -1 && records[r].id == id && links[slot].record == r && steps < pool.size(); steps++) {
+    int prev = links[slot].strokePrev;
+    if (isLive(pool[slot])) eraseSegment(slot);
+    slot = prev;
+  }
+  if (records[r].id == id) endStroke(r);  // every segment had already gone
+}
+
+void SceneState::linkNode(int node, int bucket) {
+  slotLinks &link = links[node >> 1];
+  int head = gridBuckets[bucket];
+  link.next[node & 1] = head;
+  link.prev[node & 1] = -1;
+  if (head != -1) links[head >> 1].prev[head & 1] = node;
+  gridBuckets[bucket] = node;
+}
+
+void SceneState::unlinkNode(int node, int bucket) {
+  slotLinks &link = links[node >> 1];
+  int prev = link.prev[node & 1], next = link.next[node & 1];
+  if (prev != -1) links[prev >> 1].next[prev & 1] = next;
+  else gridBuckets[bucket] = next;
+  if (next != -1) links[next >> 1].prev[next & 1] = prev;
+}
+
+// Chain a live segment to its stroke and link it under the buckets of both
+// its ends.
+void SceneState::indexSegment(int r, int slot) {
+  myline cline = unpackLine(pool[slot]);
+  int a = gridBucket(cline.x1, cline.y1, cline.z1);
+  int b = gridBucket(cline.x2, cline.y2, cline.z2);
+  linkNode(slot * 2, a);
+  if (b != a) linkNode(slot * 2 + 1, b);
+  strokeRecord &record = records[r];
+  links[slot].record = r;
+  links[slot].strokePrev = record.last;
+  record.last = slot;
+  record.live++;
+  liveSegments++;
+}
+
+// Take a live segment out of the index, before it is erased or overwritten.
+void SceneState::unindexSegment(int slot) {
+  myline cline = unpackLine(pool[slot]);
+  int a = gridBucket(cline.x1, cline.y1, cline.z1);
+  int b = gridBucket(cline.x2, cline.y2, cline.z2);
+  unlinkNode(slot * 2, a);
+  if (b != a) unlinkNode(slot * 2 + 1, b);
+  liveSegments--;
+  int r = links[slot].record;
+  if (--records[r].live <= 0) endStroke(r);
+}
+
+// Leave the slot in place as a tombstone, so nothing else moves.
+void SceneState::eraseSegment(int slot) {
+  unindexSegment(slot);
+  packedLine &cline = pool[slot];
+  cline.flags &= ~PACKED_LIVE;
+  cline.sx1 = cline.sy1 = cline.sz1 = 0;  // collapses its ribbon
+  cline.sx2 = cline.sy2 = cline.sz2 = 0;
+  markDirty(slot, 1);
+}
+
+void SceneState::markStrokeDirty(int r) {
+  // the chain runs newest first; mark each run of neighbouring slots at once
+  int slot = records[r].last;
+  int first = -1, last = -1;
+  // a stroke longer than the pool has overwritten its own start, so the
+  // chain can lead back round to its newest slot
+  for (int steps = 0; slot != -1 && links[slot].record == r && steps < pool.size(); steps++) {
+    if (slot == first - 1) {
+      first = slot;
+    } else {
+      if (first != -1) markDirty(first, last - first + 1);
+      first = last = slot;
+    }
+    slot = links[slot].strokePrev;
+  }
+  if (first != -1) markDirty(first, last - first + 1);
+}
+
+// Empty every table without giving any memory back.
+void SceneState::resetIndex() {
+  for (int b = 0; b < gridBuckets.size(); b++) gridBuckets[b] = -1;
+  for (int r = 0; r < records.size(); r++) {
+    records[r].id = 0;
+    records[r].older = r + 1 < records.size() ? r + 1 : -1;
+  }
+  freeRecord = records.empty() ? -1 : 0;
+  oldestRecord = newestRecord = -1;
+  numStrokes = 0;
+  liveSegments = 0;
+  for (map<string, int>::iterator it = currentRecord.begin(); it != currentRecord.end(); it++) it->second = -1;
+}
+
+// strokes has each slot's stroke id. Segments don't record which object
+// drew them, so only strokes still being drawn get their names back; undo
+// only needs those.
+void SceneState::rebuildIndex(const vector<unsigned int> &strokes) {
+  resetIndex();
+  map<unsigned int, int> started;
+  int oldest = poolHead + 1 < pool.size() ? poolHead + 1 : 0;
+  for (int i = 0; i < pool.size(); i++) {
+    int slot = (oldest + i) % pool.size();
+    unsigned int stroke = strokes[slot];
+    if (!isLive(pool[slot])) continue;
+    if (stroke == 0) {  // live, but no stroke to put it in
+      pool[slot].flags &= ~PACKED_LIVE;
+      continue;
+    }
+    map<unsigned int, int>::iterator record = started.find(stroke);
+    if (record == started.end()) {
+      record = started.insert(make_pair(stroke, startStroke(stroke, pool[slot].flags & PACKED_LAYER_MASK, -1))).first;
+    }
+    indexSegment(record->second, slot);
+    if (stroke >= nextStroke) nextStroke = stroke + 1;
+  }
+  for (map<string, myline>::iterator it = currentLine.begin(); it != currentLine.end(); it++) {
+    map<unsigned int, int>::iterator record = started.find(it->second.stroke);
+    if (it->second.stroke == 0 || record == started.end() || records[record->second].id != it->second.stroke) continue;
+    records[record->second].object = objectIndex(it->first);
+    currentRecord[it->first] = record->second;
+  }
+}
+
+int SceneState::objectIndex(const string &name) {
+  for (int i = 0; i < objectNames.size(); i++) {
+    if (objectNames[i] == name) return i;
+  }
+  objectNames.push_back(name);
+  return objectNames.size() - 1;
+}
+
+// end of stroke index ////////////////////////////////////////////////////////
+
+// Write a line into its slot, or onto the end of the pool, with its time
+// against its chunk's base. The first line in an empty chunk sets the base.
+// A line too new for the base moves it up to half the range before the
+// line, and with it the chunk's older lines, clamping the oldest at that.
+void SceneState::storeLine(int slot, packedLine cline, float time) {
+  int c = slot / POOL_CHUNK;
+  int first = c * POOL_CHUNK;
+  if (slot == first && slot >= pool.size()) {
+    chunkTimes[c] = timeGrid(time);
+  } else if (time - chunkTimes[c] >= PACKED_TIME_RANGE) {
+    float base = timeGrid(time - PACKED_TIME_RANGE / 2);
+    int end = first + POOL_CHUNK < pool.size() ? first + POOL_CHUNK : pool.size();
+    int shift = timeShift(chunkTimes[c], base);
+    for (int i = first; i < end; i++) pool[i].time = shiftTime(pool[i].time, shift);
+    chunkTimes[c] = base;
+    markDirty(first, end - first);
+  }
+  cline.time = packTime(time, chunkTimes[c]);
+  if (slot >= pool.size()) pool.push_back(cline);
+  else pool[slot] = cline;
+}
+
+// Extend name's stroke to sample and store the new segment. side is the
+// brush direction from brushSide(), or all zero for an unoriented sample.
+void SceneState::recordLine(const string &name, trackable sample, trackable side, float speed) {
+  PROFILE_SCOPE(PROFILE_RECORD);
+
+  // a stroke starts with an object's first segment, after a break, or when
+  // the active layer changes under it
+  if (currentLine[name].stroke == 0 || currentLine[name].layer != activeLayer) {
+    currentLine[name].stroke = nextStroke++;
+    if (nextStroke == 0) nextStroke = 1;
+    currentLine[name].layer = activeLayer;
+  }
+
+  double channels[3] = { lineRed, lineGreen, lineBlue };
+  currentLine[name].r = channels[paletteChannels[palette][0]];
+  currentLine[name].g = channels[paletteChannels[palette][1]];
+  currentLine[name].b = channels[paletteChannels[palette][2]];
+
+  currentLine[name].x1 = currentLine[name].x2;
+  currentLine[name].y1 = currentLine[name].y2;
+  currentLine[name].z1 = currentLine[name].z2;
+
+  currentLine[name].x2 = sample.x;
+  currentLine[name].y2 = sample.y;
+  currentLine[name].z2 = sample.z;
+
+  currentLine[name].sx1 = currentLine[name].sx2;
+  currentLine[name].sy1 = currentLine[name].sy2;
+  currentLine[name].sz1 = currentLine[name].sz2;
+
+  currentLine[name].sx2 = side.x;
+  currentLine[name].sy2 = side.y;
+  currentLine[name].sz2 = side.z;
+
+  currentLine[name].time = strokeClock;
+  currentLine[name].speed = speed;
+
+  myline newLine;
+  newLine.x1 = currentLine[name].x1; newLine.x2 = currentLine[name].x2;
+  newLine.y1 = currentLine[name].y1; newLine.y2 = currentLine[name].y2;
+  newLine.z1 = currentLine[name].z1; newLine.z2 = currentLine[name].z2;
+  newLine.r = currentLine[name].r;
+  newLine.g = currentLine[name].g;
+  newLine.b = currentLine[name].b;
+  newLine.sx1 = currentLine[name].sx1; newLine.sx2 = currentLine[name].sx2;
+  newLine.sy1 = currentLine[name].sy1; newLine.sy2 = currentLine[name].sy2;
+  newLine.sz1 = currentLine[name].sz1; newLine.sz2 = currentLine[name].sz2;
+  newLine.time = currentLine[name].time;
+  newLine.speed = currentLine[name].speed;
+  newLine.stroke = currentLine[name].stroke;
+  newLine.layer = currentLine[name].layer;
+
+  // the slot after the newest holds the oldest line in the pool
+  int slot = poolHead + 1;
+  if (slot >= poolCapacity) slot = 0;
+  if (slot < pool.size() && isLive(pool[slot])) {
+    unindexSegment(slot);
+    poolEvicted++;
+  }
+  storeLine(slot, packLine(newLine, 0), newLine.time);
+  poolHead = slot;
+  markDirty(slot, 1);
+
+  map<string, int>::iterator current = currentRecord.find(name);
+  if (current == currentRecord.end()) current = currentRecord.insert(make_pair(name, -1)).first;
+  // the eraser may have taken the whole stroke so far
+  if (current->second == -1 || records[current->second].id != newLine.stroke) {
+    current->second = startStroke(newLine.stroke, newLine.layer, objectIndex(name));
+  }
+  indexSegment(current->second, slot);
+}
+
+void SceneState::apply(const sceneSample &sample, bool latest, double time) {
+  const string &name = sample.name;
+  trackable newTrackData = sample.position;
+  if (newTrackData.x == 0 && newTrackData.y == 0 && newTrackData.z == 0) {
+    applyOcclusion(name);
+    return;
+  }
+  // both keep an entry per object once it has been seen, so that a sample
+  // never has to allocate one
+  occluded[name] = false;
+  bool &pendingBreak = breaks[name];
+  bool restart = pendingBreak;
+  pendingBreak = false;
+  map<string, int>::iterator known = trackIndex.find(name);
+  int object;
+  if (known != trackIndex.end()) {
+    object = known->second;
+  } else {
+    trackNames.push_back(name);
+    object = addKinematicObject(motion);
+    trackIndex[name] = object;
+    if (currentLine.count(name) == 0) { // else continue the stroke a snapshot left off
+      myline newcline;
+      newcline.x1 = newcline.x2 = newTrackData.x;
+      newcline.y1 = newcline.y2 = newTrackData.y;
+      newcline.z1 = newcline.z2 = newTrackData.z;
+      newcline.sx1 = newcline.sx2 = 0;
+      newcline.sy1 = newcline.sy2 = 0;
+      newcline.sz1 = newcline.sz2 = 0;
+      newcline.time = newcline.speed = 0;
+      newcline.stroke = 0;
+      newcline.layer = activeLayer;
+      currentLine[name] = newcline;
+    }
+  }
+  float position[3] = { newTrackData.x, newTrackData.y, newTrackData.z };
+  // live samples without a time are spread evenly over the frame, so even
+  // ones a backlog coalesced keep their own
+  if (!simulation) untimedClock += 1.0 / ((double)dataHertz * trackNames.size());
+  if (time < 0) time = untimedClock;
+  float speed = speedTo(motion, object, position, time);
+  recordKinematics(motion, object, position, time);
+  if (clockStart < 0) clockStart = time;
+  if (time - clockStart > strokeClock) strokeClock = time - clockStart;
+  if (latest && executionCtr % 3 == 0) addAfterImage(name, newTrackData);
+
+  // ADD LINE RECORDING FOR ARTIST VERSION
+  trackable side;
+  side.x = side.y = side.z = 0;
+  if (sample.oriented) side = brushSide(sample.rotation);
+  if (restart) { // first point of a new stroke
+    myline &cline = currentLine[name];
+    cline.x2 = newTrackData.x; cline.y2 = newTrackData.y; cline.z2 = newTrackData.z;
+    cline.sx2 = side.x; cline.sy2 = side.y; cline.sz2 = side.z;
+    cline.stroke = 0;
+  } else if (drawingOn /*&& totalCtr % UPDATE_COUNTER == 0*/) {
+    if (speed < 0) speed = currentLine[name].speed;  // no older sample to measure from
+    recordLine(name, newTrackData, side, speed);
+  }
+  // END LINE RECORDING FOR ARTIST VERSION
+
+  if (latest) countSample();
+}
+
+void SceneState::applyOcclusion(const string &name) {
+  // an object that was never seen has no stroke to end
+  map<string, int>::iterator known = trackIndex.find(name);
+  if (known != trackIndex.end()) {
+    occluded[name] = true;
+    breaks[name] = true;
+    resetKinematics(motion, known->second);  // its motion starts again when it's found
+  }
+  countSample();
+}
+
+void SceneState::setDrawing(bool on) {
+  // pen down starts a fresh stroke rather than joining up with where the
+  // hand was when drawing stopped (the master sends no samples meanwhile)
+  if (on) {
+    for (int i = 0; i < trackNames.size(); i++) breaks[trackNames[i]] = true;
+  }
+  drawingOn = on;
+}
+
+void SceneState::clearStrokes() {
+  pool.clear();
+  poolHead = -1;
+  markDirty(0, 0);
+  resetIndex();
+  // strokes still being drawn carry on as new ones
+  for (map<string, myline>::iterator it = currentLine.begin(); it != currentLine.end(); it++) it->second.stroke = 0;
+}
+
+bool SceneState::undoStroke() {
+  if (newestRecord == -1) return false;
+  unsigned int stroke = records[newestRecord].id;
+  int object = records[newestRecord].object;
+  eraseStroke(newestRecord);
+  if (object == -1) return true;
+  const string &name = objectNames[object];
+  map<string, myline>::iterator cline = currentLine.find(name);
+  if (cline != currentLine.end() && cline->second.stroke == stroke) breaks[name] = true;
+  return true;
+}
+
+int SceneState::eraseNear(trackable center, float radius) {
+  int lo[3] = { gridCoord(center.x - radius), gridCoord(center.y - radius), gridCoord(center.z - radius) };
+  int hi[3] = { gridCoord(center.x + radius), gridCoord(center.y + radius), gridCoord(center.z + radius) };
+  vector<int> &victims = eraseVictims;
+  victims.clear();
+  for (int cx = lo[0]; cx <= hi[0]; cx++) {
+    for (int cy = lo[1]; cy <= hi[1]; cy++) {
+      for (int cz = lo[2]; cz <= hi[2]; cz++) {
+        for (int node = gridBuckets[gridBucket(cx, cy, cz)]; node != -1; node = links[node >> 1].next[node & 1]) {
+          int slot = node >> 1;
+          if (segmentDistance2(unpackLine(pool[slot]), center) <= radius * radius) victims.push_back(slot);
+        }
+      }
+    }
+  }
+  int erased = 0;
+  for (int i = 0; i < victims.size(); i++) {
+    // a segment is listed once per end, and a bucket may be searched for
+    // more than one cell
+    if (!isLive(pool[victims[i]])) continue;
+    eraseSegment(victims[i]);
+    erased++;
+  }
+  return erased;
+}
+
+void SceneState::setPalette(int newPalette) {
+  palette = ((newPalette % NUM_PALETTES) + NUM_PALETTES) % NUM_PALETTES;
+}
+
+void SceneState::setActiveLayer(int layer) {
+  activeLayer = ((layer % NUM_LAYERS) + NUM_LAYERS) % NUM_LAYERS;
+  setVisibleLayers(visibleLayers | (1u << activeLayer));
+}
+
+// Only the strokes on layers that appear or disappear need their ribbons
+// rebuilt; the line path checks visibility every frame anyway.
+void SceneState::setVisibleLayers(unsigned int mask) {
+  mask &= (1u << NUM_LAYERS) - 1;
+  unsigned int changed = mask ^ visibleLayers;
+  visibleLayers = mask;
+  if (changed == 0) return;
+  for (int r = oldestRecord; r != -1; r = records[r].newer) {
+    if (changed & (1u << records[r].layer)) markStrokeDirty(r);
+  }
+}
+
+// "!COMMAND~event[~value]". The master repeats each one, so only the first
+// copy of an event is acted on.
+void SceneState::applyControl(const char *payload, size_t len) {
+  parsedLine parsed;
+  if (!parseLine(payload, len, parsed) || parsed.numValues < 1) return;
+  unsigned int event = (unsigned int)parsed.values[0];
+  if (event == lastControlEvent) return;
+  lastControlEvent = event;
+  string command(parsed.name, parsed.nameLen);
+  int value = parsed.numValues > 1 ? (int)parsed.values[1] : 0;
+  if (command == CONTROL_DRAW) setDrawing(value != 0);
+  else if (command == CONTROL_CLEAR) clearStrokes();
+  else if (command == CONTROL_UNDO) undoStroke();
+  else if (command == CONTROL_PALETTE) setPalette(value);
+  else if (command == CONTROL_LAYER) setActiveLayer(value);
+  else if (command == CONTROL_SHOW) setVisibleLayers(value);
+  else if (command == CONTROL_ERASE && parsed.numValues == 5) {
+    trackable center;
+    center.x = parsed.values[1];
+    center.y = parsed.values[2];
+    center.z = parsed.values[3];
+    eraseNear(center, parsed.values[4]);
+  }
+}
+
+void SceneState::countSample() {
+  if (!simulation) {  // counting for live tracking
+    totalCtr++;
+    if (trackNames.size() > 0) {
+      if (totalCtr % trackNames.size() == 0) {
+        averageDistanceHelper();
+      }
+    }
+  }
+}
+
+void SceneState::applyFrameMarker() {
+  if (simulation) { // counting for data dump reading
+    totalCtr++;
+    averageDistanceHelper();
+  }
+}
+
+// Returns false for a frame marker or anything else that isn't a sample or
+// an occlusion. Control messages aren't parsed here.
+bool SceneState::parsePacket(const char *payload, size_t len, parsedLine &parsed) {
+  PROFILE_SCOPE(PROFILE_PARSE);
+  return parseLine(payload, len, parsed) &&
+         (parsed.numValues == 1 || parsed.numValues == 3 || parsed.numValues == 7);
+}
+
+void SceneState::applyParsed(const char *payload, size_t len, bool validLine, const parsedLine &parsed,
+                             bool latest, double time) {
+  if (len > 0 && payload[0] == CONTROL_PREFIX) {  // not a frame marker either
+    applyControl(payload, len);
+    return;
+  }
+  if (validLine && parsed.numValues == 1) {  // "Name~occluded"
+    applyOcclusion(string(parsed.name, parsed.nameLen));
+  } else if (validLine) {  // valid input line
+    sceneSample sample;
+    sample.name.assign(parsed.name, parsed.nameLen);
+    sample.position.x = parsed.values[0];
+    sample.position.y = parsed.values[1];
+    sample.position.z = parsed.values[2];
+    sample.oriented = false;
+    if (parsed.numValues == 7) {
+      // renormalize; the master rounds each component to four decimals
+      float norm = sqrt(parsed.values[3] * parsed.values[3] + parsed.values[4] * parsed.values[4] +
+                        parsed.values[5] * parsed.values[5] + parsed.values[6] * parsed.values[6]);
+      if (norm > 0.5f) {
+        sample.oriented = true;
+        sample.rotation.x = parsed.values[3] / norm;
+        sample.rotation.y = parsed.values[4] / norm;
+        sample.rotation.z = parsed.values[5] / norm;
+        sample.rotation.w = parsed.values[6] / norm;
+      }
+    }
+    apply(sample, latest, time);
+  } else {
+    if (simulation) untimedClock += 1.0 / dataHertz;  // coalesced frames still take their time
+    if (latest) applyFrameMarker();
+  }
+}
+
+void SceneState::applyPacket(const char *payload, size_t len, double time) {
+  parsedLine parsed;
+  bool validLine = !(len > 0 && payload[0] == CONTROL_PREFIX) && parsePacket(payload, len, parsed);
+  applyParsed(payload, len, validLine, parsed, true, time);
+}
+
+int SceneState::applyPackets(const char *const *payloads, const size_t *lens, int count, const double *times) {
+  if (batchLines.size() < count) {
+    batchLines.resize(count);
+    batchKinds.resize(count);
+  }
+  for (int i = 0; i < count; i++) {
+    parsedLine &line = batchLines[i];
+    if (lens[i] > 0 && payloads[i][0] == CONTROL_PREFIX) batchKinds[i] = PACKET_CONTROL;
+    else if (!parsePacket(payloads[i], lens[i], line)) batchKinds[i] = PACKET_MARKER;
+    else batchKinds[i] = line.numValues == 1 ? PACKET_OCCLUSION : PACKET_SAMPLE;
+  }
+  // walk back from the newest, keeping the first sample of each object and
+  // the first frame marker met; a batch only holds a handful of objects
+  vector<int> &newest = batchNewest;
+  newest.clear();
+  bool markerSeen = false;
+  int skipped = 0;
+  for (int i = count - 1; i >= 0; i--) {
+    if (batchKinds[i] == PACKET_MARKER) {
+      if (markerSeen) {
+        batchKinds[i] = PACKET_OLD_MARKER;
+        skipped++;
+      }
+      markerSeen = true;
+    } else if (batchKinds[i] == PACKET_SAMPLE) {
+      const parsedLine &line = batchLines[i];
+      int n = 0;
+      while (n < newest.size() && (batchLines[newest[n]].nameLen != line.nameLen ||
+                                   memcmp(batchLines[newest[n]].name, line.name, line.nameLen) != 0)) n++;
+      if (n < newest.size()) {
+        batchKinds[i] = PACKET_OLD_SAMPLE;
+        skipped++;
+      } else {
+        newest.push_back(i);
+      }
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    char kind = batchKinds[i];
+    bool valid = kind == PACKET_SAMPLE || kind == PACKET_OLD_SAMPLE || kind == PACKET_OCCLUSION;
+    applyParsed(payloads[i], lens[i], valid, batchLines[i], kind != PACKET_OLD_SAMPLE && kind != PACKET_OLD_MARKER,
+                times ? times[i] : -1);
+  }
+  return skipped;
+}
+
+void SceneState::buildFrame(sceneFrame &frame, double displayTime) {
+  // color changing
+  lineRed += COLOR_CHANGE * lineRedDir;
+  lineGreen += COLOR_CHANGE * lineGreenDir;
+  lineBlue += COLOR_CHANGE * lineBlueDir;
+  if (lineRed <= 0) lineRedDir = 1.0;
+  else if (lineRed >= 1) lineRedDir = -1.0;
+  if (lineGreen <= 0) lineGreenDir = 1.0;
+  else if (lineGreen >= 1) lineGreenDir = -1.0;
+  if (lineBlue <= 0) lineBlueDir = 1.0;
+  else if (lineBlue >= 1) lineBlueDir = -1.0;
+
+  frame.spheres.clear();
+  frame.tips.clear();
+  updateKinematics(motion);
+  trackable color = getColors();
+  for (int i = 0; i < trackNames.size(); i++) {
+    const string &effName = trackNames[i];
+
+    // where the object is, or will be when the frame is on screen
+    float position[3];
+    newestPosition(motion, i, position);
+    bool predicted = displayTime >= 0 && !occluded[effName] && predictMotion(motion, i, displayTime, position);
+    trackable head = { position[0], position[1], position[2] };
+
+    frameSphere sphere;
+    sphere.r = color.x;
+    sphere.g = color.y;
+    sphere.b = color.z;
+    if (head.z != 0 && !occluded[effName]) {
+      sphere.position = head;
+      sphere.radius = 0.1f;
+      sphere.a = 1.0f;
+      sphere.detail = 12;
+      frame.spheres.push_back(sphere);
+    }
+    // afterimages (trail)
+    float runningSize = 0.1f;
+    float runningAlpha = 1.0f;
+    if (afterImages[effName].size() == numAfterImages) {
+      for (int a = 0; a < numAfterImages; a++) {
+        if (afterImages[effName][a].z != 0) {
+          sphere.position = afterImages[effName][a];
+          sphere.radius = runningSize;
+          sphere.a = runningAlpha;
+          sphere.detail = 8;
+          frame.spheres.push_back(sphere);
+          runningSize -= 0.005f;
+          runningAlpha -= 0.05f;
+        }
+      }
+    }
+    // the stroke reaches out to the predicted head; ribbons stop at their
+    // last sample, as their vertices live in the pool's buffers
+    const myline &cline = currentLine[effName];
+    if (predicted && drawingOn && cline.stroke != 0 && !breaks[effName] && !isRibbon(cline)) {
+      myline tip = cline;
+      tip.x1 = cline.x2; tip.y1 = cline.y2; tip.z1 = cline.z2;
+      tip.x2 = head.x; tip.y2 = head.y; tip.z2 = head.z;
+      tip.time = strokeClock;
+      tip.speed = motion.speed[i];
+      frame.tips.push_back(tip);
+    }
+  }
+
+  // lines, whichever object drew them
+  frame.segments = &pool;
+  frame.links = links.empty() ? NULL : &links[0];
+  frame.chunkTimes.assign(chunkTimes.begin(), chunkTimes.begin() + (pool.size() + POOL_CHUNK - 1) / POOL_CHUNK);
+  frame.timeBase = timeGrid(strokeClock - PACKED_TIME_RANGE / 2);
+  frame.updates.swap(dirtyLines);
+  dirtyLines.clear();
+  dirtyLines.reserve(MAX_DIRTY_RANGES);  // here rather than as lines arrive
+  frame.visibleLayers = visibleLayers;
+  frame.strokeClock = strokeClock;
+}
+
+size_t SceneState::strokeCount() {
+  return pool.size();
+}
+
+void SceneState::setPoolBudget(double megabytes, bool hugePages) {
+  poolCapacity = (int)(megabytes * 1048576 / SEGMENT_BYTES);
+  if (poolCapacity < 1) poolCapacity = 1;
+  poolEvicted = 0;
+  // map and touch it all now, so that neither the pool nor its index ever
+  // grows while lines are arriving
+  pool.reserve(poolCapacity, hugePages);
+  chunkTimes.assign(poolCapacity / POOL_CHUNK + 1, 0);
+  links.assign(poolCapacity, slotLinks());
+  records.assign(poolCapacity / STROKE_TABLE_RATIO + 64, strokeRecord());
+  gridBuckets.assign(GRID_BUCKETS, -1);
+  clearStrokes();
+}
+
+void SceneState::poolStats(strokePoolStats &stats) {
+  stats.capacity = poolCapacity;
+  stats.used = pool.size();
+  stats.live = liveSegments;
+  stats.hugePages = pool.onHugePages();
+  stats.usedMB = (double)stats.used * SEGMENT_BYTES / 1048576;
+  stats.budgetMB = (double)poolCapacity * SEGMENT_BYTES / 1048576;
+  stats.evicted = poolEvicted;
+}
+
+// ***SNAPSHOTS***
+
+void appendBytes(string &out, const void *data, size_t len) {
+  out.append((const char*)data, len);
+}
+
+bool readBytes(const char *&p, const char *end, void *data, size_t len) {
+  if (p + len > end) return false;
+  memcpy(data, p, len);
+  p += len;
+  return true;
+}
+
+// The pool goes out oldest line first, so a slave with a smaller budget can
+// drop the excess from the front. Each run of POOL_CHUNK lines in that order
+// goes with its own base time, and the stroke ids follow the lines.
+void SceneState::encodeSnapshot(string &raw) {
+  unsigned int numLines = pool.size();
+  size_t numChunks = (numLines + POOL_CHUNK - 1) / POOL_CHUNK;
+  raw.reserve(64 + currentLine.size() * (64 + sizeof(myline)) + numChunks * sizeof(float) +
+              (size_t)numLines * (sizeof(packedLine) + sizeof(unsigned int)));
+
+  double colorState[6] = { lineRed, lineGreen, lineBlue, lineRedDir, lineGreenDir, lineBlueDir };
+  appendBytes(raw, colorState, sizeof(colorState));
+  int drawState[5] = { drawingOn, palette, activeLayer, (int)visibleLayers, (int)nextStroke };
+  appendBytes(raw, drawState, sizeof(drawState));
+  appendBytes(raw, &strokeClock, sizeof(strokeClock));
+  unsigned int numNames = currentLine.size();
+  appendBytes(raw, &numNames, sizeof(numNames));
+  for (map<string, myline>::iterator it = currentLine.begin(); it != currentLine.end(); it++) {
+    unsigned int nameLen = it->first.size();
+    appendBytes(raw, &nameLen, sizeof(nameLen));
+    appendBytes(raw, it->first.data(), nameLen);
+    appendBytes(raw, &it->second, sizeof(myline));
+  }
+  appendBytes(raw, &numLines, sizeof(numLines));
+
+  int oldest = poolHead + 1 < pool.size() ? poolHead + 1 : 0;
+  vector<packedLine> lines(numLines);
+  vector<float> times(numLines);
+  vector<unsigned int> strokes(numLines);
+  for (int i = 0; i < numLines; i++) {
+    int slot = (oldest + i) % numLines;
+    lines[i] = pool[slot];
+    times[i] = chunkTimes[slot / POOL_CHUNK] + pool[slot].time * PACKED_TIME_STEP;
+    strokes[i] = isLive(pool[slot]) ? records[links[slot].record].id : 0;
+  }
+  for (int first = 0; first < numLines; first += POOL_CHUNK) {
+    int end = first + POOL_CHUNK < numLines ? first + POOL_CHUNK : numLines;
+    float oldestTime = times[first], newestTime = times[first];
+    for (int i = first; i < end; i++) {
+      if (times[i] < oldestTime) oldestTime = times[i];
+      if (times[i] > newestTime) newestTime = times[i];
+    }
+    float base = timeGrid(oldestTime);
+    if (newestTime - base >= PACKED_TIME_RANGE) base = timeGrid(newestTime - PACKED_TIME_RANGE / 2);
+    for (int i = first; i < end; i++) lines[i].time = packTime(times[i], base);
+    appendBytes(raw, &base, sizeof(base));
+  }
+  if (numLines > 0) {
+    appendBytes(raw, &lines[0], numLines * sizeof(packedLine));
+    appendBytes(raw, &strokes[0], numLines * sizeof(unsigned int));
+  }
+}
+
+bool SceneState::decodeSnapshot(const string &raw) {
+  const char *p = raw.data();
+  const char *end = p + raw.size();
+  double colorState[6];
+  int drawState[5];
+  float theirClock;
+  unsigned int numNames, numLines;
+  if (!readBytes(p, end, colorState, sizeof(colorState))) return false;
+  if (!readBytes(p, end, drawState, sizeof(drawState))) return false;
+  if (!readBytes(p, end, &theirClock, sizeof(theirClock))) return false;
+  if (!readBytes(p, end, &numNames, sizeof(numNames))) return false;
+  vector<string> names;
+  vector<myline> clines;
+  for (unsigned int i = 0; i < numNames; i++) {
+    unsigned int nameLen;
+    myline cline;
+    if (!readBytes(p, end, &nameLen, sizeof(nameLen)) || p + nameLen > end) return false;
+    names.push_back(string(p, nameLen));
+    p += nameLen;
+    if (!readBytes(p, end, &cline, sizeof(cline))) return false;
+    clines.push_back(cline);
+  }
+  if (!readBytes(p, end, &numLines, sizeof(numLines))) return false;
+  size_t numChunks = ((size_t)numLines + POOL_CHUNK - 1) / POOL_CHUNK;
+  if ((size_t)(end - p) < numChunks * sizeof(float) + (size_t)numLines * (sizeof(packedLine) + sizeof(unsigned int))) {
+    return false;
+  }
+  vector<float> bases(numChunks);
+  if (numChunks > 0) readBytes(p, end, &bases[0], numChunks * sizeof(float));
+  const char *lines = p;
+  const char *ids = lines + (size_t)numLines * sizeof(packedLine);
+
+  // the lines were timed by the sender's stroke clock; move them onto ours,
+  // so that what it drew last counts as drawn just now
+  float shift = strokeClock - theirClock;
+  // and keep a corrupt layer from shifting the layer masks out of range
+  for (int i = 0; i < names.size(); i++) {
+    clines[i].time += shift;
+    clines[i].layer = ((clines[i].layer % NUM_LAYERS) + NUM_LAYERS) % NUM_LAYERS;
+    currentLine[names[i]] = clines[i];
+  }
+  unsigned int skip = numLines > poolCapacity ? numLines - poolCapacity : 0;
+  vector<unsigned int> strokes(numLines - skip);
+  pool.clear();
+  dirtyLines.clear();
+  for (unsigned int i = skip; i < numLines; i++) {
+    packedLine cline;
+    memcpy(&cline, lines + (size_t)i * sizeof(packedLine), sizeof(cline));
+    memcpy(&strokes[i - skip], ids + (size_t)i * sizeof(unsigned int), sizeof(unsigned int));
+    cline.flags = (cline.flags & PACKED_LIVE) | (cline.flags & PACKED_LAYER_MASK) % NUM_LAYERS;
+    storeLine(i - skip, cline, bases[i / POOL_CHUNK] + cline.time * PACKED_TIME_STEP + shift);
+  }
+  poolHead = (int)pool.size() - 1;
+  dirtyLines.clear();
+  markDirty(0, pool.size());
+  lineRed = colorState[0]; lineGreen = colorState[1]; lineBlue = colorState[2];
+  lineRedDir = colorState[3]; lineGreenDir = colorState[4]; lineBlueDir = colorState[5];
+  drawingOn = drawState[0] != 0;
+  setPalette(drawState[1]);
+  activeLayer = ((drawState[2] % NUM_LAYERS) + NUM_LAYERS) % NUM_LAYERS;
+  visibleLayers = (unsigned int)drawState[3] & ((1u << NUM_LAYERS) - 1);
+  nextStroke = drawState[4] > 0 ? (unsigned int)drawState[4] : 1;
+  rebuildIndex(strokes);
+  return true;
+}
@@ -0,0 +1,490 @@
+// Scene state for GestureResponseSlave: sample ingest, stroke recording,
+// trails and colour. No GL, GLUT or sockets, so it can be driven from a
+// benchmark or instantiated several times in one process.
+// Author: James Walker jwwalker a+ mtu d0+ edu
+
+#ifndef SCENE_STATE_H
+#define SCENE_STATE_H
+
+#include <stddef.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "LineParser.h"
+#include "Kinematics.h"
+#include "Predictor.h"
+
+using namespace std;
+
+typedef struct trackable {
+  float x;
+  float y;
+  float z;
+} trackable;
+
+// A line as the scene builds and draws it; the pool keeps it as a packedLine.
+typedef struct myline {
+  float x1, x2;
+  float y1, y2;
+  float z1, z2;
+  float r, g, b;
+  float sx1, sx2;       // brush direction at each end, from the wand's roll;
+  float sy1, sy2;       // all zero for samples without an orientation,
+  float sz1, sz2;       // which are drawn as plain lines
+  float time;           // when it was drawn, seconds on the scene's stroke clock
+  float speed;          // how fast the object was moving then, scene units a second
+  unsigned int stroke;  // id of the stroke it belongs to; 0 once erased
+  int layer;
+} myline;
+
+// A ribbon is only extruded where both ends know the brush direction.
+inline bool isRibbon(const myline &cline) {
+  return (cline.sx1 != 0 || cline.sy1 != 0 || cline.sz1 != 0) &&
+         (cline.sx2 != 0 || cline.sy2 != 0 || cline.sz2 != 0);
+}
+
+// Erased segments stay in their slots until the pool reuses them.
+inline bool isDrawn(const myline &cline, unsigned int visibleLayers) {
+  return cline.stroke != 0 && (visibleLayers >> cline.layer & 1);
+}
+
+// Squared distance from p to the segment.
+inline float segmentDistance2(const myline &cline, trackable p) {
+  float dx = cline.x2 - cline.x1, dy = cline.y2 - cline.y1, dz = cline.z2 - cline.z1;
+  float px = p.x - cline.x1, py = p.y - cline.y1, pz = p.z - cline.z1;
+  float length2 = dx*dx + dy*dy + dz*dz;
+  float t = length2 > 0 ? (px*dx + py*dy + pz*dz) / length2 : 0;
+  if (t < 0) t = 0;
+  else if (t > 1) t = 1;
+  px -= t * dx; py -= t * dy; pz -= t * dz;
+  return px*px + py*py + pz*pz;
+}
+
+// How a line is kept in the pool, sent to the GPU and put in snapshots:
+// myline quantized to 26 bytes against the stage box (see packLine()). The
+// stroke id stays in the stroke index, and the time is kept against a base
+// time shared by the line's chunk of the pool.
+typedef struct packedLine {
+  unsigned short x1, y1, z1;  // fixed point across the stage box
+  unsigned short x2, y2, z2;
+  unsigned char r, g, b;      // RGB8
+  unsigned char flags;        // layer in PACKED_LAYER_MASK, PACKED_LIVE until it is erased
+  signed char sx1, sy1, sz1;  // brush direction, in steps of PACKED_SIDE_STEP
+  signed char sx2, sy2, sz2;
+  unsigned short time;        // in steps of PACKED_TIME_STEP after its chunk's base time
+  unsigned char speed;        // in steps of PACKED_SPEED_STEP; the shaders widen and glow by it
+} packedLine;
+
+const unsigned char PACKED_LAYER_MASK = 0x7f;  // room for any NUM_LAYERS
+const unsigned char PACKED_LIVE = 0x80;
+
+inline bool isRibbon(const packedLine &cline) {
+  return (cline.sx1 != 0 || cline.sy1 != 0 || cline.sz1 != 0) &&
+         (cline.sx2 != 0 || cline.sy2 != 0 || cline.sz2 != 0);
+}
+
+inline bool isLive(const packedLine &cline) {
+  return (cline.flags & PACKED_LIVE) != 0;
+}
+
+inline bool isDrawn(const packedLine &cline, unsigned int visibleLayers) {
+  return isLive(cline) && (visibleLayers >> (cline.flags & PACKED_LAYER_MASK) & 1);
+}
+
+typedef struct orientation {
+  float x, y, z, w;     // unit quaternion
+} orientation;
+
+// One tracked object's position from the master, and its orientation if
+// the master sent one ("Name~x~y~z~qx~qy~qz~qw").
+typedef struct sceneSample {
+  string name;
+  trackable position;
+  bool oriented;
+  orientation rotation;
+} sceneSample;
+
+// Pool slots written since the last frame, for incremental upload.
+typedef struct strokeUpdate {
+  int first;
+  int count;
+} strokeUpdate;
+
+const int POOL_CHUNK = 4096;  // lines per chunk of the pool, the unit the renderer uploads and simplifies
+
+// The pool's lines: one mapping for the whole budget, faulted in when the
+// budget is set, so that appending never allocates, copies or page-faults
+// and a line keeps its address for as long as it is in the pool.
+class strokeArena {
+public:
+  strokeArena();
+  ~strokeArena();
+  // Map room for capacity lines, rounded up to whole chunks, and empty it.
+  // Huge pages are used if the system has any to spare, else the kernel is
+  // asked to back it with transparent ones.
+  void reserve(int capacity, bool hugePages);
+  int size() const { return used; }
+  bool empty() const { return used == 0; }
+  bool onHugePages() const { return huge; }
+  packedLine &operator[](int i) { return lines[i]; }
+  const packedLine &operator[](int i) const { return lines[i]; }
+  // Neither checks for room; SceneState stays within the capacity it reserved.
+  void push_back(const packedLine &cline) { lines[used++] = cline; }
+  void resize(int n) { used = n; }
+  void clear() { used = 0; }
+
+private:
+  strokeArena(const strokeArena &);
+  void operator=(const strokeArena &);
+  void release();
+  packedLine *lines;
+  int used;
+  size_t mappedBytes;
+  bool huge;
+};
+
+// The stroke index: every live segment is chained to the previous segment
+// of its stroke and linked into the grid buckets its ends fall in, so undo,
+// erase and layer changes touch only the segments concerned. Its tables are
+// sized with the pool, so drawing never allocates. A grid node is
+// slot * 2 + end; -1 ends a chain or list.
+typedef struct slotLinks {
+  int record;           // entry in the stroke table
+  int strokePrev;       // the stroke's previous slot, which may since have been reused
+  int next[2], prev[2]; // neighbouring nodes in the bucket of each end
+} slotLinks;
+
+typedef struct strokeRecord {
+  unsigned int id;      // 0 while the entry is free
+  int layer;
+  int object;           // index into objectNames of who drew it, or -1
+  int live;             // segments not yet erased or overwritten
+  int last;             // newest slot
+  int older, newer;     // live strokes in order of id; free entries chain through older
+} strokeRecord;
+
+typedef struct frameSphere {
+  trackable position;
+  float radius;
+  float r, g, b, a;
+  int detail;           // slices and stacks
+} frameSphere;
+
+// Everything needed to draw one frame. The segments and links point into
+// the SceneState and are only valid until it next changes.
+typedef struct sceneFrame {
+  vector<frameSphere> spheres;
+  const strokeArena *segments;
+  const slotLinks *links;       // per segment; the record tells one stroke's segments from another's
+  vector<float> chunkTimes;     // base time of each POOL_CHUNK of the segments
+  float timeBase;               // a base the frame's times all fit against, on the grid
+  vector<myline> tips;          // each stroke being drawn, from its last line to where the hand is predicted to be
+  vector<strokeUpdate> updates;
+  unsigned int visibleLayers;   // bit per layer
+  float strokeClock;            // the scene's stroke clock as of the frame, for fading old strokes
+} sceneFrame;
+
+const int dataHertz = 100;   // frames a second in a recording; samples without a time are timed by it
+
+const bool SIMULATION = true;
+const int numAfterImages = 24;
+
+// Strokes the stroke table has room for, per pool slot. Once it is full, the
+// oldest stroke is erased to make way for a new one.
+const int STROKE_TABLE_RATIO = 8;
+
+// A line plus its share of the stroke index, for sizing the pool.
+const int SEGMENT_BYTES = sizeof(packedLine) + sizeof(slotLinks) + sizeof(strokeRecord) / STROKE_TABLE_RATIO;
+
+// Artist performance variables **CUSTOMIZABLE**
+const double STROKE_POOL_MB = 64; // Memory, in megabytes, for the lines of every tracked object together (the
+                                 // slave's --pool-mb overrides it). Once the pool is full, each new line replaces
+                                 // the oldest one on the canvas, whichever object drew it.
+                                 // Make the number too small, and old lines will start to disappear quickly.
+                                 // Make the number too big, and the system's performance will degrade.
+                                 // Tweak this value to try to achieve an effective balance.
+                                 // Here is the equation for how quickly lines will start to disappear based on
+                                 // this value:
+                                 //
+                                 // X = STROKE_POOL_MB * 1048576 / SEGMENT_BYTES / (lines per second per object * <number of tracked objects>)
+                                 //
+                                 // where X = number of seconds before the pool fills up.
+                                 // If STROKE_POOL_MB = 64 (about 1,100,000 lines), each object draws 100 lines a
+                                 // second and you are tracking 4 objects, then it will be 2,840 seconds, or 47
+                                 // minutes, before the pool fills.
+
+const double COLOR_CHANGE = 0.0003f; // The program is configured so that the color of drawn lines changes over time.
+                                 // This number controls how quickly the line color changes. The rate of change is
+                                 // expressed by the following equation:
+                                 //
+                                 // X = 1 / COLOR_CHANGE / 60
+                                 //
+                                 // where X is the number of seconds until the color has completely changed, and the
+                                 // pattern repeats. If COLOR_CHANGE = .0003, the color goes through one complete
+                                 // cycle about once per minute.
+
+const float LINE_THICKNESS = 5.0f; // Line thickness varies on user's distance from the screen, but this variable
+                                   // controls the "base" thickness of the lines. Higher value = fatter lines.
+                                   // Adjust to suit your aesthetic taste.
+
+const float GRID_CELL = 0.1f;      // Edge, in metres, of the cells strokes are indexed by for erasing. Segments
+                                   // longer than this are only found near their ends.
+
+const float RIBBON_WIDTH = 0.05f;  // Width, in metres, of the ribbons drawn when the master sends orientations.
+                                   // The ribbon lies along the wand's local x axis, so rolling the wand
+                                   // turns the brush between its broad and its narrow side.
+
+// Stroke storage variables **CUSTOMIZABLE**
+const float STAGE_MIN[3] = { -6, -9, -3 };  // Corners, in scene units, of the box strokes are stored within. The
+const float STAGE_MAX[3] = { 6, 9, 9 };     // master's viconToScene() makes x metres, y metres * 1.5 and z metres
+                                            // * 3.5 - 2, so this box holds a stage 12 m square, from 0.3 m below
+                                            // the floor to 3.1 m above it: a wand held up at full stretch (2.6 m,
+                                            // z = 7.1) with room to spare. Each coordinate is kept as a 16-bit step
+                                            // across it, (STAGE_MAX - STAGE_MIN) / 65535: 0.18 mm of x, 0.27 mm of
+                                            // y (0.18 mm on the stage) and 0.18 mm of z (0.05 mm on the stage), and
+                                            // a stored point is within half a step of where it was drawn. Points
+                                            // outside it are drawn on its wall. A bigger stage wants a bigger box,
+                                            // and loses precision in proportion.
+const float PACKED_MAX_SPEED = 10.0f;       // Fastest speed, in metres a second, a line remembers for its width and
+                                            // glow; kept to within 1/510 of this (2 cm/s), faster is clamped.
+                                            // Colours are kept to within 1/510, brush directions to within
+                                            // RIBBON_WIDTH / 508 (0.1 mm).
+const float PACKED_TIME_STEP = 0.1f;        // Seconds per step of a line's time, which only fades it: kept to within
+                                            // 50 ms, for 109 minutes after its chunk's base. A line older than that
+                                            // by the time its chunk takes a new one counts as half that old
+                                            // (see SceneState::storeLine()), long past any fade.
+
+const float PACKED_SPEED_STEP = PACKED_MAX_SPEED / 255;
+const float PACKED_SIDE_STEP = RIBBON_WIDTH / 2 / 127;
+const float PACKED_TIME_RANGE = PACKED_TIME_STEP * 65535;
+
+inline float stageStep(int axis) {
+  return (STAGE_MAX[axis] - STAGE_MIN[axis]) / 65535;
+}
+
+inline unsigned short packCoordinate(float v, int axis) {
+  float q = (v - STAGE_MIN[axis]) / stageStep(axis) + 0.5f;
+  return q <= 0 ? 0 : q >= 65535 ? 65535 : (unsigned short)q;
+}
+
+inline float unpackCoordinate(unsigned short q, int axis) {
+  return STAGE_MIN[axis] + q * stageStep(axis);
+}
+
+inline unsigned char packUnit(float v) {
+  return v <= 0 ? 0 : v >= 1 ? 255 : (unsigned char)(v * 255 + 0.5f);
+}
+
+inline signed char packSide(float v) {
+  float q = v / PACKED_SIDE_STEP;
+  q += q < 0 ? -0.5f : 0.5f;
+  return q <= -127 ? -127 : q >= 127 ? 127 : (signed char)q;
+}
+
+// Base times sit on whole steps, so that moving a line between bases is
+// exact.
+inline float timeGrid(float t) {
+  return floorf(t / PACKED_TIME_STEP) * PACKED_TIME_STEP;
+}
+
+// Times before the base are clamped to it, later than PACKED_TIME_RANGE
+// after it to that.
+inline unsigned short packTime(float t, float timeBase) {
+  float q = (t - timeBase) / PACKED_TIME_STEP + 0.5f;
+  return q <= 0 ? 0 : q >= 65535 ? 65535 : (unsigned short)q;
+}
+
+// Steps to add to a packed time to move it from one base onto another,
+// both on the grid.
+inline int timeShift(float from, float to) {
+  return (int)floorf((from - to) / PACKED_TIME_STEP + 0.5f);
+}
+
+inline unsigned short shiftTime(unsigned short q, int steps) {
+  steps += q;
+  return steps <= 0 ? 0 : steps >= 65535 ? 65535 : (unsigned short)steps;
+}
+
+inline packedLine packLine(const myline &cline, float timeBase) {
+  packedLine p;
+  p.x1 = packCoordinate(cline.x1, 0); p.y1 = packCoordinate(cline.y1, 1); p.z1 = packCoordinate(cline.z1, 2);
+  p.x2 = packCoordinate(cline.x2, 0); p.y2 = packCoordinate(cline.y2, 1); p.z2 = packCoordinate(cline.z2, 2);
+  p.r = packUnit(cline.r); p.g = packUnit(cline.g); p.b = packUnit(cline.b);
+  p.flags = (cline.layer & PACKED_LAYER_MASK) | (cline.stroke != 0 ? PACKED_LIVE : 0);
+  p.sx1 = packSide(cline.sx1); p.sy1 = packSide(cline.sy1); p.sz1 = packSide(cline.sz1);
+  p.sx2 = packSide(cline.sx2); p.sy2 = packSide(cline.sy2); p.sz2 = packSide(cline.sz2);
+  p.time = packTime(cline.time, timeBase);
+  p.speed = packUnit(cline.speed / PACKED_MAX_SPEED);
+  return p;
+}
+
+// The line's stroke id isn't packed with it, so the unpacked stroke is only
+// 0 or not, as isDrawn() needs; the stroke index has the id. Without its
+// chunk's base, the time comes out relative to it.
+inline myline unpackLine(const packedLine &p, float timeBase = 0) {
+  myline cline;
+  cline.x1 = unpackCoordinate(p.x1, 0); cline.y1 = unpackCoordinate(p.y1, 1); cline.z1 = unpackCoordinate(p.z1, 2);
+  cline.x2 = unpackCoordinate(p.x2, 0); cline.y2 = unpackCoordinate(p.y2, 1); cline.z2 = unpackCoordinate(p.z2, 2);
+  cline.r = p.r / 255.0f; cline.g = p.g / 255.0f; cline.b = p.b / 255.0f;
+  cline.sx1 = p.sx1 * PACKED_SIDE_STEP; cline.sy1 = p.sy1 * PACKED_SIDE_STEP; cline.sz1 = p.sz1 * PACKED_SIDE_STEP;
+  cline.sx2 = p.sx2 * PACKED_SIDE_STEP; cline.sy2 = p.sy2 * PACKED_SIDE_STEP; cline.sz2 = p.sz2 * PACKED_SIDE_STEP;
+  cline.speed = p.speed * PACKED_SPEED_STEP;
+  cline.layer = p.flags & PACKED_LAYER_MASK;
+  cline.time = timeBase + p.time * PACKED_TIME_STEP;
+  cline.stroke = isLive(p) ? 1 : 0;
+  return cline;
+}
+
+// How full the stroke pool is.
+typedef struct strokePoolStats {
+  int capacity;         // slots the budget allows
+  int used;             // slots written so far, up to capacity
+  int live;             // of those, lines still on the canvas
+  double usedMB;        // used * SEGMENT_BYTES
+  double budgetMB;
+  unsigned long long evicted;  // lines overwritten by newer ones, or erased to free the stroke table
+  bool hugePages;       // the pool is on explicit huge pages
+} strokePoolStats;
+
+// Not thread-safe; callers serialize access (the slave uses stateMutex).
+class SceneState {
+public:
+  SceneState(int numTrackedObjects, bool simulation);
+
+  // Ingest one sample, or the frame marker between samples in a recording.
+  // A sample at exactly (0, 0, 0) is an occlusion from an older recording.
+  // A sample that isn't the object's latest only extends its stroke; the
+  // trail and colouring are left to the newer one. time is when the sample
+  // was taken, in seconds on the clock buildFrame() is given; without one,
+  // samples are timed by the frame they arrive in, which is only good for
+  // the object's motion, not for prediction.
+  void apply(const sceneSample &sample, bool latest = true, double time = -1);
+  void applyFrameMarker();
+  // The object has been lost: hide it and end its stroke, so that its next
+  // sample starts a new one rather than drawing a line across the gap.
+  void applyOcclusion(const string &name);
+  // Parse one "Name~x~y~z", "Name~x~y~z~qx~qy~qz~qw" or "Name~occluded"
+  // payload, or a "!COMMAND~..." control message (sequence header already
+  // stripped) and apply it; anything else counts as a frame marker.
+  void applyPacket(const char *payload, size_t len, double time = -1);
+  // Apply a backlog of packets in order, as applyPacket() would, except that
+  // only the newest sample of each object and the last frame marker update
+  // the head, trail and colouring: every sample still extends its stroke.
+  // Returns the number of samples and markers whose state was skipped.
+  // times, if given, has the time each packet's sample was taken.
+  int applyPackets(const char *const *payloads, const size_t *lens, int count, const double *times = NULL);
+
+  // Gesture commands. Turning drawing on starts new strokes. undoStroke()
+  // erases the most recently started stroke that is still on the canvas and
+  // returns false if there is none; eraseNear() returns the number of
+  // segments erased. New strokes go on the active layer, which is made
+  // visible.
+  void setDrawing(bool on);
+  void clearStrokes();
+  bool undoStroke();
+  int eraseNear(trackable center, float radius);
+  void setPalette(int palette);
+  void setActiveLayer(int layer);
+  void setVisibleLayers(unsigned int mask);
+
+  // Advance the colour cycle by one frame and list what to draw. With a
+  // display time, the heads and the tips of the strokes being drawn are
+  // carried forward to where each object is predicted to be then.
+  void buildFrame(sceneFrame &frame, double displayTime = -1);
+
+  // The stroke buffer and colour state, for late-joining slaves. decode
+  // leaves the scene untouched unless the whole payload parses.
+  void encodeSnapshot(string &raw);
+  bool decodeSnapshot(const string &raw);
+
+  size_t strokeCount();
+
+  // Size the pool and map it, on huge pages if asked; the strokes already
+  // drawn are cleared.
+  void setPoolBudget(double megabytes, bool hugePages = false);
+  void poolStats(strokePoolStats &stats);
+
+  // The individual ingest steps, public so they can be benchmarked.
+  void averageDistanceHelper();
+  void addAfterImage(const string &key, trackable addMe);
+  void recordLine(const string &name, trackable sample, trackable side, float speed = 0);
+
+  int numTrackedObjects;
+  bool simulation;
+
+  vector<string> trackNames;
+  map<string, int> trackIndex;  // into trackNames and motion
+  kinematics motion;            // every object's recent samples, and its velocity and so on as of the last frame
+  double clockStart;            // time of the first sample, or -1; the stroke clock counts from it
+  float strokeClock;            // seconds from clockStart to the newest sample
+  double untimedClock;          // the time given to samples that come without one: the frame count in
+                                // a recording, else the share of a frame each live sample counts for
+  float averageDistance;        // between the objects as of the last frame
+  bool distanceMeasured;        // averageDistance has been worked out at least once
+  vector<trackable> distancePoints;   // scratch for averageDistanceHelper()
+  map<string, vector<trackable> > afterImages;
+  int executionCtr;
+  int totalCtr;
+  map<string, bool> occluded;   // objects lost since their last sample
+  map<string, bool> breaks;     // objects whose next sample starts a new stroke
+  unsigned int lastControlEvent;
+
+  // Artist performance variables **NOT CUSTOMIZABLE--DON'T ALTER THESE**
+  // Every object's lines share one ring of poolCapacity slots, written in
+  // drawing order, so the slot after poolHead always holds the oldest line.
+  strokeArena pool;
+  vector<float> chunkTimes;         // base time of each POOL_CHUNK of the pool
+  int poolCapacity;
+  int poolHead;         // slot of the newest line, or -1
+  unsigned long long poolEvicted;
+  vector<strokeUpdate> dirtyLines;  // slot ranges changed since the last buildFrame()
+  vector<slotLinks> links;          // per pool slot
+  vector<strokeRecord> records;
+  int oldestRecord, newestRecord, freeRecord;
+  int numStrokes;                   // live ones
+  int liveSegments;
+  vector<int> gridBuckets;          // first node of each bucket
+  vector<string> objectNames;
+  map<string, int> currentRecord;   // each object's stroke being drawn, or -1
+  vector<int> eraseVictims;         // scratch for eraseNear()
+  vector<parsedLine> batchLines;    // scratch for applyPackets()
+  vector<char> batchKinds;
+  vector<int> batchNewest;
+  unsigned int nextStroke;
+  int activeLayer;
+  unsigned int visibleLayers;
+  map<string, myline> currentLine;
+  bool drawingOn;
+  int palette;
+  double lineRed;
+  double lineGreen;
+  double lineBlue;
+  double lineRedDir;
+  double lineGreenDir;
+  double lineBlueDir;
+
+private:
+  trackable getColors();
+  void markDirty(int first, int count);
+  void countSample();
+  void applyControl(const char *payload, size_t len);
+  bool parsePacket(const char *payload, size_t len, parsedLine &parsed);
+  void applyParsed(const char *payload, size_t len, bool valid, const parsedLine &parsed, bool latest, double time);
+  int startStroke(unsigned int id, int layer, int object);
+  void endStroke(int record);
+  void eraseStroke(int record);
+  void linkNode(int node, int bucket);
+  void unlinkNode(int node, int bucket);
+  void indexSegment(int record, int slot);
+  void unindexSegment(int slot);
+  void eraseSegment(int slot);
+  void markStrokeDirty(int record);
+  int objectIndex(const string &name);
+  void resetIndex();
+  void rebuildIndex(const vector<unsigned int> &strokes);
+  void storeLine(int slot, packedLine cline, float time);
+};
+
+#endif
@@ -0,0 +1,203 @@
+// Shared-memory transport between a master and slaves on the same machine
+// Author: James Walker jwwalker a+ mtu d0+ edu
+//
+// The master publishes each datagram, header and all, into a ring of
+// fixed-size slots in a POSIX shared memory object; any number of local
+// slaves read it at their own pace, without a syscall while there's data.
+// A reader that has caught up sleeps on a futex in the ring, which the
+// master only wakes when someone is asleep on it. There is no back-pressure:
+// a reader that falls a whole ring behind is lapped, skips to the oldest
+// slot still intact and sees a gap in the sequence numbers, as it would if
+// UDP had dropped the datagrams.
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_MAGIC "GRSM"
+#define SHM_VERSION 1
+#define SHM_PREFIX "shm:"        // a master address of "shm:/name" publishes into the ring /name
+
+const int SHM_RING_SLOTS = 16384;  // about 15 seconds of a busy performance
+const int SHM_SLOT_BYTES = 512;    // largest datagram, as BUFLEN in the master and slave
+
+typedef struct shmSlot {
+  unsigned long long index;      // which datagram the slot holds; ~0 while it's being written
+  unsigned long long stampNs;    // CLOCK_REALTIME when it was published
+  unsigned int len;
+  char data[SHM_SLOT_BYTES];
+} shmSlot;
+
+typedef struct shmRingHeader {
+  char magic[4];
+  unsigned int version;
+  unsigned int capacity;         // slots
+  unsigned int slotBytes;
+  unsigned long long written;    // datagrams published so far
+  int futex;                     // bumped after every batch, for sleeping readers
+  int waiters;                   // readers asleep, or about to be
+} shmRingHeader;
+
+// One process's view of a ring.
+typedef struct shmRing {
+  shmRingHeader *header;
+  shmSlot *slots;
+  size_t mappedBytes;
+} shmRing;
+
+inline unsigned long long shmClockNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+inline bool mapShmRing(shmRing &r, const char *name, bool create) {
+  size_t bytes = sizeof(shmRingHeader) + (size_t)SHM_RING_SLOTS * sizeof(shmSlot);
+  int fd = shm_open(name, create ? O_RDWR | O_CREAT : O_RDWR, 0666);
+  if (fd == -1) return false;
+  if (create && ftruncate(fd, bytes) == -1) {
+    close(fd);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < bytes) {
+    close(fd);
+    return false;
+  }
+  void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) return false;
+  r.header = (shmRingHeader*)p;
+  r.slots = (shmSlot*)(r.header + 1);
+  r.mappedBytes = bytes;
+  return true;
+}
+
+// Create the ring, or take over one left by an earlier master. Readers still
+// attached see the count go back and start again from the new datagrams.
+inline bool createShmRing(shmRing &r, const char *name) {
+  if (!mapShmRing(r, name, true)) return false;
+  shmRingHeader &h = *r.header;
+  __atomic_store_n(&h.written, 0, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < SHM_RING_SLOTS; i++) r.slots[i].index = ~0ULL;
+  memcpy(h.magic, SHM_MAGIC, 4);
+  h.version = SHM_VERSION;
+  h.capacity = SHM_RING_SLOTS;
+  h.slotBytes = SHM_SLOT_BYTES;
+  return true;
+}
+
+// Attach to a master's ring. Fails if there is none, or it's from a
+// different build.
+inline bool openShmRing(shmRing &r, const char *name) {
+  if (!mapShmRing(r, name, false)) return false;
+  shmRingHeader &h = *r.header;
+  if (memcmp(h.magic, SHM_MAGIC, 4) != 0 || h.version != SHM_VERSION ||
+      h.capacity != SHM_RING_SLOTS || h.slotBytes != SHM_SLOT_BYTES) {
+    munmap(r.header, r.mappedBytes);
+    return false;
+  }
+  return true;
+}
+
+inline void closeShmRing(shmRing &r) {
+  munmap(r.header, r.mappedBytes);
+  r.header = NULL;
+}
+
+// Write one datagram into the next slot. Readers don't see it until
+// shmWake().
+inline void shmPublish(shmRing &r, unsigned long long &pending, const char *data, size_t len) {
+  shmRingHeader &h = *r.header;
+  unsigned long long index = __atomic_load_n(&h.written, __ATOMIC_RELAXED) + pending;
+  shmSlot &slot = r.slots[index % SHM_RING_SLOTS];
+  if (len > SHM_SLOT_BYTES) len = SHM_SLOT_BYTES;
+  // a reader copying the slot out sees the index change and drops the copy
+  __atomic_store_n(&slot.index, ~0ULL, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  memcpy(slot.data, data, len);
+  slot.len = len;
+  slot.stampNs = shmClockNs();
+  __atomic_store_n(&slot.index, index, __ATOMIC_RELEASE);
+  pending++;
+}
+
+// Make the datagrams published since the last call visible, and wake any
+// reader that has gone to sleep.
+inline void shmWake(shmRing &r, unsigned long long &pending) {
+  if (pending == 0) return;
+  shmRingHeader &h = *r.header;
+  __atomic_add_fetch(&h.written, pending, __ATOMIC_SEQ_CST);
+  pending = 0;
+  __atomic_add_fetch(&h.futex, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&h.waiters, __ATOMIC_SEQ_CST) > 0) {
+    syscall(SYS_futex, &h.futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+// Where a new reader starts: with the next datagram published.
+inline unsigned long long shmCursor(shmRing &r) {
+  return __atomic_load_n(&r.header->written, __ATOMIC_ACQUIRE);
+}
+
+// Copy the datagram at cursor into buf and move on. Returns its length, or
+// -1 if there's nothing new. A reader that has been lapped skips ahead and
+// adds the datagrams it missed to overruns.
+inline int shmRead(shmRing &r, unsigned long long &cursor, char *buf, size_t size,
+                   unsigned long long &stampNs, unsigned long &overruns) {
+  shmRingHeader &h = *r.header;
+  while (true) {
+    unsigned long long written = __atomic_load_n(&h.written, __ATOMIC_ACQUIRE);
+    if (cursor > written) cursor = written;  // the master restarted
+    if (cursor == written) return -1;
+    if (written - cursor > SHM_RING_SLOTS - 1) {
+      // keep a slot's grace, as the master may be writing the oldest
+      overruns += written - cursor - (SHM_RING_SLOTS - 1);
+      cursor = written - (SHM_RING_SLOTS - 1);
+    }
+    shmSlot &slot = r.slots[cursor % SHM_RING_SLOTS];
+    if (__atomic_load_n(&slot.index, __ATOMIC_ACQUIRE) != cursor) {
+      overruns++;
+      cursor++;
+      continue;
+    }
+    size_t len = slot.len;
+    if (len > size) len = size;
+    memcpy(buf, slot.data, len);
+    stampNs = slot.stampNs;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot.index, __ATOMIC_RELAXED) != cursor) {
+      overruns++;  // overwritten while we copied it
+      cursor++;
+      continue;
+    }
+    cursor++;
+    return len;
+  }
+}
+
+// Sleep until something is published past cursor or timeoutMs passes.
+inline void shmWait(shmRing &r, unsigned long long cursor, int timeoutMs) {
+  shmRingHeader &h = *r.header;
+  __atomic_add_fetch(&h.waiters, 1, __ATOMIC_SEQ_CST);
+  int seen = __atomic_load_n(&h.futex, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&h.written, __ATOMIC_SEQ_CST) == cursor) {
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+    syscall(SYS_futex, &h.futex, FUTEX_WAIT, seen, &timeout, NULL, 0);
+  }
+  __atomic_sub_fetch(&h.waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+#endif
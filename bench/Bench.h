@@ -0,0 +1,43 @@
+// Shared helpers for the standalone benchmarks in bench/
+// Author: James Walker jwwalker a+ mtu d0+ edu
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+inline double benchSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+inline std::vector<std::string> readLines(const char *filename) {
+  std::vector<std::string> result;
+  std::ifstream inputFile(filename);
+  if (!inputFile.is_open()) {
+    fprintf(stderr, "Unable to open %s\n", filename);
+    exit(1);
+  }
+  std::string line;
+  while (getline(inputFile, line)) result.push_back(line);
+  return result;
+}
+
+// One result per line, as JSON, so runs can be diffed and graphed.
+inline void reportResult(const char *benchmark, const char *variant, const char *metric,
+                  double value, const char *unit) {
+  printf("{\"benchmark\":\"%s\",\"variant\":\"%s\",\"metric\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"}\n",
+    benchmark, variant, metric, value, unit);
+  fflush(stdout);
+}
+
+// Keeps the optimizer from discarding a benchmark's results.
+static volatile double benchSink;
+
+#endif
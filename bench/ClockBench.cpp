@@ -0,0 +1,130 @@
+// Accuracy of the clock sync estimator. Round trips are measured for real
+// on loopback, then replayed against a simulated slave clock that is off by
+// a known offset and drifts at a known rate, with the master holding each
+// request for a while as a busy playback loop does, and the uplink and
+// downlink taking unequal shares of each trip. Reports how far the slave's
+// idea of the master's time is from the truth, once synced and over a
+// simulated run of a few minutes.
+// Usage: ClockBench [seconds]
+
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "Bench.h"
+#include "../ClockSync.h"
+
+#define ROUND_TRIPS 2000
+
+typedef struct clockScenario {
+  const char *name;
+  double offset;        // slave minus master at the start, seconds
+  double drift;         // slave's rate error, parts per million
+  double hold;          // longest the master sits on a request, seconds
+  double asymmetry;     // largest share of a trip the uplink may take beyond half
+} clockScenario;
+
+void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+// Loopback round trips, in seconds, through a socket pair answering each
+// other as the master and slave do.
+std::vector<double> measureRoundTrips() {
+  int a = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP), b = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(b, (struct sockaddr*)&addr, sizeof(addr)) == -1) error("ERROR bind");
+  socklen_t len = sizeof(addr);
+  getsockname(b, (struct sockaddr*)&addr, &len);
+  std::vector<double> trips;
+  char buf[96];
+  for (int i = 0; i < ROUND_TRIPS; i++) {
+    double start = benchSeconds();
+    int n = writeSyncRequest(buf, sizeof(buf), localClockNs());
+    sendto(a, buf, n, 0, (struct sockaddr*)&addr, sizeof(addr));
+    struct sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    n = recvfrom(b, buf, sizeof(buf) - 1, 0, (struct sockaddr*)&from, &fromLen);
+    n = writeSyncReply(buf, sizeof(buf), 1, 2, 3);
+    sendto(b, buf, n, 0, (struct sockaddr*)&from, fromLen);
+    recv(a, buf, sizeof(buf) - 1, 0);
+    trips.push_back(benchSeconds() - start);
+  }
+  close(a);
+  close(b);
+  return trips;
+}
+
+void benchScenario(const clockScenario &sc, const std::vector<double> &trips, double seconds) {
+  clockSync c;
+  initClockSync(c);
+  unsigned int seed = 3;
+  const long long start = 1700000000LL * 1000000000LL;  // master time at the start, ns
+  // the slave's clock, by the master's
+  #define SLAVE_CLOCK(master) ((long long)((master) + sc.offset * 1e9 + ((master) - start) * sc.drift * 1e-6))
+  double firstSynced = -1;
+  std::vector<double> errors;
+  double worst = 0, unsettled = 0;
+  for (double t = 0; t < seconds; t += SYNC_INTERVAL / 10) {
+    long long master = start + (long long)(t * 1e9);
+    if (c.synced) {
+      // how far the slave's estimate of the master's time is off
+      double err = fabs((double)(syncedNs(c, SLAVE_CLOCK(master)) - master)) / 1e3;
+      if (firstSynced < 0) firstSynced = t;
+      // until the exchanges span SYNC_MIN_SPAN the drift is unknown and the
+      // error grows with it between exchanges
+      if (t > firstSynced + SYNC_MIN_SPAN + 2 * SYNC_INTERVAL) {
+        errors.push_back(err);
+        if (err > worst) worst = err;
+      } else if (err > unsettled) {
+        unsettled = err;
+      }
+    }
+    // the slave only asks on its own schedule; step its request clock by hand
+    if (c.requests >= SYNC_STARTUP && t - c.lastRequest < SYNC_INTERVAL) continue;
+    if (c.requests < SYNC_STARTUP && t - c.lastRequest < SYNC_STARTUP_INTERVAL) continue;
+    c.lastRequest = t;
+    c.requests++;
+    double trip = trips[rand_r(&seed) % trips.size()];
+    double up = trip * (0.5 + sc.asymmetry * (2.0 * rand_r(&seed) / RAND_MAX - 1));
+    double hold = sc.hold * rand_r(&seed) / RAND_MAX;
+    long long t2 = master + (long long)(up * 1e9);
+    long long t3 = t2 + (long long)(hold * 1e9);
+    long long t4master = t3 + (long long)((trip - up) * 1e9);
+    addSyncReply(c, SLAVE_CLOCK(master), t2, t3, SLAVE_CLOCK(t4master));
+  }
+  #undef SLAVE_CLOCK
+  std::sort(errors.begin(), errors.end());
+  reportResult("clock", sc.name, "first_synced_ms", firstSynced * 1e3, "ms");
+  reportResult("clock", sc.name, "unsettled_max_us", unsettled, "us");
+  if (!errors.empty()) {
+    reportResult("clock", sc.name, "error_p50_us", errors[errors.size() / 2], "us");
+    reportResult("clock", sc.name, "error_p99_us", errors[errors.size() * 99 / 100], "us");
+    reportResult("clock", sc.name, "error_max_us", worst, "us");
+  }
+  reportResult("clock", sc.name, "drift_error_ppm", fabs(-c.drift * 1e6 - sc.drift), "ppm");
+}
+
+int main(int argc, char** argv) {
+  double seconds = argc > 1 ? atof(argv[1]) : 300;
+  std::vector<double> trips = measureRoundTrips();
+  std::sort(trips.begin(), trips.end());
+  reportResult("clock", "loopback", "round_trip_p50_us", trips[trips.size() / 2] * 1e6, "us");
+  reportResult("clock", "loopback", "round_trip_p99_us", trips[trips.size() * 99 / 100] * 1e6, "us");
+  const clockScenario scenarios[] = {
+    { "offset_only", 0.25, 0, 0, 0.1 },
+    { "drift_50ppm", -3.0, 50, 0, 0.1 },
+    { "drift_50ppm_held_20ms", -3.0, 50, 0.02, 0.1 },
+    { "drift_50ppm_asymmetric", -3.0, 50, 0, 0.4 },
+  };
+  for (int i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) benchScenario(scenarios[i], trips, seconds);
+  return 0;
+}
@@ -0,0 +1,158 @@
+// Throughput of the master's "Name~x~y~z" encode (lexical_cast per field)
+// against snprintf() and a fixed-point formatter, over recordings.
+// Usage: EncodeBench recording... [--passes=n]
+
+#include <string.h>
+#include <math.h>
+#include <boost/lexical_cast.hpp>
+
+#include "Bench.h"
+#include "../LineParser.h"
+
+using namespace std;
+
+typedef struct namedSample {
+  string name;
+  float x, y, z;
+} namedSample;
+
+// The master's live path, field by field.
+void encodeLexicalCast(const namedSample &s, string &out) {
+  out = s.name;
+  out.append("~");
+  out.append(boost::lexical_cast<string>(s.x));
+  out.append("~");
+  out.append(boost::lexical_cast<string>(s.y));
+  out.append("~");
+  out.append(boost::lexical_cast<string>(s.z));
+}
+
+// lexical_cast<string>(float) prints 9 significant digits, so this produces
+// the same bytes.
+int encodeSnprintf(const namedSample &s, char *buf, size_t size) {
+  return snprintf(buf, size, "%s~%.9g~%.9g~%.9g", s.name.c_str(), s.x, s.y, s.z);
+}
+
+// Fixed six decimals (micrometres, well below Vicon's resolution); shorter on
+// the wire but not byte-identical to the others.
+char *formatFixed(char *p, float value) {
+  long long micro = llround((double)value * 1e6);
+  if (micro < 0) {
+    *p++ = '-';
+    micro = -micro;
+  }
+  char digits[24];
+  int n = 0;
+  long long whole = micro / 1000000;
+  do {
+    digits[n++] = '0' + whole % 10;
+    whole /= 10;
+  } while (whole > 0);
+  while (n > 0) *p++ = digits[--n];
+  int frac = micro % 1000000;
+  if (frac != 0) {
+    *p++ = '.';
+    for (int scale = 100000; scale > 0 && frac != 0; scale /= 10) {
+      *p++ = '0' + frac / scale;
+      frac %= scale;
+    }
+  }
+  return p;
+}
+
+int encodeFixed(const namedSample &s, char *buf) {
+  char *p = buf;
+  memcpy(p, s.name.data(), s.name.size());
+  p += s.name.size();
+  *p++ = FIELD_DELIM;
+  p = formatFixed(p, s.x);
+  *p++ = FIELD_DELIM;
+  p = formatFixed(p, s.y);
+  *p++ = FIELD_DELIM;
+  p = formatFixed(p, s.z);
+  *p = '\0';
+  return p - buf;
+}
+
+int main(int argc, char** argv) {
+  int passes = 5;
+  vector<namedSample> samples;
+  for (int a = 1; a < argc; a++) {
+    if (strncmp(argv[a], "--passes=", 9) == 0) {
+      passes = atoi(argv[a] + 9);
+      continue;
+    }
+    vector<string> lines = readLines(argv[a]);
+    for (int i = 0; i < lines.size(); i++) {
+      parsedLine parsed;
+      if (!parseLine(lines[i].c_str(), lines[i].size(), parsed) || parsed.numValues != 3) continue;
+      namedSample s;
+      s.name.assign(parsed.name, parsed.nameLen);
+      s.x = parsed.values[0];
+      s.y = parsed.values[1];
+      s.z = parsed.values[2];
+      samples.push_back(s);
+    }
+  }
+  if (samples.empty()) {
+    printf("USAGE: EncodeBench recording... [--passes=n]\n");
+    return 1;
+  }
+
+  // snprintf must be a drop-in; the fixed format should round-trip to within
+  // half a micrometre plus float rounding
+  int mismatches = 0;
+  double maxError = 0;
+  double bytesLexical = 0, bytesFixed = 0;
+  char buf[128];
+  string encoded;
+  for (int i = 0; i < samples.size(); i++) {
+    encodeLexicalCast(samples[i], encoded);
+    encodeSnprintf(samples[i], buf, sizeof(buf));
+    if (encoded != buf) mismatches++;
+    bytesLexical += encoded.size();
+    int len = encodeFixed(samples[i], buf);
+    bytesFixed += len;
+    parsedLine parsed;
+    if (!parseLine(buf, len, parsed) || parsed.numValues != 3) {
+      mismatches++;
+      continue;
+    }
+    float original[3] = { samples[i].x, samples[i].y, samples[i].z };
+    for (int f = 0; f < 3; f++) maxError = max(maxError, fabs((double)parsed.values[f] - original[f]));
+  }
+  reportResult("encode", "snprintf", "mismatches", mismatches, "lines");
+  reportResult("encode", "fixed", "max_error", maxError * 1e6, "um");
+  reportResult("encode", "fixed", "bytes_saved", 1.0 - bytesFixed / bytesLexical, "fraction");
+
+  double totalLines = (double)samples.size() * passes;
+  double sum = 0;
+  double start = benchSeconds();
+  for (int p = 0; p < passes; p++) {
+    for (int i = 0; i < samples.size(); i++) {
+      encodeLexicalCast(samples[i], encoded);
+      sum += encoded.size();
+    }
+  }
+  double elapsed = benchSeconds() - start;
+  reportResult("encode", "lexical_cast", "lines_per_sec", totalLines / elapsed, "lines/s");
+  double legacy = elapsed;
+
+  start = benchSeconds();
+  for (int p = 0; p < passes; p++) {
+    for (int i = 0; i < samples.size(); i++) sum += encodeSnprintf(samples[i], buf, sizeof(buf));
+  }
+  elapsed = benchSeconds() - start;
+  reportResult("encode", "snprintf", "lines_per_sec", totalLines / elapsed, "lines/s");
+  reportResult("encode", "snprintf", "speedup", legacy / elapsed, "x");
+
+  start = benchSeconds();
+  for (int p = 0; p < passes; p++) {
+    for (int i = 0; i < samples.size(); i++) sum += encodeFixed(samples[i], buf);
+  }
+  elapsed = benchSeconds() - start;
+  reportResult("encode", "fixed", "lines_per_sec", totalLines / elapsed, "lines/s");
+  reportResult("encode", "fixed", "speedup", legacy / elapsed, "x");
+  benchSink = sum;
+  return mismatches == 0 ? 0 : 1;
+}
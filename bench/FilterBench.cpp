@@ -0,0 +1,166 @@
+// The master's motion filter over recordings: cost per sample, how many
+// samples survive resampling, how much jitter is removed and how far the
+// smoothed path trails the raw one, and how far off a bridged occlusion
+// ends up. Sample times come from the frame markers of playback recordings
+// (seconds since the previous frame); live dumps have none, so there each
+// object's samples are taken to be 1/DATA_HERTZ apart.
+// Usage: FilterBench recording... [--passes=n]
+
+#include <string.h>
+#include <math.h>
+#include <map>
+
+#include "Bench.h"
+#include "../LineParser.h"
+#include "../MotionFilter.h"
+
+#define DATA_HERTZ 100.0
+
+using namespace std;
+
+typedef struct objectSample {
+  int object;
+  double time;
+  float position[3];
+} objectSample;
+
+const char *baseName(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+// Mean length of the second difference between consecutive points: zero for
+// a straight, evenly sampled path and dominated by noise for a jittery one.
+double jitter(const vector<vector<float> > &paths) {
+  double total = 0;
+  int count = 0;
+  for (int o = 0; o < paths.size(); o++) {
+    const vector<float> &p = paths[o];
+    for (int i = 6; i + 2 < p.size(); i += 3) {
+      double d2 = 0;
+      for (int k = 0; k < 3; k++) {
+        double a = p[i + k] - 2 * p[i - 3 + k] + p[i - 6 + k];
+        d2 += a * a;
+      }
+      total += sqrt(d2);
+      count++;
+    }
+  }
+  return count ? total / count : 0;
+}
+
+void benchRecording(const char *recording, int passes) {
+  const char *label = baseName(recording);
+  vector<string> input = readLines(recording);
+  vector<objectSample> samples;
+  map<string, int> objects;
+  vector<int> counts;
+  double clock = 0;
+  bool timed = false;
+  for (int i = 0; i < input.size(); i++) {
+    parsedLine parsed;
+    if (!parseLine(input[i].c_str(), input[i].size(), parsed)) {
+      if (!input[i].empty() && i > 0) {  // the first marker is the time before recording began
+        clock += atof(input[i].c_str());
+        timed = true;
+      }
+      continue;
+    }
+    if (parsed.numValues < 3) continue;
+    if (parsed.values[0] == 0 && parsed.values[1] == 0 && parsed.values[2] == 0) continue; // occluded
+    string name(parsed.name, parsed.nameLen);
+    if (objects.count(name) == 0) {
+      objects[name] = counts.size();
+      counts.push_back(0);
+    }
+    objectSample s;
+    s.object = objects[name];
+    s.time = timed ? clock : counts[s.object] / DATA_HERTZ;
+    counts[s.object]++;
+    memcpy(s.position, parsed.values, sizeof(s.position));
+    samples.push_back(s);
+  }
+  if (samples.empty()) return;
+
+  vector<motionFilter> filters(objects.size());
+  vector<vector<float> > rawPaths(objects.size()), smoothPaths(objects.size());
+  double start = benchSeconds();
+  int kept = 0;
+  double error = 0;
+  for (int p = 0; p < passes; p++) {
+    for (int o = 0; o < filters.size(); o++) resetMotionFilter(filters[o]);
+    kept = 0;
+    error = 0;
+    for (int i = 0; i < samples.size(); i++) {
+      motionFilter &f = filters[samples[i].object];
+      float smoothed[3];
+      filterPosition(f, samples[i].position, samples[i].time, smoothed);
+      if (resamplePosition(f, smoothed, RESAMPLE_DISTANCE)) kept++;
+      if (p == 0) {
+        rawPaths[samples[i].object].insert(rawPaths[samples[i].object].end(), samples[i].position, samples[i].position + 3);
+        smoothPaths[samples[i].object].insert(smoothPaths[samples[i].object].end(), smoothed, smoothed + 3);
+      }
+      float dx = smoothed[0] - samples[i].position[0];
+      float dy = smoothed[1] - samples[i].position[1];
+      float dz = smoothed[2] - samples[i].position[2];
+      error += sqrt(dx*dx + dy*dy + dz*dz);
+    }
+  }
+  double elapsed = benchSeconds() - start;
+  benchSink = error;
+
+  // pretend each object vanishes every tenth sample and compare where the
+  // bridge has carried it when it gives up with where it really was
+  int horizon = (int)(OCCLUSION_BRIDGE * DATA_HERTZ + 0.5);
+  vector<vector<int> > byObject(objects.size());
+  for (int i = 0; i < samples.size(); i++) byObject[samples[i].object].push_back(i);
+  double bridgeError = 0, holdError = 0;
+  int bridges = 0;
+  for (int o = 0; o < byObject.size(); o++) {
+    motionFilter f;
+    resetMotionFilter(f);
+    for (int j = 0; j + horizon < byObject[o].size(); j++) {
+      const objectSample &now = samples[byObject[o][j]];
+      float smoothed[3];
+      filterPosition(f, now.position, now.time, smoothed);
+      if (j % 10 != 0 || j == 0) continue;
+      const objectSample &later = samples[byObject[o][j + horizon]];
+      float predicted[3];
+      predictPosition(f, later.time, predicted);
+      float dx = predicted[0] - later.position[0];
+      float dy = predicted[1] - later.position[1];
+      float dz = predicted[2] - later.position[2];
+      bridgeError += sqrt(dx*dx + dy*dy + dz*dz);
+      dx = smoothed[0] - later.position[0];  // versus leaving it where it was last seen
+      dy = smoothed[1] - later.position[1];
+      dz = smoothed[2] - later.position[2];
+      holdError += sqrt(dx*dx + dy*dy + dz*dz);
+      bridges++;
+    }
+  }
+
+  reportResult("filter", label, "ns_per_sample", elapsed / ((double)samples.size() * passes) * 1e9, "ns");
+  reportResult("filter", label, "kept", (double)kept / samples.size(), "fraction");
+  reportResult("filter", label, "raw_jitter", jitter(rawPaths) * 1e6, "um");
+  reportResult("filter", label, "smoothed_jitter", jitter(smoothPaths) * 1e6, "um");
+  reportResult("filter", label, "mean_lag", error / samples.size() * 1e6, "um");
+  if (bridges > 0) {
+    reportResult("filter", label, "bridge_error", bridgeError / bridges * 1e6, "um");
+    reportResult("filter", label, "hold_error", holdError / bridges * 1e6, "um");
+  }
+}
+
+int main(int argc, char** argv) {
+  int passes = 10;
+  vector<const char*> recordings;
+  for (int a = 1; a < argc; a++) {
+    if (strncmp(argv[a], "--passes=", 9) == 0) passes = atoi(argv[a] + 9);
+    else recordings.push_back(argv[a]);
+  }
+  if (recordings.empty()) {
+    printf("USAGE: FilterBench recording... [--passes=n]\n");
+    return 1;
+  }
+  for (int r = 0; r < recordings.size(); r++) benchRecording(recordings[r], passes);
+  return 0;
+}
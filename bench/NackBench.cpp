@@ -0,0 +1,258 @@
+// Recovery of dropped datagrams on loopback: a master and a wall of slaves
+// in one process, with datagrams dropped on purpose, either by one tile at a
+// time or by every tile at once (as when the master's own send is lost).
+// Reports how many come back, how long they take, and what the NACKs and
+// resends cost on top of the stream. A master restart is checked too: the
+// new run must reach the tiles in full even though its sequence numbers
+// overlap the ones they already have.
+// Usage: NackBench [packets]
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "Bench.h"
+#include "../Retransmit.h"
+
+#define BUFLEN 512
+#define TILES 8
+#define SEND_INTERVAL 0.0002   // seconds between datagrams, a busy performance
+#define RESTART_OLD 500        // datagrams of the old run a tile has when the master restarts
+#define RESTART_NEW 600        // and of the new run sent after it
+
+typedef struct lossModel {
+  const char *name;
+  double perTile;       // chance each tile drops a datagram, originals and resends alike
+  double shared;        // chance the master's send of an original is lost to every tile
+} lossModel;
+
+typedef struct benchTile {
+  int fd;
+  struct sockaddr_in addr;
+  reorderWindow window;
+  unsigned int last;    // last seq delivered
+  unsigned long delivered;
+  unsigned long mismatches;  // delivered out of order
+} benchTile;
+
+int tx;
+benchTile tiles[TILES];
+unsigned int lossSeed = 1;
+
+void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+bool chance(double p) {
+  return p > 0 && rand_r(&lossSeed) < p * RAND_MAX;
+}
+
+int openSocket(struct sockaddr_in &addr) {
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd == -1) error("ERROR socket");
+  int rcvbuf = 4 * 1024 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) error("ERROR bind");
+  socklen_t len = sizeof(addr);
+  getsockname(fd, (struct sockaddr*)&addr, &len);
+  return fd;
+}
+
+void deliver(void *context, unsigned int seq, const char *data, size_t len) {
+  benchTile *tile = (benchTile*)context;
+  if (tile->last != 0 && !seqAfter(seq, tile->last)) tile->mismatches++;
+  tile->last = seq;
+  tile->delivered++;
+}
+
+// "Broadcast": the same datagram to every tile.
+void sendToWall(const char *data, int len) {
+  for (int t = 0; t < TILES; t++) {
+    if (sendto(tx, data, len, 0, (struct sockaddr*)&tiles[t].addr, sizeof(tiles[t].addr)) == -1) {
+      error("ERROR sendto()");
+    }
+  }
+}
+
+// Drain every tile's socket, dropping what the loss model says, and send
+// the NACKs that are due back to the master.
+void serviceTiles(const lossModel &loss, struct sockaddr_in &masterAddr) {
+  char buf[BUFLEN + 1];
+  double now = retransmitClock();
+  for (int t = 0; t < TILES; t++) {
+    benchTile &tile = tiles[t];
+    while (true) {
+      ssize_t n = recv(tile.fd, buf, BUFLEN, MSG_DONTWAIT);
+      if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        error("ERROR recv");
+      }
+      if (chance(loss.perTile)) continue;
+      buf[n] = '\0';
+      unsigned int seq;
+      readSeqHeader(buf, seq);
+      acceptPacket(tile.window, seq, 0, buf, n, now, deliver, &tile);
+    }
+    nackRange ranges[NACK_MAX_RANGES];
+    int numRanges = serviceWindow(tile.window, now, ranges, NACK_MAX_RANGES, deliver, &tile);
+    for (int r = 0; r < numRanges; r++) {
+      char nack[64];
+      int len = writeNack(nack, sizeof(nack), ranges[r].first, ranges[r].count);
+      sendto(tile.fd, nack, len, 0, (struct sockaddr*)&masterAddr, sizeof(masterAddr));
+    }
+  }
+}
+
+void serviceMaster(resendHistory &history) {
+  char request[64];
+  while (true) {
+    ssize_t n = recv(tx, request, sizeof(request) - 1, MSG_DONTWAIT);
+    if (n == -1) break;
+    request[n] = '\0';
+    unsigned int first;
+    int count;
+    if (!parseNack(request, first, count)) continue;
+    history.nacks++;
+    double now = retransmitClock();
+    for (unsigned int seq = first; count > 0; seq = nextSeq(seq), count--) {
+      const sentPacket *p = packetToResend(history, seq, now);
+      if (p != NULL) sendToWall(p->data, p->len);
+    }
+  }
+}
+
+void benchLoss(const lossModel &loss, int packets) {
+  struct sockaddr_in masterAddr;
+  tx = openSocket(masterAddr);
+  for (int t = 0; t < TILES; t++) {
+    tiles[t].fd = openSocket(tiles[t].addr);
+    initReorderWindow(tiles[t].window, 1000 + t);
+    tiles[t].last = 0;
+    tiles[t].delivered = tiles[t].mismatches = 0;
+  }
+  resendHistory history;
+  initResendHistory(history);
+
+  unsigned int seq = 0;
+  unsigned long sentBytes = 0;
+  int sharedDrops = 0;
+  double start = retransmitClock();
+  double next = start;
+  for (int i = 0; i < packets; ) {
+    if (retransmitClock() >= next) {
+      char packet[BUFLEN];
+      seq = nextSeq(seq);
+      int len = writeSeqHeader(packet, BUFLEN, seq);
+      len += snprintf(packet + len, BUFLEN - len, "HandL~%.6f~%.6f~%.6f", i * 1e-4, -i * 1e-4, 1.5);
+      rememberPacket(history, seq, packet, len);
+      if (chance(loss.shared)) sharedDrops++;
+      else sendToWall(packet, len);
+      sentBytes += (unsigned long)len * TILES;
+      next += SEND_INTERVAL;
+      i++;
+    }
+    serviceTiles(loss, masterAddr);
+    serviceMaster(history);
+  }
+  // a last datagram shows up any gap at the very end, then give the tiles
+  // time to chase it
+  char tail[BUFLEN];
+  int tailLen = writeSeqHeader(tail, BUFLEN, nextSeq(seq));
+  tailLen += snprintf(tail + tailLen, BUFLEN - tailLen, "DUMMYDATA");
+  rememberPacket(history, nextSeq(seq), tail, tailLen);
+  sendToWall(tail, tailLen);
+  for (double end = retransmitClock() + NACK_GIVE_UP * 2; retransmitClock() < end; ) {
+    serviceTiles(loss, masterAddr);
+    serviceMaster(history);
+  }
+
+  unsigned long missed = 0, recovered = 0, lost = 0, nacks = 0, delivered = 0, mismatches = 0;
+  double recoveryTotal = 0, recoveryMax = 0;
+  for (int t = 0; t < TILES; t++) {
+    reorderWindow &w = tiles[t].window;
+    missed += w.missed;
+    recovered += w.recovered;
+    lost += w.lost;
+    nacks += w.nacks;
+    recoveryTotal += w.recoveryTotal;
+    if (w.recoveryMax > recoveryMax) recoveryMax = w.recoveryMax;
+    delivered += tiles[t].delivered;
+    mismatches += tiles[t].mismatches;
+    close(tiles[t].fd);
+  }
+  close(tx);
+  unsigned long expected = (unsigned long)(packets + 1) * TILES;
+  reportResult("nack", loss.name, "missed_per_tile", (double)missed / TILES, "packets");
+  reportResult("nack", loss.name, "recovered", missed ? (double)recovered / missed : 1, "fraction");
+  reportResult("nack", loss.name, "lost", lost, "packets");
+  reportResult("nack", loss.name, "delivered", (double)delivered / expected, "fraction");
+  reportResult("nack", loss.name, "mismatches", mismatches, "packets");
+  reportResult("nack", loss.name, "recovery_mean_ms", recovered ? recoveryTotal / recovered * 1e3 : 0, "ms");
+  reportResult("nack", loss.name, "recovery_max_ms", recoveryMax * 1e3, "ms");
+  reportResult("nack", loss.name, "nacks_per_miss", missed ? (double)nacks / missed : 0, "nacks");
+  reportResult("nack", loss.name, "nacks_received", history.nacks, "nacks");
+  reportResult("nack", loss.name, "resent", history.resent, "packets");
+  reportResult("nack", loss.name, "suppressed", history.suppressed, "nacks");
+  if (sharedDrops > 0 && loss.perTile == 0) {
+    reportResult("nack", loss.name, "resends_per_shared_drop", (double)history.resent / sharedDrops, "packets");
+  }
+  reportResult("nack", loss.name, "overhead", (double)history.resentBytes * TILES / sentBytes, "fraction");
+}
+
+// Hand one tile's window a datagram as the slave does, run and all.
+void feedTile(benchTile &tile, unsigned int seq, unsigned int run, const char *payload) {
+  char packet[BUFLEN + 1];
+  int len = run ? writeSeqHeader(packet, BUFLEN, seq, run, 0) : writeSeqHeader(packet, BUFLEN, seq);
+  len += snprintf(packet + len, BUFLEN - len, "%s", payload);
+  unsigned int parsedSeq, parsedRun;
+  long long stamp;
+  readSeqHeader(packet, parsedSeq, parsedRun, stamp);
+  acceptPacket(tile.window, parsedSeq, parsedRun, packet, len, retransmitClock(), deliver, &tile);
+}
+
+// The master restarts when a tile has only seen RESTART_OLD of its
+// datagrams, fewer than the reorder window, then a resend from the old run
+// straggles in. Headers without the run show what the tiles did before
+// they had it: the new run's first RESTART_OLD datagrams, its !DRAW among
+// them, were taken for duplicates.
+void benchRestart() {
+  const char *variants[2] = { "restart_no_run", "restart" };
+  for (int v = 0; v < 2; v++) {
+    benchTile tile;
+    initReorderWindow(tile.window, 1);
+    tile.last = 0;
+    tile.delivered = tile.mismatches = 0;
+    unsigned int oldRun = v ? 1000 : 0, newRun = v ? 1042 : 0;
+    for (unsigned int seq = 1; seq <= RESTART_OLD; seq++) feedTile(tile, seq, oldRun, "HandL~0.1~0.2~1.5");
+    unsigned long before = tile.delivered;
+    tile.last = 0;  // the new run is in order from its own start
+    feedTile(tile, 1, newRun, "!DRAW~1~1");
+    for (unsigned int seq = 2; seq <= RESTART_NEW; seq++) feedTile(tile, seq, newRun, "HandL~0.1~0.2~1.5");
+    unsigned long afterRestart = tile.delivered;
+    feedTile(tile, RESTART_OLD, oldRun, "HandL~0.1~0.2~1.5");
+    reportResult("nack", variants[v], "delivered", (double)(afterRestart - before) / RESTART_NEW, "fraction");
+    reportResult("nack", variants[v], "stragglers_passed", tile.delivered - afterRestart, "packets");
+    reportResult("nack", variants[v], "restarts", tile.window.restarts, "restarts");
+    reportResult("nack", variants[v], "mismatches", tile.mismatches, "packets");
+  }
+}
+
+int main(int argc, char** argv) {
+  int packets = argc > 1 ? atoi(argv[1]) : 5000;
+  const lossModel models[] = {
+    { "none", 0, 0 },
+    { "tile_1pct", 0.01, 0 },
+    { "shared_1pct", 0, 0.01 },
+    { "mixed_5pct", 0.04, 0.01 },
+  };
+  for (int m = 0; m < sizeof(models) / sizeof(models[0]); m++) benchLoss(models[m], packets);
+  benchRestart();
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Throughput of the "Name~x~y~z" line parser against the old split()/atof()
+// path, over a recording.
+// Usage: ParseBench recording [passes]
+
+#include <string.h>
+#include <sstream>
+
+#include "Bench.h"
+#include "../LineParser.h"
+
+using namespace std;
+
+// The receive path as it was: a stringstream split into a fresh vector per
+// packet, then atof() on each field.
+vector<string> &split(const string &s, char delim, vector<string> &elems) {
+  stringstream ss(s);
+  string item;
+  while (getline(ss, item, delim)) {
+    elems.push_back(item);
+  }
+  return elems;
+}
+
+vector<string> split(const string &s, char delim) {
+  vector<string> elems;
+  return split(s, delim, elems);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("USAGE: ParseBench recording [passes]\n");
+    return 1;
+  }
+  int passes = argc > 2 ? atoi(argv[2]) : 20;
+  vector<string> lines = readLines(argv[1]);
+  double bytes = 0;
+  for (int i = 0; i < lines.size(); i++) bytes += lines[i].size() + 1;
+
+  // both parsers must agree on every line before their speed means anything
+  int mismatches = 0;
+  for (int i = 0; i < lines.size(); i++) {
+    vector<string> splitLine = split(lines[i], '~');
+    parsedLine parsed;
+    bool ok = parseLine(lines[i].c_str(), lines[i].size(), parsed);
+    if ((splitLine.size() == 4) != (ok && parsed.numValues == 3)) {
+      mismatches++;
+      continue;
+    }
+    if (splitLine.size() != 4) continue;
+    if (splitLine[0] != string(parsed.name, parsed.nameLen)) mismatches++;
+    for (int f = 0; f < 3; f++) {
+      float expected = atof(splitLine[f + 1].c_str());
+      if (memcmp(&expected, &parsed.values[f], sizeof(float)) != 0) mismatches++;
+    }
+  }
+  reportResult("parse", "agreement", "mismatches", mismatches, "fields");
+
+  double sum = 0;
+  double start = benchSeconds();
+  for (int p = 0; p < passes; p++) {
+    for (int i = 0; i < lines.size(); i++) {
+      string itrmdt(lines[i].c_str());
+      vector<string> splitLine = split(itrmdt, '~');
+      if (splitLine.size() == 4) {
+        sum += atof(splitLine[1].c_str()) + atof(splitLine[2].c_str()) + atof(splitLine[3].c_str());
+      }
+    }
+  }
+  double legacy = benchSeconds() - start;
+  benchSink = sum;
+
+  sum = 0;
+  start = benchSeconds();
+  for (int p = 0; p < passes; p++) {
+    for (int i = 0; i < lines.size(); i++) {
+      parsedLine parsed;
+      if (parseLine(lines[i].c_str(), lines[i].size(), parsed) && parsed.numValues == 3) {
+        sum += parsed.values[0] + parsed.values[1] + parsed.values[2];
+      }
+    }
+  }
+  double fast = benchSeconds() - start;
+  benchSink = sum;
+
+  double totalLines = (double)lines.size() * passes;
+  reportResult("parse", "split+atof", "lines_per_sec", totalLines / legacy, "lines/s");
+  reportResult("parse", "split+atof", "mb_per_sec", bytes * passes / legacy / 1e6, "MB/s");
+  reportResult("parse", "parseLine", "lines_per_sec", totalLines / fast, "lines/s");
+  reportResult("parse", "parseLine", "mb_per_sec", bytes * passes / fast / 1e6, "MB/s");
+  reportResult("parse", "parseLine", "speedup", legacy / fast, "x");
+  return mismatches == 0 ? 0 : 1;
+}
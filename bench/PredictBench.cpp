@@ -0,0 +1,110 @@
+// Prediction error against a recorded performance. Each object's samples
+// are fed to a predictor at the times the recording gives them, and after
+// each one the position a few frames' worth of milliseconds ahead is
+// predicted and compared with where the recording has the object then. The
+// last sample, which is what the slave draws without prediction, is the
+// baseline. Needs a recording with frame times (Vicon_output_an.txt).
+// Usage: PredictBench recording
+
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+#include "Bench.h"
+#include "../LineParser.h"
+#include "../Predictor.h"
+
+typedef struct timedSample {
+  double time;
+  float position[3];
+  bool occluded;
+} timedSample;
+
+// Where the recording has the object at time, between the frames either
+// side of it; false if either is an occlusion or time is past the end.
+bool recordedAt(const std::vector<timedSample> &track, size_t from, double time, float out[3]) {
+  for (size_t j = from; j + 1 < track.size(); j++) {
+    if (track[j + 1].time < time) continue;
+    if (track[j].occluded || track[j + 1].occluded) return false;
+    double f = (time - track[j].time) / (track[j + 1].time - track[j].time);
+    for (int k = 0; k < 3; k++) out[k] = track[j].position[k] + f * (track[j + 1].position[k] - track[j].position[k]);
+    return true;
+  }
+  return false;
+}
+
+float distanceMm(const float a[3], const float b[3]) {
+  float dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+  return sqrtf(dx*dx + dy*dy + dz*dz) * 1000;
+}
+
+void reportErrors(const char *variant, const char *name, std::vector<float> &errors) {
+  if (errors.empty()) return;
+  std::sort(errors.begin(), errors.end());
+  double total = 0;
+  for (size_t i = 0; i < errors.size(); i++) total += errors[i];
+  std::string metric = std::string(name) + "_mean_mm";
+  reportResult("predict", variant, metric.c_str(), total / errors.size(), "mm");
+  metric = std::string(name) + "_p95_mm";
+  reportResult("predict", variant, metric.c_str(), errors[errors.size() * 95 / 100], "mm");
+  metric = std::string(name) + "_max_mm";
+  reportResult("predict", variant, metric.c_str(), errors.back(), "mm");
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: PredictBench recording\n");
+    return 1;
+  }
+  // a line holding just a number is the time since the previous frame
+  std::vector<std::string> lines = readLines(argv[1]);
+  std::map<std::string, std::vector<timedSample> > tracks;
+  double now = 0;
+  for (size_t i = 0; i < lines.size(); i++) {
+    parsedLine parsed;
+    if (!parseLine(lines[i].c_str(), lines[i].length(), parsed)) {
+      char *end;
+      double dt = strtod(lines[i].c_str(), &end);
+      if (end != lines[i].c_str()) now += dt;
+      continue;
+    }
+    if (parsed.numValues < 3) continue;
+    timedSample sample;
+    sample.time = now;
+    for (int k = 0; k < 3; k++) sample.position[k] = parsed.values[k];
+    sample.occluded = parsed.values[0] == 0 && parsed.values[1] == 0 && parsed.values[2] == 0;
+    tracks[std::string(parsed.name, parsed.nameLen)].push_back(sample);
+  }
+
+  const int horizonsMs[] = { 8, 17, 25, 33, 50 };
+  for (int h = 0; h < sizeof(horizonsMs) / sizeof(horizonsMs[0]); h++) {
+    double horizon = horizonsMs[h] / 1000.0;
+    std::vector<float> held, predicted;
+    unsigned long worse = 0;
+    for (std::map<std::string, std::vector<timedSample> >::iterator it = tracks.begin(); it != tracks.end(); it++) {
+      const std::vector<timedSample> &track = it->second;
+      kinematics motion;
+      initKinematics(motion);
+      addKinematicObject(motion);
+      for (size_t i = 0; i < track.size(); i++) {
+        if (track[i].occluded) {
+          resetKinematics(motion, 0);
+          continue;
+        }
+        recordKinematics(motion, 0, track[i].position, track[i].time);
+        float truth[3], guess[3];
+        if (!recordedAt(track, i, track[i].time + horizon, truth)) continue;
+        predictMotion(motion, 0, track[i].time + horizon, guess);
+        held.push_back(distanceMm(track[i].position, truth));
+        predicted.push_back(distanceMm(guess, truth));
+        if (predicted.back() > held.back()) worse++;
+      }
+    }
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%dms_ahead", horizonsMs[h]);
+    reportResult("predict", variant, "worse_than_held", held.empty() ? 0 : (double)worse / held.size(), "fraction");
+    reportErrors(variant, "held", held);
+    reportErrors(variant, "predicted", predicted);
+  }
+  return 0;
+}
@@ -0,0 +1,136 @@
+// Loopback packets/sec for the slave's receive path (recvfrom() per datagram
+// vs. recvmmsg() batches) and the master's send path (sendto() vs. sendmmsg()).
+// Usage: RecvBench [packets]
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "Bench.h"
+
+#define BUFLEN 512
+#define BATCH 64
+
+const char *PAYLOAD = "123456|HandL~-1.11515021~0.592835486~-1.96779454\n";
+
+int rx, tx;
+struct sockaddr_in rxAddr;
+char bufs[BATCH][BUFLEN + 1];
+struct mmsghdr msgs[BATCH];
+struct iovec iovecs[BATCH];
+
+void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+void setupMessages(bool sending) {
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < BATCH; i++) {
+    if (sending) strcpy(bufs[i], PAYLOAD);
+    iovecs[i].iov_base = bufs[i];
+    iovecs[i].iov_len = sending ? strlen(PAYLOAD) : BUFLEN;
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if (sending) {
+      msgs[i].msg_hdr.msg_name = &rxAddr;
+      msgs[i].msg_hdr.msg_namelen = sizeof(rxAddr);
+    }
+  }
+}
+
+// Send count datagrams, one syscall each or BATCH per syscall.
+double sendPackets(int count, bool batched) {
+  setupMessages(true);
+  double start = benchSeconds();
+  if (batched) {
+    for (int sent = 0; sent < count; ) {
+      int n = sendmmsg(tx, msgs, count - sent < BATCH ? count - sent : BATCH, 0);
+      if (n == -1) error("ERROR sendmmsg()");
+      sent += n;
+    }
+  } else {
+    for (int sent = 0; sent < count; sent++) {
+      if (sendto(tx, bufs[0], iovecs[0].iov_len, 0, (struct sockaddr*)&rxAddr, sizeof(rxAddr)) == -1) {
+        error("ERROR sendto()");
+      }
+    }
+  }
+  return benchSeconds() - start;
+}
+
+// Receive until the socket is empty; returns the number of datagrams drained.
+int drain(bool batched, double &elapsed) {
+  setupMessages(false);
+  int received = 0;
+  double start = benchSeconds();
+  while (true) {
+    int n;
+    if (batched) {
+      n = recvmmsg(rx, msgs, BATCH, MSG_DONTWAIT, NULL);
+    } else {
+      struct sockaddr_in from;
+      socklen_t fromLen = sizeof(from);
+      n = recvfrom(rx, bufs[0], BUFLEN, MSG_DONTWAIT, (struct sockaddr*)&from, &fromLen);
+      if (n >= 0) n = 1;
+    }
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      error("ERROR receive");
+    }
+    received += n;
+  }
+  elapsed += benchSeconds() - start;
+  return received;
+}
+
+int main(int argc, char** argv) {
+  int total = argc > 1 ? atoi(argv[1]) : 500000;
+  const int fill = 4000;  // datagrams queued per round; fits the receive buffer below
+
+  if ((rx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) error("ERROR socket");
+  if ((tx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) error("ERROR socket");
+  int rcvbuf = 16 * 1024 * 1024;
+  if (setsockopt(rx, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1) {
+    setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  memset(&rxAddr, 0, sizeof(rxAddr));
+  rxAddr.sin_family = AF_INET;
+  rxAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(rx, (struct sockaddr*)&rxAddr, sizeof(rxAddr)) == -1) error("ERROR bind");
+  socklen_t addrLen = sizeof(rxAddr);
+  getsockname(rx, (struct sockaddr*)&rxAddr, &addrLen);
+
+  // receive side: queue a round of datagrams, then time draining them
+  for (int batched = 0; batched <= 1; batched++) {
+    double elapsed = 0;
+    int received = 0;
+    int sent = 0;
+    while (sent < total) {
+      sendPackets(fill, true);
+      sent += fill;
+      received += drain(batched, elapsed);
+    }
+    const char *variant = batched ? "recvmmsg" : "recvfrom";
+    reportResult("recv", variant, "packets_per_sec", received / elapsed, "packets/s");
+    reportResult("recv", variant, "loss", 1.0 - (double)received / sent, "fraction");
+  }
+
+  // send side: the receiver is drained between rounds so the kernel never
+  // has to drop anything
+  for (int batched = 0; batched <= 1; batched++) {
+    double elapsed = 0;
+    double ignored = 0;
+    for (int sent = 0; sent < total; sent += fill) {
+      elapsed += sendPackets(fill, batched);
+      drain(true, ignored);
+    }
+    reportResult("send", batched ? "sendmmsg" : "sendto", "packets_per_sec", total / elapsed, "packets/s");
+  }
+  close(rx);
+  close(tx);
+  return 0;
+}
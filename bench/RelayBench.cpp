@@ -0,0 +1,245 @@
+// Latency a relay adds on loopback: a source sends a busy performance's
+// worth of datagrams to a slave directly, and then through one and two
+// relays, each on its own thread. Reports the end-to-end latency the slave
+// sees and the per-hop latency each relay measures, and checks that a slave
+// behind a relay gets its own losses back from the relay. Every node sleeps
+// while it waits, so the bench means something on a machine with fewer
+// cores than nodes.
+// Usage: RelayBench [packets]
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "Bench.h"
+#include "../Relay.h"
+
+#define BUFLEN 512
+#define MAX_HOPS 2
+#define SEND_INTERVAL 0.0002   // seconds between datagrams, a busy performance
+
+typedef struct benchSlave {
+  int fd;
+  struct sockaddr_in addr;
+  reorderWindow window;
+  double lossRate;
+  unsigned int seed;
+  unsigned int last;
+  unsigned long delivered;
+  unsigned long mismatches;  // delivered out of order, or altered on the way
+  std::vector<double> latencies;
+} benchSlave;
+
+relayNode relays[MAX_HOPS];
+volatile bool relaying = false;
+volatile bool listening = false;
+bool realtime = true;        // every relay got real-time scheduling, as the master asks for
+
+void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+void *runRelayThread(void *arg) {
+  relayNode *relay = (relayNode*)arg;
+  if (!relayRealtime()) realtime = false;
+  while (relaying) {
+    if (relayPackets(*relay) == -1) error("ERROR relaying");
+  }
+  return NULL;
+}
+
+unsigned short portOf(int fd) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  getsockname(fd, (struct sockaddr*)&addr, &len);
+  return ntohs(addr.sin_port);
+}
+
+void deliver(void *context, unsigned int seq, const char *data, size_t len) {
+  benchSlave *slave = (benchSlave*)context;
+  unsigned int sentSeq;
+  unsigned long long sentNs;
+  if (slave->last != 0 && !seqAfter(seq, slave->last)) slave->mismatches++;
+  if (sscanf(data, "%*u|PING~%u~%llu", &sentSeq, &sentNs) != 2 || sentSeq != seq) slave->mismatches++;
+  slave->last = seq;
+  slave->delivered++;
+}
+
+// Wait for the slave's socket, drain it, dropping what its loss rate says,
+// and NACK whoever sent the stream for the gaps.
+void serviceSlave(benchSlave &slave) {
+  char buf[BUFLEN + 1];
+  struct sockaddr_in from;
+  static struct sockaddr_in sender;
+  static bool haveSender = false;
+  for (int flags = 0; ; flags = MSG_DONTWAIT) {
+    socklen_t fromLen = sizeof(from);
+    ssize_t n = recvfrom(slave.fd, buf, BUFLEN, flags, (struct sockaddr*)&from, &fromLen);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+      error("ERROR recv");
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    sender = from;
+    haveSender = true;
+    if (slave.lossRate > 0 && rand_r(&slave.seed) < slave.lossRate * RAND_MAX) continue;
+    buf[n] = '\0';
+    unsigned int seq;
+    unsigned long long sentNs;
+    if (sscanf(buf, "%*u|PING~%*u~%llu", &sentNs) == 1) {
+      slave.latencies.push_back((ts.tv_sec * 1000000000ULL + ts.tv_nsec - sentNs) / 1e3);
+    }
+    readSeqHeader(buf, seq);
+    acceptPacket(slave.window, seq, 0, buf, n, retransmitClock(), deliver, &slave);
+  }
+  double now = retransmitClock();
+  nackRange ranges[NACK_MAX_RANGES];
+  int numRanges = serviceWindow(slave.window, now, ranges, NACK_MAX_RANGES, deliver, &slave);
+  for (int r = 0; r < numRanges && haveSender; r++) {
+    char nack[64];
+    int len = writeNack(nack, sizeof(nack), ranges[r].first, ranges[r].count);
+    sendto(slave.fd, nack, len, 0, (struct sockaddr*)&sender, sizeof(sender));
+  }
+}
+
+void *runSlaveThread(void *arg) {
+  benchSlave *slave = (benchSlave*)arg;
+  while (listening) serviceSlave(*slave);
+  return NULL;
+}
+
+void sleepUntil(double when) {
+  struct timespec ts;
+  ts.tv_sec = (time_t)when;
+  ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+// lossRate is the chance the slave drops a datagram, upstreamLoss the chance
+// the source's send never reaches the first relay.
+void benchHops(const char *variant, int hops, double lossRate, double upstreamLoss, int packets) {
+  benchSlave slave;
+  slave.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  memset(&slave.addr, 0, sizeof(slave.addr));
+  slave.addr.sin_family = AF_INET;
+  slave.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(slave.fd, (struct sockaddr*)&slave.addr, sizeof(slave.addr)) == -1) error("ERROR bind");
+  struct timeval tick;
+  tick.tv_sec = 0;
+  tick.tv_usec = RELAY_TICK_MS * 1000;
+  setsockopt(slave.fd, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof(tick));
+  initReorderWindow(slave.window, 7);
+  slave.lossRate = lossRate;
+  slave.seed = 1;
+  slave.last = 0;
+  slave.delivered = slave.mismatches = 0;
+  slave.latencies.reserve(packets);
+
+  // chain the relays back from the slave, each sending to the next hop
+  int nextPort = portOf(slave.fd);
+  for (int h = hops - 1; h >= 0; h--) {
+    if (!openRelay(relays[h], "0", "127.0.0.1", nextPort)) error("ERROR openRelay");
+    nextPort = portOf(relays[h].upstream);
+  }
+  pthread_t threads[MAX_HOPS], slaveThread;
+  relaying = listening = true;
+  for (int h = 0; h < hops; h++) pthread_create(&threads[h], NULL, runRelayThread, &relays[h]);
+  pthread_create(&slaveThread, NULL, runSlaveThread, &slave);
+
+  int tx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in first;
+  memset(&first, 0, sizeof(first));
+  first.sin_family = AF_INET;
+  first.sin_port = htons(nextPort);
+  first.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  resendHistory history;  // the source answers NACKs passed up to it
+  initResendHistory(history);
+
+  unsigned int seq = 0, upstreamSeed = 2;
+  double next = retransmitClock();
+  for (int i = 0; i <= packets; i++) {
+    sleepUntil(next);
+    next += SEND_INTERVAL;
+    char packet[BUFLEN];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    seq = nextSeq(seq);
+    int len = writeSeqHeader(packet, BUFLEN, seq);
+    len += snprintf(packet + len, BUFLEN - len, "PING~%u~%llu", seq, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    rememberPacket(history, seq, packet, len);
+    if (upstreamLoss == 0 || rand_r(&upstreamSeed) >= upstreamLoss * RAND_MAX) {
+      sendto(tx, packet, len, 0, (struct sockaddr*)&first, sizeof(first));
+    }
+    char request[64];
+    ssize_t n;
+    while ((n = recv(tx, request, sizeof(request) - 1, MSG_DONTWAIT)) > 0) {
+      request[n] = '\0';
+      unsigned int nackFirst;
+      int count;
+      if (!parseNack(request, nackFirst, count)) continue;
+      for (unsigned int s = nackFirst; count > 0; s = nextSeq(s), count--) {
+        const sentPacket *p = packetToResend(history, s, retransmitClock());
+        if (p != NULL) sendto(tx, p->data, p->len, 0, (struct sockaddr*)&first, sizeof(first));
+      }
+    }
+  }
+  usleep((useconds_t)(NACK_GIVE_UP * 2 * 1e6));
+  listening = false;
+  pthread_join(slaveThread, NULL);
+  relaying = false;
+  for (int h = 0; h < hops; h++) {
+    pthread_join(threads[h], NULL);
+    closeRelay(relays[h]);
+  }
+  close(tx);
+  close(slave.fd);
+
+  std::vector<double> &l = slave.latencies;
+  std::sort(l.begin(), l.end());
+  if (!l.empty()) {
+    reportResult("relay", variant, "end_to_end_p50_us", l[l.size() / 2], "us");
+    reportResult("relay", variant, "end_to_end_p99_us", l[l.size() * 99 / 100], "us");
+    reportResult("relay", variant, "end_to_end_max_us", l.back(), "us");
+  }
+  for (int h = 0; h < hops; h++) {
+    const latencyHistogram &hist = relays[h].latency;
+    char metric[64];
+    snprintf(metric, sizeof(metric), "hop%d_p50_us", h + 1);
+    reportResult("relay", variant, metric, latencyPercentile(hist, 0.5) * 1e6, "us");
+    snprintf(metric, sizeof(metric), "hop%d_p99_us", h + 1);
+    reportResult("relay", variant, metric, latencyPercentile(hist, 0.99) * 1e6, "us");
+    snprintf(metric, sizeof(metric), "hop%d_max_us", h + 1);
+    reportResult("relay", variant, metric, hist.max * 1e6, "us");
+    snprintf(metric, sizeof(metric), "hop%d_over_1ms", h + 1);
+    reportResult("relay", variant, metric, hist.count ? (double)hist.overBudget / hist.count : 0, "fraction");
+  }
+  if (hops > 0) reportResult("relay", variant, "realtime", realtime, "bool");
+  reportResult("relay", variant, "delivered", (double)slave.delivered / (packets + 1), "fraction");
+  reportResult("relay", variant, "mismatches", slave.mismatches, "packets");
+  if (lossRate > 0 || upstreamLoss > 0) {
+    reorderWindow &w = slave.window;
+    reportResult("relay", variant, "recovered", w.missed ? (double)w.recovered / w.missed : 1, "fraction");
+    reportResult("relay", variant, "recovery_mean_ms", w.recovered ? w.recoveryTotal / w.recovered * 1e3 : 0, "ms");
+    if (hops > 0) {
+      reportResult("relay", variant, "resent_by_relay", relays[hops - 1].history.resent, "packets");
+      reportResult("relay", variant, "nacks_passed_up", relays[hops - 1].passedUp, "nacks");
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  int packets = argc > 1 ? atoi(argv[1]) : 10000;
+  benchHops("direct", 0, 0, 0, packets);
+  benchHops("1_hop", 1, 0, 0, packets);
+  benchHops("2_hops", 2, 0, 0, packets);
+  benchHops("1_hop_1pct_loss", 1, 0.01, 0, packets);
+  benchHops("1_hop_1pct_upstream_loss", 1, 0, 0.01, packets);
+  return 0;
+}
@@ -0,0 +1,706 @@
+// Slave-side costs over recordings: packet ingest (SceneState::applyPacket(),
+// i.e. the receiver without sockets), averageDistanceHelper(), addAfterImage(),
+// stroke recording, per-tile command building for the whole wall, and
+// CPU-side geometry submission into an offscreen context (a small pbuffer,
+// so rasterization stays out of the way). A synthetic performance with
+// orientations covers ribbon generation, incremental upload and drawing, the
+// stroke index behind undo, erase and layers, and a dense scribble covers
+// level-of-detail building and what it saves as the canvas fills. A late
+// joiner's snapshot of that performance is timed from encoding through
+// compression, TCP loopback and inflation to decoding. Ingest is
+// also timed in backlogs, as the slave applies what piles up behind a slow
+// frame, checking that the strokes and motion come out the same. Heap
+// allocations are counted, so ingest can be checked to allocate nothing once
+// the scene has warmed up, and the stroke pool's mapping is timed.
+// Usage: SceneBench recording... [--passes=n] [--frames=n] [--no-render]
+
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include <new>
+#include <algorithm>
+
+#include "Bench.h"
+#include "../SceneState.h"
+#include "../SceneRenderer.h"
+#include "../Offscreen.h"
+#include "../LineParser.h"
+#include "../Protocol.h"
+
+#define RENDER_SIZE 64
+#define BACKLOG 256            // packets a slow frame leaves behind
+#define RIBBON_OBJECTS 4
+#define RIBBON_SAMPLES 60000   // per object, so 240k segments in all
+#define STORE_SAMPLES 50000    // per object, so 200k segments in all
+#define STORE_STROKE 500       // samples per stroke
+#define STORE_OPS 100
+#define LOD_FILL 409600        // segments at the last of four fill levels
+#define SNAPSHOT_SAMPLES 50000 // per object, so a 200k-line pool to catch up on
+#define GIGABIT_BYTES_PER_SEC 117e6  // what TCP gets through a gigabit link
+#define WALL_TILES "-0.5,0,-0.5,-0.25/-0.5,0,-0.25,0/-0.5,0,0,0.25/-0.5,0,0.25,0.5/" \
+                   "0,0.5,-0.5,-0.25/0,0.5,-0.25,0/0,0.5,0,0.25/0,0.5,0.25,0.5"
+
+using namespace std;
+
+// Every heap allocation in the process, counted.
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if (!p) throw bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) throw() {
+  free(p);
+}
+
+void operator delete(void *p, size_t size) throw() {
+  free(p);
+}
+
+void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+const char *baseName(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+// Lines that differ between two scenes fed the same packets.
+int strokeMismatches(SceneState *a, SceneState *b) {
+  if (a->strokeCount() != b->strokeCount()) return 1;
+  for (int i = 0; i < a->strokeCount(); i++) {
+    const packedLine &p = a->pool[i], &q = b->pool[i];
+    if (p.x1 != q.x1 || p.y1 != q.y1 || p.z1 != q.z1 || p.x2 != q.x2 || p.y2 != q.y2 || p.z2 != q.z2 ||
+        p.flags != q.flags || p.r != q.r || p.g != q.g || p.b != q.b || p.speed != q.speed) return 1;
+    if (isLive(p) && a->records[a->links[i].record].id != b->records[b->links[i].record].id) return 1;
+  }
+  return 0;
+}
+
+// Objects whose sample histories or motion differ between two scenes fed the
+// same packets.
+int kinematicMismatches(SceneState *a, SceneState *b) {
+  if (a->motion.numObjects != b->motion.numObjects) return max(a->motion.numObjects, b->motion.numObjects);
+  updateKinematics(a->motion);
+  updateKinematics(b->motion);
+  int mismatches = 0;
+  for (int o = 0; o < a->motion.numObjects; o++) {
+    double timesA[KINEMATIC_HISTORY], timesB[KINEMATIC_HISTORY];
+    float positionsA[KINEMATIC_HISTORY][3], positionsB[KINEMATIC_HISTORY][3];
+    int n = kinematicHistory(a->motion, o, KINEMATIC_HISTORY, timesA, positionsA);
+    bool same = n == kinematicHistory(b->motion, o, KINEMATIC_HISTORY, timesB, positionsB);
+    for (int i = 0; i < n && same; i++) {
+      same = timesA[i] == timesB[i] && memcmp(positionsA[i], positionsB[i], sizeof(positionsA[i])) == 0;
+    }
+    for (int axis = 0; axis < 3 && same; axis++) {
+      same = a->motion.velocity[axis][o] == b->motion.velocity[axis][o] &&
+             a->motion.acceleration[axis][o] == b->motion.acceleration[axis][o] &&
+             a->motion.jerk[axis][o] == b->motion.jerk[axis][o];
+    }
+    mismatches += !same;
+  }
+  return mismatches;
+}
+
+void benchRecording(const char *recording, int passes, int frames, bool render) {
+  const char *label = baseName(recording);
+  vector<string> input = readLines(recording);
+
+  // recordings with frame markers are played back in simulation mode, live
+  // dumps are not; either way every object in the file counts as tracked
+  vector<sceneSample> samples;
+  map<string, int> names;
+  bool simulation = false;
+  for (int i = 0; i < input.size(); i++) {
+    parsedLine parsed;
+    if (!parseLine(input[i].c_str(), input[i].size(), parsed)) {
+      simulation = true;
+      continue;
+    }
+    if (parsed.numValues != 3) continue;  // occlusion notices
+    sceneSample s;
+    s.name.assign(parsed.name, parsed.nameLen);
+    s.position.x = parsed.values[0];
+    s.position.y = parsed.values[1];
+    s.position.z = parsed.values[2];
+    samples.push_back(s);
+    names[s.name]++;
+  }
+  double start, elapsed;
+
+  SceneState *scene = NULL;
+  elapsed = 0;
+  for (int p = 0; p < passes; p++) {
+    delete scene;
+    scene = new SceneState(names.size(), simulation);
+    start = benchSeconds();
+    for (int i = 0; i < input.size(); i++) scene->applyPacket(input[i].c_str(), input[i].size());
+    elapsed += benchSeconds() - start;
+  }
+  reportResult("apply", label, "lines_per_sec", input.size() * (double)passes / elapsed, "lines/s");
+  reportResult("apply", label, "strokes", scene->strokeCount(), "lines");
+
+  // warm up on the first half, as the slave has by mid-performance, then
+  // count what the second half allocates
+  delete scene;
+  scene = new SceneState(names.size(), simulation);
+  for (int i = 0; i < input.size() / 2; i++) scene->applyPacket(input[i].c_str(), input[i].size());
+  size_t before = allocations;
+  for (int i = input.size() / 2; i < input.size(); i++) scene->applyPacket(input[i].c_str(), input[i].size());
+  reportResult("apply", label, "allocs_per_packet",
+               (double)(allocations - before) / (input.size() - input.size() / 2), "allocs");
+
+  // the same recording as the backlogs a slow frame leaves: the strokes and
+  // every object's motion must come out exactly as they did packet by packet
+  vector<const char*> payloads(input.size());
+  vector<size_t> lens(input.size());
+  for (int i = 0; i < input.size(); i++) {
+    payloads[i] = input[i].c_str();
+    lens[i] = input[i].size();
+  }
+  SceneState *batched = NULL;
+  int coalesced = 0;
+  elapsed = 0;
+  for (int p = 0; p < passes; p++) {
+    delete batched;
+    batched = new SceneState(names.size(), simulation);
+    coalesced = 0;
+    start = benchSeconds();
+    for (int i = 0; i < input.size(); i += BACKLOG) {
+      int count = min(BACKLOG, (int)input.size() - i);
+      coalesced += batched->applyPackets(&payloads[i], &lens[i], count);
+    }
+    elapsed += benchSeconds() - start;
+  }
+  reportResult("backlog", label, "lines_per_sec", input.size() * (double)passes / elapsed, "lines/s");
+  reportResult("backlog", label, "coalesced", (double)coalesced / input.size(), "fraction");
+  reportResult("backlog", label, "mismatches", strokeMismatches(scene, batched), "lines");
+  reportResult("backlog", label, "kinematic_mismatches", kinematicMismatches(scene, batched), "objects");
+  delete batched;
+
+  // and again with every packet timed as the slave times them, arriving a
+  // line a millisecond
+  vector<double> times(input.size());
+  for (int i = 0; i < input.size(); i++) times[i] = i / 1000.0;
+  SceneState *timed = new SceneState(names.size(), simulation);
+  for (int i = 0; i < input.size(); i++) timed->applyPacket(input[i].c_str(), input[i].size(), times[i]);
+  batched = new SceneState(names.size(), simulation);
+  for (int i = 0; i < input.size(); i += BACKLOG) {
+    int count = min(BACKLOG, (int)input.size() - i);
+    batched->applyPackets(&payloads[i], &lens[i], count, &times[i]);
+  }
+  reportResult("backlog_timed", label, "mismatches", strokeMismatches(timed, batched), "lines");
+  reportResult("backlog_timed", label, "kinematic_mismatches", kinematicMismatches(timed, batched), "objects");
+  delete timed;
+  delete batched;
+
+  // the scene is now full, as it would be mid-performance
+  int calls = 1000000;
+  scene->numTrackedObjects = scene->trackNames.size();
+  start = benchSeconds();
+  for (int i = 0; i < calls; i++) scene->averageDistanceHelper();
+  elapsed = benchSeconds() - start;
+  reportResult("averageDistanceHelper", label, "ns_per_call", elapsed / calls * 1e9, "ns");
+
+  // every object's motion, as buildFrame() works it out once a frame
+  start = benchSeconds();
+  for (int i = 0; i < calls; i++) updateKinematics(scene->motion);
+  elapsed = benchSeconds() - start;
+  reportResult("updateKinematics", label, "ns_per_object",
+    elapsed / calls / (scene->motion.numObjects ? scene->motion.numObjects : 1) * 1e9, "ns");
+
+  scene->afterImages.clear();
+  start = benchSeconds();
+  for (int p = 0; p < passes; p++) {
+    for (int i = 0; i < samples.size(); i++) scene->addAfterImage(samples[i].name, samples[i].position);
+  }
+  elapsed = benchSeconds() - start;
+  reportResult("addAfterImage", label, "ns_per_call", elapsed / ((double)samples.size() * passes) * 1e9, "ns");
+
+  trackable noSide;
+  noSide.x = noSide.y = noSide.z = 0;
+  elapsed = 0;
+  for (int p = 0; p < passes; p++) {
+    scene->clearStrokes();
+    start = benchSeconds();
+    for (int i = 0; i < samples.size(); i++) scene->recordLine(samples[i].name, samples[i].position, noSide);
+    elapsed += benchSeconds() - start;
+  }
+  reportResult("recordLine", label, "ns_per_call", elapsed / ((double)samples.size() * passes) * 1e9, "ns");
+
+  // per-tile command building for the eight-tile wall in playback_launcher.sh
+  vector<tileView> wall;
+  parseTiles(WALL_TILES, SCREEN_WIDTH, SCREEN_HEIGHT, wall);
+  vector<tileCommands> wallCommands;
+  sceneFrame frame;
+  lodCache lod = lodCache();
+  scene->buildFrame(frame);
+  stageLod(frame, lod);
+  start = benchSeconds();
+  for (int f = 0; f < frames; f++) buildAllTileCommands(frame, lod, wall, wallCommands);
+  elapsed = benchSeconds() - start;
+  size_t culled = 0;
+  for (int i = 0; i < wallCommands.size(); i++) culled += wallCommands[i].culled;
+  reportResult("tiles", label, "ms_per_frame", elapsed / frames * 1e3, "ms");
+  reportResult("tiles", label, "culled", (double)culled / (scene->strokeCount() * wall.size()), "fraction");
+
+  if (!render) {
+    delete scene;
+    return;
+  }
+  offscreenContext ctx = createOffscreenContext(RENDER_SIZE, RENDER_SIZE);
+  initGL();
+  vector<tileView> tiles;
+  parseTiles("-0.5,0.5,-0.5,0.5", RENDER_SIZE, RENDER_SIZE, tiles);
+  vector<tileCommands> commands;
+  ribbonCache ribbons = ribbonCache();
+  scene->buildFrame(frame);
+  stageLod(frame, lod);
+  buildAllTileCommands(frame, lod, tiles, commands);
+  drawTiles(frame, tiles, commands, ribbons);  // warm up the driver
+  glFinish();
+  vector<double> frameTimes;
+  for (int f = 0; f < frames; f++) {
+    start = benchSeconds();
+    scene->buildFrame(frame);
+    stageLod(frame, lod);
+    buildAllTileCommands(frame, lod, tiles, commands);
+    drawTiles(frame, tiles, commands, ribbons);
+    glFinish();
+    frameTimes.push_back(benchSeconds() - start);
+  }
+  sort(frameTimes.begin(), frameTimes.end());
+  double median = frameTimes[frameTimes.size() / 2];
+  reportResult("submit", label, "ms_per_frame", median * 1e3, "ms");
+  reportResult("submit", label, "lines_per_sec", scene->strokeCount() / median, "lines/s");
+  destroyOffscreenContext(ctx);
+  delete scene;
+}
+
+// The wand sweeping a spiral while it rolls, one sample per object.
+sceneSample ribbonSample(int object, int step) {
+  sceneSample s;
+  char name[16];
+  snprintf(name, sizeof(name), "Wand%d", object);
+  s.name = name;
+  float t = step / 200.0f + object;
+  float radius = 0.2f + 0.6f * (step % 20000) / 20000.0f;
+  s.position.x = radius * cosf(t * 3);
+  s.position.y = 0.3f * sinf(t * 2);
+  s.position.z = 1 + radius * sinf(t * 3);
+  s.oriented = true;
+  s.rotation.x = 0;
+  s.rotation.y = sinf(t);
+  s.rotation.z = 0;
+  s.rotation.w = cosf(t);
+  return s;
+}
+
+void benchRibbons(int frames, bool render) {
+  const char *label = "synthetic";
+  SceneState *scene = new SceneState(RIBBON_OBJECTS, false);
+  for (int step = 0; step < RIBBON_SAMPLES; step++) {
+    for (int o = 0; o < RIBBON_OBJECTS; o++) scene->apply(ribbonSample(o, step));
+  }
+  size_t segments = scene->strokeCount();
+  reportResult("ribbons", label, "segments", segments, "lines");
+
+  // vertex generation alone, then staging the whole scene as a late joiner would
+  vector<float> positions, colors;
+  double start = benchSeconds();
+  positions.resize(segments * 12);
+  colors.resize(segments * 12);
+  buildRibbonVertices(&scene->pool[0], segments, &positions[0], &colors[0]);
+  double elapsed = benchSeconds() - start;
+  reportResult("ribbons", label, "generate_ns_per_segment", elapsed / segments * 1e9, "ns");
+
+  sceneFrame frame;
+  ribbonCache ribbons = ribbonCache();
+  lodCache lod = lodCache();
+  scene->buildFrame(frame);
+  start = benchSeconds();
+  stageRibbons(frame, ribbons);
+  elapsed = benchSeconds() - start;
+  reportResult("ribbons", label, "stage_all_ms", elapsed * 1e3, "ms");
+
+  if (!render) {
+    delete scene;
+    return;
+  }
+  offscreenContext ctx = createOffscreenContext(RENDER_SIZE, RENDER_SIZE);
+  initGL();
+  vector<tileView> tiles;
+  parseTiles("-0.5,0.5,-0.5,0.5", RENDER_SIZE, RENDER_SIZE, tiles);
+  vector<tileCommands> commands;
+  start = benchSeconds();
+  uploadRibbons(ribbons);
+  glFinish();
+  elapsed = benchSeconds() - start;
+  reportResult("ribbons", label, "upload_all_ms", elapsed * 1e3, "ms");
+  stageLod(frame, lod);
+  buildAllTileCommands(frame, lod, tiles, commands);
+  drawTiles(frame, tiles, commands, ribbons);  // warm up the driver
+  glFinish();
+
+  // let every chunk age, one build a frame as in the slave
+  for (int f = 0; f < LOD_AGE + lod.chunks.size() + 1; f++) {
+    scene->buildFrame(frame);
+    stageLod(frame, lod);
+  }
+
+  // a live frame: one new sample per object, then everything the slave's
+  // renderScene() does, with every chunk drawn in full and then at the
+  // level the tile picks
+  int step = RIBBON_SAMPLES;
+  for (int pass = 0; pass < 2; pass++) {
+    lod.disabled = pass == 0;
+    vector<double> frameTimes;
+    size_t uploadedBefore = ribbons.uploadedBytes;
+    size_t drawn = 0;
+    for (int f = 0; f < frames; f++) {
+      start = benchSeconds();
+      for (int o = 0; o < RIBBON_OBJECTS; o++) scene->apply(ribbonSample(o, step));
+      step++;
+      scene->buildFrame(frame);
+      stageRibbons(frame, ribbons);
+      stageLod(frame, lod);
+      buildAllTileCommands(frame, lod, tiles, commands);
+      uploadRibbons(ribbons);
+      drawTiles(frame, tiles, commands, ribbons);
+      glFinish();
+      frameTimes.push_back(benchSeconds() - start);
+      for (int i = 0; i < commands.size(); i++) {
+        drawn += commands[i].ribbons.size();
+        for (int c = 0; c < commands[i].ribbonChunks.size(); c++) drawn += ribbons.chunks[commands[i].ribbonChunks[c]].segments;
+      }
+    }
+    sort(frameTimes.begin(), frameTimes.end());
+    reportResult("ribbons", label, lod.disabled ? "full_ms_per_frame" : "ms_per_frame",
+                 frameTimes[frameTimes.size() / 2] * 1e3, "ms");
+    reportResult("ribbons", label, lod.disabled ? "full_drawn_per_frame" : "drawn_per_frame",
+                 (double)drawn / frames, "lines");
+    if (!lod.disabled) {
+      reportResult("ribbons", label, "upload_bytes_per_frame",
+                   (double)(ribbons.uploadedBytes - uploadedBefore) / frames, "bytes");
+    }
+  }
+  freeRibbons(ribbons);
+  destroyOffscreenContext(ctx);
+  delete scene;
+}
+
+// Median and worst time of each stroke command against a 200k segment
+// scene spread over every layer, plus what the next frame then has to
+// restage for the ribbons.
+void benchStrokeStore() {
+  const char *label = "synthetic";
+  SceneState *scene = new SceneState(RIBBON_OBJECTS, false);
+  for (int step = 0; step < STORE_SAMPLES; step++) {
+    if (step % STORE_STROKE == 0) scene->setDrawing(true);  // pen down: new strokes
+    if (step % (STORE_SAMPLES / NUM_LAYERS) == 0) scene->setActiveLayer(step / (STORE_SAMPLES / NUM_LAYERS));
+    for (int o = 0; o < RIBBON_OBJECTS; o++) scene->apply(ribbonSample(o, step));
+  }
+  reportResult("strokes", label, "segments", scene->strokeCount(), "lines");
+  reportResult("strokes", label, "indexed_strokes", scene->numStrokes, "strokes");
+  sceneFrame frame;
+  ribbonCache ribbons = ribbonCache();
+  scene->buildFrame(frame);
+  stageRibbons(frame, ribbons);
+  ribbons.numPending = 0;
+
+  vector<double> times;
+  for (int i = 0; i < STORE_OPS; i++) {
+    double start = benchSeconds();
+    scene->undoStroke();
+    times.push_back(benchSeconds() - start);
+  }
+  sort(times.begin(), times.end());
+  reportResult("strokes", label, "undo_ms", times[times.size() / 2] * 1e3, "ms");
+  reportResult("strokes", label, "undo_max_ms", times.back() * 1e3, "ms");
+  scene->buildFrame(frame);
+  stageRibbons(frame, ribbons);
+  ribbons.numPending = 0;
+
+  times.clear();
+  int erased = 0;
+  for (int i = 0; i < STORE_OPS; i++) {
+    sceneSample at = ribbonSample(i % RIBBON_OBJECTS, i * (STORE_SAMPLES / STORE_OPS));
+    double start = benchSeconds();
+    erased += scene->eraseNear(at.position, 0.1f);
+    times.push_back(benchSeconds() - start);
+  }
+  sort(times.begin(), times.end());
+  reportResult("strokes", label, "erase_ms", times[times.size() / 2] * 1e3, "ms");
+  reportResult("strokes", label, "erase_max_ms", times.back() * 1e3, "ms");
+  reportResult("strokes", label, "erased_per_call", (double)erased / STORE_OPS, "lines");
+  scene->buildFrame(frame);
+  double start = benchSeconds();
+  stageRibbons(frame, ribbons);
+  reportResult("strokes", label, "erase_restage_ms", (benchSeconds() - start) * 1e3, "ms");
+  ribbons.numPending = 0;
+
+  start = benchSeconds();
+  scene->setVisibleLayers(scene->visibleLayers & ~2u);
+  reportResult("strokes", label, "hide_layer_ms", (benchSeconds() - start) * 1e3, "ms");
+  scene->buildFrame(frame);
+  start = benchSeconds();
+  stageRibbons(frame, ribbons);
+  reportResult("strokes", label, "hide_restage_ms", (benchSeconds() - start) * 1e3, "ms");
+  ribbons.numPending = 0;
+
+  start = benchSeconds();
+  scene->clearStrokes();
+  reportResult("strokes", label, "clear_ms", (benchSeconds() - start) * 1e3, "ms");
+  delete scene;
+}
+
+// Mapping and faulting in the default stroke pool, on ordinary pages and
+// then on huge ones if the system has any to spare.
+void benchPoolMapping() {
+  reportResult("pool", "default", "bytes_per_line", sizeof(packedLine), "bytes");
+  reportResult("pool", "default", "bytes_per_segment", SEGMENT_BYTES, "bytes");
+  const char *variants[2] = { "pages", "hugepages" };
+  for (int h = 0; h < 2; h++) {
+    SceneState *scene = new SceneState(RIBBON_OBJECTS, false);
+    double start = benchSeconds();
+    scene->setPoolBudget(STROKE_POOL_MB, h == 1);
+    reportResult("pool", variants[h], "map_ms", (benchSeconds() - start) * 1e3, "ms");
+    strokePoolStats stats;
+    scene->poolStats(stats);
+    reportResult("pool", variants[h], "on_huge_pages", stats.hugePages, "bool");
+    reportResult("pool", variants[h], "capacity", stats.capacity, "lines");
+    delete scene;
+  }
+}
+
+// One side of a snapshot transfer, as the slave's server sends it: encode
+// the scene under nothing but this thread, compress, then header and body.
+typedef struct snapshotServe {
+  SceneState *scene;
+  int listener;
+  double encodeSeconds, compressSeconds, sent;
+  unsigned int rawSize, compressedSize;
+} snapshotServe;
+
+bool sendAll(int fd, const void *data, size_t len) {
+  const char *p = (const char*)data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool receiveAll(int fd, void *data, size_t len) {
+  char *p = (char*)data;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+void *serveSnapshot(void *arg) {
+  snapshotServe &serve = *(snapshotServe*)arg;
+  int cs = accept(serve.listener, NULL, NULL);
+  char request[sizeof(SNAPSHOT_REQUEST) - 1];
+  if (cs == -1 || !receiveAll(cs, request, sizeof(request))) return NULL;
+  double start = benchSeconds();
+  string raw;
+  serve.scene->encodeSnapshot(raw);
+  serve.encodeSeconds = benchSeconds() - start;
+  start = benchSeconds();
+  uLongf compressedSize = compressBound(raw.size());
+  vector<Bytef> compressed(compressedSize);
+  compress2(&compressed[0], &compressedSize, (const Bytef*)raw.data(), raw.size(), Z_BEST_SPEED);
+  serve.compressSeconds = benchSeconds() - start;
+  snapshotHeader header;
+  memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+  header.version = SNAPSHOT_VERSION;
+  header.seq = 0;
+  header.rawSize = serve.rawSize = raw.size();
+  header.compressedSize = serve.compressedSize = compressedSize;
+  serve.sent = benchSeconds();
+  sendAll(cs, &header, sizeof(header));
+  sendAll(cs, &compressed[0], compressedSize);
+  close(cs);
+  return NULL;
+}
+
+// A late joiner catching up on a 200k-line performance over loopback. The
+// link time is also projected onto gigabit Ethernet, which is what the wall
+// has between slaves; the whole catch-up should stay under a second there.
+void benchSnapshot(int passes) {
+  const char *label = "synthetic";
+  SceneState *scene = new SceneState(RIBBON_OBJECTS, false);
+  for (int step = 0; step < SNAPSHOT_SAMPLES; step++) {
+    if (step % STORE_STROKE == 0) scene->setDrawing(true);
+    for (int o = 0; o < RIBBON_OBJECTS; o++) scene->apply(ribbonSample(o, step));
+  }
+  reportResult("snapshot", label, "segments", scene->strokeCount(), "lines");
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrLen = sizeof(addr);
+  if (listener == -1 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+      listen(listener, 1) == -1 || getsockname(listener, (struct sockaddr*)&addr, &addrLen) == -1) {
+    perror("WARNING: no loopback socket, snapshot not timed");
+    return;
+  }
+  double encode = 0, compress = 0, transfer = 0, inflate = 0, decode = 0, total = 0;
+  snapshotServe serve;
+  int ok = 0;
+  for (int p = 0; p < passes; p++) {
+    serve.scene = scene;
+    serve.listener = listener;
+    pthread_t server;
+    pthread_create(&server, NULL, serveSnapshot, &serve);
+    SceneState *joiner = new SceneState(RIBBON_OBJECTS, false);
+    double start = benchSeconds();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    snapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    vector<Bytef> compressed;
+    bool received = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+                    sendAll(fd, SNAPSHOT_REQUEST, sizeof(SNAPSHOT_REQUEST) - 1) &&
+                    receiveAll(fd, &header, sizeof(header));
+    if (received) {
+      compressed.resize(header.compressedSize);
+      received = receiveAll(fd, &compressed[0], header.compressedSize);
+    }
+    close(fd);
+    pthread_join(server, NULL);
+    double arrived = benchSeconds();
+    string raw(header.rawSize, '\0');
+    uLongf rawSize = header.rawSize;
+    bool inflated = received &&
+                    uncompress((Bytef*)&raw[0], &rawSize, &compressed[0], header.compressedSize) == Z_OK;
+    double inflatedAt = benchSeconds();
+    ok += inflated && joiner->decodeSnapshot(raw) && joiner->strokeCount() == scene->strokeCount();
+    double done = benchSeconds();
+    encode += serve.encodeSeconds;
+    compress += serve.compressSeconds;
+    transfer += arrived - serve.sent;
+    inflate += inflatedAt - arrived;
+    decode += done - inflatedAt;
+    total += done - start;
+    delete joiner;
+  }
+  close(listener);
+  reportResult("snapshot", label, "raw_bytes", serve.rawSize, "bytes");
+  reportResult("snapshot", label, "compressed_bytes", serve.compressedSize, "bytes");
+  reportResult("snapshot", label, "encode_ms", encode / passes * 1e3, "ms");
+  reportResult("snapshot", label, "compress_ms", compress / passes * 1e3, "ms");
+  reportResult("snapshot", label, "loopback_ms", transfer / passes * 1e3, "ms");
+  reportResult("snapshot", label, "inflate_ms", inflate / passes * 1e3, "ms");
+  reportResult("snapshot", label, "decode_ms", decode / passes * 1e3, "ms");
+  reportResult("snapshot", label, "total_ms", total / passes * 1e3, "ms");
+  double gigabit = serve.compressedSize / GIGABIT_BYTES_PER_SEC;
+  reportResult("snapshot", label, "gigabit_ms", (total - transfer) / passes * 1e3 + gigabit * 1e3, "ms");
+  reportResult("snapshot", label, "round_trips_ok", ok, "passes");
+  delete scene;
+}
+
+// Small circles wandering over a patch far enough back for the coarsest
+// level on the bench wall, so that they pile up as an hour of scribbling does.
+sceneSample scribbleSample(int object, int step) {
+  sceneSample s;
+  char name[16];
+  snprintf(name, sizeof(name), "Pen%d", object);
+  s.name = name;
+  float t = step * 0.033f;  // about 5 mm a step, as the master resamples
+  s.position.x = 0.2f * sinf(step * 0.0011f + object) + 0.15f * cosf(t);
+  s.position.y = -6 + 0.1f * sinf(step * 0.0009f);
+  s.position.z = 1 + 0.2f * cosf(step * 0.0007f + 2 * object) + 0.15f * sinf(t);
+  s.oriented = false;
+  return s;
+}
+
+// Wall command building over the scribble as it fills, with every chunk
+// drawn in full and then at the level each tile picks: the first grows
+// with the canvas, the second should stay roughly flat.
+void benchLod(int frames) {
+  SceneState *scene = new SceneState(RIBBON_OBJECTS, false);
+  vector<tileView> wall;
+  parseTiles(WALL_TILES, SCREEN_WIDTH, SCREEN_HEIGHT, wall);
+  vector<tileCommands> commands;
+  sceneFrame frame;
+  lodCache lod = lodCache();
+  int step = 0;
+  for (int fill = LOD_FILL / 8; fill <= LOD_FILL; fill *= 2) {
+    char label[32];
+    snprintf(label, sizeof(label), "scribble_%dk", fill / 1000);
+    while (scene->strokeCount() < fill) {
+      for (int o = 0; o < RIBBON_OBJECTS; o++) scene->apply(scribbleSample(o, step));
+      step++;
+    }
+    // let every chunk age, one build a frame as in the slave
+    scene->buildFrame(frame);
+    stageLod(frame, lod);  // the new lines, which aren't what's being timed
+    int builtBefore = lod.built;
+    double buildTime = 0;
+    for (int f = 0; f < LOD_AGE + lod.chunks.size() + fill / LOD_CHUNK + 1; f++) {
+      scene->buildFrame(frame);
+      double start = benchSeconds();
+      stageLod(frame, lod);
+      buildTime += benchSeconds() - start;
+    }
+    if (lod.built > builtBefore) {
+      reportResult("lod", label, "stage_ms_per_build", buildTime / (lod.built - builtBefore) * 1e3, "ms");
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+      lod.disabled = pass == 0;
+      buildAllTileCommands(frame, lod, wall, commands);
+      double start = benchSeconds();
+      for (int f = 0; f < frames; f++) buildAllTileCommands(frame, lod, wall, commands);
+      double elapsed = benchSeconds() - start;
+      size_t lines = 0;
+      for (int i = 0; i < commands.size(); i++) lines += commands[i].lines.size();
+      reportResult("lod", label, lod.disabled ? "full_tiles_ms" : "lod_tiles_ms", elapsed / frames * 1e3, "ms");
+      reportResult("lod", label, lod.disabled ? "full_lines" : "lod_lines", lines, "lines");
+    }
+  }
+  delete scene;
+}
+
+int main(int argc, char** argv) {
+  int passes = 3;
+  int frames = 10;
+  bool render = true;
+  vector<const char*> recordings;
+  for (int a = 1; a < argc; a++) {
+    if (strncmp(argv[a], "--passes=", 9) == 0) passes = atoi(argv[a] + 9);
+    else if (strncmp(argv[a], "--frames=", 9) == 0) frames = atoi(argv[a] + 9);
+    else if (strcmp(argv[a], "--no-render") == 0) render = false;
+    else recordings.push_back(argv[a]);
+  }
+  if (recordings.empty()) {
+    printf("USAGE: SceneBench recording... [--passes=n] [--frames=n] [--no-render]\n");
+    return 1;
+  }
+  for (int r = 0; r < recordings.size(); r++) benchRecording(recordings[r], passes, frames, render);
+  benchRibbons(frames, render);
+  benchStrokeStore();
+  benchPoolMapping();
+  benchSnapshot(passes);
+  benchLod(frames);
+  return 0;
+}
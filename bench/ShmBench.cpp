@@ -0,0 +1,284 @@
+// Shared-memory ring vs loopback UDP between a master and slaves on the same
+// machine, each slave its own process as on a multi-head node. Reports the
+// latency from publishing a datagram to a slave holding it, at a busy
+// performance's pace, and the rate a slave can take them when the master
+// sends as fast as it can. Over UDP the master sends each batch to every
+// slave, as the kernel copies a broadcast to every socket anyway.
+// Usage: ShmBench [packets]
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "Bench.h"
+#include "../Protocol.h"
+#include "../ShmRing.h"
+
+#define BUFLEN 512
+#define BATCH 64
+#define MAX_READERS 8
+#define PACE_INTERVAL 0.0002   // seconds between datagrams in the latency runs
+#define IDLE_TIMEOUT_MS 1000   // a reader gives up once nothing has come for this long
+
+typedef struct readerResult {
+  unsigned long received;
+  unsigned long lost;        // gaps in the sequence numbers, or overruns
+  double seconds;            // from the first datagram to the end
+  double p50, p99, max;      // microseconds from publishing to holding it
+} readerResult;
+
+typedef struct transport {
+  const char *name;
+  bool shm;
+} transport;
+
+char ringName[64];
+shmRing ring;
+int tx;
+struct sockaddr_in readerAddrs[MAX_READERS];
+
+void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+int openReaderSocket(struct sockaddr_in &addr) {
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd == -1) error("ERROR socket");
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) error("ERROR bind");
+  socklen_t len = sizeof(addr);
+  getsockname(fd, (struct sockaddr*)&addr, &len);
+  struct timeval timeout;
+  timeout.tv_sec = IDLE_TIMEOUT_MS / 1000;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+// Read until the END datagram or the stream goes quiet, noting how long each
+// datagram took and which never came.
+readerResult runReader(const transport &t, int fd) {
+  static char bufs[BATCH][BUFLEN + 1];
+  std::vector<double> latencies;
+  latencies.reserve(1 << 20);
+  readerResult result;
+  memset(&result, 0, sizeof(result));
+  unsigned long long cursor = 0;
+  unsigned long overruns = 0;
+  struct mmsghdr msgs[BATCH];
+  struct iovec iovecs[BATCH];
+  if (t.shm) {
+    if (!openShmRing(ring, ringName)) error("ERROR openShmRing");
+    cursor = shmCursor(ring);
+  } else {
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH; i++) {
+      iovecs[i].iov_base = bufs[i];
+      iovecs[i].iov_len = BUFLEN;
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+  }
+  unsigned int last = 0;
+  double first = 0, idleSince = benchSeconds();
+  bool done = false;
+  while (!done) {
+    int lens[BATCH];
+    int n = 0;
+    if (t.shm) {
+      unsigned long long stamp;
+      while (n < BATCH && (lens[n] = shmRead(ring, cursor, bufs[n], BUFLEN, stamp, overruns)) >= 0) n++;
+      if (n == 0) {
+        if ((benchSeconds() - idleSince) * 1000 > IDLE_TIMEOUT_MS) break;
+        shmWait(ring, cursor, 100);
+        continue;
+      }
+    } else {
+      n = recvmmsg(fd, msgs, BATCH, MSG_WAITFORONE, NULL);
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        break;  // timed out
+      }
+      for (int i = 0; i < n; i++) lens[i] = msgs[i].msg_len;
+    }
+    unsigned long long now = shmClockNs();
+    idleSince = benchSeconds();
+    if (first == 0) first = idleSince;
+    for (int i = 0; i < n; i++) {
+      bufs[i][lens[i]] = '\0';
+      unsigned int seq;
+      const char *payload = readSeqHeader(bufs[i], seq);
+      if (strcmp(payload, "END") == 0) {
+        done = true;
+        break;
+      }
+      if (last != 0 && seqAfter(seq, nextSeq(last))) result.lost += seq - nextSeq(last);
+      last = seq;
+      result.received++;
+      unsigned long long sent = strtoull(payload + 5, NULL, 10);  // "PING~<ns>"
+      if (now > sent) latencies.push_back((now - sent) / 1e3);
+    }
+  }
+  result.seconds = first > 0 ? benchSeconds() - first : 0;
+  result.lost += overruns;
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    result.p50 = latencies[latencies.size() / 2];
+    result.p99 = latencies[latencies.size() * 99 / 100];
+    result.max = latencies.back();
+  }
+  return result;
+}
+
+unsigned long long pending = 0;
+
+// Hand a batch to every reader: one publish for the ring, one sendmmsg()
+// per reader for UDP.
+void sendBatch(const transport &t, char bufs[][BUFLEN], int *lens, int count, int readers) {
+  if (t.shm) {
+    for (int i = 0; i < count; i++) shmPublish(ring, pending, bufs[i], lens[i]);
+    shmWake(ring, pending);
+    return;
+  }
+  struct mmsghdr msgs[BATCH];
+  struct iovec iovecs[BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  for (int r = 0; r < readers; r++) {
+    for (int i = 0; i < count; i++) {
+      iovecs[i].iov_base = bufs[i];
+      iovecs[i].iov_len = lens[i];
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &readerAddrs[r];
+      msgs[i].msg_hdr.msg_namelen = sizeof(readerAddrs[r]);
+    }
+    for (int sent = 0; sent < count; ) {
+      int n = sendmmsg(tx, msgs + sent, count - sent, 0);
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        error("ERROR sendmmsg()");
+      }
+      sent += n;
+    }
+  }
+}
+
+// One master and `readers` slave processes. Paced runs send a datagram every
+// PACE_INTERVAL; unpaced ones send BATCH at a time as fast as they can.
+void benchTransport(const transport &t, int readers, int packets, bool paced) {
+  if (t.shm && !createShmRing(ring, ringName)) error("ERROR createShmRing");
+  tx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  int fds[MAX_READERS];
+  int resultPipes[MAX_READERS][2];
+  pid_t pids[MAX_READERS];
+  for (int r = 0; r < readers; r++) {
+    fds[r] = t.shm ? -1 : openReaderSocket(readerAddrs[r]);
+    if (pipe(resultPipes[r]) == -1) error("ERROR pipe");
+  }
+  for (int r = 0; r < readers; r++) {
+    pids[r] = fork();
+    if (pids[r] == -1) error("ERROR fork");
+    if (pids[r] == 0) {
+      char ready = 1;
+      if (write(resultPipes[r][1], &ready, 1) != 1) exit(1);
+      readerResult result = runReader(t, fds[r]);
+      if (write(resultPipes[r][1], &result, sizeof(result)) != sizeof(result)) exit(1);
+      exit(0);
+    }
+  }
+  for (int r = 0; r < readers; r++) {
+    char ready;
+    if (read(resultPipes[r][0], &ready, 1) != 1) error("ERROR reader");
+  }
+  usleep(100000);  // let the readers reach their first wait
+
+  static char bufs[BATCH][BUFLEN];
+  int lens[BATCH];
+  unsigned int seq = 0;
+  double start = benchSeconds(), next = start;
+  for (int i = 0; i < packets; ) {
+    int count = paced ? 1 : std::min(BATCH, packets - i);
+    if (paced) {
+      while (benchSeconds() < next) ;
+      next += PACE_INTERVAL;
+    }
+    for (int b = 0; b < count; b++) {
+      seq = nextSeq(seq);
+      int len = writeSeqHeader(bufs[b], BUFLEN, seq);
+      lens[b] = len + snprintf(bufs[b] + len, BUFLEN - len, "PING~%llu", shmClockNs());
+    }
+    sendBatch(t, bufs, lens, count, readers);
+    i += count;
+  }
+  double sendSeconds = benchSeconds() - start;
+  for (int repeat = 0; repeat < 3; repeat++) {
+    seq = nextSeq(seq);
+    lens[0] = writeSeqHeader(bufs[0], BUFLEN, seq);
+    lens[0] += snprintf(bufs[0] + lens[0], BUFLEN - lens[0], "END");
+    sendBatch(t, bufs, lens, 1, readers);
+    usleep(10000);
+  }
+
+  readerResult total;
+  memset(&total, 0, sizeof(total));
+  double slowest = 0;
+  for (int r = 0; r < readers; r++) {
+    readerResult result;
+    if (read(resultPipes[r][0], &result, sizeof(result)) != sizeof(result)) error("ERROR reader result");
+    waitpid(pids[r], NULL, 0);
+    close(resultPipes[r][0]);
+    close(resultPipes[r][1]);
+    if (fds[r] != -1) close(fds[r]);
+    total.received += result.received;
+    total.lost += result.lost;
+    total.p50 = std::max(total.p50, result.p50);
+    total.p99 = std::max(total.p99, result.p99);
+    total.max = std::max(total.max, result.max);
+    slowest = std::max(slowest, result.seconds);
+  }
+  close(tx);
+  if (t.shm) {
+    closeShmRing(ring);
+    shm_unlink(ringName);
+  }
+
+  char variant[64];
+  snprintf(variant, sizeof(variant), "%s_%d_slaves", t.name, readers);
+  unsigned long expected = (unsigned long)packets * readers;
+  if (paced) {
+    reportResult("shm_latency", variant, "p50_us", total.p50, "us");
+    reportResult("shm_latency", variant, "p99_us", total.p99, "us");
+    reportResult("shm_latency", variant, "max_us", total.max, "us");
+    reportResult("shm_latency", variant, "delivered", (double)total.received / expected, "fraction");
+  } else {
+    reportResult("shm_throughput", variant, "sent_per_sec", packets / sendSeconds, "packets/s");
+    reportResult("shm_throughput", variant, "received_per_sec", slowest > 0 ? (double)total.received / readers / slowest : 0,
+      "packets/s");
+    reportResult("shm_throughput", variant, "delivered", (double)total.received / expected, "fraction");
+  }
+}
+
+int main(int argc, char** argv) {
+  int packets = argc > 1 ? atoi(argv[1]) : 20000;
+  snprintf(ringName, sizeof(ringName), "/grs-shmbench-%d", (int)getpid());
+  const transport transports[] = {
+    { "udp", false },
+    { "shm", true },
+  };
+  const int readerCounts[] = { 1, 4 };
+  for (int c = 0; c < 2; c++) {
+    for (int t = 0; t < 2; t++) benchTransport(transports[t], readerCounts[c], packets, true);
+  }
+  for (int c = 0; c < 2; c++) {
+    for (int t = 0; t < 2; t++) benchTransport(transports[t], readerCounts[c], packets * 25, false);
+  }
+  return 0;
+}
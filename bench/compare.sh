@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+# Compare two runs of `make bench` and fail if anything got worse by more
+# than the tolerance (default 10%). Rates (lines/s, MB/s, x) should go up,
+# times and errors (ns, ms, us, um) should go down; mismatches must stay 0.
+#
+#   make bench > baseline.json     (on the known-good build)
+#   make bench > current.json
+#   bench/compare.sh baseline.json current.json [tolerance_percent]
+
+if [ $# -lt 2 ]; then
+  echo "USAGE: compare.sh baseline.json current.json [tolerance_percent]"
+  exit 2
+fi
+
+awk -v tolerance="${3:-10}" '
+function field(line, name,    m) {
+  if (match(line, "\"" name "\":\"[^\"]*\"")) return substr(line, RSTART + length(name) + 4, RLENGTH - length(name) - 5)
+  if (match(line, "\"" name "\":[^,}]*")) return substr(line, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+  return ""
+}
+/"benchmark"/ {
+  key = field($0, "benchmark") "/" field($0, "variant") "/" field($0, "metric")
+  value = field($0, "value") + 0
+  if (FNR == NR) {
+    baseline[key] = value
+    next
+  }
+  if (!(key in baseline)) {
+    printf "new       %-60s %g %s\n", key, value, field($0, "unit")
+    next
+  }
+  unit = field($0, "unit")
+  old = baseline[key]
+  change = (old != 0) ? (value - old) / old * 100 : 0
+  if (field($0, "metric") == "mismatches") worse = value > old
+  else if (unit ~ /\/s$|^x$/) worse = change < -tolerance
+  else if (unit ~ /^(ns|ms|us|um)$/) worse = change > tolerance
+  else worse = 0
+  status = worse ? "REGRESSED" : "ok"
+  if (worse) regressions++
+  printf "%-9s %-60s %g -> %g %s (%+.1f%%)\n", status, key, old, value, unit, change
+}
+END {
+  if (regressions > 0) {
+    printf "%d regression(s) beyond %s%%\n", regressions, tolerance
+    exit 1
+  }
+}
+' "$1" "$2"
@@ -10,6 +10,15 @@ rocks run host tile-0-5 command="DISPLAY=tile-0-5:0.0 /research/jwwalker/vrlab/i
 rocks run host tile-0-6 command="DISPLAY=tile-0-6:0.0 /research/jwwalker/vrlab/ivs/gesture-artwork/GestureResponseSlave 0 0.5 0        0.25 2 FALSE" &
 rocks run host tile-0-7 command="DISPLAY=tile-0-7:0.0 /research/jwwalker/vrlab/ivs/gesture-artwork/GestureResponseSlave 0 0.5 0.25    0.5   2 FALSE" &
 
+# To restart a single tile mid-performance, have it catch up from a neighbour's stroke buffer:
+#rocks run host tile-0-3 command="DISPLAY=tile-0-3:0.0 /research/jwwalker/vrlab/ivs/gesture-artwork/GestureResponseSlave -0.5 0 0.25   0.5   2 FALSE --snapshot-from=tile-0-2" &
+
+# On a host driving several tiles' outputs, one slave can draw them all from a single copy of the scene:
+#rocks run host tile-0-0 command="DISPLAY=tile-0-0:0.0 /research/jwwalker/vrlab/ivs/gesture-artwork/GestureResponseSlave 0 0 0 0 2 FALSE --tiles=-0.5,0,-0.5,-0.25/-0.5,0,-0.25,0/-0.5,0,0,0.25/-0.5,0,0.25,0.5" &
+
 #./GestureResponseMaster FALSE 10.2.255.255 25884 OutputFile FlagObject ObjectsToTrack
 
+# With the gestures in gestures.txt (undo, clear and palette as well as the draw toggle):
+#./GestureResponseMaster FALSE 10.2.255.255 25884 testoutput.txt Wand HandL HandR --gestures=gestures.txt
+
 ./GestureResponseMaster FALSE 10.2.255.255 25884 testoutput.txt Wand HandL HandR